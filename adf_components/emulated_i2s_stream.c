@@ -0,0 +1,177 @@
+#include <string.h>
+#include <math.h>
+#include "audio_common.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "audio_mem.h"
+#include "audio_element.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "emulated_i2s_stream.h"
+
+#define SINE_TABLE_SIZE 64          // Samples of one tone period in the table
+#define TONE_AMPLITUDE  8000        // About -12 dBFS
+#define BYTES_PER_SAMPLE 2          // 16-bit mono
+
+static const char *TAG = "EMULATED_I2S";
+
+typedef struct emulated_i2s_stream {
+    audio_stream_type_t type;   // Type of the audio stream
+    int sample_rate;            // Samples per second
+    uint32_t phase;             // Tone phase, 16.16 fixed point index into the sine table
+    uint32_t phase_step;        // Phase increment per sample
+    int64_t start_us;           // Time the stream was opened
+    uint64_t bytes;             // Bytes produced or consumed since the stream was opened
+    int16_t sine[SINE_TABLE_SIZE];
+    bool is_open;               // Flag to indicate if the stream is open
+} emulated_i2s_stream_t;
+
+static esp_err_t _emulated_i2s_open(audio_element_handle_t self)
+{
+    emulated_i2s_stream_t *i2s = (emulated_i2s_stream_t *)audio_element_getdata(self);
+    if (i2s->is_open) {
+        return ESP_OK;
+    }
+
+    i2s->start_us = esp_timer_get_time();
+    i2s->bytes = 0;
+    i2s->is_open = true;
+    ESP_LOGI(TAG, "Emulated I2S %s opened at %d Hz",
+             i2s->type == AUDIO_STREAM_READER ? "reader" : "writer", i2s->sample_rate);
+    return ESP_OK;
+}
+
+static esp_err_t _emulated_i2s_close(audio_element_handle_t self)
+{
+    emulated_i2s_stream_t *i2s = (emulated_i2s_stream_t *)audio_element_getdata(self);
+    i2s->is_open = false;
+
+    if (AEL_STATE_PAUSED != audio_element_get_state(self)) {
+        audio_element_report_pos(self);
+        audio_element_set_byte_pos(self, 0);
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Block until `bytes` of audio would have passed through a real I2S port
+ */
+static void _emulated_i2s_pace(emulated_i2s_stream_t *i2s, int len)
+{
+    i2s->bytes += len;
+    int64_t due_us = i2s->start_us + (int64_t)(i2s->bytes * 1000000ULL / (i2s->sample_rate * BYTES_PER_SAMPLE));
+    int64_t wait_us = due_us - esp_timer_get_time();
+    if (wait_us >= 1000) {
+        vTaskDelay(pdMS_TO_TICKS(wait_us / 1000));
+    }
+}
+
+static int _emulated_i2s_read(audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait, void *context)
+{
+    emulated_i2s_stream_t *i2s = (emulated_i2s_stream_t *)audio_element_getdata(self);
+    if (!i2s->is_open) {
+        return AEL_IO_FAIL;
+    }
+
+    int samples = len / BYTES_PER_SAMPLE;
+    int16_t *out = (int16_t *)buffer;
+    for (int i = 0; i < samples; i++) {
+        out[i] = i2s->sine[(i2s->phase >> 16) % SINE_TABLE_SIZE];
+        i2s->phase += i2s->phase_step;
+    }
+    len = samples * BYTES_PER_SAMPLE;
+
+    _emulated_i2s_pace(i2s, len);
+    audio_element_update_byte_pos(self, len);
+    return len;
+}
+
+static int _emulated_i2s_write(audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait, void *context)
+{
+    emulated_i2s_stream_t *i2s = (emulated_i2s_stream_t *)audio_element_getdata(self);
+    if (!i2s->is_open) {
+        return AEL_IO_FAIL;
+    }
+    if (len <= 0) {
+        return len;
+    }
+
+    // The samples are dropped, only the playback time is kept
+    _emulated_i2s_pace(i2s, len);
+    return len;
+}
+
+static int _emulated_i2s_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    int r_size = audio_element_input(self, in_buffer, in_len);
+    int w_size = 0;
+
+    if (r_size == AEL_IO_TIMEOUT) {
+        return AEL_IO_TIMEOUT;
+    }
+    else if (r_size > 0) {
+        w_size = audio_element_output(self, in_buffer, r_size);
+        if (w_size > 0) {
+            audio_element_update_byte_pos(self, w_size);
+        }
+    }
+    else {
+        // Propagate error/done status
+        w_size = r_size;
+    }
+    return w_size;
+}
+
+static esp_err_t _emulated_i2s_destroy(audio_element_handle_t self)
+{
+    emulated_i2s_stream_t *i2s = (emulated_i2s_stream_t *)audio_element_getdata(self);
+    if (i2s) {
+        audio_free(i2s);
+    }
+    return ESP_OK;
+}
+
+audio_element_handle_t emulated_i2s_stream_init(emulated_i2s_stream_cfg_t *config)
+{
+    if (config == NULL || config->sample_rate <= 0) {
+        ESP_LOGE(TAG, "Invalid emulated I2S stream config");
+        return NULL;
+    }
+
+    emulated_i2s_stream_t *i2s = audio_calloc(1, sizeof(emulated_i2s_stream_t));
+    AUDIO_MEM_CHECK(TAG, i2s, return NULL);
+
+    i2s->type = config->type;
+    i2s->sample_rate = config->sample_rate;
+    i2s->is_open = false;
+    for (int i = 0; i < SINE_TABLE_SIZE; i++) {
+        i2s->sine[i] = config->tone_hz > 0 ? (int16_t)(TONE_AMPLITUDE * sinf(2.0f * (float)M_PI * i / SINE_TABLE_SIZE)) : 0;
+    }
+    i2s->phase_step = (uint32_t)(((uint64_t)config->tone_hz * SINE_TABLE_SIZE << 16) / config->sample_rate);
+
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    cfg.task_stack = config->task_stack < 4096 ? 4096 : config->task_stack;
+    cfg.buffer_len = config->buffer_len;
+    cfg.out_rb_size = config->out_rb_size;
+    cfg.open = _emulated_i2s_open;
+    cfg.close = _emulated_i2s_close;
+    cfg.destroy = _emulated_i2s_destroy;
+    cfg.process = _emulated_i2s_process;
+    cfg.tag = (i2s->type == AUDIO_STREAM_WRITER) ? "emulated_i2s_writer" : "emulated_i2s_reader";
+    if (i2s->type == AUDIO_STREAM_WRITER) {
+        cfg.write = _emulated_i2s_write;
+    } else {
+        cfg.read = _emulated_i2s_read;
+    }
+
+    audio_element_handle_t el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, {
+        audio_free(i2s);
+        return NULL;
+    });
+
+    audio_element_setdata(el, i2s);
+    ESP_LOGI(TAG, "Emulated I2S stream initialized: %s",
+             i2s->type == AUDIO_STREAM_WRITER ? "writer" : "reader");
+    return el;
+}
@@ -0,0 +1,46 @@
+#ifndef _EMULATED_I2S_STREAM_H_
+#define _EMULATED_I2S_STREAM_H_
+
+#include "audio_element.h"
+#include "audio_common.h"
+#include "audio_error.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    audio_stream_type_t type; // Reader produces microphone samples, writer consumes speaker samples
+    int sample_rate;          // Samples per second (16-bit mono)
+    int tone_hz;              // Reader: frequency of the generated tone, 0 for silence
+    int out_rb_size;          // Size of the output ring buffer
+    int task_stack;           // Stack size for the task
+    int buffer_len;           // Length of the buffer for reading/writing
+} emulated_i2s_stream_cfg_t;
+
+#define EMULATED_I2S_STREAM_CFG_DEFAULT() {     \
+    .type = AUDIO_STREAM_READER,                \
+    .sample_rate = 8000,                        \
+    .tone_hz = 440,                             \
+    .out_rb_size = 1024,                        \
+    .task_stack = 4096,                         \
+    .buffer_len = 324,                          \
+}
+
+/**
+ * @brief Initialize an I2S stand-in for targets without audio hardware (QEMU)
+ *
+ * The element runs at the real sample rate: the reader blocks until the
+ * requested samples would have been recorded, the writer until the written
+ * samples would have been played, so the pipelines keep their timing.
+ *
+ * @param config Configuration structure
+ * @return audio_element_handle_t Audio element handle, or NULL on error
+ */
+audio_element_handle_t emulated_i2s_stream_init(emulated_i2s_stream_cfg_t *config);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _EMULATED_I2S_STREAM_H_
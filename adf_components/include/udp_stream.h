@@ -10,12 +10,48 @@
 extern "C" {
 #endif
 
+/**
+ * @brief Audio codecs, carried in the upper nibble of the packet type byte
+ */
+typedef enum {
+    UDP_STREAM_CODEC_PCM = 0,       // 16 bit PCM at 8 kHz, 324 byte blocks
+    UDP_STREAM_CODEC_OPUS_8K = 1,   // Opus narrowband, 20 ms frames
+    UDP_STREAM_CODEC_OPUS_16K = 2,  // Opus wideband, 20 ms frames
+} udp_stream_codec_t;
+
+#define UDP_STREAM_CODEC_COUNT 3
+
+/**
+ * @brief Called after every send of a writer
+ *
+ * @param start_us esp_timer_get_time() before the send
+ * @param result   Return value of sendmsg
+ * @param err      errno after the send, valid when result < 0
+ */
+typedef void (*udp_stream_send_cb_t)(int64_t start_us, int result, int err);
+
+/**
+ * @brief Called after every packet a stream handled
+ *
+ * A writer calls it when the packet is sent, a reader when the packet is
+ * turned into PCM.
+ *
+ * @param start_us esp_timer_get_time() when the writer started building the
+ *                 packet or the reader received it
+ */
+typedef void (*udp_stream_packet_cb_t)(int64_t start_us);
+
 typedef struct {
     audio_stream_type_t type; // Type of the audio stream
     int out_rb_size; // Size of the output ring buffer
     struct sockaddr_in dest_addr; // Destination address for UDP stream
     int task_stack; // Stack size for the task
     int buffer_len; // Length of the buffer for reading/writing
+    udp_stream_send_cb_t on_send; // Optional send accounting of a writer (congestion monitor)
+    udp_stream_packet_cb_t on_packet; // Optional per-packet timing (CONFIG_PACKET_TIMING)
+    udp_stream_codec_t codec; // Codec of the packets sent or accepted
+    int bitrate; // Opus target bitrate in bit/s, 0 for the codec default
+    int expected_loss; // Opus packet loss (%) the in-band FEC is sized for
 } udp_stream_cfg_t;
 
 /**
@@ -26,6 +62,21 @@ typedef struct {
  */
 audio_element_handle_t udp_stream_init(udp_stream_cfg_t *config);
 
+/**
+ * @brief Whether this build can encode and decode a codec
+ */
+bool udp_stream_codec_supported(udp_stream_codec_t codec);
+
+/**
+ * @brief Sample rate of the PCM a codec carries (Hz)
+ */
+int udp_stream_codec_sample_rate(udp_stream_codec_t codec);
+
+/**
+ * @brief Bytes of 16 bit mono PCM per packet of a codec
+ */
+int udp_stream_codec_block_bytes(udp_stream_codec_t codec);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,5 +1,6 @@
 #include <string.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -7,10 +8,18 @@
 #include "freertos/FreeRTOS.h"
 #include "audio_mem.h"
 #include "audio_element.h"
+#include "esp_attr.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "udp_stream.h"
+#include "sdkconfig.h"
+#if CONFIG_AUDIO_OPUS
+#include "opus.h"
+#endif
 
 #define AUDIO_PACKAGE 0
+#define AUDIO_TYPE_MASK   0x0F  // Lower nibble of the type byte: package type
+#define AUDIO_CODEC_SHIFT 4     // Upper nibble of the type byte: udp_stream_codec_t
 
 // UDP Stream packet header structure:
 // 1 Byte for package type
@@ -35,6 +44,17 @@
 
 #define MAX_UDP_PACKET_SIZE 1400  // MTU-safe packet size
 
+#define PCM_BLOCK_BYTES 324       // PCM packet payload, 20.25 ms at 8 kHz
+#define OPUS_FRAME_MS 20          // Opus frame duration
+#define OPUS_COMPLEXITY 5         // Encoder complexity (0-10), real time on one core at 16 kHz
+
+// The per-packet functions run from IRAM, flash cache misses stall them under PSRAM load
+#if CONFIG_MEDIA_IRAM
+#define UDP_STREAM_IRAM_ATTR IRAM_ATTR
+#else
+#define UDP_STREAM_IRAM_ATTR
+#endif
+
 static const char *TAG = "udp_STREAM";
 
 typedef struct udp_stream {
@@ -42,8 +62,119 @@ typedef struct udp_stream {
     int sock; // Socket for UDP communication
     struct sockaddr_in dest_addr; // Destination address for UDP stream
     bool is_open; // Flag to indicate if the stream is open
+    udp_stream_send_cb_t on_send; // Send accounting callback, may be NULL
+    udp_stream_packet_cb_t on_packet; // Packet timing callback, may be NULL
+    udp_stream_codec_t codec; // Codec of the packets sent or accepted
+    int bitrate; // Opus target bitrate, 0 for the default
+    int expected_loss; // Opus loss (%) the in-band FEC is sized for
+    int block_bytes; // PCM bytes per packet
+#if CONFIG_AUDIO_OPUS
+    OpusEncoder *encoder; // Writer with an Opus codec
+    OpusDecoder *decoder; // Reader with an Opus codec
+    uint8_t *pcm; // Writer: PCM of the frame being collected
+    int pcm_fill; // Writer: bytes in pcm
+    uint32_t next_sequence; // Reader: sequence number expected next
+    bool have_sequence; // Reader: next_sequence is valid
+    uint32_t dtx_frames; // Frames not sent during silence (DTX)
+    uint32_t fec_frames; // Lost frames recovered from the in-band FEC
+    uint32_t plc_frames; // Lost frames concealed
+#endif
 } udp_stream_t;
 
+static uint32_t sequence_number = 0; // Sequence number for packets
+
+bool udp_stream_codec_supported(udp_stream_codec_t codec)
+{
+    switch (codec) {
+        case UDP_STREAM_CODEC_PCM:
+            return true;
+        case UDP_STREAM_CODEC_OPUS_8K:
+        case UDP_STREAM_CODEC_OPUS_16K:
+#if CONFIG_AUDIO_OPUS
+            return true;
+#else
+            return false;
+#endif
+        default:
+            return false;
+    }
+}
+
+int udp_stream_codec_sample_rate(udp_stream_codec_t codec)
+{
+    return (codec == UDP_STREAM_CODEC_OPUS_16K) ? 16000 : 8000;
+}
+
+int udp_stream_codec_block_bytes(udp_stream_codec_t codec)
+{
+    if (codec == UDP_STREAM_CODEC_PCM) {
+        return PCM_BLOCK_BYTES;
+    }
+    return udp_stream_codec_sample_rate(codec) * OPUS_FRAME_MS / 1000 * sizeof(int16_t);
+}
+
+#if CONFIG_AUDIO_OPUS
+static esp_err_t _udp_open_codec(udp_stream_t *udp)
+{
+    int sample_rate = udp_stream_codec_sample_rate(udp->codec);
+    int err = OPUS_OK;
+
+    if (udp->type == AUDIO_STREAM_WRITER) {
+        udp->pcm = audio_calloc(1, udp->block_bytes);
+        AUDIO_MEM_CHECK(TAG, udp->pcm, return ESP_ERR_NO_MEM);
+        udp->pcm_fill = 0;
+
+        udp->encoder = opus_encoder_create(sample_rate, 1, OPUS_APPLICATION_VOIP, &err);
+        if (udp->encoder == NULL) {
+            ESP_LOGE(TAG, "Opus encoder creation failed: %s", opus_strerror(err));
+            return ESP_FAIL;
+        }
+        opus_encoder_ctl(udp->encoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
+        opus_encoder_ctl(udp->encoder, OPUS_SET_COMPLEXITY(OPUS_COMPLEXITY));
+        opus_encoder_ctl(udp->encoder, OPUS_SET_BITRATE(udp->bitrate > 0 ? udp->bitrate : OPUS_AUTO));
+        // In-band FEC carries a coarse copy of the previous frame, DTX stops sending during silence
+        opus_encoder_ctl(udp->encoder, OPUS_SET_INBAND_FEC(1));
+        opus_encoder_ctl(udp->encoder, OPUS_SET_PACKET_LOSS_PERC(udp->expected_loss));
+        opus_encoder_ctl(udp->encoder, OPUS_SET_DTX(1));
+    }
+    else {
+        udp->decoder = opus_decoder_create(sample_rate, 1, &err);
+        if (udp->decoder == NULL) {
+            ESP_LOGE(TAG, "Opus decoder creation failed: %s", opus_strerror(err));
+            return ESP_FAIL;
+        }
+        udp->have_sequence = false;
+    }
+
+    udp->dtx_frames = 0;
+    udp->fec_frames = 0;
+    udp->plc_frames = 0;
+    ESP_LOGI(TAG, "Opus %s at %d Hz, %d bit/s", udp->type == AUDIO_STREAM_WRITER ? "encoder" : "decoder",
+             sample_rate, udp->bitrate);
+    return ESP_OK;
+}
+
+static void _udp_close_codec(udp_stream_t *udp)
+{
+    if (udp->encoder != NULL || udp->decoder != NULL) {
+        ESP_LOGI(TAG, "Opus frames: %" PRIu32 " DTX, %" PRIu32 " FEC, %" PRIu32 " concealed",
+                 udp->dtx_frames, udp->fec_frames, udp->plc_frames);
+    }
+    if (udp->encoder != NULL) {
+        opus_encoder_destroy(udp->encoder);
+        udp->encoder = NULL;
+    }
+    if (udp->decoder != NULL) {
+        opus_decoder_destroy(udp->decoder);
+        udp->decoder = NULL;
+    }
+    if (udp->pcm != NULL) {
+        audio_free(udp->pcm);
+        udp->pcm = NULL;
+    }
+}
+#endif
+
 static esp_err_t _udp_open(audio_element_handle_t self)
 {
     udp_stream_t *udp = (udp_stream_t *)audio_element_getdata(self);
@@ -78,6 +209,14 @@ static esp_err_t _udp_open(audio_element_handle_t self)
         }
     }
 
+#if CONFIG_AUDIO_OPUS
+    if (udp->codec != UDP_STREAM_CODEC_PCM && _udp_open_codec(udp) != ESP_OK) {
+        _udp_close_codec(udp);
+        close(sock);
+        return ESP_FAIL;
+    }
+#endif
+
     udp->sock = sock;
     udp->is_open = true;
 
@@ -101,6 +240,10 @@ static esp_err_t _udp_close(audio_element_handle_t self)
     }
     
     udp->is_open = false;
+
+#if CONFIG_AUDIO_OPUS
+    _udp_close_codec(udp);
+#endif
     
     if (AEL_STATE_PAUSED != audio_element_get_state(self)) {
         audio_element_report_pos(self);
@@ -112,7 +255,66 @@ static esp_err_t _udp_close(audio_element_handle_t self)
     return ESP_OK;
 }
 
-static int _udp_stream_read(audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait, void *context)
+#if CONFIG_AUDIO_OPUS
+/**
+ * @brief Decode an Opus packet into PCM, concealing the frames lost before it
+ *
+ * A lost frame right before the packet is rebuilt from the packet's in-band
+ * FEC, older ones are concealed by the decoder (PLC, comfort noise after DTX).
+ * Only as many lost frames as fit next to the packet in the buffer are filled.
+ */
+static int UDP_STREAM_IRAM_ATTR _udp_decode_opus(udp_stream_t *udp, const uint8_t *packet, int packet_len, char *buffer, int len)
+{
+    uint32_t sequence;
+    memcpy(&sequence, packet + UDP_HEADER_SEQUENCE_OFFSET, UDP_HEADER_SEQUENCE_SIZE);
+    const uint8_t *payload = packet + UDP_STREAM_HEADER_LEN;
+    int frame_samples = udp->block_bytes / sizeof(int16_t);
+    int max_frames = len / udp->block_bytes;
+    opus_int16 *pcm = (opus_int16 *)buffer;
+    int out_frames = 0;
+
+    if (max_frames < 1) {
+        ESP_LOGE(TAG, "Buffer of %d bytes too small for an Opus frame", len);
+        return AEL_IO_FAIL;
+    }
+
+    if (udp->have_sequence) {
+        int32_t gap = (int32_t)(sequence - udp->next_sequence);
+        if (gap < 0) {
+            // Late or duplicated, its frame was already concealed
+            return AEL_IO_TIMEOUT;
+        }
+        int conceal = (gap < max_frames - 1) ? gap : max_frames - 1;
+        for (int i = 0; i < conceal; i++) {
+            bool fec = (i == conceal - 1) && (conceal == gap);
+            int decoded = fec ? opus_decode(udp->decoder, payload, packet_len, pcm, frame_samples, 1)
+                              : opus_decode(udp->decoder, NULL, 0, pcm, frame_samples, 0);
+            if (decoded <= 0) {
+                break;
+            }
+            if (fec) {
+                udp->fec_frames++;
+            } else {
+                udp->plc_frames++;
+            }
+            pcm += decoded;
+            out_frames++;
+        }
+    }
+
+    int decoded = opus_decode(udp->decoder, payload, packet_len, pcm, frame_samples, 0);
+    if (decoded < 0) {
+        ESP_LOGW(TAG, "Opus decode failed: %s", opus_strerror(decoded));
+        decoded = 0;
+    }
+    udp->next_sequence = sequence + 1;
+    udp->have_sequence = true;
+
+    return (out_frames * frame_samples + decoded) * sizeof(int16_t);
+}
+#endif
+
+static int UDP_STREAM_IRAM_ATTR _udp_stream_read(audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait, void *context)
 {
     udp_stream_t *udp = (udp_stream_t *)audio_element_getdata(self);
     static int pckg_count = 0;
@@ -150,10 +352,35 @@ static int _udp_stream_read(audio_element_handle_t self, char *buffer, int len,
         audio_element_report_status(self, AEL_STATUS_ERROR_INPUT);
         return AEL_IO_FAIL;
     }
+    int64_t packet_start_us = esp_timer_get_time();
 
     int recv_length = recv_buffer[UDP_HEADER_LENGTH_OFFSET] | 
                       (recv_buffer[UDP_HEADER_LENGTH_OFFSET + 1] << 8);
 
+    // The session negotiated one codec, the pipeline runs at its sample rate
+    int codec = recv_buffer[UDP_HEADER_TYPE_OFFSET] >> AUDIO_CODEC_SHIFT;
+    if (ret < UDP_STREAM_HEADER_LEN || (recv_buffer[UDP_HEADER_TYPE_OFFSET] & AUDIO_TYPE_MASK) != AUDIO_PACKAGE ||
+        codec != udp->codec) {
+        ESP_LOGD(TAG, "Dropped packet of type 0x%02x", recv_buffer[UDP_HEADER_TYPE_OFFSET]);
+        return AEL_IO_TIMEOUT;
+    }
+
+#if CONFIG_AUDIO_OPUS
+    if (udp->decoder != NULL) {
+        if (recv_length > ret - UDP_STREAM_HEADER_LEN) {
+            recv_length = ret - UDP_STREAM_HEADER_LEN;
+        }
+        int pcm_length = _udp_decode_opus(udp, recv_buffer, recv_length, buffer, len);
+        if (pcm_length > 0) {
+            audio_element_update_byte_pos(self, pcm_length);
+        }
+        if (udp->on_packet) {
+            udp->on_packet(packet_start_us);
+        }
+        return pcm_length;
+    }
+#endif
+
     if (recv_length < 0) {
         ESP_LOGE(TAG, "Invalid packet length: %d", recv_length);
         audio_element_report_status(self, AEL_STATUS_ERROR_INPUT);
@@ -173,29 +400,19 @@ static int _udp_stream_read(audio_element_handle_t self, char *buffer, int len,
     if (ret > 0  && recv_length > 0) {
         audio_element_update_byte_pos(self, recv_length);
     }
+    if (udp->on_packet) {
+        udp->on_packet(packet_start_us);
+    }
     
     return recv_length;
 }
 
-static int _udp_stream_write(audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait, void *context)
+/**
+ * @brief Send one audio packet, returns the sendmsg result with errno preserved
+ */
+static int UDP_STREAM_IRAM_ATTR _udp_send_packet(udp_stream_t *udp, uint32_t sequence, const void *payload, int len)
 {
-    udp_stream_t *udp = (udp_stream_t *)audio_element_getdata(self);
-    int ret;
-    static uint32_t sequence_number = 0; // Sequence number for packets
-
-    if(!udp->is_open) {
-        ESP_LOGW(TAG, "UDP stream not open");
-        return AEL_IO_FAIL;
-    }
-
-    if (len < 0) {
-        return len;
-    }
-    
-    else if(len == 0) {
-        ESP_LOGD(TAG, "Write received zero-length buffer, ignoring");
-        return AEL_IO_OK;
-    }
+    int64_t packet_start_us = esp_timer_get_time();
 
     // Build audio packet header in separate buffer
     uint8_t header[UDP_STREAM_HEADER_LEN];
@@ -205,15 +422,15 @@ static int _udp_stream_write(audio_element_handle_t self, char *buffer, int len,
     uint16_t packet_length = len;
     
     // Audio packet header construction
-    header[UDP_HEADER_TYPE_OFFSET] = AUDIO_PACKAGE;
-    memcpy(&header[UDP_HEADER_SEQUENCE_OFFSET], &sequence_number, UDP_HEADER_SEQUENCE_SIZE);
+    header[UDP_HEADER_TYPE_OFFSET] = AUDIO_PACKAGE | (udp->codec << AUDIO_CODEC_SHIFT);
+    memcpy(&header[UDP_HEADER_SEQUENCE_OFFSET], &sequence, UDP_HEADER_SEQUENCE_SIZE);
     memcpy(&header[UDP_HEADER_TIMESTAMP_OFFSET], &time_ms, UDP_HEADER_TIMESTAMP_SIZE);
     memcpy(&header[UDP_HEADER_LENGTH_OFFSET], &packet_length, UDP_HEADER_LENGTH_SIZE);
 
     struct iovec iov[2];
     iov[0].iov_base = header;
     iov[0].iov_len = UDP_STREAM_HEADER_LEN;
-    iov[1].iov_base = buffer;
+    iov[1].iov_base = (void *)payload;
     iov[1].iov_len = len;
 
     struct msghdr msg = {
@@ -226,7 +443,96 @@ static int _udp_stream_write(audio_element_handle_t self, char *buffer, int len,
         .msg_flags = 0
     };
 
-    if((ret = sendmsg(udp->sock, &msg, 0)) < 0){
+    int64_t send_start_us = esp_timer_get_time();
+    int ret = sendmsg(udp->sock, &msg, 0);
+    int err = errno;
+    if (udp->on_send) {
+        udp->on_send(send_start_us, ret, err);
+    }
+    if (udp->on_packet) {
+        udp->on_packet(packet_start_us);
+    }
+    errno = err;
+    return ret;
+}
+
+#if CONFIG_AUDIO_OPUS
+/**
+ * @brief Collect PCM into 20 ms frames, encode and send them
+ *
+ * Every frame takes a sequence number, also the ones not sent during
+ * silence (DTX) or discarded on ENOMEM, so the receiver conceals the gap.
+ */
+static int UDP_STREAM_IRAM_ATTR _udp_write_opus(audio_element_handle_t self, udp_stream_t *udp, char *buffer, int len)
+{
+    uint8_t packet[MAX_UDP_PACKET_SIZE - UDP_STREAM_HEADER_LEN];
+    int used = 0;
+
+    while (used < len) {
+        int chunk = udp->block_bytes - udp->pcm_fill;
+        if (chunk > len - used) {
+            chunk = len - used;
+        }
+        memcpy(udp->pcm + udp->pcm_fill, buffer + used, chunk);
+        udp->pcm_fill += chunk;
+        used += chunk;
+        if (udp->pcm_fill < udp->block_bytes) {
+            break;
+        }
+        udp->pcm_fill = 0;
+
+        int encoded = opus_encode(udp->encoder, (const opus_int16 *)udp->pcm,
+                                  udp->block_bytes / sizeof(int16_t), packet, sizeof(packet));
+        if (encoded < 0) {
+            ESP_LOGE(TAG, "Opus encode failed: %s", opus_strerror(encoded));
+            audio_element_report_status(self, AEL_STATUS_ERROR_OUTPUT);
+            return AEL_IO_FAIL;
+        }
+        uint32_t sequence = sequence_number++;
+        if (encoded <= 2) {
+            // DTX: the frame does not need to be transmitted
+            udp->dtx_frames++;
+            continue;
+        }
+
+        if (_udp_send_packet(udp, sequence, packet, encoded) < 0) {
+            ESP_LOGD(TAG, "UDP send failed: errno %d (%s) ; len %d", errno, strerror(errno), encoded);
+            if (errno != ENOMEM) {
+                audio_element_report_status(self, AEL_STATUS_ERROR_OUTPUT);
+                return AEL_IO_FAIL;
+            }
+        }
+    }
+    return len;
+}
+#endif
+
+static int UDP_STREAM_IRAM_ATTR _udp_stream_write(audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait, void *context)
+{
+    udp_stream_t *udp = (udp_stream_t *)audio_element_getdata(self);
+    int ret;
+
+    if(!udp->is_open) {
+        ESP_LOGW(TAG, "UDP stream not open");
+        return AEL_IO_FAIL;
+    }
+
+    if (len < 0) {
+        return len;
+    }
+    
+    else if(len == 0) {
+        ESP_LOGD(TAG, "Write received zero-length buffer, ignoring");
+        return AEL_IO_OK;
+    }
+
+#if CONFIG_AUDIO_OPUS
+    if (udp->encoder != NULL) {
+        return _udp_write_opus(self, udp, buffer, len);
+    }
+#endif
+
+    if((ret = _udp_send_packet(udp, sequence_number, buffer, len)) < 0){
         ESP_LOGD(TAG, "UDP send failed: errno %d (%s) ; len %d", errno,strerror(errno), len);
         if(errno == ENOMEM){
             ESP_LOGD(TAG,"NO MEM %d", len);
@@ -240,7 +546,7 @@ static int _udp_stream_write(audio_element_handle_t self, char *buffer, int len,
     return ret;
 }
 
-static int _udp_stream_process(audio_element_handle_t self, char *in_buffer, int in_len)
+static int UDP_STREAM_IRAM_ATTR _udp_stream_process(audio_element_handle_t self, char *in_buffer, int in_len)
 {
 
     if(in_len < 0)
@@ -290,6 +596,17 @@ audio_element_handle_t udp_stream_init(udp_stream_cfg_t *config)
     udp->sock = -1;
     udp->dest_addr = config->dest_addr;
     udp->is_open = false;
+    udp->on_send = config->on_send;
+    udp->on_packet = config->on_packet;
+    udp->codec = config->codec;
+    udp->bitrate = config->bitrate;
+    udp->expected_loss = config->expected_loss;
+    udp->block_bytes = udp_stream_codec_block_bytes(config->codec);
+    if (!udp_stream_codec_supported(config->codec)) {
+        ESP_LOGE(TAG, "Codec %d not supported by this build", config->codec);
+        audio_free(udp);
+        return NULL;
+    }
 
     audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
     if (config -> task_stack < 4096) {
@@ -0,0 +1,248 @@
+#include "capture_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "The capture fields are read in host byte order, which must be little endian"
+#endif
+
+namespace {
+
+// Below this a chunk is not worth a thread
+constexpr size_t MIN_CHUNK_BYTES = 4 << 20;
+// Records that must parse in a row before a guessed chunk start is taken
+constexpr int SYNC_RECORDS = 8;
+// Arrival times this far from the creation time of the file are not records
+constexpr uint64_t SYNC_TIME_WINDOW_NS = 30ULL * 24 * 3600 * 1000000000ULL;
+
+template <typename T>
+inline T load(const uint8_t *p)
+{
+    T value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline size_t record_span(uint16_t length)
+{
+    return (CAPTURE_RECORD_HEADER_SIZE + length + CAPTURE_RECORD_ALIGN - 1) & ~(CAPTURE_RECORD_ALIGN - 1);
+}
+
+inline void describe(const uint8_t *record, packet_desc_t &desc)
+{
+    uint16_t port = load<uint16_t>(record);
+    uint16_t length = load<uint16_t>(record + 2);
+    const uint8_t *payload = record + CAPTURE_RECORD_HEADER_SIZE;
+
+    desc = packet_desc_t{};
+    desc.source = load<uint32_t>(record + 4);
+    desc.arrival_ns = load<uint64_t>(record + 8);
+    desc.length = length;
+    desc.kind = packet_kind::other;
+    if (port == CAPTURE_PORT_DEVICE_LOG) {
+        desc.kind = packet_kind::device_log;
+        return;
+    }
+    if (length == 0) {
+        return;
+    }
+
+    // Classified by the package type like media_packets.py, not by the port
+    uint8_t package = payload[0] & 0x0F;
+    desc.codec = payload[0] >> 4;
+    if (package == AUDIO_PACKAGE && length >= AUDIO_HEADER_SIZE) {
+        desc.kind = packet_kind::audio;
+        desc.id = load<uint32_t>(payload + 1);
+        desc.media_ms = load<uint64_t>(payload + 5);
+    } else if (package == VIDEO_PACKAGE && length >= VIDEO_HEADER_SIZE) {
+        uint16_t total_packets = load<uint16_t>(payload + 17);
+        if (total_packets == 0) {
+            return;
+        }
+        desc.kind = packet_kind::video;
+        desc.id = load<uint32_t>(payload + 1);
+        desc.media_ms = load<uint64_t>(payload + 5);
+        desc.packet_seq = load<uint16_t>(payload + 15);
+        desc.total_packets = total_packets;
+    }
+}
+
+/**
+ * @brief Whether a record could start at pos; true at the end of the file
+ */
+bool plausible_record(const uint8_t *data, size_t size, size_t pos, uint64_t created_ns)
+{
+    if (pos + CAPTURE_RECORD_HEADER_SIZE > size) {
+        return true;
+    }
+    const uint8_t *record = data + pos;
+    uint16_t port = load<uint16_t>(record);
+    uint16_t length = load<uint16_t>(record + 2);
+    uint64_t arrival_ns = load<uint64_t>(record + 8);
+
+    uint64_t distance = arrival_ns > created_ns ? arrival_ns - created_ns : created_ns - arrival_ns;
+    if (distance > SYNC_TIME_WINDOW_NS) {
+        return false;
+    }
+    size_t end = pos + CAPTURE_RECORD_HEADER_SIZE + length;
+    if (end > size) {
+        return true;  // Truncated last record
+    }
+    if (port != CAPTURE_PORT_DEVICE_LOG && (length == 0 || (record[CAPTURE_RECORD_HEADER_SIZE] & 0x0F) > VIDEO_PACKAGE)) {
+        return false;
+    }
+    // The writer pads with zeros
+    for (size_t i = end; i < pos + record_span(length) && i < size; i++) {
+        if (data[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief First aligned offset from which SYNC_RECORDS records parse in a row
+ */
+size_t find_record_start(const uint8_t *data, size_t size, size_t from, uint64_t created_ns)
+{
+    for (size_t pos = (from + CAPTURE_RECORD_ALIGN - 1) & ~(CAPTURE_RECORD_ALIGN - 1); pos < size;
+         pos += CAPTURE_RECORD_ALIGN) {
+        size_t next = pos;
+        int parsed = 0;
+        while (parsed < SYNC_RECORDS && next + CAPTURE_RECORD_HEADER_SIZE <= size &&
+               plausible_record(data, size, next, created_ns)) {
+            next += record_span(load<uint16_t>(data + next + 2));
+            parsed++;
+        }
+        if (parsed == SYNC_RECORDS || next + CAPTURE_RECORD_HEADER_SIZE > size) {
+            return pos;
+        }
+    }
+    return size;
+}
+
+/**
+ * @brief Describe the records starting in [start, limit)
+ * @return Offset of the first record at or after limit, size at the end of the file
+ */
+size_t walk_records(const uint8_t *data, size_t size, size_t start, size_t limit, std::vector<packet_desc_t> &out)
+{
+    size_t pos = start;
+    while (pos < limit) {
+        if (pos + CAPTURE_RECORD_HEADER_SIZE > size) {
+            return size;
+        }
+        uint16_t length = load<uint16_t>(data + pos + 2);
+        if (pos + CAPTURE_RECORD_HEADER_SIZE + length > size) {
+            return size;
+        }
+        out.emplace_back();
+        describe(data + pos, out.back());
+        pos += record_span(length);
+    }
+    return pos < size ? pos : size;
+}
+
+struct chunk_t {
+    size_t begin;  // Chunk boundary
+    size_t limit;  // Next chunk boundary
+    size_t start;  // First record, guessed for all but the first chunk
+    size_t end;    // First record after the chunk
+    std::vector<packet_desc_t> packets;
+};
+
+} // namespace
+
+capture_file::capture_file(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error(path + ": " + std::strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < CAPTURE_FILE_HEADER_SIZE) {
+        close(fd);
+        throw std::runtime_error(path + " is not a capture file");
+    }
+    size_ = static_cast<size_t>(st.st_size);
+    void *map = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        throw std::runtime_error(path + ": " + std::strerror(errno));
+    }
+    data_ = static_cast<const uint8_t *>(map);
+    madvise(map, size_, MADV_SEQUENTIAL);
+
+    if (std::memcmp(data_, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0 || load<uint16_t>(data_ + 4) != CAPTURE_VERSION) {
+        munmap(map, size_);
+        throw std::runtime_error(path + " is not a version 1 capture file");
+    }
+    created_ns_ = load<uint64_t>(data_ + 8);
+}
+
+capture_file::~capture_file()
+{
+    munmap(const_cast<uint8_t *>(data_), size_);
+}
+
+std::vector<packet_desc_t> capture_file::scan(unsigned threads) const
+{
+    size_t body = size_ - CAPTURE_FILE_HEADER_SIZE;
+    size_t count = threads > 0 ? threads : 1;
+    if (count > 1 && body / count < MIN_CHUNK_BYTES) {
+        count = body / MIN_CHUNK_BYTES > 0 ? body / MIN_CHUNK_BYTES : 1;
+    }
+
+    std::vector<chunk_t> chunks(count);
+    for (size_t i = 0; i < count; i++) {
+        chunks[i].begin = CAPTURE_FILE_HEADER_SIZE + body / count * i;
+        chunks[i].limit = i + 1 == count ? size_ : CAPTURE_FILE_HEADER_SIZE + body / count * (i + 1);
+    }
+
+    auto parse = [this](chunk_t &chunk, bool first) {
+        madvise(const_cast<uint8_t *>(data_) + (chunk.begin & ~size_t(4095)),
+                chunk.limit - (chunk.begin & ~size_t(4095)), MADV_WILLNEED);
+        chunk.start = first ? chunk.begin : find_record_start(data_, size_, chunk.begin, created_ns_);
+        // Media datagrams are about 1 KB, log lines less
+        chunk.packets.reserve((chunk.limit - chunk.begin) / 512);
+        chunk.end = walk_records(data_, size_, chunk.start, chunk.limit, chunk.packets);
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < count; i++) {
+        workers.emplace_back(parse, std::ref(chunks[i]), false);
+    }
+    parse(chunks[0], true);
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    // A guessed start is right exactly when the previous chunk ended there
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0 && chunks[i].start != chunks[i - 1].end) {
+            chunks[i].packets.clear();
+            chunks[i].start = chunks[i - 1].end;
+            chunks[i].end = chunks[i].start < chunks[i].limit
+                ? walk_records(data_, size_, chunks[i].start, chunks[i].limit, chunks[i].packets)
+                : chunks[i].start;
+        }
+        total += chunks[i].packets.size();
+    }
+
+    std::vector<packet_desc_t> packets;
+    packets.reserve(total);
+    for (auto &chunk : chunks) {
+        packets.insert(packets.end(), chunk.packets.begin(), chunk.packets.end());
+        std::vector<packet_desc_t>().swap(chunk.packets);
+    }
+    return packets;
+}
@@ -0,0 +1,82 @@
+#ifndef CAPTURE_FILE_H
+#define CAPTURE_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Layout of the .tcap files of python_server/packet_capture.py, see docs/packet_capture.md
+constexpr char CAPTURE_MAGIC[4] = {'T', 'C', 'A', 'P'};
+constexpr uint16_t CAPTURE_VERSION = 1;
+constexpr size_t CAPTURE_FILE_HEADER_SIZE = 16;
+constexpr size_t CAPTURE_RECORD_HEADER_SIZE = 16;
+constexpr size_t CAPTURE_RECORD_ALIGN = 8;
+constexpr uint16_t CAPTURE_PORT_DEVICE_LOG = 0;
+
+// Media headers, see docs/PACKET_FORMATS.md
+constexpr size_t AUDIO_HEADER_SIZE = 15;  // type, sequence, timestamp, length
+constexpr size_t VIDEO_HEADER_SIZE = 19;  // type, frame id, timestamp, length, packet seq, total packets
+constexpr uint8_t AUDIO_PACKAGE = 0;
+constexpr uint8_t VIDEO_PACKAGE = 1;
+
+enum class packet_kind : uint8_t {
+    audio,
+    video,
+    device_log,
+    other,  // Empty or unknown datagram
+};
+
+/**
+ * @brief What the analysis needs of one record, 32 bytes per datagram
+ */
+struct packet_desc_t {
+    uint64_t arrival_ns;     // Kernel receive time (ns since EPOCH)
+    uint64_t media_ms;       // Timestamp of the media header (ms since EPOCH)
+    uint32_t source;         // IPv4 address as stored in the record
+    uint32_t id;             // Audio sequence number or video frame id
+    uint16_t length;         // Datagram length
+    uint16_t packet_seq;     // Video: fragment index within the frame
+    uint16_t total_packets;  // Video: fragments of the frame
+    packet_kind kind;
+    uint8_t codec;           // Upper nibble of the package type
+};
+
+/**
+ * @brief Read-only memory mapping of a capture file
+ */
+class capture_file {
+public:
+    /**
+     * @brief Map a capture file
+     * @throw std::runtime_error if it cannot be opened or is not a version 1 capture
+     */
+    explicit capture_file(const std::string &path);
+    ~capture_file();
+
+    capture_file(const capture_file &) = delete;
+    capture_file &operator=(const capture_file &) = delete;
+
+    size_t size() const { return size_; }
+    uint64_t created_ns() const { return created_ns_; }
+
+    /**
+     * @brief Describe every record, in file order
+     *
+     * The file is cut into one chunk per thread. Every thread finds the
+     * first record of its chunk by itself and walks the record headers,
+     * skipping the payloads; chunks whose guessed start turns out wrong are
+     * walked again from the end of the previous one. A truncated last
+     * record is ignored, like packet_capture.py does.
+     *
+     * @param threads Chunks parsed in parallel
+     */
+    std::vector<packet_desc_t> scan(unsigned threads) const;
+
+private:
+    const uint8_t *data_ = nullptr;
+    size_t size_ = 0;
+    uint64_t created_ns_ = 0;
+};
+
+#endif // CAPTURE_FILE_H
@@ -0,0 +1,510 @@
+/**
+ * Offline stream quality analyzer for packet capture files
+ *
+ * Reads the .tcap captures of python_server/packet_capture.py, which can be
+ * gigabytes for field recordings, and reports per session: audio loss and
+ * loss bursts, reordering, duplicates and jitter, video frame completion and
+ * fragments per frame, and the bitrate timeline. The file is memory mapped
+ * and its records are parsed by one thread per chunk. `--bench-mb` measures
+ * the scan throughput on a synthetic capture.
+ */
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "capture_file.h"
+#include "session_stats.h"
+
+namespace {
+
+struct options_t {
+    std::vector<std::string> captures;
+    analysis_config_t config;
+    bool json = false;
+    bool timeline = false;
+    size_t bench_mb = 0;
+    int bench_rounds = 3;
+};
+
+struct scan_result_t {
+    size_t bytes = 0;
+    size_t records = 0;
+    uint64_t log_lines = 0;
+    double scan_s = 0.0;
+    double analyze_s = 0.0;
+    std::vector<session_t> sessions;
+};
+
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::string format_ip(uint32_t source)
+{
+    // Stored as the little endian value of the address bytes, see ip_to_u32 in packet_capture.py
+    char text[16];
+    std::snprintf(text, sizeof(text), "%u.%u.%u.%u", source & 0xFF, (source >> 8) & 0xFF, (source >> 16) & 0xFF,
+                  source >> 24);
+    return text;
+}
+
+std::string format_time(uint64_t ns)
+{
+    time_t seconds = static_cast<time_t>(ns / 1000000000ULL);
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+    char text[32];
+    std::strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &utc);
+    return text;
+}
+
+/**
+ * @brief Minimum, median and maximum kbit/s of the full bins of a timeline
+ */
+void bitrate_summary(const std::vector<uint64_t> &bins, uint64_t bin_ns, double out[3])
+{
+    std::vector<uint64_t> full(bins.begin(), bins.size() > 1 ? bins.end() - 1 : bins.end());
+    out[0] = out[1] = out[2] = 0.0;
+    if (full.empty()) {
+        return;
+    }
+    std::sort(full.begin(), full.end());
+    double scale = 8.0 / (static_cast<double>(bin_ns) / 1e9) / 1000.0;
+    out[0] = full.front() * scale;
+    out[1] = full[full.size() / 2] * scale;
+    out[2] = full.back() * scale;
+}
+
+scan_result_t analyze_file(const std::string &path, const analysis_config_t &config)
+{
+    scan_result_t result;
+    auto start = std::chrono::steady_clock::now();
+    capture_file capture(path);
+    std::vector<packet_desc_t> packets = capture.scan(config.threads);
+    result.scan_s = seconds_since(start);
+    result.bytes = capture.size();
+    result.records = packets.size();
+    for (const packet_desc_t &packet : packets) {
+        result.log_lines += packet.kind == packet_kind::device_log;
+    }
+
+    start = std::chrono::steady_clock::now();
+    result.sessions = analyze_sessions(packets, config);
+    result.analyze_s = seconds_since(start);
+    return result;
+}
+
+void print_histogram(const std::array<uint64_t, HISTOGRAM_BUCKETS> &hist)
+{
+    const char *separator = "";
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        if (hist[bucket] > 0) {
+            std::printf("%s%s:%" PRIu64, separator, histogram_label(bucket), hist[bucket]);
+            separator = " ";
+        }
+    }
+    if (*separator == '\0') {
+        std::printf("none");
+    }
+}
+
+void print_report(const std::string &path, const scan_result_t &result, const options_t &options)
+{
+    std::printf("%s: %.2f GB, %zu records (%" PRIu64 " log lines), %zu sessions; scanned in %.2f s (%.2f GB/s), "
+                "analyzed in %.2f s, %u threads\n",
+                path.c_str(), result.bytes / 1e9, result.records, result.log_lines, result.sessions.size(),
+                result.scan_s, result.bytes / 1e9 / std::max(result.scan_s, 1e-9), result.analyze_s,
+                options.config.threads);
+
+    int number = 1;
+    for (const session_t &session : result.sessions) {
+        const audio_stats_t &audio = session.audio;
+        const video_stats_t &video = session.video;
+        std::printf("Session %d: %s, %.1f s from %s UTC\n", number++, format_ip(session.source).c_str(),
+                    (session.end_ns - session.start_ns) / 1e9, format_time(session.start_ns).c_str());
+
+        if (audio.packets > 0) {
+            std::printf("  audio  %" PRIu64 " packets, %.2f%% lost in %" PRIu64 " bursts (max %" PRIu64 "; ",
+                        audio.packets, audio.expected ? 100.0 * audio.lost / audio.expected : 0.0, audio.loss_bursts,
+                        audio.loss_burst_max);
+            print_histogram(audio.loss_burst_hist);
+            std::printf("), reordered %" PRIu64 " (depth %" PRIu64 "), duplicates %" PRIu64
+                        ", jitter %.1f ms, max gap %.0f ms\n",
+                        audio.reordered, audio.reorder_depth, audio.duplicates, audio.jitter_ms, audio.max_gap_ms);
+        }
+        if (video.packets > 0) {
+            std::printf("  video  %" PRIu64 " frames (%" PRIu64 " packets), %.1f%% complete, %" PRIu64
+                        " never seen, %" PRIu64 " fragments lost, fragments per frame ",
+                        video.frames, video.packets, video.frames ? 100.0 * video.complete / video.frames : 0.0,
+                        video.missing_frames, video.lost_fragments);
+            print_histogram(video.fragment_hist);
+            std::printf(", reordered %" PRIu64 " (depth %" PRIu64 " frames), duplicates %" PRIu64 ", jitter %.1f ms\n",
+                        video.reordered, video.reorder_depth, video.duplicates, video.jitter_ms);
+        }
+        double audio_kbps[3], video_kbps[3];
+        bitrate_summary(session.audio_bytes, options.config.bin_ns, audio_kbps);
+        bitrate_summary(session.video_bytes, options.config.bin_ns, video_kbps);
+        std::printf("  kbit/s audio %.0f/%.0f/%.0f, video %.0f/%.0f/%.0f (min/median/max of %.1f s bins)\n",
+                    audio_kbps[0], audio_kbps[1], audio_kbps[2], video_kbps[0], video_kbps[1], video_kbps[2],
+                    options.config.bin_ns / 1e9);
+        if (options.timeline) {
+            for (size_t bin = 0; bin < session.audio_bytes.size(); bin++) {
+                double scale = 8.0 / (options.config.bin_ns / 1e9) / 1000.0;
+                std::printf("    %8.1f s  audio %7.1f  video %7.1f\n", bin * options.config.bin_ns / 1e9,
+                            session.audio_bytes[bin] * scale, session.video_bytes[bin] * scale);
+            }
+        }
+    }
+}
+
+void json_histogram(const std::array<uint64_t, HISTOGRAM_BUCKETS> &hist)
+{
+    std::printf("{");
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        std::printf("%s\"%s\": %" PRIu64, bucket ? ", " : "", histogram_label(bucket), hist[bucket]);
+    }
+    std::printf("}");
+}
+
+void json_codecs(const std::array<uint64_t, 16> &codecs)
+{
+    std::printf("{");
+    const char *separator = "";
+    for (size_t codec = 0; codec < codecs.size(); codec++) {
+        if (codecs[codec] > 0) {
+            std::printf("%s\"%zu\": %" PRIu64, separator, codec, codecs[codec]);
+            separator = ", ";
+        }
+    }
+    std::printf("}");
+}
+
+void json_timeline(const std::vector<uint64_t> &bins)
+{
+    std::printf("[");
+    for (size_t bin = 0; bin < bins.size(); bin++) {
+        std::printf("%s%" PRIu64, bin ? ", " : "", bins[bin]);
+    }
+    std::printf("]");
+}
+
+// Quoted and escaped, a path may hold quotes, backslashes or control characters
+void json_string(const std::string &text)
+{
+    std::printf("\"");
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') {
+            std::printf("\\%c", c);
+        } else if (c < 0x20) {
+            std::printf("\\u%04x", c);
+        } else {
+            std::putchar(c);
+        }
+    }
+    std::printf("\"");
+}
+
+void print_json(const std::string &path, const scan_result_t &result, const options_t &options)
+{
+    std::printf("{\"capture\": ");
+    json_string(path);
+    std::printf(", \"bytes\": %zu, \"records\": %zu, \"log_lines\": %" PRIu64
+                ", \"threads\": %u, \"scan_s\": %.6f, \"scan_gbps\": %.3f, \"analyze_s\": %.6f, "
+                "\"bin_s\": %.3f, \"sessions\": [",
+                result.bytes, result.records, result.log_lines, options.config.threads, result.scan_s,
+                result.bytes / 1e9 / std::max(result.scan_s, 1e-9), result.analyze_s, options.config.bin_ns / 1e9);
+    for (size_t i = 0; i < result.sessions.size(); i++) {
+        const session_t &session = result.sessions[i];
+        const audio_stats_t &audio = session.audio;
+        const video_stats_t &video = session.video;
+        std::printf("%s{\"source\": \"%s\", \"start_ns\": %" PRIu64 ", \"duration_s\": %.3f, \"log_lines\": %" PRIu64,
+                    i ? ", " : "", format_ip(session.source).c_str(), session.start_ns,
+                    (session.end_ns - session.start_ns) / 1e9, session.log_lines);
+        std::printf(", \"audio\": {\"packets\": %" PRIu64 ", \"expected\": %" PRIu64 ", \"lost\": %" PRIu64
+                    ", \"loss_bursts\": %" PRIu64 ", \"loss_burst_max\": %" PRIu64 ", \"loss_burst_hist\": ",
+                    audio.packets, audio.expected, audio.lost, audio.loss_bursts, audio.loss_burst_max);
+        json_histogram(audio.loss_burst_hist);
+        std::printf(", \"reordered\": %" PRIu64 ", \"reorder_depth\": %" PRIu64 ", \"duplicates\": %" PRIu64
+                    ", \"jitter_ms\": %.3f, \"max_gap_ms\": %.3f, \"codecs\": ",
+                    audio.reordered, audio.reorder_depth, audio.duplicates, audio.jitter_ms, audio.max_gap_ms);
+        json_codecs(audio.codecs);
+        std::printf("}, \"video\": {\"packets\": %" PRIu64 ", \"frames\": %" PRIu64 ", \"complete\": %" PRIu64
+                    ", \"missing_frames\": %" PRIu64 ", \"lost_fragments\": %" PRIu64 ", \"fragment_hist\": ",
+                    video.packets, video.frames, video.complete, video.missing_frames, video.lost_fragments);
+        json_histogram(video.fragment_hist);
+        std::printf(", \"reordered\": %" PRIu64 ", \"reorder_depth\": %" PRIu64 ", \"duplicates\": %" PRIu64
+                    ", \"jitter_ms\": %.3f, \"codecs\": ",
+                    video.reordered, video.reorder_depth, video.duplicates, video.jitter_ms);
+        json_codecs(video.codecs);
+        std::printf("}, \"audio_bytes\": ");
+        json_timeline(session.audio_bytes);
+        std::printf(", \"video_bytes\": ");
+        json_timeline(session.video_bytes);
+        std::printf("}");
+    }
+    std::printf("]}\n");
+}
+
+/**
+ * @brief Deterministic pseudo random numbers for the synthetic capture
+ */
+class lcg {
+public:
+    explicit lcg(uint64_t seed) : state_(seed) {}
+    uint32_t next()
+    {
+        state_ = state_ * 6364136223846793005ULL + 1442695040888963407ULL;
+        return static_cast<uint32_t>(state_ >> 33);
+    }
+    bool chance(uint32_t per_mille) { return next() % 1000 < per_mille; }
+
+private:
+    uint64_t state_;
+};
+
+class capture_writer {
+public:
+    capture_writer(const std::string &path, uint64_t created_ns) : out_(path, std::ios::binary)
+    {
+        if (!out_) {
+            throw std::runtime_error(path + ": cannot write");
+        }
+        uint16_t version = CAPTURE_VERSION, reserved = 0;
+        out_.write(CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+        out_.write(reinterpret_cast<const char *>(&version), 2);
+        out_.write(reinterpret_cast<const char *>(&reserved), 2);
+        out_.write(reinterpret_cast<const char *>(&created_ns), 8);
+        bytes_ = CAPTURE_FILE_HEADER_SIZE;
+    }
+
+    void write(uint16_t port, uint32_t source, uint64_t arrival_ns, const std::vector<uint8_t> &payload)
+    {
+        uint16_t length = static_cast<uint16_t>(payload.size());
+        static const char padding[CAPTURE_RECORD_ALIGN] = {};
+        out_.write(reinterpret_cast<const char *>(&port), 2);
+        out_.write(reinterpret_cast<const char *>(&length), 2);
+        out_.write(reinterpret_cast<const char *>(&source), 4);
+        out_.write(reinterpret_cast<const char *>(&arrival_ns), 8);
+        out_.write(reinterpret_cast<const char *>(payload.data()), length);
+        size_t pad = (CAPTURE_RECORD_ALIGN - (CAPTURE_RECORD_HEADER_SIZE + length) % CAPTURE_RECORD_ALIGN) %
+                     CAPTURE_RECORD_ALIGN;
+        out_.write(padding, pad);
+        bytes_ += CAPTURE_RECORD_HEADER_SIZE + length + pad;
+    }
+
+    size_t bytes() const { return bytes_; }
+
+private:
+    std::ofstream out_;
+    size_t bytes_ = 0;
+};
+
+std::vector<uint8_t> media_packet(uint8_t type, uint32_t id, uint64_t media_ms, size_t data_len, uint16_t packet_seq,
+                                  uint16_t total_packets)
+{
+    bool video = (type & 0x0F) == VIDEO_PACKAGE;
+    std::vector<uint8_t> packet((video ? VIDEO_HEADER_SIZE : AUDIO_HEADER_SIZE) + data_len, 0x5A);
+    uint16_t length = static_cast<uint16_t>(data_len);
+    packet[0] = type;
+    std::memcpy(&packet[1], &id, 4);
+    std::memcpy(&packet[5], &media_ms, 8);
+    std::memcpy(&packet[13], &length, 2);
+    if (video) {
+        std::memcpy(&packet[15], &packet_seq, 2);
+        std::memcpy(&packet[17], &total_packets, 2);
+    }
+    return packet;
+}
+
+/**
+ * @brief Write a capture of ten minute talk sessions with 0.5 % loss and some reordering
+ */
+void write_synthetic_capture(const std::string &path, size_t target_bytes)
+{
+    const uint64_t start_ns = 1760000000ULL * 1000000000ULL;
+    const uint64_t audio_interval_ns = 20250000;  // 324 bytes of 8 kHz PCM
+    const uint64_t frame_interval_ns = 66666667;  // 15 fps
+    const uint64_t session_ns = 600ULL * 1000000000ULL;
+    const uint32_t sources[2] = {0x1100000A, 0x1200000A};  // 10.0.0.17, 10.0.0.18
+
+    capture_writer writer(path, start_ns);
+    lcg random(1);
+    std::vector<uint8_t> log_line(72, 'L');
+    uint64_t session_start_ns = start_ns;
+    uint32_t session = 0;
+
+    while (writer.bytes() < target_bytes) {
+        uint32_t source = sources[session % 2];
+        uint64_t next_audio = session_start_ns, next_frame = session_start_ns;
+        uint32_t sequence = 0, frame_id = 0;
+        std::vector<uint8_t> held;  // Packet delayed behind the next one
+        uint16_t held_port = 0;
+        uint64_t held_ns = 0;
+
+        while (next_audio < session_start_ns + session_ns && writer.bytes() < target_bytes) {
+            std::vector<std::pair<uint16_t, std::vector<uint8_t>>> due;
+            uint64_t now;
+            if (next_audio <= next_frame) {
+                now = next_audio;
+                due.emplace_back(12345, media_packet(AUDIO_PACKAGE, sequence++, now / 1000000, 324, 0, 0));
+                next_audio += audio_interval_ns;
+            } else {
+                now = next_frame;
+                size_t frame_len = 2500 + random.next() % 4000;
+                uint16_t total = static_cast<uint16_t>((frame_len + 1380) / 1381);
+                for (uint16_t seq = 0; seq < total; seq++) {
+                    size_t chunk = std::min<size_t>(1381, frame_len - seq * 1381);
+                    due.emplace_back(12346, media_packet(VIDEO_PACKAGE, frame_id, now / 1000000, chunk, seq, total));
+                }
+                frame_id++;
+                next_frame += frame_interval_ns;
+                writer.write(CAPTURE_PORT_DEVICE_LOG, source, now, log_line);
+            }
+            for (auto &packet : due) {
+                uint64_t arrival = now + 2000000 + random.next() % 3000000;
+                if (random.chance(5)) {
+                    continue;  // Lost
+                }
+                if (held.empty() && random.chance(2)) {
+                    held = std::move(packet.second);
+                    held_port = packet.first;
+                    held_ns = arrival;
+                    continue;
+                }
+                writer.write(packet.first, source, arrival, packet.second);
+                if (!held.empty()) {
+                    writer.write(held_port, source, std::max(held_ns, arrival), held);
+                    held.clear();
+                }
+            }
+        }
+        session_start_ns += session_ns + 5ULL * 1000000000ULL;
+        session++;
+    }
+}
+
+int run_bench(const options_t &options)
+{
+    const char *tmpdir = std::getenv("TMPDIR");
+    std::string path = std::string(tmpdir ? tmpdir : "/tmp") + "/capture_analyzer_bench_" +
+                       std::to_string(getpid()) + ".tcap";
+    write_synthetic_capture(path, options.bench_mb << 20);
+
+    scan_result_t best;
+    try {
+        for (int round = 0; round < options.bench_rounds; round++) {
+            scan_result_t result = analyze_file(path, options.config);
+            if (round == 0 || result.scan_s + result.analyze_s < best.scan_s + best.analyze_s) {
+                best = std::move(result);
+            }
+        }
+    } catch (const std::exception &e) {
+        unlink(path.c_str());
+        throw;
+    }
+    unlink(path.c_str());
+
+    double gbps = best.bytes / 1e9 / std::max(best.scan_s, 1e-9);
+    double total_gbps = best.bytes / 1e9 / std::max(best.scan_s + best.analyze_s, 1e-9);
+    if (options.json) {
+        std::printf("{\"benchmark\": \"capture_analyzer\", \"bytes\": %zu, \"records\": %zu, \"sessions\": %zu, "
+                    "\"threads\": %u, \"rounds\": %d, \"scan_s\": %.6f, \"analyze_s\": %.6f, \"scan_gbps\": %.3f, "
+                    "\"total_gbps\": %.3f}\n",
+                    best.bytes, best.records, best.sessions.size(), options.config.threads, options.bench_rounds,
+                    best.scan_s, best.analyze_s, gbps, total_gbps);
+    } else {
+        std::printf("Synthetic capture: %.2f GB, %zu records, %zu sessions, %u threads, best of %d\n",
+                    best.bytes / 1e9, best.records, best.sessions.size(), options.config.threads,
+                    options.bench_rounds);
+        std::printf("  scan     %.3f s  %.2f GB/s\n", best.scan_s, gbps);
+        std::printf("  analyze  %.3f s\n", best.analyze_s);
+        std::printf("  total             %.2f GB/s\n", total_gbps);
+    }
+    return 0;
+}
+
+void usage(const char *program)
+{
+    std::fprintf(stderr,
+                 "Usage: %s [options] CAPTURE...\n"
+                 "       %s --bench-mb MB [--bench-rounds N] [--threads N] [--json]\n"
+                 "Options:\n"
+                 "  --threads N         Parallel chunks and sessions (default: all cores)\n"
+                 "  --session-gap S     Silence of a source that ends its session (default 2 s)\n"
+                 "  --bin-s S           Width of the bitrate timeline bins (default 1 s)\n"
+                 "  --timeline          Print the bitrate timeline of every session\n"
+                 "  --json              Print a machine-readable report\n",
+                 program, program);
+}
+
+bool parse_options(int argc, char **argv, options_t &options)
+{
+    unsigned cores = std::thread::hardware_concurrency();
+    options.config.threads = cores > 0 ? cores : 1;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--threads" && has_value) {
+            options.config.threads = static_cast<unsigned>(std::max(1, std::atoi(argv[++i])));
+        } else if (arg == "--session-gap" && has_value) {
+            options.config.session_gap_ns = static_cast<uint64_t>(std::atof(argv[++i]) * 1e9);
+        } else if (arg == "--bin-s" && has_value) {
+            options.config.bin_ns = static_cast<uint64_t>(std::max(0.001, std::atof(argv[++i])) * 1e9);
+        } else if (arg == "--timeline") {
+            options.timeline = true;
+        } else if (arg == "--json") {
+            options.json = true;
+        } else if (arg == "--bench-mb" && has_value) {
+            options.bench_mb = static_cast<size_t>(std::max(1, std::atoi(argv[++i])));
+        } else if (arg == "--bench-rounds" && has_value) {
+            options.bench_rounds = std::max(1, std::atoi(argv[++i]));
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            return false;
+        } else {
+            options.captures.push_back(arg);
+        }
+    }
+    return options.bench_mb > 0 || !options.captures.empty();
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    options_t options;
+    if (!parse_options(argc, argv, options)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    try {
+        if (options.bench_mb > 0) {
+            return run_bench(options);
+        }
+        for (const std::string &path : options.captures) {
+            scan_result_t result = analyze_file(path, options.config);
+            if (options.json) {
+                print_json(path, result, options);
+            } else {
+                print_report(path, result, options);
+            }
+        }
+    } catch (const std::exception &e) {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,343 @@
+#include "session_stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+#include <unordered_map>
+
+namespace {
+
+// Window of recent sequence numbers checked for duplicates
+constexpr uint64_t SEEN_WINDOW = 1 << 16;
+// An id this far behind the newest one is a restarted stream, not reordering
+constexpr int32_t RESTART_DISTANCE = 256;
+
+const char *const HISTOGRAM_LABELS[HISTOGRAM_BUCKETS] = {"1", "2", "3-4", "5-8", "9-16", "17-32", "33-64", "65+"};
+
+/**
+ * @brief Extends 32 bit sequence numbers and frame ids across wraps
+ */
+class unwrapper {
+public:
+    int64_t operator()(uint32_t id)
+    {
+        if (!started_) {
+            started_ = true;
+            last_ = id;
+            return last_;
+        }
+        last_ += static_cast<int32_t>(id - static_cast<uint32_t>(last_));
+        return last_;
+    }
+
+private:
+    bool started_ = false;
+    int64_t last_ = 0;
+};
+
+/**
+ * @brief Which of the last SEEN_WINDOW sequence numbers arrived
+ */
+class seen_window {
+public:
+    seen_window() : bits_(SEEN_WINDOW / 64, 0) {}
+
+    // Returns false for a duplicate
+    bool mark(int64_t seq, int64_t highest)
+    {
+        if (highest - seq >= static_cast<int64_t>(SEEN_WINDOW)) {
+            return true;  // Too old to tell, counted as reordered only
+        }
+        uint64_t bit = static_cast<uint64_t>(seq) % SEEN_WINDOW;
+        uint64_t mask = 1ULL << (bit % 64);
+        if (bits_[bit / 64] & mask) {
+            return false;
+        }
+        bits_[bit / 64] |= mask;
+        return true;
+    }
+
+    // Forget the slots that the sequence numbers (from, to] will use
+    void advance(int64_t from, int64_t to)
+    {
+        if (to - from >= static_cast<int64_t>(SEEN_WINDOW)) {
+            std::fill(bits_.begin(), bits_.end(), 0);
+            return;
+        }
+        for (int64_t seq = from + 1; seq <= to; seq++) {
+            uint64_t bit = static_cast<uint64_t>(seq) % SEEN_WINDOW;
+            bits_[bit / 64] &= ~(1ULL << (bit % 64));
+        }
+    }
+
+private:
+    std::vector<uint64_t> bits_;
+};
+
+/**
+ * @brief RFC 3550 interarrival jitter
+ */
+class jitter_estimator {
+public:
+    void add(uint64_t arrival_ns, uint64_t media_ms)
+    {
+        double transit_ms = static_cast<double>(arrival_ns) / 1e6 - static_cast<double>(media_ms);
+        if (started_) {
+            jitter_ms_ += (std::fabs(transit_ms - last_transit_ms_) - jitter_ms_) / 16.0;
+        }
+        last_transit_ms_ = transit_ms;
+        started_ = true;
+    }
+
+    double value() const { return jitter_ms_; }
+
+private:
+    bool started_ = false;
+    double last_transit_ms_ = 0.0;
+    double jitter_ms_ = 0.0;
+};
+
+struct frame_state_t {
+    uint16_t total_packets;
+    uint16_t received;
+    uint16_t highest_seq;
+    uint64_t first_arrival_ns;
+    uint64_t media_ms;
+    std::vector<uint64_t> fragments;  // Bit per fragment
+};
+
+void add_to_timeline(std::vector<uint64_t> &bins, const session_t &session, uint64_t arrival_ns, uint64_t bin_ns,
+                     uint16_t length)
+{
+    size_t bin = arrival_ns > session.start_ns ? (arrival_ns - session.start_ns) / bin_ns : 0;
+    if (bin >= bins.size()) {
+        bins.resize(bin + 1, 0);
+    }
+    bins[bin] += length;
+}
+
+void analyze_audio(session_t &session, const std::vector<packet_desc_t> &packets, const std::vector<size_t> &indices,
+                   uint64_t bin_ns)
+{
+    audio_stats_t &audio = session.audio;
+    unwrapper unwrap;
+    seen_window seen;
+    jitter_estimator jitter;
+    std::vector<int64_t> sequences;
+    int64_t highest = 0;
+    uint64_t last_arrival_ns = 0;
+
+    for (size_t index : indices) {
+        const packet_desc_t &packet = packets[index];
+        if (packet.kind != packet_kind::audio) {
+            continue;
+        }
+        int64_t seq = unwrap(packet.id);
+        if (audio.packets == 0) {
+            highest = seq;
+            seen.mark(seq, highest);
+        } else if (seq > highest) {
+            seen.advance(highest, seq);
+            highest = seq;
+            seen.mark(seq, highest);
+        } else if (!seen.mark(seq, highest)) {
+            audio.duplicates++;
+        } else if (seq < highest) {
+            audio.reordered++;
+            audio.reorder_depth = std::max<uint64_t>(audio.reorder_depth, highest - seq);
+        }
+
+        if (audio.packets > 0 && packet.arrival_ns > last_arrival_ns) {
+            audio.max_gap_ms = std::max(audio.max_gap_ms, (packet.arrival_ns - last_arrival_ns) / 1e6);
+        }
+        last_arrival_ns = std::max(last_arrival_ns, packet.arrival_ns);
+        jitter.add(packet.arrival_ns, packet.media_ms);
+        sequences.push_back(seq);
+        audio.codecs[packet.codec]++;
+        audio.packets++;
+        add_to_timeline(session.audio_bytes, session, packet.arrival_ns, bin_ns, packet.length);
+    }
+    if (sequences.empty()) {
+        return;
+    }
+
+    // Loss bursts are the holes between the distinct sequence numbers
+    std::sort(sequences.begin(), sequences.end());
+    sequences.erase(std::unique(sequences.begin(), sequences.end()), sequences.end());
+    audio.expected = static_cast<uint64_t>(sequences.back() - sequences.front() + 1);
+    audio.lost = audio.expected - sequences.size();
+    for (size_t i = 1; i < sequences.size(); i++) {
+        uint64_t hole = static_cast<uint64_t>(sequences[i] - sequences[i - 1] - 1);
+        if (hole > 0) {
+            audio.loss_bursts++;
+            audio.loss_burst_max = std::max(audio.loss_burst_max, hole);
+            audio.loss_burst_hist[histogram_bucket(hole)]++;
+        }
+    }
+    audio.jitter_ms = jitter.value();
+}
+
+void analyze_video(session_t &session, const std::vector<packet_desc_t> &packets, const std::vector<size_t> &indices,
+                   uint64_t bin_ns)
+{
+    video_stats_t &video = session.video;
+    unwrapper unwrap;
+    std::unordered_map<int64_t, frame_state_t> frames;
+    int64_t newest = 0;
+
+    for (size_t index : indices) {
+        const packet_desc_t &packet = packets[index];
+        if (packet.kind != packet_kind::video) {
+            continue;
+        }
+        int64_t frame_id = unwrap(packet.id);
+        video.packets++;
+        video.codecs[packet.codec]++;
+        add_to_timeline(session.video_bytes, session, packet.arrival_ns, bin_ns, packet.length);
+
+        auto inserted = frames.try_emplace(frame_id);
+        frame_state_t &frame = inserted.first->second;
+        if (inserted.second) {
+            frame.total_packets = packet.total_packets;
+            frame.received = 0;
+            frame.highest_seq = 0;
+            frame.first_arrival_ns = packet.arrival_ns;
+            frame.media_ms = packet.media_ms;
+            frame.fragments.assign((packet.total_packets + 63) / 64, 0);
+        }
+        if (packet.packet_seq >= frame.total_packets) {
+            continue;  // Inconsistent with the first fragment of the frame
+        }
+        uint64_t mask = 1ULL << (packet.packet_seq % 64);
+        uint64_t &word = frame.fragments[packet.packet_seq / 64];
+        if (word & mask) {
+            video.duplicates++;
+            continue;
+        }
+        word |= mask;
+
+        if (video.packets == 1 || frame_id > newest) {
+            newest = frame_id;
+        } else if (frame_id < newest) {
+            video.reordered++;
+            video.reorder_depth = std::max<uint64_t>(video.reorder_depth, newest - frame_id);
+        } else if (frame.received > 0 && packet.packet_seq < frame.highest_seq) {
+            video.reordered++;
+        }
+        frame.highest_seq = std::max(frame.highest_seq, packet.packet_seq);
+        frame.received++;
+    }
+    if (frames.empty()) {
+        return;
+    }
+
+    std::vector<int64_t> ids;
+    ids.reserve(frames.size());
+    for (const auto &entry : frames) {
+        ids.push_back(entry.first);
+    }
+    std::sort(ids.begin(), ids.end());
+
+    jitter_estimator jitter;
+    for (int64_t id : ids) {
+        const frame_state_t &frame = frames[id];
+        video.fragment_hist[histogram_bucket(frame.total_packets)]++;
+        if (frame.received == frame.total_packets) {
+            video.complete++;
+        } else {
+            video.lost_fragments += frame.total_packets - frame.received;
+        }
+        jitter.add(frame.first_arrival_ns, frame.media_ms);
+    }
+    video.frames = ids.size();
+    video.missing_frames = static_cast<uint64_t>(ids.back() - ids.front() + 1) - ids.size();
+    video.jitter_ms = jitter.value();
+}
+
+} // namespace
+
+int histogram_bucket(uint64_t value)
+{
+    int bucket = 0;
+    for (uint64_t bound = 1; value > bound && bucket < HISTOGRAM_BUCKETS - 1; bound <<= 1) {
+        bucket++;
+    }
+    return bucket;
+}
+
+const char *histogram_label(int bucket)
+{
+    return HISTOGRAM_LABELS[bucket];
+}
+
+std::vector<session_t> analyze_sessions(const std::vector<packet_desc_t> &packets, const analysis_config_t &config)
+{
+    struct open_session_t {
+        size_t index;
+        uint64_t last_ns;
+        uint32_t newest_id[2];  // Audio sequence number and video frame id
+        bool has_id[2];
+    };
+    std::vector<session_t> sessions;
+    std::vector<std::vector<size_t>> members;
+    std::unordered_map<uint32_t, open_session_t> open;
+
+    // Sessions in one pass over the descriptors, the statistics in parallel below
+    for (size_t i = 0; i < packets.size(); i++) {
+        const packet_desc_t &packet = packets[i];
+        int media = packet.kind == packet_kind::audio ? 0 : packet.kind == packet_kind::video ? 1 : -1;
+        auto found = open.find(packet.source);
+        bool expired = found == open.end() ||
+                       (packet.arrival_ns > found->second.last_ns &&
+                        packet.arrival_ns - found->second.last_ns > config.session_gap_ns) ||
+                       (media >= 0 && found->second.has_id[media] &&
+                        static_cast<int32_t>(packet.id - found->second.newest_id[media]) < -RESTART_DISTANCE);
+        if (packet.kind == packet_kind::device_log) {
+            if (!expired) {
+                sessions[found->second.index].log_lines++;
+            }
+            continue;
+        }
+        if (expired) {
+            open[packet.source] = open_session_t{sessions.size(), packet.arrival_ns, {0, 0}, {false, false}};
+            sessions.emplace_back();
+            sessions.back().source = packet.source;
+            sessions.back().start_ns = packet.arrival_ns;
+            sessions.back().end_ns = packet.arrival_ns;
+            members.emplace_back();
+            found = open.find(packet.source);
+        }
+        session_t &session = sessions[found->second.index];
+        found->second.last_ns = std::max(found->second.last_ns, packet.arrival_ns);
+        if (media >= 0 && (!found->second.has_id[media] ||
+                           static_cast<int32_t>(packet.id - found->second.newest_id[media]) > 0)) {
+            found->second.newest_id[media] = packet.id;
+            found->second.has_id[media] = true;
+        }
+        session.start_ns = std::min(session.start_ns, packet.arrival_ns);
+        session.end_ns = std::max(session.end_ns, packet.arrival_ns);
+        members[found->second.index].push_back(i);
+    }
+
+    std::atomic<size_t> next{0};
+    auto work = [&]() {
+        for (size_t i = next++; i < sessions.size(); i = next++) {
+            analyze_audio(sessions[i], packets, members[i], config.bin_ns);
+            analyze_video(sessions[i], packets, members[i], config.bin_ns);
+            size_t bins = std::max(sessions[i].audio_bytes.size(), sessions[i].video_bytes.size());
+            sessions[i].audio_bytes.resize(bins, 0);
+            sessions[i].video_bytes.resize(bins, 0);
+        }
+    };
+    std::vector<std::thread> workers;
+    unsigned count = std::min<size_t>(config.threads > 0 ? config.threads : 1, sessions.size());
+    for (unsigned i = 1; i < count; i++) {
+        workers.emplace_back(work);
+    }
+    work();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    return sessions;
+}
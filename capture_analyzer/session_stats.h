@@ -0,0 +1,85 @@
+#ifndef SESSION_STATS_H
+#define SESSION_STATS_H
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "capture_file.h"
+
+// Histogram buckets of loss burst lengths and of fragments per frame: 1, 2, 3-4, 5-8, ... 65+
+constexpr int HISTOGRAM_BUCKETS = 8;
+
+/**
+ * @brief Bucket of a histogram with power of two bounds
+ */
+int histogram_bucket(uint64_t value);
+
+/**
+ * @brief Label of a bucket ("1", "2", "3-4", ... "65+")
+ */
+const char *histogram_label(int bucket);
+
+struct analysis_config_t {
+    uint64_t session_gap_ns = 2000000000ULL;  // Silence of a source that ends its session
+    uint64_t bin_ns = 1000000000ULL;          // Width of the bitrate timeline bins
+    unsigned threads = 1;
+};
+
+struct audio_stats_t {
+    uint64_t packets = 0;
+    uint64_t expected = 0;        // Sequence range of the session
+    uint64_t lost = 0;
+    uint64_t duplicates = 0;
+    uint64_t reordered = 0;       // Arrived after a higher sequence number
+    uint64_t reorder_depth = 0;   // Largest distance to the highest sequence number seen
+    uint64_t loss_bursts = 0;
+    uint64_t loss_burst_max = 0;
+    std::array<uint64_t, HISTOGRAM_BUCKETS> loss_burst_hist{};
+    double jitter_ms = 0.0;       // RFC 3550 interarrival jitter against the media timestamps
+    double max_gap_ms = 0.0;      // Largest gap between two arrivals
+    std::array<uint64_t, 16> codecs{};
+};
+
+struct video_stats_t {
+    uint64_t packets = 0;
+    uint64_t duplicates = 0;
+    uint64_t reordered = 0;       // Fragments after a later fragment or frame
+    uint64_t reorder_depth = 0;   // Largest distance in frames to the newest frame seen
+    uint64_t frames = 0;          // Frames with at least one fragment
+    uint64_t complete = 0;
+    uint64_t missing_frames = 0;  // Frame ids of the range without any fragment
+    uint64_t lost_fragments = 0;  // Fragments missing from incomplete frames
+    std::array<uint64_t, HISTOGRAM_BUCKETS> fragment_hist{};
+    double jitter_ms = 0.0;       // RFC 3550 jitter of the first fragment of each frame
+    std::array<uint64_t, 16> codecs{};
+};
+
+/**
+ * @brief One session: the datagrams of a source until it is silent for the
+ * session gap or its sequence numbers or frame ids start over
+ */
+struct session_t {
+    uint32_t source = 0;
+    uint64_t start_ns = 0;
+    uint64_t end_ns = 0;
+    uint64_t log_lines = 0;
+    audio_stats_t audio;
+    video_stats_t video;
+    std::vector<uint64_t> audio_bytes;  // Per timeline bin
+    std::vector<uint64_t> video_bytes;
+};
+
+/**
+ * @brief Split the packets into sessions and compute their statistics
+ *
+ * Device log lines count towards the session of the device they were
+ * captured with. Sessions are analyzed in parallel.
+ *
+ * @param packets Descriptors in file order
+ * @param config  Session gap, timeline bins and threads
+ * @return Sessions ordered by their first packet
+ */
+std::vector<session_t> analyze_sessions(const std::vector<packet_desc_t> &packets, const analysis_config_t &config);
+
+#endif // SESSION_STATS_H
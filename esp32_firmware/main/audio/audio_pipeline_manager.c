@@ -4,14 +4,23 @@
 #include "audio_pipeline.h"
 #include "i2s_stream.h"
 #include "udp_stream.h"
+#include "congestion_monitor.h"
+#include "packet_timing.h"
 #include "board.h"
+#include "sdkconfig.h"
+#if CONFIG_EMULATED_PERIPHERALS
+#include "emulated_i2s_stream.h"
+#endif
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
-#define I2S_SAMPLE_RATE     8000
 #define UDP_PORT_LOCAL      12345
 
+// The UDP elements run the Opus encoder and decoder in their own task
+#define UDP_TASK_STACK      4096
+#define OPUS_TASK_STACK     (24 * 1024)
+
 static const char *TAG = "AUDIO_MANAGER";
 
 esp_err_t audio_pipelines_init(struct audio_pipeline_manager_info *audio_pipelines_info)
@@ -21,6 +30,19 @@ esp_err_t audio_pipelines_init(struct audio_pipeline_manager_info *audio_pipelin
         return ESP_ERR_INVALID_ARG;
     }
 
+    // The codec sets the sample rate of both directions and the size of a packet
+    udp_stream_codec_t codec = audio_pipelines_info->codec;
+    int sample_rate = udp_stream_codec_sample_rate(codec);
+    int block_bytes = udp_stream_codec_block_bytes(codec);
+    int udp_task_stack = (codec == UDP_STREAM_CODEC_PCM) ? UDP_TASK_STACK : OPUS_TASK_STACK;
+    int bitrate = 0;
+    int expected_loss = 0;
+#if CONFIG_AUDIO_OPUS
+    bitrate = (codec == UDP_STREAM_CODEC_OPUS_16K) ? CONFIG_AUDIO_OPUS_BITRATE_16K : CONFIG_AUDIO_OPUS_BITRATE_8K;
+    expected_loss = CONFIG_AUDIO_OPUS_EXPECTED_LOSS;
+#endif
+    ESP_LOGI(TAG, "Audio codec %d at %d Hz", codec, sample_rate);
+
     // === SEND PIPELINE: I2S MIC -> UDP ===
     audio_pipeline_cfg_t pipeline_cfg = DEFAULT_AUDIO_PIPELINE_CONFIG();
     audio_pipelines_info->pipeline_send = audio_pipeline_init(&pipeline_cfg);
@@ -30,17 +52,26 @@ esp_err_t audio_pipelines_init(struct audio_pipeline_manager_info *audio_pipelin
     }
 
     // === I2S CONFIG
+#if CONFIG_EMULATED_PERIPHERALS
+    emulated_i2s_stream_cfg_t i2s_cfg_send = EMULATED_I2S_STREAM_CFG_DEFAULT();
+    i2s_cfg_send.type = AUDIO_STREAM_READER;
+    i2s_cfg_send.sample_rate = sample_rate;
+    i2s_cfg_send.tone_hz = CONFIG_EMULATED_AUDIO_TONE_HZ;
+    i2s_cfg_send.buffer_len = block_bytes;
+    audio_pipelines_info->i2s_reader = emulated_i2s_stream_init(&i2s_cfg_send);
+#else
     i2s_stream_cfg_t i2s_cfg_send = I2S_STREAM_CFG_DEFAULT();
     i2s_cfg_send.type = AUDIO_STREAM_READER;
     i2s_cfg_send.chan_cfg.id = CODEC_ADC_I2S_PORT;
     i2s_cfg_send.std_cfg.slot_cfg.slot_mode = I2S_SLOT_MODE_MONO;
     i2s_cfg_send.std_cfg.slot_cfg.slot_mask = I2S_STD_SLOT_LEFT;
-    i2s_cfg_send.std_cfg.clk_cfg.sample_rate_hz = I2S_SAMPLE_RATE;
+    i2s_cfg_send.std_cfg.clk_cfg.sample_rate_hz = sample_rate;
     i2s_cfg_send.std_cfg.slot_cfg.slot_bit_width = I2S_SLOT_BIT_WIDTH_16BIT;
-    i2s_cfg_send.buffer_len = 324;
+    i2s_cfg_send.buffer_len = block_bytes;
     i2s_cfg_send.use_alc = true;      // Enable ALC for volume control
     i2s_cfg_send.volume = 30;         // Boost microphone signal by +40dB for small mic
     audio_pipelines_info->i2s_reader = i2s_stream_init(&i2s_cfg_send);
+#endif
     if (audio_pipelines_info->i2s_reader == NULL) {
         ESP_LOGE(TAG, "Failed to initialize I2S reader");
         return ESP_FAIL;
@@ -57,8 +88,15 @@ esp_err_t audio_pipelines_init(struct audio_pipeline_manager_info *audio_pipelin
         .type = AUDIO_STREAM_WRITER,
         .dest_addr = dest_addr,
         .out_rb_size = 1024,
-        .task_stack = 4096,
-        .buffer_len = 324,
+        .task_stack = udp_task_stack,
+        .buffer_len = block_bytes,
+        .on_send = congestion_monitor_record_send,
+#if CONFIG_PACKET_TIMING
+        .on_packet = packet_timing_audio_tx,
+#endif
+        .codec = codec,
+        .bitrate = bitrate,
+        .expected_loss = expected_loss,
     };
     audio_pipelines_info->udp_writer = udp_stream_init(&udp_cfg_send);
     if (audio_pipelines_info->udp_writer == NULL) {
@@ -82,8 +120,12 @@ esp_err_t audio_pipelines_init(struct audio_pipeline_manager_info *audio_pipelin
         .type = AUDIO_STREAM_READER,
         .out_rb_size = 1024,
         .dest_addr = dest_addr,
-        .task_stack = 4096,
+        .task_stack = udp_task_stack,
         .buffer_len = 1400,
+        .codec = codec,
+#if CONFIG_PACKET_TIMING
+        .on_packet = packet_timing_audio_rx,
+#endif
     };
     audio_pipelines_info->udp_reader = udp_stream_init(&udp_cfg_recv);
     if (audio_pipelines_info->udp_reader == NULL) {
@@ -91,18 +133,26 @@ esp_err_t audio_pipelines_init(struct audio_pipeline_manager_info *audio_pipelin
         return ESP_FAIL;
     }
 
+#if CONFIG_EMULATED_PERIPHERALS
+    emulated_i2s_stream_cfg_t i2s_cfg_recv = EMULATED_I2S_STREAM_CFG_DEFAULT();
+    i2s_cfg_recv.type = AUDIO_STREAM_WRITER;
+    i2s_cfg_recv.sample_rate = sample_rate;
+    i2s_cfg_recv.buffer_len = 1404;
+    audio_pipelines_info->i2s_writer = emulated_i2s_stream_init(&i2s_cfg_recv);
+#else
     i2s_stream_cfg_t i2s_cfg_recv = I2S_STREAM_CFG_DEFAULT();
     i2s_cfg_recv.type = AUDIO_STREAM_WRITER;
     i2s_cfg_recv.chan_cfg.id = CODEC_ADC_I2S_PORT;
     i2s_cfg_recv.std_cfg.slot_cfg.slot_mode = I2S_SLOT_MODE_MONO;
     i2s_cfg_recv.std_cfg.slot_cfg.slot_mask = I2S_STD_SLOT_LEFT;
-    i2s_cfg_recv.std_cfg.clk_cfg.sample_rate_hz = I2S_SAMPLE_RATE;
+    i2s_cfg_recv.std_cfg.clk_cfg.sample_rate_hz = sample_rate;
     i2s_cfg_recv.std_cfg.slot_cfg.slot_bit_width = I2S_SLOT_BIT_WIDTH_16BIT;
     i2s_cfg_recv.use_alc = true; // Enable ALC for volume control
     i2s_cfg_recv.volume = 30;
     i2s_cfg_recv.buffer_len = 1404;
 
     audio_pipelines_info->i2s_writer = i2s_stream_init(&i2s_cfg_recv);
+#endif
     if (audio_pipelines_info->i2s_writer == NULL) {
         ESP_LOGE(TAG, "Failed to initialize I2S writer");
         return ESP_FAIL;
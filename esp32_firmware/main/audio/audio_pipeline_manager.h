@@ -3,6 +3,7 @@
 
 #include "audio_pipeline.h"
 #include "audio_element.h"
+#include "udp_stream.h"
 #include <netinet/in.h>
 
 struct audio_pipeline_manager_info {
@@ -13,6 +14,7 @@ struct audio_pipeline_manager_info {
     audio_element_handle_t udp_reader;
     audio_element_handle_t i2s_writer;
     in_addr_t remote_addr;
+    udp_stream_codec_t codec;  // Codec negotiated for the session
 };
 
 /**
@@ -0,0 +1,327 @@
+#include "cpu_profiler.h"
+#include "sdkconfig.h"
+
+#if CONFIG_CPU_PROFILER
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_cpu.h"
+#include "esp_cpu_utils.h"
+#include "esp_memory_utils.h"
+#include "esp_debug_helpers.h"
+#include "driver/gptimer.h"
+
+static const char *TAG = "CPU_PROFILER";
+
+// The walk starts in the timer ISR: the gptimer driver's handler and the
+// interrupt dispatcher come before the interrupted code. The host tool
+// strips them by symbol
+#define PROFILER_ISR_FRAMES 2
+#define SAMPLE_FRAMES (CONFIG_CPU_PROFILER_DEPTH + PROFILER_ISR_FRAMES)
+#define PROFILER_TIMER_HZ 1000000
+#define PROFILER_MAX_TASKS 32
+#define PROFILER_UNKNOWN_TASK 0xFF
+
+// Dump layout, parsed by python_server/cpu_profile.py
+#define DUMP_HEADER_LEN 24
+#define DUMP_SAMPLE_HEADER_LEN 4
+
+typedef struct {
+    uint8_t task;    // Index into the task table
+    uint8_t depth;   // Valid entries of pcs, innermost first
+    uint32_t pcs[SAMPLE_FRAMES];
+} profiler_sample_t;
+
+// Each core's timer interrupt writes only its own ring
+typedef struct {
+    gptimer_handle_t timer;
+    esp_err_t setup_result;
+    profiler_sample_t *samples;
+    volatile uint32_t written;  // Samples taken, the ring keeps the last CONFIG_CPU_PROFILER_SAMPLES
+} profiler_core_t;
+
+typedef struct {
+    TaskHandle_t handle;
+    char name[CPU_PROFILE_TASK_NAME_LEN];
+} profiler_task_t;
+
+static profiler_core_t cores[portNUM_PROCESSORS];
+static profiler_task_t tasks[PROFILER_MAX_TASKS];
+static volatile uint32_t task_count = 0;
+static portMUX_TYPE task_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static SemaphoreHandle_t profiler_mutex = NULL;
+static volatile bool paused = false;  // Set while a dump copies the rings
+static bool running = false;
+static int64_t started_us = 0;
+static int64_t sampled_us = 0;        // Sampling time of the samples held
+static TaskHandle_t setup_waiter = NULL;
+
+// Table index of the interrupted task, adds it on its first sample. Called from
+// _sample_isr, so in IRAM as well: pcTaskGetName is too (unless
+// CONFIG_FREERTOS_PLACE_FUNCTIONS_INTO_FLASH), the name is copied without libc
+static uint8_t IRAM_ATTR _task_index(TaskHandle_t task)
+{
+    uint32_t count = task_count;
+    for (uint32_t i = 0; i < count; i++) {
+        if (tasks[i].handle == task) {
+            return i;
+        }
+    }
+
+    uint8_t index = PROFILER_UNKNOWN_TASK;
+    portENTER_CRITICAL_ISR(&task_lock);
+        // The other core may have added it meanwhile
+        for (uint32_t i = count; i < task_count; i++) {
+            if (tasks[i].handle == task) {
+                index = i;
+            }
+        }
+        if (index == PROFILER_UNKNOWN_TASK && task_count < PROFILER_MAX_TASKS) {
+            index = task_count;
+            tasks[index].handle = task;
+            const char *name = task != NULL ? pcTaskGetName(task) : NULL;
+            for (size_t i = 0; i < CPU_PROFILE_TASK_NAME_LEN; i++) {
+                tasks[index].name[i] = (name != NULL) ? name[i] : '\0';
+                if (tasks[index].name[i] == '\0') {
+                    name = NULL;
+                }
+            }
+            task_count = index + 1;
+        }
+    portEXIT_CRITICAL_ISR(&task_lock);
+    return index;
+}
+
+// In IRAM like the packet timing, a cache miss here would land in the sample
+static bool IRAM_ATTR _sample_isr(gptimer_handle_t timer, const gptimer_alarm_event_data_t *event, void *arg)
+{
+    if (paused) {
+        return false;
+    }
+    profiler_core_t *core = &cores[esp_cpu_get_core_id()];
+    profiler_sample_t *sample = &core->samples[core->written % CONFIG_CPU_PROFILER_SAMPLES];
+
+    // CONFIG_FREERTOS_INTERRUPT_BACKTRACE links the interrupt frame to the interrupted code
+    esp_backtrace_frame_t frame = {0};
+    esp_backtrace_get_start(&frame.pc, &frame.sp, &frame.next_pc);
+    uint8_t depth = 0;
+    while (depth < SAMPLE_FRAMES && frame.next_pc != 0 && esp_backtrace_get_next_frame(&frame)) {
+        uint32_t pc = esp_cpu_process_stack_pc(frame.pc);
+        if (!esp_ptr_executable((void *)(uintptr_t)pc)) {
+            break;
+        }
+        sample->pcs[depth++] = pc;
+    }
+    sample->depth = depth;
+    sample->task = _task_index(xTaskGetCurrentTaskHandle());
+    core->written++;
+    return false;
+}
+
+// Runs pinned to its core: the timer interrupt is allocated on the core that registers the callback
+static void _timer_setup_task(void *arg)
+{
+    profiler_core_t *core = (profiler_core_t *)arg;
+    gptimer_config_t timer_config = {
+        .clk_src = GPTIMER_CLK_SRC_DEFAULT,
+        .direction = GPTIMER_COUNT_UP,
+        .resolution_hz = PROFILER_TIMER_HZ,
+    };
+    gptimer_event_callbacks_t callbacks = {
+        .on_alarm = _sample_isr,
+    };
+    gptimer_alarm_config_t alarm_config = {
+        .alarm_count = PROFILER_TIMER_HZ / CONFIG_CPU_PROFILER_HZ,
+        .reload_count = 0,
+        .flags.auto_reload_on_alarm = true,
+    };
+
+    esp_err_t ret = gptimer_new_timer(&timer_config, &core->timer);
+    if (ret == ESP_OK) {
+        ret = gptimer_register_event_callbacks(core->timer, &callbacks, NULL);
+    }
+    if (ret == ESP_OK) {
+        ret = gptimer_set_alarm_action(core->timer, &alarm_config);
+    }
+    if (ret == ESP_OK) {
+        ret = gptimer_enable(core->timer);
+    }
+    core->setup_result = ret;
+    xTaskNotifyGive(setup_waiter);
+    vTaskDelete(NULL);
+}
+
+esp_err_t cpu_profiler_init(void)
+{
+    if (profiler_mutex != NULL) {
+        ESP_LOGW(TAG, "CPU profiler already initialized");
+        return ESP_FAIL;
+    }
+    profiler_mutex = xSemaphoreCreateMutex();
+    if (profiler_mutex == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    setup_waiter = xTaskGetCurrentTaskHandle();
+    for (int i = 0; i < portNUM_PROCESSORS; i++) {
+        profiler_core_t *core = &cores[i];
+        size_t ring_bytes = CONFIG_CPU_PROFILER_SAMPLES * sizeof(profiler_sample_t);
+        core->samples = heap_caps_malloc(ring_bytes, MALLOC_CAP_SPIRAM);
+        if (core->samples == NULL) {
+            core->samples = heap_caps_malloc(ring_bytes, MALLOC_CAP_INTERNAL);
+        }
+        if (core->samples == NULL) {
+            ESP_LOGE(TAG, "No memory for %d samples on core %d", CONFIG_CPU_PROFILER_SAMPLES, i);
+            return ESP_ERR_NO_MEM;
+        }
+
+        if (xTaskCreatePinnedToCore(_timer_setup_task, "prof_setup", 3072, core, 5, NULL, i) != pdPASS) {
+            return ESP_ERR_NO_MEM;
+        }
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (core->setup_result != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to set up the timer of core %d: %s", i, esp_err_to_name(core->setup_result));
+            return core->setup_result;
+        }
+    }
+
+    ESP_LOGI(TAG, "CPU profiler ready: %d Hz, %d frames, %d samples per core",
+             CONFIG_CPU_PROFILER_HZ, CONFIG_CPU_PROFILER_DEPTH, CONFIG_CPU_PROFILER_SAMPLES);
+    return ESP_OK;
+}
+
+void cpu_profiler_start(void)
+{
+    if (profiler_mutex == NULL) {
+        return;
+    }
+    xSemaphoreTake(profiler_mutex, portMAX_DELAY);
+        if (!running) {
+            for (int i = 0; i < portNUM_PROCESSORS; i++) {
+                gptimer_start(cores[i].timer);
+            }
+            running = true;
+            started_us = esp_timer_get_time();
+        }
+    xSemaphoreGive(profiler_mutex);
+}
+
+void cpu_profiler_stop(void)
+{
+    if (profiler_mutex == NULL) {
+        return;
+    }
+    xSemaphoreTake(profiler_mutex, portMAX_DELAY);
+        if (running) {
+            for (int i = 0; i < portNUM_PROCESSORS; i++) {
+                gptimer_stop(cores[i].timer);
+            }
+            running = false;
+            sampled_us += esp_timer_get_time() - started_us;
+        }
+    xSemaphoreGive(profiler_mutex);
+}
+
+static void _put_u16(uint8_t *p, uint16_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static void _put_u32(uint8_t *p, uint32_t value)
+{
+    _put_u16(p, value & 0xFFFF);
+    _put_u16(p + 2, value >> 16);
+}
+
+esp_err_t cpu_profiler_dump(uint8_t **dump, size_t *len)
+{
+    if (profiler_mutex == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(profiler_mutex, portMAX_DELAY);
+    // A sample in progress on the other core finishes well within a tick
+    paused = true;
+    vTaskDelay(1);
+
+    int64_t now_us = esp_timer_get_time();
+    uint32_t kept[portNUM_PROCESSORS];
+    uint32_t samples = 0;
+    uint32_t overwritten = 0;
+    size_t size = DUMP_HEADER_LEN + task_count * CPU_PROFILE_TASK_NAME_LEN;
+    for (int i = 0; i < portNUM_PROCESSORS; i++) {
+        uint32_t written = cores[i].written;
+        kept[i] = written < CONFIG_CPU_PROFILER_SAMPLES ? written : CONFIG_CPU_PROFILER_SAMPLES;
+        overwritten += written - kept[i];
+        samples += kept[i];
+        for (uint32_t n = written - kept[i]; n < written; n++) {
+            size += DUMP_SAMPLE_HEADER_LEN + cores[i].samples[n % CONFIG_CPU_PROFILER_SAMPLES].depth * 4;
+        }
+    }
+
+    esp_err_t ret = ESP_OK;
+    uint8_t *buf = heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+    if (buf == NULL) {
+        buf = malloc(size);
+    }
+    if (buf == NULL) {
+        ESP_LOGE(TAG, "No memory for a %u byte profile", (unsigned)size);
+        ret = ESP_ERR_NO_MEM;
+    } else {
+        uint8_t *p = buf;
+        int64_t total_us = sampled_us + (running ? now_us - started_us : 0);
+        _put_u32(p, CPU_PROFILE_MAGIC);
+        _put_u16(p + 4, CPU_PROFILE_VERSION);
+        _put_u16(p + 6, CONFIG_CPU_PROFILER_HZ);
+        p[8] = portNUM_PROCESSORS;
+        p[9] = task_count;
+        _put_u16(p + 10, 0);
+        _put_u32(p + 12, samples);
+        _put_u32(p + 16, overwritten);
+        _put_u32(p + 20, (uint32_t)(total_us / 1000));
+        p += DUMP_HEADER_LEN;
+        for (uint32_t t = 0; t < task_count; t++) {
+            memcpy(p, tasks[t].name, CPU_PROFILE_TASK_NAME_LEN);
+            p += CPU_PROFILE_TASK_NAME_LEN;
+        }
+        // Per core, oldest sample first
+        for (int i = 0; i < portNUM_PROCESSORS; i++) {
+            uint32_t written = cores[i].written;
+            for (uint32_t n = written - kept[i]; n < written; n++) {
+                const profiler_sample_t *sample = &cores[i].samples[n % CONFIG_CPU_PROFILER_SAMPLES];
+                p[0] = i;
+                p[1] = sample->task;
+                p[2] = sample->depth;
+                p[3] = 0;
+                p += DUMP_SAMPLE_HEADER_LEN;
+                for (int f = 0; f < sample->depth; f++) {
+                    _put_u32(p, sample->pcs[f]);
+                    p += 4;
+                }
+            }
+            cores[i].written = 0;
+        }
+        task_count = 0;
+        sampled_us = 0;
+        started_us = now_us;
+        *dump = buf;
+        *len = size;
+        ESP_LOGI(TAG, "Dumped %" PRIu32 " samples (%" PRIu32 " overwritten), %u bytes",
+                 samples, overwritten, (unsigned)size);
+    }
+
+    paused = false;
+    xSemaphoreGive(profiler_mutex);
+    return ret;
+}
+
+#endif // CONFIG_CPU_PROFILER
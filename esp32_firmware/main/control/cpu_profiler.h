@@ -0,0 +1,51 @@
+#ifndef CPU_PROFILER_H
+#define CPU_PROFILER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Profile dump, see docs/cpu_profile.md
+#define CPU_PROFILE_MAGIC 0x46525043  // 'CPRF'
+#define CPU_PROFILE_VERSION 1
+#define CPU_PROFILE_TASK_NAME_LEN 16
+
+/**
+ * @brief Create one sampling timer per core
+ *
+ * The timers stay stopped until cpu_profiler_start().
+ *
+ * @return ESP_OK on success, error code on failure
+ */
+esp_err_t cpu_profiler_init(void);
+
+/**
+ * @brief Start sampling, called when a session starts
+ */
+void cpu_profiler_start(void);
+
+/**
+ * @brief Stop sampling, called when a session ends; the samples are kept
+ */
+void cpu_profiler_stop(void);
+
+/**
+ * @brief Serialize the samples of all cores and clear them
+ *
+ * Sampling pauses while the rings are copied and resumes if it was running.
+ *
+ * @param dump Set to the profile, free it with free()
+ * @param len  Set to the length of the profile
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the copy does not fit
+ */
+esp_err_t cpu_profiler_dump(uint8_t **dump, size_t *len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CPU_PROFILER_H
@@ -1,13 +1,20 @@
 #include "device_manager.h"
 #include "../audio/audio_pipeline_manager.h"
 #include "../video/video_manager.h"
+#include "cpu_profiler.h"
+#include "lock_profiler.h"
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netdb.h>
+#include "lwip/sockets.h"
 #include <unistd.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include "esp_log.h"
+#include "esp_timer.h"
 
 static const char *TAG = "DEVICE_MANAGER";
 
@@ -22,9 +29,37 @@ typedef enum {
     CMD_TALK_ENDED = 4,
     CMD_TALK_DID_NOT_END = 5,
     CMD_DOORBELL_RING = 6,
-    CMD_OPEN_DOOR = 7
+    CMD_OPEN_DOOR = 7,
+    CMD_SET_CODEC = 8,
+    CMD_CODEC_SELECTED = 9,
+    CMD_REQUEST_KEYFRAME = 10,
+    CMD_DOORBELL_THUMBNAIL = 11,
+    CMD_NACK = 12,
+    CMD_CPU_PROFILE = 13
 } device_command_t;
 
+// Commands with an argument carry it above the command byte
+#define CMD_CODE_MASK     0xFF
+#define CMD_ARGUMENT_SHIFT 8
+
+// NACK argument: low 12 bits of the frame id, then 12 bits of the packet sequence
+#define NACK_ID_MASK   0xFFF
+#define NACK_SEQ_SHIFT 12
+
+// One press can reach broadcast_doorbell_ring from both button paths, and
+// clients should not be flooded by a visitor pressing repeatedly
+#define DOORBELL_RING_MIN_INTERVAL_MS 5000
+
+#if CONFIG_DOORBELL_THUMBNAIL
+// A thumbnail that cannot be sent in time drops the client, its stream is out of step
+#define THUMBNAIL_SEND_TIMEOUT_MS 1000
+#endif
+
+#if CONFIG_CPU_PROFILER
+// A profile dump the client does not read in time drops it, the handler must not block on it
+#define CPU_PROFILE_SEND_TIMEOUT_MS 1000
+#endif
+
 // Forward declarations for static functions
 
 /**
@@ -61,7 +96,7 @@ static void _cleanup_client(int client_index);
  * @param client_index Index of the client sending the command
  * @param command Command to handle
  */
-static void _handle_client_command(int client_index, int command);
+static void _handle_client_command(int client_index, uint32_t command);
 
 /**
  * @brief Task handler for individual clients
@@ -73,8 +108,10 @@ static void _client_handler_task(void *param);
  * @brief Add a new client to the manager
  * @param client_sock Socket descriptor for the new client
  * @param client_ip IP address of the new client
+ * @param generation Set to the generation of the slot for _client_is_current, may be NULL
+ * @return Index of the client slot, or -1 if none is free
  */
-static bool _add_new_client(int client_sock, in_addr_t client_ip);
+static int _add_new_client(int client_sock, in_addr_t client_ip, uint32_t *generation);
 
 /**
  * @brief Main device manager task
@@ -82,18 +119,53 @@ static bool _add_new_client(int client_sock, in_addr_t client_ip);
  */
 static void _device_manager_task(void *arg);
 
+#if CONFIG_RELAY_UPLINK
+/**
+ * @brief Keep the outbound control connection to the relay
+ * @param arg Unused
+ */
+static void _relay_uplink_task(void *arg);
+#endif
+
+#if CONFIG_DOORBELL_THUMBNAIL || CONFIG_CPU_PROFILER
+/**
+ * @brief Write the whole buffer to a client socket
+ * @param sock Socket of the client
+ * @param buf Data to send
+ * @param len Length of the data
+ * @return false if the socket failed or timed out on the way
+ */
+static bool _send_all(int sock, const uint8_t *buf, size_t len);
+#endif
+
+#if CONFIG_DOORBELL_THUMBNAIL
+/**
+ * @brief Send the thumbnail of each ring to the clients that asked for it
+ * @param arg Unused
+ */
+static void _thumbnail_task(void *arg);
+#endif
+
 typedef struct {
     int socket;
     in_addr_t ip_address;
     bool is_connected;
     TaskHandle_t task_handle;
+    udp_stream_codec_t audio_codec;  // Codec of the client's next talk session
+    bool wants_thumbnail;            // Sent DOORBELL_THUMBNAIL, reads the framed thumbnails
+    uint32_t generation;             // Bumped on cleanup, tells a reused slot from a snapshot of the old one
+    timed_mutex_t *send_mutex;       // Serializes the writes, so a reply cannot land inside a thumbnail
 } tcp_client_t;
 
 // Client management
 static tcp_client_t clients[MAX_CLIENTS];
-static SemaphoreHandle_t clients_mutex = NULL;
+static timed_mutex_t *clients_mutex = NULL;
 static int active_talker_index = -1;  // -1 means no one talking
-static SemaphoreHandle_t talker_mutex = NULL;
+static timed_mutex_t *talker_mutex = NULL;
+#if CONFIG_DOORBELL_THUMBNAIL
+static TaskHandle_t thumbnail_task_handle = NULL;
+#endif
+static int64_t last_ring_us = 0;  // Guarded by clients_mutex
 
 // Global audio pipeline state - shared by all clients, only one can use at a time
 #define INACTIVE_CLIENT_INDEX -1
@@ -112,8 +184,8 @@ esp_err_t device_manager_init(void)
     }
 
     // Initialize mutexes
-    clients_mutex = xSemaphoreCreateMutex();
-    talker_mutex = xSemaphoreCreateMutex();
+    clients_mutex = timed_mutex_create("clients");
+    talker_mutex = timed_mutex_create("talker");
     
     if (clients_mutex == NULL || talker_mutex == NULL) {
         ESP_LOGE(TAG, "Failed to create mutexes");
@@ -122,50 +194,120 @@ esp_err_t device_manager_init(void)
     
     // Initialize clients array
     memset(clients, 0, sizeof(clients));
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        // Per client, a slow socket only holds up the writes to that client
+        clients[i].send_mutex = timed_mutex_create("send");
+        if (clients[i].send_mutex == NULL) {
+            ESP_LOGE(TAG, "Failed to create mutexes");
+            return ESP_FAIL;
+        }
+    }
 
     // Initialize global audio pipeline state
     memset(&audio_info, 0, sizeof(audio_info));
     audio_info.active_client_index = INACTIVE_CLIENT_INDEX;
 
     xTaskCreate(_device_manager_task, "device_manager", 4096, NULL, 5, NULL);
+#if CONFIG_RELAY_UPLINK
+    xTaskCreate(_relay_uplink_task, "relay_uplink", 4096, NULL, 5, NULL);
+#endif
+#if CONFIG_DOORBELL_THUMBNAIL
+    // Below the media tasks, the thumbnail must not hold up a running stream
+    xTaskCreate(_thumbnail_task, "ring_thumbnail", 4096, NULL, 3, &thumbnail_task_handle);
+#endif
 
     return ESP_OK;
 }
 
+// Send a reply to a client, from its own handler task
+static void _send_command(int client_index, uint32_t command, int flags) {
+    TIMED_MUTEX_TAKE(clients[client_index].send_mutex);
+        send(clients[client_index].socket, &command, sizeof(command), flags);
+    TIMED_MUTEX_GIVE(clients[client_index].send_mutex);
+}
+
+// Whether the slot still holds the client of a snapshot, called with the client's send mutex or clients_mutex
+static bool _client_is_current(int client_index, uint32_t generation) {
+    // _cleanup_client bumps the generation under both
+    return clients[client_index].is_connected && clients[client_index].generation == generation;
+}
+
 // Broadcast doorbell ring to all connected clients
-void broadcast_doorbell_ring(void) {
-    xSemaphoreTake(clients_mutex, portMAX_DELAY);
-        uint32_t doorbell_cmd = CMD_DOORBELL_RING;
-        
+bool broadcast_doorbell_ring(int64_t press_us) {
+    int64_t first_send_us = 0;
+    int sent = 0;
+    int ring_clients[MAX_CLIENTS];
+    uint32_t ring_generations[MAX_CLIENTS];
+    int ring_count = 0;
+
+    TIMED_MUTEX_TAKE(clients_mutex);
+        int64_t now = esp_timer_get_time();
+        if (last_ring_us != 0 && now - last_ring_us < DOORBELL_RING_MIN_INTERVAL_MS * 1000LL) {
+            TIMED_MUTEX_GIVE(clients_mutex);
+            return false;
+        }
+        last_ring_us = now;
+
         for (int i = 0; i < MAX_CLIENTS; i++) {
             if (clients[i].is_connected) {
-                send(clients[i].socket, &doorbell_cmd, sizeof(doorbell_cmd), MSG_DONTWAIT);
-                ESP_LOGI(TAG, "Sent doorbell ring to client %d", i);
+                ring_clients[ring_count] = i;
+                ring_generations[ring_count++] = clients[i].generation;
             }
         }
-    xSemaphoreGive(clients_mutex);
+    TIMED_MUTEX_GIVE(clients_mutex);
+
+    // Outside clients_mutex: a client busy with a thumbnail holds up only its own ring
+    for (int n = 0; n < ring_count; n++) {
+        uint32_t command = CMD_DOORBELL_RING;
+        int i = ring_clients[n];
+        TIMED_MUTEX_TAKE(clients[i].send_mutex);
+            bool current = _client_is_current(i, ring_generations[n]);
+            if (current) {
+                send(clients[i].socket, &command, sizeof(command), MSG_DONTWAIT);
+            }
+        TIMED_MUTEX_GIVE(clients[i].send_mutex);
+        if (current && sent++ == 0) {
+            first_send_us = esp_timer_get_time();
+        }
+    }
+
+    // Press to the first ring handed to the stack, the figure the button paths are compared by
+    if (sent > 0) {
+        ESP_LOGI(TAG, "Sent doorbell ring to %d clients, press to first send %" PRId64 " us",
+                 sent, first_send_us - press_us);
+    } else {
+        ESP_LOGI(TAG, "Doorbell ring with no client connected");
+    }
+
+#if CONFIG_DOORBELL_THUMBNAIL
+    // The ring is out, the capture runs in its own task
+    if (thumbnail_task_handle != NULL) {
+        xTaskNotifyGive(thumbnail_task_handle);
+    }
+#endif
+    return true;
 }
 
 // Request talk permission for a client
 static bool _request_talk_permission(int client_index) {
-    xSemaphoreTake(talker_mutex, portMAX_DELAY);
+    TIMED_MUTEX_TAKE(talker_mutex);
         if (active_talker_index == INACTIVE_CLIENT_INDEX) {
             active_talker_index = client_index;
-            xSemaphoreGive(talker_mutex);
+            TIMED_MUTEX_GIVE(talker_mutex);
             ESP_LOGI(TAG, "Talk permission granted to client %d", client_index);
             return true;
         }
         
         ESP_LOGW(TAG, "Talk permission denied to client %d", client_index);
         ESP_LOGI(TAG, "Another client is currently talking %d", active_talker_index);
-    xSemaphoreGive(talker_mutex);
+    TIMED_MUTEX_GIVE(talker_mutex);
     return false;
 }
 
 // Release talk permission for a client
 static bool _release_talk_permission(int client_index) {
     bool released = false;
-    xSemaphoreTake(talker_mutex, portMAX_DELAY);
+    TIMED_MUTEX_TAKE(talker_mutex);
         if (active_talker_index == client_index) {
             active_talker_index = INACTIVE_CLIENT_INDEX;
             
@@ -175,7 +317,7 @@ static bool _release_talk_permission(int client_index) {
             
             released = true;
         }
-    xSemaphoreGive(talker_mutex);
+    TIMED_MUTEX_GIVE(talker_mutex);
     return released;
 }
 
@@ -189,16 +331,22 @@ static void _stop_audio_and_video(void) {
     video_manager_stop_streaming();
     ESP_LOGI(TAG, "Video streaming stopped");
 
+#if CONFIG_CPU_PROFILER
+    cpu_profiler_stop();
+#endif
+
 }
 
 // Start audio and video for a specific client
 static esp_err_t _start_audio_and_video_for_client(int client_index) {
 
     // Get client IP address
-    xSemaphoreTake(clients_mutex, portMAX_DELAY);
+    TIMED_MUTEX_TAKE(clients_mutex);
         in_addr_t client_ip = clients[client_index].ip_address;
-    xSemaphoreGive(clients_mutex);
+        udp_stream_codec_t codec = clients[client_index].audio_codec;
+    TIMED_MUTEX_GIVE(clients_mutex);
     audio_info.audio_pipelines_info.remote_addr = client_ip;
+    audio_info.audio_pipelines_info.codec = codec;
     
     // Convert to string for logging
     char ip_str[INET_ADDRSTRLEN];
@@ -235,71 +383,163 @@ static esp_err_t _start_audio_and_video_for_client(int client_index) {
     }
 
     ESP_LOGI(TAG, "Audio pipelines started successfully for client %d (IP: %s)", client_index, ip_str);
+#if CONFIG_CPU_PROFILER
+    // Samples the session, the client fetches them with CPU_PROFILE
+    cpu_profiler_start();
+#endif
     return ESP_OK;
 }
 
 // Clean up a client connection
 static void _cleanup_client(int client_index) {
 
-    xSemaphoreTake(talker_mutex, portMAX_DELAY);
+    TIMED_MUTEX_TAKE(talker_mutex);
         if (active_talker_index == client_index) {
             _stop_audio_and_video();
         }
-    xSemaphoreGive(talker_mutex);
+    TIMED_MUTEX_GIVE(talker_mutex);
     
     _release_talk_permission(client_index);
 
-    xSemaphoreTake(clients_mutex, portMAX_DELAY);        
+    // After the ring or thumbnail in flight, which hold the send mutex but not clients_mutex
+    TIMED_MUTEX_TAKE(clients[client_index].send_mutex);
+    TIMED_MUTEX_TAKE(clients_mutex);        
         close(clients[client_index].socket);
         clients[client_index].is_connected = false;
         clients[client_index].task_handle = NULL;
         clients[client_index].socket = 0;
         clients[client_index].ip_address = 0;
+        clients[client_index].generation++;
         
         ESP_LOGI(TAG, "Client %d cleaned up", client_index);
-    xSemaphoreGive(clients_mutex);
+    TIMED_MUTEX_GIVE(clients_mutex);
+    TIMED_MUTEX_GIVE(clients[client_index].send_mutex);
 }
 
 // Handle client commands
-static void _handle_client_command(int client_index, int command) {
-    switch (command) {
+static void _handle_client_command(int client_index, uint32_t command) {
+    uint32_t argument = command >> CMD_ARGUMENT_SHIFT;
+    switch (command & CMD_CODE_MASK) {
         case CMD_REQUEST_TALK:
             if (_request_talk_permission(client_index)) {
                 // Grant permission and start audio with this client's IP
-                uint32_t response = CMD_GRANT_TALK;
-                send(clients[client_index].socket, &response, sizeof(response), 0);
+                _send_command(client_index, CMD_GRANT_TALK, 0);
                 _start_audio_and_video_for_client(client_index);
             } else {
-                uint32_t response = CMD_DENY_TALK;
-                send(clients[client_index].socket, &response, sizeof(response), 0);
+                _send_command(client_index, CMD_DENY_TALK, 0);
             }
             break;
             
         case CMD_END_TALK:
 
             if(_release_talk_permission(client_index)) {
-                uint32_t response = CMD_TALK_ENDED;
-                send(clients[client_index].socket, &response, sizeof(response), 0);
+                _send_command(client_index, CMD_TALK_ENDED, 0);
                 _stop_audio_and_video();
             }
             else {
                 ESP_LOGW(TAG, "Failed to release talk permission for client %d", client_index);
-                uint32_t response = CMD_TALK_DID_NOT_END;
-                send(clients[client_index].socket, &response, sizeof(response), 0);
+                _send_command(client_index, CMD_TALK_DID_NOT_END, 0);
             }
             break;
             
         case CMD_OPEN_DOOR:
             ESP_LOGI(TAG, "Door open command received from client %d", client_index);
             // Send confirmation back to client
+            _send_command(client_index, CMD_OPEN_DOOR, 0);
+            ESP_LOGI(TAG, "Door opened by client %d, UART message sent", client_index);
+            break;
+        case CMD_SET_CODEC:
+            // Applies from the next talk session, unsupported codecs fall back to PCM
             {
-                uint32_t response = CMD_OPEN_DOOR;
-                send(clients[client_index].socket, &response, sizeof(response), 0);
+                udp_stream_codec_t codec = UDP_STREAM_CODEC_PCM;
+                if (argument < UDP_STREAM_CODEC_COUNT && udp_stream_codec_supported((udp_stream_codec_t)argument)) {
+                    codec = (udp_stream_codec_t)argument;
+                }
+                TIMED_MUTEX_TAKE(clients_mutex);
+                    clients[client_index].audio_codec = codec;
+                TIMED_MUTEX_GIVE(clients_mutex);
+                _send_command(client_index,
+                              CMD_CODEC_SELECTED | ((uint32_t)codec << CMD_ARGUMENT_SHIFT), 0);
+                ESP_LOGI(TAG, "Client %d requested codec %" PRIu32 ", using %d", client_index, argument, codec);
+            }
+            break;
+        case CMD_REQUEST_KEYFRAME:
+            // Sent by the talker after a video loss, no reply; only its stream is affected
+            {
+                TIMED_MUTEX_TAKE(talker_mutex);
+                    bool is_talker = (active_talker_index == client_index);
+                TIMED_MUTEX_GIVE(talker_mutex);
+                if (is_talker) {
+                    video_manager_request_keyframe();
+                }
+                ESP_LOGD(TAG, "Client %d requested a keyframe%s", client_index, is_talker ? "" : " without talking");
             }
-            ESP_LOGI(TAG, "Door opened by client %d, UART message sent", client_index);
             break;
+#if CONFIG_VIDEO_RETRANSMIT
+        case CMD_NACK:
+            // A video fragment the talker lost: frame id and packet sequence, 12 bits each, no reply
+            {
+                TIMED_MUTEX_TAKE(talker_mutex);
+                    bool is_talker = (active_talker_index == client_index);
+                TIMED_MUTEX_GIVE(talker_mutex);
+                if (is_talker) {
+                    video_manager_retransmit(argument & NACK_ID_MASK, (argument >> NACK_SEQ_SHIFT) & NACK_ID_MASK);
+                }
+            }
+            break;
+#endif
+#if CONFIG_DOORBELL_THUMBNAIL
+        case CMD_DOORBELL_THUMBNAIL:
+            // Opt in: from now on a thumbnail follows each ring. The empty
+            // thumbnail in reply tells the client the device has them
+            {
+                struct timeval timeout = {
+                    .tv_sec = THUMBNAIL_SEND_TIMEOUT_MS / 1000,
+                    .tv_usec = (THUMBNAIL_SEND_TIMEOUT_MS % 1000) * 1000,
+                };
+                TIMED_MUTEX_TAKE(clients_mutex);
+                    clients[client_index].wants_thumbnail = true;
+                    setsockopt(clients[client_index].socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                TIMED_MUTEX_GIVE(clients_mutex);
+                _send_command(client_index, CMD_DOORBELL_THUMBNAIL, 0);
+                ESP_LOGI(TAG, "Client %d gets ring thumbnails", client_index);
+            }
+            break;
+#endif
+#if CONFIG_CPU_PROFILER
+        case CMD_CPU_PROFILE:
+            // The samples since the last dump, framed like a thumbnail: length in the argument, then the profile
+            {
+                uint8_t *dump = NULL;
+                size_t dump_len = 0;
+                if (cpu_profiler_dump(&dump, &dump_len) != ESP_OK) {
+                    dump_len = 0;
+                }
+                uint32_t header = CMD_CPU_PROFILE | ((uint32_t)dump_len << CMD_ARGUMENT_SHIFT);
+                struct timeval timeout = {
+                    .tv_sec = CPU_PROFILE_SEND_TIMEOUT_MS / 1000,
+                    .tv_usec = (CPU_PROFILE_SEND_TIMEOUT_MS % 1000) * 1000,
+                };
+                TIMED_MUTEX_TAKE(clients[client_index].send_mutex);
+                    // Set before the first dump and kept, like the thumbnail timeout; the
+                    // send mutex would otherwise be held forever and block rings to this client
+                    setsockopt(clients[client_index].socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                    bool sent = _send_all(clients[client_index].socket, (const uint8_t *)&header, sizeof(header)) &&
+                                _send_all(clients[client_index].socket, dump, dump_len);
+                TIMED_MUTEX_GIVE(clients[client_index].send_mutex);
+                free(dump);
+                if (sent) {
+                    ESP_LOGI(TAG, "Sent a %u byte CPU profile to client %d", (unsigned)dump_len, client_index);
+                } else {
+                    // The client cannot find the next command in a partial profile
+                    ESP_LOGW(TAG, "CPU profile to client %d failed, dropping it", client_index);
+                    shutdown(clients[client_index].socket, SHUT_RDWR);
+                }
+            }
+            break;
+#endif
         default:
-            ESP_LOGW(TAG, "Unknown command %d from client %d", command, client_index);
+            ESP_LOGW(TAG, "Unknown command %" PRIu32 " from client %d", command, client_index);
             break;
     }
 }
@@ -312,11 +552,11 @@ static void _client_handler_task(void *param) {
     ESP_LOGI(TAG, "Client handler task started for client %d", client_index);
     
     while (clients[client_index].is_connected) {
-        int command = 0;
+        uint32_t command = 0;
         int recv_result = recv(sock, &command, sizeof(command), 0);
         
         if (recv_result > 0) {
-            ESP_LOGI(TAG, "Client %d received command: %d", client_index, command);
+            ESP_LOGI(TAG, "Client %d received command: %" PRIu32, client_index, command);
             _handle_client_command(client_index, command);
         } else if (recv_result == 0) {
             // Client disconnected
@@ -338,13 +578,18 @@ static void _client_handler_task(void *param) {
 }
 
 // Add a new client to the system
-static bool _add_new_client(int client_sock, in_addr_t client_ip) {
-    xSemaphoreTake(clients_mutex, portMAX_DELAY);
+static int _add_new_client(int client_sock, in_addr_t client_ip, uint32_t *generation) {
+    TIMED_MUTEX_TAKE(clients_mutex);
         for (int i = 0; i < MAX_CLIENTS; i++) {
             if (!clients[i].is_connected) {
                 clients[i].socket = client_sock;
                 clients[i].ip_address = client_ip;
                 clients[i].is_connected = true;
+                clients[i].audio_codec = UDP_STREAM_CODEC_PCM;
+                clients[i].wants_thumbnail = false;
+                if (generation != NULL) {
+                    *generation = clients[i].generation;
+                }
                 
                 // Create dedicated task for this client
                 char task_name[32];
@@ -364,20 +609,20 @@ static bool _add_new_client(int client_sock, in_addr_t client_ip) {
                     inet_ntop(AF_INET, &addr, ip_str, INET_ADDRSTRLEN);
                     
                     ESP_LOGI(TAG, "Added new client %d from IP %s", i, ip_str);
-                    xSemaphoreGive(clients_mutex);
-                    return true;
+                    TIMED_MUTEX_GIVE(clients_mutex);
+                    return i;
                 } else {
                     ESP_LOGE(TAG, "Failed to create task for client %d", i);
                     clients[i].is_connected = false;
-                    xSemaphoreGive(clients_mutex);
-                    return false;
+                    TIMED_MUTEX_GIVE(clients_mutex);
+                    return -1;
                 }
             }
         }
-    xSemaphoreGive(clients_mutex);
+    TIMED_MUTEX_GIVE(clients_mutex);
     
     ESP_LOGW(TAG, "No available client slots");
-    return false;
+    return -1;
 }
 
 static void _device_manager_task(void *arg)
@@ -433,10 +678,156 @@ static void _device_manager_task(void *arg)
                  (int)((client_ip >> 8) & 0xFF), (int)(client_ip & 0xFF));
 
         // Try to add the new client
-        if (!_add_new_client(client_sock, client_addr.sin_addr.s_addr)) {
+        if (_add_new_client(client_sock, client_addr.sin_addr.s_addr, NULL) < 0) {
             // Max clients reached or error, reject connection
             ESP_LOGW(TAG, "Rejecting connection - max clients reached or error");
             close(client_sock);
         }
     }
 }
+
+#if CONFIG_DOORBELL_THUMBNAIL || CONFIG_CPU_PROFILER
+// Write the whole buffer, false if the socket failed or timed out on the way
+static bool _send_all(int sock, const uint8_t *buf, size_t len) {
+    while (len > 0) {
+        int sent = send(sock, buf, len, 0);
+        if (sent <= 0) {
+            return false;
+        }
+        buf += sent;
+        len -= sent;
+    }
+    return true;
+}
+#endif
+
+#if CONFIG_DOORBELL_THUMBNAIL
+static void _thumbnail_task(void *arg) {
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        int thumb_clients[MAX_CLIENTS];
+        uint32_t thumb_generations[MAX_CLIENTS];
+        int thumb_count = 0;
+        TIMED_MUTEX_TAKE(clients_mutex);
+            for (int i = 0; i < MAX_CLIENTS; i++) {
+                if (clients[i].is_connected && clients[i].wants_thumbnail) {
+                    thumb_clients[thumb_count] = i;
+                    thumb_generations[thumb_count++] = clients[i].generation;
+                }
+            }
+        TIMED_MUTEX_GIVE(clients_mutex);
+        if (thumb_count == 0) {
+            continue;
+        }
+
+        // Encoded once, the same buffer goes to every client
+        uint8_t *jpeg = NULL;
+        size_t jpeg_len = 0;
+        if (video_manager_capture_thumbnail(&jpeg, &jpeg_len) != ESP_OK) {
+            continue;
+        }
+        uint32_t header = CMD_DOORBELL_THUMBNAIL | ((uint32_t)jpeg_len << CMD_ARGUMENT_SHIFT);
+
+        // Without clients_mutex, a slow client must not hold up the rings, replies and new connections
+        for (int n = 0; n < thumb_count; n++) {
+            int i = thumb_clients[n];
+            TIMED_MUTEX_TAKE(clients[i].send_mutex);
+                if (!_client_is_current(i, thumb_generations[n])) {
+                    TIMED_MUTEX_GIVE(clients[i].send_mutex);
+                    continue;
+                }
+                bool sent = _send_all(clients[i].socket, (const uint8_t *)&header, sizeof(header)) &&
+                            _send_all(clients[i].socket, jpeg, jpeg_len);
+                if (!sent) {
+                    // Part of the thumbnail may be out, the client cannot find the next command
+                    shutdown(clients[i].socket, SHUT_RDWR);
+                }
+            TIMED_MUTEX_GIVE(clients[i].send_mutex);
+            if (sent) {
+                ESP_LOGI(TAG, "Sent ring thumbnail to client %d", i);
+            } else {
+                ESP_LOGW(TAG, "Ring thumbnail to client %d failed, dropping it", i);
+            }
+        }
+        free(jpeg);
+    }
+}
+#endif
+
+#if CONFIG_RELAY_UPLINK
+// Connect to the relay, returns the socket and the relay address or -1
+static int _connect_relay(in_addr_t *relay_ip) {
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *res = NULL;
+    char port_str[8];
+    snprintf(port_str, sizeof(port_str), "%d", CONFIG_RELAY_UPLINK_PORT);
+
+    int err = getaddrinfo(CONFIG_RELAY_UPLINK_HOST, port_str, &hints, &res);
+    if (err != 0 || res == NULL) {
+        ESP_LOGW(TAG, "Failed to resolve relay %s (%d)", CONFIG_RELAY_UPLINK_HOST, err);
+        return -1;
+    }
+
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "Failed to create relay uplink socket");
+        freeaddrinfo(res);
+        return -1;
+    }
+
+    // Commands are 4 bytes, send them at once; keepalive notices a relay that vanished
+    int opt = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
+    int keep_idle = 10, keep_interval = 5, keep_count = 3;
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &keep_idle, sizeof(keep_idle));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &keep_interval, sizeof(keep_interval));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &keep_count, sizeof(keep_count));
+
+    if (connect(sock, res->ai_addr, res->ai_addrlen) != 0) {
+        ESP_LOGW(TAG, "Failed to connect to relay %s:%d: %s",
+                 CONFIG_RELAY_UPLINK_HOST, CONFIG_RELAY_UPLINK_PORT, strerror(errno));
+        close(sock);
+        freeaddrinfo(res);
+        return -1;
+    }
+
+    *relay_ip = ((struct sockaddr_in *)res->ai_addr)->sin_addr.s_addr;
+    freeaddrinfo(res);
+    return sock;
+}
+
+// The relay becomes a regular client: its talk requests start the single media stream
+static void _relay_uplink_task(void *arg) {
+    while (1) {
+        in_addr_t relay_ip = 0;
+        int sock = _connect_relay(&relay_ip);
+        uint32_t generation = 0;
+        int client_index = sock < 0 ? -1 : _add_new_client(sock, relay_ip, &generation);
+
+        if (client_index >= 0) {
+            ESP_LOGI(TAG, "Relay uplink to %s:%d connected as client %d",
+                     CONFIG_RELAY_UPLINK_HOST, CONFIG_RELAY_UPLINK_PORT, client_index);
+
+            // The client handler task cleans the slot up when the relay goes away; the
+            // generation, not the socket, tells the slot of a later client reusing the fd
+            bool connected = true;
+            while (connected) {
+                vTaskDelay(pdMS_TO_TICKS(500));
+                TIMED_MUTEX_TAKE(clients_mutex);
+                    connected = _client_is_current(client_index, generation);
+                TIMED_MUTEX_GIVE(clients_mutex);
+            }
+            ESP_LOGW(TAG, "Relay uplink lost");
+        } else if (sock >= 0) {
+            close(sock);
+        }
+
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_RELAY_UPLINK_RETRY_MS));
+    }
+}
+#endif
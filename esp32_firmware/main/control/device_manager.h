@@ -1,6 +1,8 @@
 #ifndef DEVICE_MANAGER_H
 #define DEVICE_MANAGER_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/semphr.h>
@@ -19,7 +21,14 @@ esp_err_t device_manager_init(void);
 
 /**
  * @brief Broadcast doorbell ring to all connected clients
+ *
+ * Rings within a few seconds of the previous one are dropped, so both button
+ * paths can report the same press. Logs the time from the press to the first
+ * send.
+ *
+ * @param press_us esp_timer_get_time() of the press
+ * @return true if the ring was sent, false if it was dropped
  */
-void broadcast_doorbell_ring(void);
+bool broadcast_doorbell_ring(int64_t press_us);
 
 #endif // DEVICE_MANAGER_H
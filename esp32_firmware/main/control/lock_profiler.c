@@ -0,0 +1,245 @@
+#include "lock_profiler.h"
+
+#if CONFIG_LOCK_PROFILER
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+// Parsed by python_server/qemu_perf_test.py, keep the line format in sync
+static const char *TAG = "LOCK_TIMING";
+
+#define LOCK_PROFILER_REPORT_MS 5000  // Report and restart the statistics every 5 s
+
+static timed_mutex_t *mutexes = NULL;  // Grows at the head, unlinked only under report_mutex
+static portMUX_TYPE mutexes_lock = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t report_mutex = NULL;  // Keeps timed_mutex_delete() out of a report
+static TaskHandle_t report_task_handle = NULL;
+
+/**
+ * @brief Histogram bucket of a duration: 0 for 0 us, k for [2^(k-1), 2^k) us
+ */
+static inline uint32_t _bucket(uint32_t us)
+{
+    uint32_t bucket = us == 0 ? 0 : 32 - __builtin_clz(us);
+    return bucket < LOCK_PROFILER_BUCKETS ? bucket : LOCK_PROFILER_BUCKETS - 1;
+}
+
+/**
+ * @brief Print a histogram as comma separated counts, without the empty tail
+ */
+static void _format_hist(char *buf, size_t size, const uint32_t *hist)
+{
+    int last = LOCK_PROFILER_BUCKETS - 1;
+    while (last > 0 && hist[last] == 0) {
+        last--;
+    }
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int i = 0; i <= last && len < size; i++) {
+        len += snprintf(buf + len, size - len, i == 0 ? "%" PRIu32 : ",%" PRIu32, hist[i]);
+    }
+}
+
+static const char *_file_name(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash != NULL ? slash + 1 : path;
+}
+
+static void _report_site(const timed_mutex_t *mutex, const lock_site_t *site)
+{
+    char wait_hist[LOCK_PROFILER_BUCKETS * 11];
+    char hold_hist[LOCK_PROFILER_BUCKETS * 11];
+    char blocked_by[48] = "-";
+
+    _format_hist(wait_hist, sizeof(wait_hist), site->wait_hist);
+    _format_hist(hold_hist, sizeof(hold_hist), site->hold_hist);
+    if (site->blocker != NULL) {
+        snprintf(blocked_by, sizeof(blocked_by), "%s:%d", _file_name(site->blocker->file), site->blocker->line);
+    }
+    ESP_LOGI(TAG, "lock=%s site=%s:%d task=%s n=%" PRIu32 " contended=%" PRIu32 " wait_max_us=%" PRIu32
+             " hold_max_us=%" PRIu32 " blocked_by=%s wait_hist=%s hold_hist=%s",
+             mutex->name, _file_name(site->file), site->line, site->task_name, site->count, site->contended,
+             site->wait_max_us, site->hold_max_us, blocked_by, wait_hist, hold_hist);
+}
+
+static void _report_task(void *arg)
+{
+    static lock_site_t snapshot;
+
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(LOCK_PROFILER_REPORT_MS));
+
+        xSemaphoreTake(report_mutex, portMAX_DELAY);
+        portENTER_CRITICAL(&mutexes_lock);
+            timed_mutex_t *first = mutexes;
+        portEXIT_CRITICAL(&mutexes_lock);
+
+        for (timed_mutex_t *mutex = first; mutex != NULL; mutex = mutex->next) {
+            // The sites are linked under the mutex; its holders only wait for the copy, not for the log
+            xSemaphoreTake(mutex->handle, portMAX_DELAY);
+                lock_site_t *site = mutex->sites;
+            xSemaphoreGive(mutex->handle);
+
+            for (; site != NULL; site = site->next) {
+                xSemaphoreTake(mutex->handle, portMAX_DELAY);
+                    snapshot = *site;
+                    site->count = 0;
+                    site->contended = 0;
+                    site->wait_max_us = 0;
+                    site->hold_max_us = 0;
+                    memset(site->wait_hist, 0, sizeof(site->wait_hist));
+                    memset(site->hold_hist, 0, sizeof(site->hold_hist));
+                    site->blocker = NULL;
+                xSemaphoreGive(mutex->handle);
+
+                if (snapshot.count > 0) {
+                    _report_site(mutex, &snapshot);
+                }
+            }
+        }
+        xSemaphoreGive(report_mutex);
+    }
+}
+
+timed_mutex_t *timed_mutex_create(const char *name)
+{
+    timed_mutex_t *mutex = calloc(1, sizeof(timed_mutex_t));
+    if (mutex == NULL) {
+        return NULL;
+    }
+    mutex->handle = xSemaphoreCreateMutex();
+    if (mutex->handle == NULL) {
+        free(mutex);
+        return NULL;
+    }
+    mutex->name = name;
+
+    portENTER_CRITICAL(&mutexes_lock);
+        mutex->next = mutexes;
+        mutexes = mutex;
+    portEXIT_CRITICAL(&mutexes_lock);
+    return mutex;
+}
+
+void timed_mutex_delete(timed_mutex_t *mutex)
+{
+    if (report_mutex != NULL) {
+        xSemaphoreTake(report_mutex, portMAX_DELAY);
+    }
+    portENTER_CRITICAL(&mutexes_lock);
+        for (timed_mutex_t **link = &mutexes; *link != NULL; link = &(*link)->next) {
+            if (*link == mutex) {
+                *link = mutex->next;
+                break;
+            }
+        }
+    portEXIT_CRITICAL(&mutexes_lock);
+    if (report_mutex != NULL) {
+        xSemaphoreGive(report_mutex);
+    }
+
+    // Unbind the sites, a later mutex may get the same address
+    lock_site_t *site = mutex->sites;
+    while (site != NULL) {
+        lock_site_t *next = site->next;
+        site->mutex = NULL;
+        site->next = NULL;
+        site = next;
+    }
+    vSemaphoreDelete(mutex->handle);
+    free(mutex);
+}
+
+// In IRAM like the FreeRTOS calls they wrap, the media paths take these mutexes per packet
+void IRAM_ATTR timed_mutex_take(timed_mutex_t *mutex, lock_site_t *site)
+{
+    uint32_t wait_us = 0;
+    const lock_site_t *blocker = NULL;
+    bool contended = xSemaphoreTake(mutex->handle, 0) != pdTRUE;
+    if (contended) {
+        // Read without the mutex, the holder may give it meanwhile
+        blocker = mutex->site;
+        int64_t wait_start_us = esp_timer_get_time();
+        xSemaphoreTake(mutex->handle, portMAX_DELAY);
+        mutex->taken_us = esp_timer_get_time();
+        wait_us = (uint32_t)(mutex->taken_us - wait_start_us);
+    } else {
+        mutex->taken_us = esp_timer_get_time();
+    }
+
+    if (site->mutex == NULL) {
+        site->mutex = mutex;
+        site->next = mutex->sites;
+        mutex->sites = site;
+    } else if (site->mutex != mutex && strcmp(site->mutex->name, mutex->name) != 0) {
+        // A site for unrelated mutexes would mix them in the report, time only the first one
+        mutex->site = NULL;
+        return;
+    }
+    // Mutexes of one name (the per-client send mutexes) share the site, listed under the first one;
+    // concurrent takes of two of them may lose a count
+    mutex->site = site;
+
+    site->count++;
+    if (contended) {
+        site->contended++;
+        if (wait_us >= site->wait_max_us) {
+            site->blocker = blocker;
+        }
+    }
+    if (wait_us > site->wait_max_us) {
+        site->wait_max_us = wait_us;
+    }
+    site->wait_hist[_bucket(wait_us)]++;
+
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    if (site->task != task) {
+        // Copied, the task may be deleted before the report
+        site->task = task;
+        strncpy(site->task_name, pcTaskGetName(task), sizeof(site->task_name) - 1);
+    }
+}
+
+void IRAM_ATTR timed_mutex_give(timed_mutex_t *mutex)
+{
+    lock_site_t *site = mutex->site;
+    if (site != NULL) {
+        uint32_t hold_us = (uint32_t)(esp_timer_get_time() - mutex->taken_us);
+        if (hold_us > site->hold_max_us) {
+            site->hold_max_us = hold_us;
+        }
+        site->hold_hist[_bucket(hold_us)]++;
+        mutex->site = NULL;
+    }
+    xSemaphoreGive(mutex->handle);
+}
+
+esp_err_t lock_profiler_init(void)
+{
+    if (report_task_handle != NULL) {
+        ESP_LOGW(TAG, "Lock profiler already started");
+        return ESP_FAIL;
+    }
+
+    report_mutex = xSemaphoreCreateMutex();
+    if (report_mutex == NULL) {
+        ESP_LOGE(TAG, "Failed to create the report mutex");
+        return ESP_ERR_NO_MEM;
+    }
+    // Lowest priority above idle, the report must not add to the waits it measures
+    if (xTaskCreate(_report_task, "lock_report", 3072, NULL, 1, &report_task_handle) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the report task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_LOGI(TAG, "Lock profiler started");
+    return ESP_OK;
+}
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef LOCK_PROFILER_H
+#define LOCK_PROFILER_H
+
+#include <stdint.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Mutex of the firmware, timed per call site with CONFIG_LOCK_PROFILER
+ *
+ * Take and give it with TIMED_MUTEX_TAKE() and TIMED_MUTEX_GIVE(), always
+ * with portMAX_DELAY. Without the option it is the plain FreeRTOS mutex and
+ * the macros are xSemaphoreTake() and xSemaphoreGive().
+ */
+typedef struct timed_mutex timed_mutex_t;
+
+#if CONFIG_LOCK_PROFILER
+
+#define LOCK_PROFILER_BUCKETS 20  // Power of two us buckets, the last one from 262 ms up
+
+/**
+ * @brief Statistics of one TIMED_MUTEX_TAKE() in the source, over a report interval
+ *
+ * Updated while the mutex is held, so the mutex itself guards them.
+ */
+typedef struct lock_site {
+    const char *file;
+    int line;
+    timed_mutex_t *mutex;             // Bound on the first take
+    struct lock_site *next;           // Next site of the same mutex
+    uint32_t count;
+    uint32_t contended;               // Takes that found the mutex held
+    uint32_t wait_max_us;
+    uint32_t hold_max_us;
+    uint32_t wait_hist[LOCK_PROFILER_BUCKETS];
+    uint32_t hold_hist[LOCK_PROFILER_BUCKETS];
+    const struct lock_site *blocker;  // Holder of the mutex at the longest wait
+    TaskHandle_t task;                // Task of the last take
+    char task_name[configMAX_TASK_NAME_LEN];
+} lock_site_t;
+
+struct timed_mutex {
+    SemaphoreHandle_t handle;
+    const char *name;
+    lock_site_t *site;                // Site of the current holder, NULL when free
+    int64_t taken_us;
+    lock_site_t *sites;
+    struct timed_mutex *next;
+};
+
+/**
+ * @brief Take the mutex and account the wait to the site, use TIMED_MUTEX_TAKE()
+ */
+void timed_mutex_take(timed_mutex_t *mutex, lock_site_t *site);
+
+/**
+ * @brief Account the hold to the site of the take and give the mutex, use TIMED_MUTEX_GIVE()
+ */
+void timed_mutex_give(timed_mutex_t *mutex);
+
+/**
+ * @brief Create a mutex and register it for the report
+ *
+ * Mutexes of the same name, like one per client, are reported together.
+ *
+ * @param name Name in the report, must outlive the mutex
+ * @return The mutex, NULL without memory
+ */
+timed_mutex_t *timed_mutex_create(const char *name);
+
+/**
+ * @brief Unregister and delete a mutex, no task may hold or wait for it
+ */
+void timed_mutex_delete(timed_mutex_t *mutex);
+
+#define TIMED_MUTEX_TAKE(mutex) do { \
+        static lock_site_t _lock_site = { .file = __FILE__, .line = __LINE__ }; \
+        timed_mutex_take((mutex), &_lock_site); \
+    } while (0)
+#define TIMED_MUTEX_GIVE(mutex) timed_mutex_give(mutex)
+
+/**
+ * @brief Start the periodic report
+ *
+ * Every few seconds logs one "LOCK_TIMING" line per call site that took
+ * its mutex, parsed by python_server/qemu_perf_test.py locks.
+ *
+ * @return ESP_OK on success, error code on failure
+ */
+esp_err_t lock_profiler_init(void);
+
+#else
+
+static inline timed_mutex_t *timed_mutex_create(const char *name)
+{
+    (void)name;
+    return (timed_mutex_t *)xSemaphoreCreateMutex();
+}
+
+static inline void timed_mutex_delete(timed_mutex_t *mutex)
+{
+    vSemaphoreDelete((SemaphoreHandle_t)mutex);
+}
+
+#define TIMED_MUTEX_TAKE(mutex) xSemaphoreTake((SemaphoreHandle_t)(mutex), portMAX_DELAY)
+#define TIMED_MUTEX_GIVE(mutex) xSemaphoreGive((SemaphoreHandle_t)(mutex))
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LOCK_PROFILER_H
@@ -3,11 +3,17 @@
 #include <freertos/task.h>
 #include "esp_log.h"
 #include "nvs_flash.h"
+#include "sdkconfig.h"
 #include "network/wifi_provisioning.h"
+#include "network/emulated_eth.h"
 #include "network/mdns_service.h"
+#include "network/congestion_monitor.h"
+#include "network/packet_timing.h"
 #include "audio/audio_pipeline_manager.h"
 #include "peripheral/peripheral_manager.h"
 #include "control/device_manager.h"
+#include "control/cpu_profiler.h"
+#include "control/lock_profiler.h"
 #include "video/video_manager.h"
 
 static const char *TAG = "UDP_AUDIO_MAIN";
@@ -34,11 +40,19 @@ void app_main(void) {
     ESP_LOGI(TAG, "Initializing peripheral manager...");
     ESP_ERROR_CHECK(peripheral_manager_init());
 
+#if CONFIG_EMULATED_PERIPHERALS
+    // QEMU: emulated Ethernet instead of WiFi
+    ESP_LOGI(TAG, "Starting emulated Ethernet...");
+    start_emulated_ethernet();
+
+    ESP_LOGI(TAG, "Ethernet connected successfully!");
+#else
     // Start WiFi provisioning
     ESP_LOGI(TAG, "Starting WiFi provisioning...");
     start_wifi_provisioning();
     
     ESP_LOGI(TAG, "WiFi connected successfully!");
+#endif
 
     // Initialize mDNS service
     ESP_LOGI(TAG, "Initializing mDNS service..."); 
@@ -46,6 +60,28 @@ void app_main(void) {
     // Add TCP service for device control (port 12345)
     ESP_ERROR_CHECK(mdns_add_tcp_service(12345));
     
+    // Sample the send path so the media senders back off before ENOMEM
+    ESP_LOGI(TAG, "Starting congestion monitor...");
+    ESP_ERROR_CHECK(congestion_monitor_init());
+
+#if CONFIG_PACKET_TIMING
+    // Per-packet latency under PSRAM load, see docs/qemu_perf_test.md
+    ESP_LOGI(TAG, "Starting packet timing...");
+    ESP_ERROR_CHECK(packet_timing_init());
+#endif
+
+#if CONFIG_CPU_PROFILER
+    // Samples the sessions, fetched with python_server/cpu_profile.py
+    ESP_LOGI(TAG, "Starting CPU profiler...");
+    ESP_ERROR_CHECK(cpu_profiler_init());
+#endif
+
+#if CONFIG_LOCK_PROFILER
+    // Wait and hold times of the mutexes, see docs/qemu_perf_test.md
+    ESP_LOGI(TAG, "Starting lock profiler...");
+    ESP_ERROR_CHECK(lock_profiler_init());
+#endif
+
     // Set log levels
     esp_log_level_set("*", ESP_LOG_DEBUG);
     esp_log_level_set("AUDIO_ELEMENT", ESP_LOG_DEBUG);
@@ -0,0 +1,223 @@
+#include "congestion_monitor.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_attr.h"
+#include "sdkconfig.h"
+
+#if CONFIG_CONGESTION_WIFI_TX_BACKLOG
+#include "esp_private/wifi.h"
+#endif
+
+static const char *TAG = "CONGESTION";
+
+// Called per media packet, in IRAM with the packet paths
+#if CONFIG_MEDIA_IRAM
+#define CONGESTION_IRAM_ATTR IRAM_ATTR
+#else
+#define CONGESTION_IRAM_ATTR
+#endif
+
+// Frames shorter than this are control, mDNS or TCP ACK traffic, not media datagrams
+#define MEDIA_FRAME_MIN_LEN 256
+
+// Without a send for this long every datagram has left, resynchronize the backlog
+#define TX_BACKLOG_RESYNC_US 1000000
+
+// WiFi TX buffers the backlog is measured against
+#ifdef CONFIG_ESP_WIFI_DYNAMIC_TX_BUFFER_NUM
+#define WIFI_TX_BUFFERS CONFIG_ESP_WIFI_DYNAMIC_TX_BUFFER_NUM
+#elif defined(CONFIG_ESP_WIFI_STATIC_TX_BUFFER_NUM)
+#define WIFI_TX_BUFFERS CONFIG_ESP_WIFI_STATIC_TX_BUFFER_NUM
+#else
+#define WIFI_TX_BUFFERS 32
+#endif
+
+#define HEAP_LOW_BYTES  (CONFIG_CONGESTION_HEAP_LOW_KB * 1024)
+#define HEAP_HIGH_BYTES (CONFIG_CONGESTION_HEAP_HIGH_KB * 1024)
+
+// Congestion monitor state, shared by the media senders, the WiFi task and the sampling timer
+typedef struct {
+    uint32_t datagrams;         // Successful media sends
+    uint32_t tx_done;           // Media frames the WiFi driver finished with
+    uint32_t enomem;            // Sends that failed with ENOMEM
+    uint32_t enomem_seen;       // enomem at the last sample
+    int64_t last_send_us;       // Time of the last media send
+    uint32_t send_us;           // Smoothed send call duration
+    uint32_t heap_free;         // Free internal heap at the last sample
+    uint32_t tx_in_flight;      // Backlog at the last sample
+    uint8_t level;              // Smoothed level
+    uint8_t reported_band;      // Band of the last log line
+} congestion_info_t;
+
+static congestion_info_t congestion_info = {0};
+static portMUX_TYPE congestion_lock = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t sample_timer = NULL;
+
+/**
+ * @brief Map a value between a low and a high bound to 0-100
+ */
+static uint32_t _scale(int64_t value, int64_t low, int64_t high)
+{
+    if (value <= low) {
+        return 0;
+    }
+    if (value >= high) {
+        return 100;
+    }
+    return (uint32_t)((value - low) * 100 / (high - low));
+}
+
+#if CONFIG_CONGESTION_WIFI_TX_BACKLOG
+// Runs in the WiFi task for every transmitted frame
+static void _wifi_tx_done(uint8_t ifidx, uint8_t *data, uint16_t *data_len, bool tx_status)
+{
+    if (data_len == NULL || *data_len < MEDIA_FRAME_MIN_LEN) {
+        return;
+    }
+    portENTER_CRITICAL(&congestion_lock);
+        congestion_info.tx_done++;
+    portEXIT_CRITICAL(&congestion_lock);
+}
+#endif
+
+static void _sample(void *arg)
+{
+    uint32_t heap_free = heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    int64_t now_us = esp_timer_get_time();
+
+    portENTER_CRITICAL(&congestion_lock);
+        uint32_t in_flight = 0;
+#if CONFIG_CONGESTION_WIFI_TX_BACKLOG
+        if (now_us - congestion_info.last_send_us > TX_BACKLOG_RESYNC_US) {
+            // Completions of other large frames pull tx_done ahead, drop the difference
+            congestion_info.tx_done = congestion_info.datagrams;
+        }
+        else if ((int32_t)(congestion_info.datagrams - congestion_info.tx_done) > 0) {
+            in_flight = congestion_info.datagrams - congestion_info.tx_done;
+        }
+#endif
+        bool enomem = congestion_info.enomem != congestion_info.enomem_seen;
+        congestion_info.enomem_seen = congestion_info.enomem;
+        uint32_t send_us = congestion_info.send_us;
+        if (now_us - congestion_info.last_send_us > TX_BACKLOG_RESYNC_US) {
+            send_us = 0;
+            congestion_info.send_us = 0;
+        }
+    portEXIT_CRITICAL(&congestion_lock);
+
+    // The most congested signal sets the level, ENOMEM means the buffers already ran out
+    uint32_t raw = _scale(HEAP_HIGH_BYTES - (int64_t)heap_free, 0, HEAP_HIGH_BYTES - HEAP_LOW_BYTES);
+    uint32_t tx_queue = _scale(in_flight, 0, WIFI_TX_BUFFERS);
+    uint32_t latency = _scale(send_us, CONFIG_CONGESTION_SEND_US_LOW, CONFIG_CONGESTION_SEND_US_HIGH);
+    if (tx_queue > raw) {
+        raw = tx_queue;
+    }
+    if (latency > raw) {
+        raw = latency;
+    }
+    if (enomem) {
+        raw = 100;
+    }
+
+    portENTER_CRITICAL(&congestion_lock);
+        // Rise within two samples, decay over about eight
+        int32_t level = congestion_info.level;
+        if ((int32_t)raw > level) {
+            level += ((int32_t)raw - level + 1) / 2;
+        }
+        else {
+            level -= (level - (int32_t)raw + 7) / 8;
+        }
+        congestion_info.level = (uint8_t)level;
+        congestion_info.heap_free = heap_free;
+        congestion_info.tx_in_flight = in_flight;
+        uint8_t band = (level >= CONGESTION_LEVEL_SEVERE) ? 3 : (level >= CONGESTION_LEVEL_HIGH) ? 2 :
+                       (level >= CONGESTION_LEVEL_ELEVATED) ? 1 : 0;
+        bool band_changed = band != congestion_info.reported_band;
+        congestion_info.reported_band = band;
+    portEXIT_CRITICAL(&congestion_lock);
+
+    if (band_changed) {
+        ESP_LOGI(TAG, "Congestion level %d (heap free %" PRIu32 ", tx backlog %" PRIu32 ", send %" PRIu32 " us)",
+                 (int)level, heap_free, in_flight, send_us);
+    }
+}
+
+esp_err_t congestion_monitor_init(void)
+{
+    if (sample_timer != NULL) {
+        return ESP_OK;
+    }
+
+    memset(&congestion_info, 0, sizeof(congestion_info));
+
+#if CONFIG_CONGESTION_WIFI_TX_BACKLOG
+    esp_err_t ret = esp_wifi_set_tx_done_cb(_wifi_tx_done);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "WiFi TX done callback unavailable (%s), backlog not measured", esp_err_to_name(ret));
+    }
+#endif
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = _sample,
+        .name = "congestion",
+    };
+    esp_err_t err = esp_timer_create(&timer_args, &sample_timer);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create sampling timer: %s", esp_err_to_name(err));
+        return err;
+    }
+    err = esp_timer_start_periodic(sample_timer, CONFIG_CONGESTION_SAMPLE_MS * 1000);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start sampling timer: %s", esp_err_to_name(err));
+        esp_timer_delete(sample_timer);
+        sample_timer = NULL;
+        return err;
+    }
+
+    ESP_LOGI(TAG, "Congestion monitor started (sample %d ms)", CONFIG_CONGESTION_SAMPLE_MS);
+    return ESP_OK;
+}
+
+void CONGESTION_IRAM_ATTR congestion_monitor_record_send(int64_t start_us, int result, int err)
+{
+    int64_t now_us = esp_timer_get_time();
+    uint32_t duration_us = (uint32_t)(now_us - start_us);
+
+    portENTER_CRITICAL(&congestion_lock);
+        if (result >= 0) {
+            congestion_info.datagrams++;
+        }
+        else if (err == ENOMEM) {
+            congestion_info.enomem++;
+        }
+        // EWMA over 8 sends
+        congestion_info.send_us = congestion_info.send_us - congestion_info.send_us / 8 + duration_us / 8;
+        congestion_info.last_send_us = now_us;
+    portEXIT_CRITICAL(&congestion_lock);
+}
+
+uint8_t CONGESTION_IRAM_ATTR congestion_monitor_level(void)
+{
+    portENTER_CRITICAL(&congestion_lock);
+        uint8_t level = congestion_info.level;
+    portEXIT_CRITICAL(&congestion_lock);
+    return level;
+}
+
+void congestion_monitor_get_stats(congestion_stats_t *stats)
+{
+    portENTER_CRITICAL(&congestion_lock);
+        stats->level = congestion_info.level;
+        stats->heap_free = congestion_info.heap_free;
+        stats->tx_in_flight = congestion_info.tx_in_flight;
+        stats->send_us = congestion_info.send_us;
+        stats->datagrams = congestion_info.datagrams;
+        stats->enomem = congestion_info.enomem;
+    portEXIT_CRITICAL(&congestion_lock);
+}
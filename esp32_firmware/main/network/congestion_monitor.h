@@ -0,0 +1,65 @@
+#ifndef CONGESTION_MONITOR_H
+#define CONGESTION_MONITOR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Congestion levels (0-100) at which the media senders back off
+#define CONGESTION_LEVEL_ELEVATED 25  // Stretch the gaps between video packets
+#define CONGESTION_LEVEL_HIGH     50  // Lower the JPEG quality
+#define CONGESTION_LEVEL_SEVERE   80  // Skip video frames
+
+/**
+ * @brief Snapshot of the sender-side congestion signals
+ */
+typedef struct {
+    uint8_t level;              // Smoothed congestion level (0-100)
+    uint32_t heap_free;         // Free internal heap, where lwIP pbufs and WiFi TX buffers live (bytes)
+    uint32_t tx_in_flight;      // Media datagrams handed to the stack and not yet sent by the WiFi driver
+    uint32_t send_us;           // Smoothed duration of a send call (us)
+    uint32_t datagrams;         // Datagrams sent since init
+    uint32_t enomem;            // Sends that failed with ENOMEM since init
+} congestion_stats_t;
+
+/**
+ * @brief Start sampling the congestion signals
+ *
+ * Samples the free internal heap, the WiFi TX backlog and the send latency
+ * every CONFIG_CONGESTION_SAMPLE_MS and keeps a smoothed level that rises
+ * quickly and falls slowly.
+ *
+ * @return ESP_OK on success, error code on failure
+ */
+esp_err_t congestion_monitor_init(void);
+
+/**
+ * @brief Account one media send call
+ *
+ * @param start_us esp_timer_get_time() before the call
+ * @param result   Return value of the call
+ * @param err      errno after the call, used when result < 0
+ */
+void congestion_monitor_record_send(int64_t start_us, int result, int err);
+
+/**
+ * @brief Current smoothed congestion level
+ * @return 0 (idle) to 100 (the stack is out of buffers)
+ */
+uint8_t congestion_monitor_level(void);
+
+/**
+ * @brief Copy the current congestion signals
+ * @param stats Output snapshot
+ */
+void congestion_monitor_get_stats(congestion_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CONGESTION_MONITOR_H
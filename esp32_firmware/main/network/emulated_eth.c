@@ -0,0 +1,66 @@
+#include "emulated_eth.h"
+#include "sdkconfig.h"
+
+#if CONFIG_EMULATED_PERIPHERALS
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include "esp_log.h"
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "esp_eth.h"
+#include "fast_rejoin.h"
+
+static const char *TAG = "EMULATED_ETH";
+static EventGroupHandle_t eth_event_group;
+
+#define ETH_GOT_IP_BIT BIT0
+
+static void _eth_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+{
+    if (event_base == ETH_EVENT && event_id == ETHERNET_EVENT_CONNECTED) {
+        ESP_LOGI(TAG, "Ethernet link up");
+        fast_rejoin_link_up();
+    } else if (event_base == ETH_EVENT && event_id == ETHERNET_EVENT_DISCONNECTED) {
+        ESP_LOGW(TAG, "Ethernet link down");
+    } else if (event_base == IP_EVENT && event_id == IP_EVENT_ETH_GOT_IP) {
+        ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
+        ESP_LOGI(TAG, "Got IP: " IPSTR, IP2STR(&event->ip_info.ip));
+        fast_rejoin_got_ip();
+        xEventGroupSetBits(eth_event_group, ETH_GOT_IP_BIT);
+    }
+}
+
+void start_emulated_ethernet(void)
+{
+    eth_event_group = xEventGroupCreate();
+
+    ESP_ERROR_CHECK(esp_netif_init());
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+
+    esp_netif_config_t netif_cfg = ESP_NETIF_DEFAULT_ETH();
+    esp_netif_t *eth_netif = esp_netif_new(&netif_cfg);
+
+    // QEMU emulates the OpenCores MAC with a DP83848 compatible PHY
+    eth_mac_config_t mac_config = ETH_MAC_DEFAULT_CONFIG();
+    eth_phy_config_t phy_config = ETH_PHY_DEFAULT_CONFIG();
+    phy_config.autonego_timeout_ms = 100;
+    esp_eth_mac_t *mac = esp_eth_mac_new_openeth(&mac_config);
+    esp_eth_phy_t *phy = esp_eth_phy_new_dp83848(&phy_config);
+
+    esp_eth_config_t eth_config = ETH_DEFAULT_CONFIG(mac, phy);
+    esp_eth_handle_t eth_handle = NULL;
+    ESP_ERROR_CHECK(esp_eth_driver_install(&eth_config, &eth_handle));
+    ESP_ERROR_CHECK(esp_netif_attach(eth_netif, esp_eth_new_netif_glue(eth_handle)));
+
+    ESP_ERROR_CHECK(esp_event_handler_register(ETH_EVENT, ESP_EVENT_ANY_ID, &_eth_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_ETH_GOT_IP, &_eth_event_handler, NULL));
+    // With CONFIG_FAST_REJOIN the DHCP client asks for the lease of the last boot first
+    fast_rejoin_begin("eth", "wired");
+    ESP_ERROR_CHECK(esp_eth_start(eth_handle));
+
+    ESP_LOGI(TAG, "Waiting for an address from the QEMU network...");
+    xEventGroupWaitBits(eth_event_group, ETH_GOT_IP_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+}
+
+#endif // CONFIG_EMULATED_PERIPHERALS
@@ -0,0 +1,12 @@
+#ifndef EMULATED_ETH_H
+#define EMULATED_ETH_H
+
+/**
+ * @brief Bring up the OpenCores Ethernet MAC emulated by QEMU
+ *
+ * Replaces the WiFi provisioning when CONFIG_EMULATED_PERIPHERALS is set.
+ * Blocks until the interface got an address from the QEMU DHCP server.
+ */
+void start_emulated_ethernet(void);
+
+#endif // EMULATED_ETH_H
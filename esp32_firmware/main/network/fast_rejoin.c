@@ -0,0 +1,167 @@
+#include "fast_rejoin.h"
+
+#include <inttypes.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+
+// Parsed by python_server/qemu_perf_test.py, keep the line format in sync
+static const char *TAG = "NET_REJOIN";
+
+// Next to the credentials, so clear_wifi_provisioning() erases it with them
+#define LINK_NAMESPACE "wifi_cred"
+#define LINK_KEY "sta.link"
+#define LINK_VERSION 1
+
+// Where lwIP keeps the last lease with CONFIG_LWIP_DHCP_RESTORE_LAST_IP
+#define LEASE_NAMESPACE "dhcp_state"
+
+// Channel and BSSID of the last AP, for the SSID it belongs to
+typedef struct {
+    uint8_t version;
+    uint8_t channel;
+    uint8_t bssid[6];
+    char ssid[32];
+} rejoin_link_t;
+
+static struct {
+    const char *iface;
+    const char *path;
+    bool lease;        // A lease was stored before this boot
+    bool reported;
+    int64_t begin_us;
+    int64_t link_us;
+} timing;
+
+void fast_rejoin_begin(const char *iface, const char *path)
+{
+    timing.iface = iface;
+    timing.path = path;
+    timing.reported = false;
+    timing.begin_us = esp_timer_get_time();
+    timing.link_us = 0;
+    timing.lease = false;
+#if CONFIG_FAST_REJOIN
+    nvs_handle_t nvs_handle;
+    if (nvs_open(LEASE_NAMESPACE, NVS_READONLY, &nvs_handle) == ESP_OK) {
+        timing.lease = true;
+        nvs_close(nvs_handle);
+    }
+#endif
+}
+
+void fast_rejoin_set_path(const char *path)
+{
+    timing.path = path;
+}
+
+void fast_rejoin_link_up(void)
+{
+    if (timing.link_us == 0) {
+        timing.link_us = esp_timer_get_time();
+    }
+}
+
+void fast_rejoin_got_ip(void)
+{
+    if (timing.iface == NULL || timing.reported) {
+        return;
+    }
+    timing.reported = true;
+    int64_t now_us = esp_timer_get_time();
+    int64_t link_us = timing.link_us ? timing.link_us : now_us;
+    // ip_ms counts from the boot, link_ms and dhcp_ms split the network part
+    ESP_LOGI(TAG, "iface=%s path=%s lease=%d start_ms=%" PRId64 " link_ms=%" PRId64 " dhcp_ms=%" PRId64
+             " ip_ms=%" PRId64, timing.iface, timing.path, timing.lease, timing.begin_us / 1000,
+             (link_us - timing.begin_us) / 1000, (now_us - link_us) / 1000, now_us / 1000);
+}
+
+#if CONFIG_FAST_REJOIN
+
+static bool _load_link(rejoin_link_t *link)
+{
+    nvs_handle_t nvs_handle;
+    if (nvs_open(LINK_NAMESPACE, NVS_READONLY, &nvs_handle) != ESP_OK) {
+        return false;
+    }
+    size_t len = sizeof(*link);
+    esp_err_t ret = nvs_get_blob(nvs_handle, LINK_KEY, link, &len);
+    nvs_close(nvs_handle);
+    return ret == ESP_OK && len == sizeof(*link) && link->version == LINK_VERSION;
+}
+
+bool fast_rejoin_apply_link(const char *ssid, wifi_config_t *config)
+{
+    rejoin_link_t link;
+    if (!_load_link(&link) || strncmp(link.ssid, ssid, sizeof(link.ssid)) != 0 || link.channel == 0) {
+        return false;
+    }
+    config->sta.channel = link.channel;
+    memcpy(config->sta.bssid, link.bssid, sizeof(link.bssid));
+    config->sta.bssid_set = true;
+    config->sta.scan_method = WIFI_FAST_SCAN;
+    ESP_LOGI(TAG, "Joining " MACSTR " on channel %d", MAC2STR(link.bssid), link.channel);
+    return true;
+}
+
+void fast_rejoin_save_link(const char *ssid)
+{
+    wifi_ap_record_t ap;
+    if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK) {
+        return;
+    }
+    rejoin_link_t link = {
+        .version = LINK_VERSION,
+        .channel = ap.primary,
+    };
+    memcpy(link.bssid, ap.bssid, sizeof(link.bssid));
+    strncpy(link.ssid, ssid, sizeof(link.ssid));
+
+    // Most boots rejoin the same AP, spare the flash
+    rejoin_link_t saved;
+    if (_load_link(&saved) && memcmp(&saved, &link, sizeof(link)) == 0) {
+        return;
+    }
+    nvs_handle_t nvs_handle;
+    esp_err_t ret = nvs_open(LINK_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to open NVS: %s", esp_err_to_name(ret));
+        return;
+    }
+    ret = nvs_set_blob(nvs_handle, LINK_KEY, &link, sizeof(link));
+    if (ret == ESP_OK) {
+        ret = nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to save the link: %s", esp_err_to_name(ret));
+        return;
+    }
+    ESP_LOGI(TAG, "Cached " MACSTR " on channel %d", MAC2STR(link.bssid), link.channel);
+}
+
+void fast_rejoin_forget_link(void)
+{
+    nvs_handle_t nvs_handle;
+    if (nvs_open(LINK_NAMESPACE, NVS_READWRITE, &nvs_handle) != ESP_OK) {
+        return;
+    }
+    if (nvs_erase_key(nvs_handle, LINK_KEY) == ESP_OK) {
+        nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+}
+
+void fast_rejoin_erase_leases(void)
+{
+    nvs_handle_t nvs_handle;
+    if (nvs_open(LEASE_NAMESPACE, NVS_READWRITE, &nvs_handle) != ESP_OK) {
+        return;
+    }
+    nvs_erase_all(nvs_handle);
+    nvs_commit(nvs_handle);
+    nvs_close(nvs_handle);
+}
+
+#endif // CONFIG_FAST_REJOIN
@@ -0,0 +1,75 @@
+#ifndef FAST_REJOIN_H
+#define FAST_REJOIN_H
+
+#include <stdbool.h>
+#include "esp_wifi.h"
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Start measuring the time to IP of an interface after boot
+ *
+ * Logs one "NET_REJOIN" line when the address arrives, parsed by
+ * python_server/qemu_perf_test.py rejoin.
+ *
+ * @param iface Interface name for the log ("sta", "eth")
+ * @param path  How it joins: "fast" (cached channel and BSSID), "full" (scan), "wired"
+ */
+void fast_rejoin_begin(const char *iface, const char *path);
+
+/**
+ * @brief The join fell back to another path, e.g. from "fast" to "full"
+ */
+void fast_rejoin_set_path(const char *path);
+
+/**
+ * @brief The interface is associated or its link is up, DHCP starts
+ */
+void fast_rejoin_link_up(void);
+
+/**
+ * @brief The interface got its address, logs the time to IP once after boot
+ */
+void fast_rejoin_got_ip(void);
+
+#if CONFIG_FAST_REJOIN
+/**
+ * @brief Set the channel and BSSID of the last AP of this SSID in a STA config
+ *
+ * With both set the driver probes a single channel instead of scanning all
+ * of them.
+ *
+ * @param ssid   SSID about to be joined
+ * @param config STA config to complete
+ * @return true if a cached link was applied
+ */
+bool fast_rejoin_apply_link(const char *ssid, wifi_config_t *config);
+
+/**
+ * @brief Cache the channel and BSSID of the AP the station is associated with
+ *
+ * Writes NVS only when they changed.
+ *
+ * @param ssid SSID of the network
+ */
+void fast_rejoin_save_link(const char *ssid);
+
+/**
+ * @brief Forget the cached link, after the fast join failed
+ */
+void fast_rejoin_forget_link(void);
+
+/**
+ * @brief Erase the DHCP leases lwIP keeps for CONFIG_LWIP_DHCP_RESTORE_LAST_IP
+ */
+void fast_rejoin_erase_leases(void);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FAST_REJOIN_H
@@ -0,0 +1,172 @@
+#include "packet_timing.h"
+#include "sdkconfig.h"
+
+#if CONFIG_PACKET_TIMING
+
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+
+// Parsed by python_server/qemu_perf_test.py, keep the line format in sync
+static const char *TAG = "PKT_TIMING";
+
+#define PACKET_TIMING_REPORT_US 5000000  // Report and restart the statistics every 5 s
+#define PACKET_TIMING_BIN_US 8           // Histogram resolution for the percentiles
+#define PACKET_TIMING_BINS 128           // Up to ~1 ms, slower packets land in the last bin
+
+#define PSRAM_LOAD_BYTES (CONFIG_PACKET_TIMING_PSRAM_LOAD_KB * 1024)
+
+// Logged with the statistics, so the builds compared can be told apart
+#if CONFIG_MEDIA_IRAM
+#define MEDIA_IRAM_ENABLED 1
+#else
+#define MEDIA_IRAM_ENABLED 0
+#endif
+
+// Statistics of one packet path over a report interval
+typedef struct {
+    uint32_t count;
+    uint64_t sum_us;
+    uint64_t sum_sq_us;
+    uint32_t max_us;
+    uint32_t bins[PACKET_TIMING_BINS];
+} packet_timing_stats_t;
+
+static const char *stream_names[PACKET_TIMING_STREAM_COUNT] = {"audio_tx", "audio_rx", "video_tx"};
+
+static packet_timing_stats_t timing_stats[PACKET_TIMING_STREAM_COUNT];
+static portMUX_TYPE timing_lock = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t report_timer = NULL;
+
+/**
+ * @brief Upper edge of the bin holding the given share of the packets (us)
+ */
+static uint32_t _percentile(const packet_timing_stats_t *stats, uint32_t permille)
+{
+    uint64_t target = ((uint64_t)stats->count * permille + 999) / 1000;
+    uint64_t seen = 0;
+    for (int i = 0; i < PACKET_TIMING_BINS; i++) {
+        seen += stats->bins[i];
+        if (seen >= target) {
+            return (i + 1) * PACKET_TIMING_BIN_US;
+        }
+    }
+    return stats->max_us;
+}
+
+static void _report(void *arg)
+{
+    static packet_timing_stats_t snapshot;
+
+    for (int stream = 0; stream < PACKET_TIMING_STREAM_COUNT; stream++) {
+        portENTER_CRITICAL(&timing_lock);
+            snapshot = timing_stats[stream];
+            memset(&timing_stats[stream], 0, sizeof(timing_stats[stream]));
+        portEXIT_CRITICAL(&timing_lock);
+
+        if (snapshot.count == 0) {
+            continue;
+        }
+        double mean = (double)snapshot.sum_us / snapshot.count;
+        double variance = (double)snapshot.sum_sq_us / snapshot.count - mean * mean;
+        ESP_LOGI(TAG, "stream=%s iram=%d load_kb=%d n=%" PRIu32 " mean_us=%.1f sd_us=%.1f p50_us=%" PRIu32
+                 " p99_us=%" PRIu32 " max_us=%" PRIu32,
+                 stream_names[stream], MEDIA_IRAM_ENABLED, CONFIG_PACKET_TIMING_PSRAM_LOAD_KB,
+                 snapshot.count, mean, variance > 0 ? sqrt(variance) : 0.0,
+                 _percentile(&snapshot, 500), _percentile(&snapshot, 990), snapshot.max_us);
+    }
+}
+
+/**
+ * @brief Copy a PSRAM buffer back and forth, evicting the cached flash code
+ */
+static void _psram_load_task(void *arg)
+{
+    uint8_t *buf = (uint8_t *)arg;
+    size_t half = PSRAM_LOAD_BYTES / 2;
+
+    while (1) {
+        memcpy(buf + half, buf, half);
+        memcpy(buf, buf + half, half);
+        // Let the idle task of this core feed the watchdog
+        vTaskDelay(1);
+    }
+}
+
+esp_err_t packet_timing_init(void)
+{
+    if (report_timer != NULL) {
+        ESP_LOGW(TAG, "Packet timing already started");
+        return ESP_FAIL;
+    }
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = _report,
+        .name = "packet_timing",
+    };
+    esp_err_t ret = esp_timer_create(&timer_args, &report_timer);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create the report timer: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    ret = esp_timer_start_periodic(report_timer, PACKET_TIMING_REPORT_US);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start the report timer: %s", esp_err_to_name(ret));
+        esp_timer_delete(report_timer);
+        report_timer = NULL;
+        return ret;
+    }
+
+    if (PSRAM_LOAD_BYTES > 0) {
+        uint8_t *buf = heap_caps_malloc(PSRAM_LOAD_BYTES, MALLOC_CAP_SPIRAM);
+        if (buf == NULL) {
+            ESP_LOGW(TAG, "No PSRAM for the %d KB load, measuring without", CONFIG_PACKET_TIMING_PSRAM_LOAD_KB);
+        } else {
+            // On the other core than the media tasks, lowest priority above idle
+            xTaskCreatePinnedToCore(_psram_load_task, "psram_load", 2048, buf, 1, NULL, portNUM_PROCESSORS - 1);
+        }
+    }
+
+    ESP_LOGI(TAG, "Packet timing started (IRAM media paths %s, PSRAM load %d KB)",
+             MEDIA_IRAM_ENABLED ? "on" : "off", CONFIG_PACKET_TIMING_PSRAM_LOAD_KB);
+    return ESP_OK;
+}
+
+// In IRAM in every build, the measurement itself must not wait for the flash cache
+void IRAM_ATTR packet_timing_record(packet_timing_stream_t stream, int64_t start_us)
+{
+    uint32_t duration_us = (uint32_t)(esp_timer_get_time() - start_us);
+    uint32_t bin = duration_us / PACKET_TIMING_BIN_US;
+    if (bin >= PACKET_TIMING_BINS) {
+        bin = PACKET_TIMING_BINS - 1;
+    }
+
+    portENTER_CRITICAL(&timing_lock);
+        packet_timing_stats_t *stats = &timing_stats[stream];
+        stats->count++;
+        stats->sum_us += duration_us;
+        stats->sum_sq_us += (uint64_t)duration_us * duration_us;
+        if (duration_us > stats->max_us) {
+            stats->max_us = duration_us;
+        }
+        stats->bins[bin]++;
+    portEXIT_CRITICAL(&timing_lock);
+}
+
+void IRAM_ATTR packet_timing_audio_tx(int64_t start_us)
+{
+    packet_timing_record(PACKET_TIMING_AUDIO_TX, start_us);
+}
+
+void IRAM_ATTR packet_timing_audio_rx(int64_t start_us)
+{
+    packet_timing_record(PACKET_TIMING_AUDIO_RX, start_us);
+}
+
+#endif
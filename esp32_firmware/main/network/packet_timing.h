@@ -0,0 +1,53 @@
+#ifndef PACKET_TIMING_H
+#define PACKET_TIMING_H
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Packet paths measured by CONFIG_PACKET_TIMING
+ */
+typedef enum {
+    PACKET_TIMING_AUDIO_TX = 0,  // Audio packet built and sent
+    PACKET_TIMING_AUDIO_RX,      // Audio packet received and turned into PCM
+    PACKET_TIMING_VIDEO_TX,      // Video packet built and sent
+    PACKET_TIMING_STREAM_COUNT
+} packet_timing_stream_t;
+
+/**
+ * @brief Start the PSRAM load and the periodic report
+ *
+ * Every few seconds logs one "PKT_TIMING" line per stream that handled
+ * packets, parsed by python_server/qemu_perf_test.py timing.
+ *
+ * @return ESP_OK on success, error code on failure
+ */
+esp_err_t packet_timing_init(void);
+
+/**
+ * @brief Account one packet
+ *
+ * @param stream   Packet path
+ * @param start_us esp_timer_get_time() when the packet entered the path
+ */
+void packet_timing_record(packet_timing_stream_t stream, int64_t start_us);
+
+/**
+ * @brief udp_stream callback of the audio writer
+ */
+void packet_timing_audio_tx(int64_t start_us);
+
+/**
+ * @brief udp_stream callback of the audio reader
+ */
+void packet_timing_audio_rx(int64_t start_us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PACKET_TIMING_H
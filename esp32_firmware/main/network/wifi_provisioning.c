@@ -12,6 +12,7 @@
 #include "nvs.h"
 #include "esp_http_server.h"
 #include "cJSON.h"
+#include "fast_rejoin.h"
 
 static const char *TAG = "WIFI_PROV";
 static EventGroupHandle_t wifi_event_group;
@@ -38,6 +39,7 @@ typedef struct {
     int connection_attempts;
     bool provisioning_active;
     bool has_credentials;
+    bool fast_join;  // Joining the cached channel and BSSID, not yet connected
 } prov_state_t;
 
 static prov_state_t current_state;
@@ -141,6 +143,7 @@ void start_wifi_provisioning(void)
         current_state.has_credentials = true;
         
         // Connect using loaded credentials
+        fast_rejoin_begin("sta", "full");
         _connect_wifi_with_credentials(&saved_credentials);
 
         // If loaded credentials fail, provisioning mode will be started in the event handler
@@ -181,6 +184,9 @@ void clear_wifi_provisioning(void)
         nvs_close(nvs_handle);
         ESP_LOGI(TAG, "WiFi STA data cleared");
     }
+#if CONFIG_FAST_REJOIN
+    fast_rejoin_erase_leases();
+#endif
     
     ESP_LOGI(TAG, "All WiFi provisioning data cleared. Restarting...");
     vTaskDelay(pdMS_TO_TICKS(2000));
@@ -197,6 +203,23 @@ void _wifi_event_handler(void* arg, esp_event_base_t event_base,
                 if (!current_state.has_credentials) {
                     break;
                 }
+#if CONFIG_FAST_REJOIN
+                if (current_state.fast_join) {
+                    // The cached AP is gone or moved to another channel, scan all of them
+                    wifi_event_sta_disconnected_t *event = (wifi_event_sta_disconnected_t *)event_data;
+                    ESP_LOGW(TAG, "Fast join failed (reason %d), scanning...", event->reason);
+                    current_state.fast_join = false;
+                    fast_rejoin_forget_link();
+                    fast_rejoin_set_path("full");
+                    wifi_config_t wifi_config;
+                    esp_wifi_get_config(WIFI_IF_STA, &wifi_config);
+                    wifi_config.sta.channel = 0;
+                    wifi_config.sta.bssid_set = false;
+                    esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+                    esp_wifi_connect();
+                    break;
+                }
+#endif
                 if(!current_state.provisioning_active){
                     // Lost connection or failed to connect to NVS credentials at startup.
                     ESP_LOGW(TAG, "WiFi disconnected, attempting to reconnect...");
@@ -219,6 +242,9 @@ void _wifi_event_handler(void* arg, esp_event_base_t event_base,
                 }
                 break;
             }
+            case WIFI_EVENT_STA_CONNECTED:
+                fast_rejoin_link_up();
+                break;
             case WIFI_EVENT_AP_START:
                 ESP_LOGI(TAG, "WiFi AP started - Provisioning mode active");
                 break;
@@ -234,9 +260,14 @@ void _wifi_event_handler(void* arg, esp_event_base_t event_base,
         current_state.connection_attempts = 0;
         current_state.wifi_connected = true;
         current_state.provisioning_complete = true;
+        current_state.fast_join = false;
+        fast_rejoin_got_ip();
         
         // Save credentials to NVS
         _save_wifi_credentials_to_nvs(&current_state.credentials);
+#if CONFIG_FAST_REJOIN
+        fast_rejoin_save_link(current_state.credentials.ssid);
+#endif
 
         // Keep AP active for a few seconds to allow client to get success notification
         if (server) {
@@ -740,6 +771,12 @@ static void _connect_wifi_with_credentials(const wifi_credentials_t *credentials
     if (strlen(credentials->password) > 0) {
         strncpy((char*)wifi_config.sta.password, credentials->password, sizeof(wifi_config.sta.password) - 1);
     }
+#if CONFIG_FAST_REJOIN
+    current_state.fast_join = fast_rejoin_apply_link(credentials->ssid, &wifi_config);
+    if (current_state.fast_join) {
+        fast_rejoin_set_path("fast");
+    }
+#endif
     
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
     ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
@@ -0,0 +1,128 @@
+#include "doorbell_button.h"
+#include "sdkconfig.h"
+
+#if CONFIG_DOORBELL_FAST_PATH
+
+#include <stdbool.h>
+#include "../control/device_manager.h"
+#include "driver/gpio.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_rom_sys.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+static const char *TAG = "DOORBELL_BUTTON";
+
+#define DOORBELL_GPIO CONFIG_DOORBELL_FAST_GPIO
+#if CONFIG_DOORBELL_FAST_ACTIVE_LOW
+#define DOORBELL_ACTIVE_LEVEL 0
+#else
+#define DOORBELL_ACTIVE_LEVEL 1
+#endif
+
+// Above the media and control tasks, the ring is the most urgent thing the device sends
+#define DOORBELL_TASK_PRIORITY 10
+#define DOORBELL_RELEASE_POLL_MS 10
+
+static TaskHandle_t doorbell_task_handle = NULL;
+static portMUX_TYPE press_lock = portMUX_INITIALIZER_UNLOCKED;
+static int64_t press_us = 0;  // First edge of the current press, 0 when none is pending
+
+static void IRAM_ATTR _doorbell_isr(void *arg)
+{
+    BaseType_t woken = pdFALSE;
+
+    // Bounces fire again, only the first edge dates the press
+    portENTER_CRITICAL_ISR(&press_lock);
+        if (press_us == 0) {
+            press_us = esp_timer_get_time();
+        }
+    portEXIT_CRITICAL_ISR(&press_lock);
+
+    vTaskNotifyGiveFromISR(doorbell_task_handle, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+static bool _is_pressed(void)
+{
+    return gpio_get_level(DOORBELL_GPIO) == DOORBELL_ACTIVE_LEVEL;
+}
+
+static void _doorbell_task(void *arg)
+{
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        // A glitch on the wire is gone after the confirm time, a press is not
+        esp_rom_delay_us(CONFIG_DOORBELL_FAST_CONFIRM_US);
+        if (_is_pressed()) {
+            portENTER_CRITICAL(&press_lock);
+                int64_t pressed_at = press_us;
+            portEXIT_CRITICAL(&press_lock);
+
+            if (broadcast_doorbell_ring(pressed_at)) {
+                ESP_LOGI(TAG, "Doorbell pressed - notified all clients");
+            }
+
+            // Holding, releasing and the bounces of both are not new presses
+            int released_ms = 0;
+            while (released_ms < CONFIG_DOORBELL_FAST_RELEASE_MS) {
+                vTaskDelay(pdMS_TO_TICKS(DOORBELL_RELEASE_POLL_MS));
+                released_ms = _is_pressed() ? 0 : released_ms + DOORBELL_RELEASE_POLL_MS;
+            }
+        }
+
+        portENTER_CRITICAL(&press_lock);
+            press_us = 0;
+        portEXIT_CRITICAL(&press_lock);
+        ulTaskNotifyTake(pdTRUE, 0);
+    }
+}
+
+esp_err_t doorbell_button_init(void)
+{
+    if (doorbell_task_handle != NULL) {
+        ESP_LOGW(TAG, "Doorbell button already initialized");
+        return ESP_FAIL;
+    }
+
+    // The task must exist before the first interrupt notifies it
+    if (xTaskCreate(_doorbell_task, "doorbell_button", 3072, NULL, DOORBELL_TASK_PRIORITY,
+                    &doorbell_task_handle) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the doorbell task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    const gpio_config_t io_cfg = {
+        .pin_bit_mask = 1ULL << DOORBELL_GPIO,
+        .mode = GPIO_MODE_INPUT,
+        .pull_up_en = DOORBELL_ACTIVE_LEVEL == 0 ? GPIO_PULLUP_ENABLE : GPIO_PULLUP_DISABLE,
+        .pull_down_en = DOORBELL_ACTIVE_LEVEL == 0 ? GPIO_PULLDOWN_DISABLE : GPIO_PULLDOWN_ENABLE,
+        .intr_type = DOORBELL_ACTIVE_LEVEL == 0 ? GPIO_INTR_NEGEDGE : GPIO_INTR_POSEDGE,
+    };
+    esp_err_t ret = gpio_config(&io_cfg);
+    if (ret == ESP_OK) {
+        // Already installed by another driver is fine, the handler is per pin
+        ret = gpio_install_isr_service(ESP_INTR_FLAG_IRAM);
+        if (ret == ESP_ERR_INVALID_STATE) {
+            ret = ESP_OK;
+        }
+    }
+    if (ret == ESP_OK) {
+        ret = gpio_isr_handler_add(DOORBELL_GPIO, _doorbell_isr, NULL);
+    }
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to set up the interrupt of GPIO %d: %s", DOORBELL_GPIO, esp_err_to_name(ret));
+        vTaskDelete(doorbell_task_handle);
+        doorbell_task_handle = NULL;
+        return ret;
+    }
+
+    ESP_LOGI(TAG, "Doorbell contact on GPIO %d (active %s)", DOORBELL_GPIO,
+             DOORBELL_ACTIVE_LEVEL == 0 ? "low" : "high");
+    return ESP_OK;
+}
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef DOORBELL_BUTTON_H
+#define DOORBELL_BUTTON_H
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Ring on the interrupt of the doorbell contact (CONFIG_DOORBELL_FAST_PATH)
+ *
+ * The interrupt timestamps the press and wakes a high priority task, which
+ * filters glitches and rings at once, without the polling of the input key
+ * service. Holding and releasing the contact do not ring again.
+ *
+ * @return ESP_OK on success, error code if the GPIO or the task could not be set up
+ */
+esp_err_t doorbell_button_init(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DOORBELL_BUTTON_H
@@ -1,16 +1,18 @@
 #include "peripheral_manager.h"
+#include "doorbell_button.h"
 #include "../network/wifi_provisioning.h"
 #include "../control/device_manager.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "board.h"
 #include "esp_peripherals.h"
 #include "periph_button.h"
 #include "input_key_service.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "sdkconfig.h"
 
 #define BUTTON_PRESS_DURATION_MS 3000  // 3 seconds for long press
-#define WAIT_TIME_BETWEEN_NOTIFICATIONS_MS 5000  // 5 seconds between notifications
 
 static const char *TAG = "PERIPHERAL_MANAGER";
 
@@ -23,6 +25,14 @@ esp_err_t peripheral_manager_init(void)
     periph_service_handle_t input_key_service = NULL;
 
     ESP_LOGI(TAG, "Initializing peripheral manager...");
+
+#if CONFIG_EMULATED_PERIPHERALS
+    // No codec and no buttons on QEMU, the audio pipelines use the emulated I2S stream
+    (void)periph_set;
+    (void)input_key_service;
+    ESP_LOGI(TAG, "Emulated peripherals: audio board and buttons skipped");
+    return ESP_OK;
+#endif
     
     // Initialize peripheral set
     esp_periph_config_t periph_cfg = DEFAULT_ESP_PERIPH_SET_CONFIG();
@@ -56,6 +66,13 @@ esp_err_t peripheral_manager_init(void)
     input_key_service_add_key(input_key_service, input_key_info, INPUT_KEY_NUM);
     periph_service_set_callback(input_key_service, _input_key_service_cb, (void *)board_handle);
     
+#if CONFIG_DOORBELL_FAST_PATH
+    // The key service keeps ringing on the REC key if the interrupt path is not available
+    if (doorbell_button_init() != ESP_OK) {
+        ESP_LOGW(TAG, "Doorbell interrupt path unavailable, ringing from the input key service only");
+    }
+#endif
+
     ESP_LOGI(TAG, "Peripheral manager initialized: audio board and buttons");
     return ESP_OK;
 }
@@ -63,7 +80,7 @@ esp_err_t peripheral_manager_init(void)
 static esp_err_t _input_key_service_cb(periph_service_handle_t handle, periph_service_event_t *evt, void *ctx)
 {
     static uint32_t button_press_start_time[INPUT_KEY_NUM] = {0};
-    static uint32_t last_doorbell_ring_time = 0;
+    static int64_t button_press_start_us[INPUT_KEY_NUM] = {0};
     static bool button_pressed[INPUT_KEY_NUM] = {false};
     int button_id = (int)evt->data;
     
@@ -71,6 +88,7 @@ static esp_err_t _input_key_service_cb(periph_service_handle_t handle, periph_se
         // Button pressed - start timing
         if (button_id < INPUT_KEY_NUM) {
             button_press_start_time[button_id] = xTaskGetTickCount();
+            button_press_start_us[button_id] = esp_timer_get_time();
             button_pressed[button_id] = true;
         }
     }
@@ -83,11 +101,9 @@ static esp_err_t _input_key_service_cb(periph_service_handle_t handle, periph_se
 
             switch(button_id) {
                 case INPUT_KEY_USER_ID_REC:
-                    if (last_doorbell_ring_time == 0 ||
-                        (now - last_doorbell_ring_time) * portTICK_PERIOD_MS >= WAIT_TIME_BETWEEN_NOTIFICATIONS_MS) {
-                        ESP_LOGI(TAG, "Doorbell button released - notifying all clients");
-                        broadcast_doorbell_ring();
-                        last_doorbell_ring_time = xTaskGetTickCount();
+                    // Rings on the release, broadcast_doorbell_ring drops repeats
+                    if (broadcast_doorbell_ring(button_press_start_us[button_id])) {
+                        ESP_LOGI(TAG, "Doorbell button released - notified all clients");
                     }
                     break;
                 case INPUT_KEY_USER_ID_PLAY:
@@ -0,0 +1,111 @@
+#include "emulated_camera.h"
+#include "sdkconfig.h"
+
+#if CONFIG_EMULATED_PERIPHERALS
+
+#include <inttypes.h>
+#include <string.h>
+#include <sys/time.h>
+#include "esp_log.h"
+#include "esp_partition.h"
+
+static const char *TAG = "EMULATED_CAMERA";
+
+#define FRAMES_HEADER_LEN 8
+#define FRAME_LENGTH_LEN 4
+
+typedef struct {
+    esp_partition_mmap_handle_t mmap_handle;
+    const uint8_t *base;       // Start of the mapped partition
+    size_t size;               // Size of the partition
+    uint32_t frame_count;      // Frames in the partition
+    uint32_t frame_index;      // Next frame to return
+    size_t offset;             // Offset of the next frame record
+    camera_fb_t fb;            // Single frame buffer handed out
+    bool fb_in_use;
+} emulated_camera_t;
+
+static emulated_camera_t camera = {0};
+
+esp_err_t emulated_camera_init(void)
+{
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                                                CONFIG_EMULATED_FRAMES_PARTITION);
+    if (partition == NULL) {
+        ESP_LOGE(TAG, "Partition '%s' not found", CONFIG_EMULATED_FRAMES_PARTITION);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    const void *mapped = NULL;
+    esp_err_t ret = esp_partition_mmap(partition, 0, partition->size, ESP_PARTITION_MMAP_DATA,
+                                       &mapped, &camera.mmap_handle);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to map the frames partition: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    camera.base = (const uint8_t *)mapped;
+    camera.size = partition->size;
+
+    uint32_t magic;
+    memcpy(&magic, camera.base, sizeof(magic));
+    memcpy(&camera.frame_count, camera.base + 4, sizeof(camera.frame_count));
+    if (magic != EMULATED_FRAMES_MAGIC || camera.frame_count == 0) {
+        ESP_LOGE(TAG, "No frames in partition '%s', write it with qemu_perf_test.py", CONFIG_EMULATED_FRAMES_PARTITION);
+        esp_partition_munmap(camera.mmap_handle);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    camera.frame_index = 0;
+    camera.offset = FRAMES_HEADER_LEN;
+    camera.fb_in_use = false;
+    ESP_LOGI(TAG, "Emulated camera ready: %" PRIu32 " frames", camera.frame_count);
+    return ESP_OK;
+}
+
+camera_fb_t *emulated_camera_fb_get(void)
+{
+    if (camera.fb_in_use) {
+        ESP_LOGW(TAG, "Frame buffer not returned");
+        return NULL;
+    }
+
+    uint32_t len;
+    memcpy(&len, camera.base + camera.offset, FRAME_LENGTH_LEN);
+    if (camera.offset + FRAME_LENGTH_LEN + len > camera.size) {
+        ESP_LOGE(TAG, "Frame %" PRIu32 " exceeds the partition", camera.frame_index);
+        return NULL;
+    }
+
+    camera.fb.buf = (uint8_t *)(camera.base + camera.offset + FRAME_LENGTH_LEN);
+    camera.fb.len = len;
+    camera.fb.width = 640;
+    camera.fb.height = 480;
+    camera.fb.format = PIXFORMAT_JPEG;
+    gettimeofday(&camera.fb.timestamp, NULL);
+    camera.fb_in_use = true;
+
+    // Advance to the next record, loop after the last frame
+    camera.offset += FRAME_LENGTH_LEN + ((len + 3) & ~3u);
+    if (++camera.frame_index == camera.frame_count) {
+        camera.frame_index = 0;
+        camera.offset = FRAMES_HEADER_LEN;
+    }
+    return &camera.fb;
+}
+
+void emulated_camera_fb_return(camera_fb_t *fb)
+{
+    if (fb == &camera.fb) {
+        camera.fb_in_use = false;
+    }
+}
+
+void emulated_camera_deinit(void)
+{
+    if (camera.base != NULL) {
+        esp_partition_munmap(camera.mmap_handle);
+        camera.base = NULL;
+    }
+}
+
+#endif // CONFIG_EMULATED_PERIPHERALS
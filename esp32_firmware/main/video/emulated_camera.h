@@ -0,0 +1,45 @@
+#ifndef EMULATED_CAMERA_H
+#define EMULATED_CAMERA_H
+
+#include "esp_err.h"
+#include "esp_camera.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Frames partition layout, written by python_server/qemu_perf_test.py:
+// 4 Bytes magic ('TFRM'), 4 Bytes frame count, then per frame
+// 4 Bytes JPEG length followed by the JPEG, padded to a multiple of 4 Bytes
+#define EMULATED_FRAMES_MAGIC 0x4D524654
+
+/**
+ * @brief Map the frames partition, the stand-in for esp_camera_init()
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if the partition is missing or invalid
+ */
+esp_err_t emulated_camera_init(void);
+
+/**
+ * @brief Next frame of the partition, looping at the end
+ *
+ * The frame buffer points into the memory-mapped flash, no copy is made.
+ * @return Frame buffer, or NULL if the previous one was not returned yet
+ */
+camera_fb_t *emulated_camera_fb_get(void);
+
+/**
+ * @brief Give the frame buffer back
+ * @param fb Frame buffer from emulated_camera_fb_get()
+ */
+void emulated_camera_fb_return(camera_fb_t *fb);
+
+/**
+ * @brief Unmap the frames partition
+ */
+void emulated_camera_deinit(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // EMULATED_CAMERA_H
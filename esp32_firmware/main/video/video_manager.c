@@ -6,12 +6,59 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include "esp_heap_caps.h"
+#include "sdkconfig.h"
+#include "congestion_monitor.h"
+#include "packet_timing.h"
+#include "lock_profiler.h"
+#include "esp_attr.h"
+
+#if CONFIG_VIDEO_CODEC_H264
+#include "esp_h264_enc_single_sw.h"
+#endif
+#if CONFIG_DOORBELL_THUMBNAIL
+#include "img_converters.h"
+#endif
+
+#if CONFIG_EMULATED_PERIPHERALS
+#include "emulated_camera.h"
+// Frames come from a flash partition when running on QEMU
+#define CAMERA_FB_GET()      emulated_camera_fb_get()
+#define CAMERA_FB_RETURN(fb) emulated_camera_fb_return(fb)
+#define CAMERA_DEINIT()      emulated_camera_deinit()
+#else
+#define CAMERA_FB_GET()      esp_camera_fb_get()
+#define CAMERA_FB_RETURN(fb) esp_camera_fb_return(fb)
+#define CAMERA_DEINIT()      esp_camera_deinit()
+#endif
 
 static const char *TAG = "VIDEO_MANAGER";
 
+// The packetizer runs from IRAM, flash cache misses stall it under camera DMA and PSRAM load
+#if CONFIG_MEDIA_IRAM
+#define VIDEO_IRAM_ATTR IRAM_ATTR
+#else
+#define VIDEO_IRAM_ATTR
+#endif
+
+#if CONFIG_LATENCY_TRACE
+// Parsed by python_server/latency_analyzer.py, keep the line format in sync
+static const char *LATENCY_TAG = "LATENCY";
+
+/**
+ * @brief Wall clock in microseconds, the clock of the packet timestamps
+ */
+static int64_t _trace_now_us(void)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (int64_t)now.tv_sec * 1000000L + (int64_t)now.tv_usec;
+}
+#endif
+
 // Video packet types
 #define VIDEO_PACKAGE 1
 
@@ -24,6 +71,13 @@ static const char *TAG = "VIDEO_MANAGER";
 #define VIDEO_HEADER_TOTAL_PACKETS_OFFSET 17 // Total packets (2 bytes)
 #define VIDEO_HEADER_DATA_OFFSET      19  // Start of data payload
 
+// Package type byte of this build
+#if CONFIG_VIDEO_CODEC_H264
+#define VIDEO_PACKAGE_TYPE (VIDEO_PACKAGE | (VIDEO_CODEC_H264 << VIDEO_CODEC_SHIFT))
+#else
+#define VIDEO_PACKAGE_TYPE (VIDEO_PACKAGE | (VIDEO_CODEC_MJPEG << VIDEO_CODEC_SHIFT))
+#endif
+
 // Header field sizes
 #define VIDEO_HEADER_TYPE_SIZE        1
 #define VIDEO_HEADER_FRAME_ID_SIZE    4
@@ -40,6 +94,17 @@ typedef struct {
     int udp_socket;
     struct sockaddr_in dest_addr;
     uint32_t frame_id;         // Frame identifier (increments per frame)
+    int jpeg_quality;          // Quality the sensor currently encodes with
+    uint32_t calm_frames;      // Frames in a row below CONGESTION_LEVEL_ELEVATED
+    uint32_t skipped_frames;   // Frames skipped for congestion
+#if CONFIG_VIDEO_CODEC_H264
+    bool keyframe_requested;   // Encode the next frame as IDR
+    int64_t last_keyframe_us;  // Time the last IDR frame was encoded
+    uint32_t keyframes;        // IDR frames of this session
+#endif
+#if CONFIG_VIDEO_SLICE_UPDATES
+    bool refresh_requested;    // Send the next JPEG frame whole
+#endif
 } video_manager_info_t;
 
 
@@ -50,10 +115,115 @@ typedef struct {
 // this define is used to compensate for the time taken in sending the packets.
 #define DELAY_COMPENSATION_MS 50
 
+// Congestion backoff
+#define VIDEO_PACKET_GAP_MS 10        // Yield between the packets of a frame
+#define VIDEO_PACKET_GAP_EXTRA_MS 20  // Added at congestion level 100
+#define JPEG_QUALITY_WORST 63         // Highest quality number the sensor accepts
+#define JPEG_QUALITY_BACKOFF_STEP 4   // Per frame at CONGESTION_LEVEL_HIGH
+#define JPEG_QUALITY_RECOVER_STEP 2   // After a second below CONGESTION_LEVEL_ELEVATED
+
+#if CONFIG_VIDEO_CODEC_H264
+// Raw YUYV frames from the sensor, encoded by the esp_h264 software encoder
+#define VIDEO_PIXEL_FORMAT PIXFORMAT_YUV422
+#define VIDEO_TASK_STACK 32768          // The software encoder keeps large arrays on the stack
+#define H264_QP_MIN 24
+#define H264_QP_MAX 42
+#define H264_NAL_TYPE_FU_A 28
+#define H264_FU_HEADER_LEN 2            // FU indicator and FU header
+#define VIDEO_KEYFRAME_MIN_INTERVAL_MS 500  // Coalesce keyframe requests of a lossy link
+
+static esp_h264_enc_handle_t h264_encoder = NULL;
+static uint8_t *h264_out_buf = NULL;
+static uint32_t h264_out_buf_len = 0;
+#else
+#define VIDEO_PIXEL_FORMAT PIXFORMAT_JPEG
+#define VIDEO_TASK_STACK 16384
+#endif
+
+#if CONFIG_VIDEO_SLICE_UPDATES
+#define VIDEO_SLICE_MAX 256              // Restart intervals tracked per frame
+#define VIDEO_SLICE_FULL_PERCENT 60      // Send the whole frame when the update would be larger
+#define VIDEO_SLICE_UPDATE_HEADER_LEN 8  // Base frame ID, slice count, changed slices
+#define VIDEO_SLICE_ENTRY_HEADER_LEN 4   // Slice index and length
+#define VIDEO_SLICE_BUF_STEP 4096
+#define JPEG_MAX_COMPONENTS 3
+
+// Huffman table of the JPEG header, decoded code by code (ITU T.81 F.2.2.3)
+typedef struct {
+    int32_t maxcode[17];               // Largest code of each length, -1 when there is none
+    int32_t valoffset[17];             // Index of the first value of a length minus its first code
+    uint8_t huffval[256];
+} jpeg_huff_t;
+
+// Baseline JPEG layout, what it takes to find the DC coefficients of the luma blocks
+typedef struct {
+    uint8_t components;                // In scan order, luma first
+    uint8_t h[JPEG_MAX_COMPONENTS];    // Blocks per MCU horizontally
+    uint8_t v[JPEG_MAX_COMPONENTS];    // Blocks per MCU vertically
+    uint8_t dc_table[JPEG_MAX_COMPONENTS];
+    uint8_t ac_table[JPEG_MAX_COMPONENTS];
+    uint32_t restart_interval;         // MCUs per restart interval
+    uint32_t mcus;                     // MCUs per frame
+    jpeg_huff_t dc[2];
+    jpeg_huff_t ac[2];
+} jpeg_layout_t;
+
+// Restart intervals of a JPEG frame, the entropy-coded data between the RST markers
+typedef struct {
+    uint32_t header_len;               // SOI up to the end of the SOS segment
+    uint16_t count;
+    uint32_t offset[VIDEO_SLICE_MAX];
+    uint16_t length[VIDEO_SLICE_MAX];  // Without the RST marker
+    uint32_t hash[VIDEO_SLICE_MAX];
+    bool decoded[VIDEO_SLICE_MAX];     // DC coefficients in dc_cur
+    bool changed[VIDEO_SLICE_MAX];
+} jpeg_slices_t;
+
+// The slices the client holds, touched by the video task only
+typedef struct {
+    bool valid;                        // The client can patch the next frame onto the last one
+    bool warned;                       // Logged that the frames cannot be sliced
+    uint32_t base_frame_id;            // Last frame sent, whole or as update
+    uint32_t header_hash;              // Tables and frame size of that frame
+    uint16_t count;
+    uint32_t frames_since_refresh;
+    uint32_t updates;                  // Frames of the session sent as slice updates
+    uint32_t hash[VIDEO_SLICE_MAX];    // Of the version the client holds
+    int16_t *dc_ref;                   // Luma DC coefficients of that version, per block
+    int16_t *dc_cur;                   // The same for the frame being sent
+    uint32_t dc_len;                   // Entries allocated in each
+} video_slice_state_t;
+
+static jpeg_layout_t jpeg_layout;
+static jpeg_slices_t jpeg_slices;
+static video_slice_state_t slice_state;
+static uint8_t *slice_buf = NULL;
+static uint32_t slice_buf_len = 0;
+#endif
+
+#if CONFIG_VIDEO_RETRANSMIT
+#define RETRANSMIT_ID_MASK 0xFFF  // NACKs carry 12 bits of the frame id and of the packet sequence
+
+/**
+ * @brief A sent datagram kept for NACKs
+ */
+typedef struct {
+    uint32_t frame_id;
+    uint16_t packet_seq;
+    uint16_t len;                  // Header and payload, 0 for an empty slot
+} video_retransmit_slot_t;
+
+static video_retransmit_slot_t retransmit_slots[CONFIG_VIDEO_RETRANSMIT_PACKETS];
+static uint8_t *retransmit_buf = NULL;  // MAX_VIDEO_PACKET_SIZE bytes per slot
+static uint32_t retransmit_next = 0;    // Slot the next datagram overwrites
+static uint32_t retransmit_count = 0;   // Datagrams resent this session
+static timed_mutex_t *retransmit_mutex = NULL;
+#endif
+
 // Global video manager state
 static video_manager_info_t video_info = {0};
 static TaskHandle_t video_task_handle = NULL;
-static SemaphoreHandle_t video_info_mutex = NULL;
+static timed_mutex_t *video_info_mutex = NULL;
 
 // ESP32 Korvo 2 v3 camera pin configuration
 #define CAM_PIN_PWDN    -1  // Power down pin
@@ -75,6 +245,672 @@ static SemaphoreHandle_t video_info_mutex = NULL;
 
 const BaseType_t CORE_PIN = 0;
 
+#if !CONFIG_VIDEO_CODEC_H264
+/**
+ * @brief Set the JPEG quality of the sensor
+ */
+static void _video_set_jpeg_quality(int quality)
+{
+#if !CONFIG_EMULATED_PERIPHERALS
+    sensor_t *sensor = esp_camera_sensor_get();
+    if (sensor != NULL && sensor->set_quality != NULL) {
+        sensor->set_quality(sensor, quality);
+    }
+#endif
+}
+
+/**
+ * @brief Adapt the JPEG quality to the congestion level, once per frame
+ *
+ * Lowers the quality quickly while the level is high and recovers slowly
+ * after a second of calm, so the frame size does not oscillate. Called with
+ * video_info_mutex; the caller sets the sensor after giving it, the register
+ * write goes over SCCB.
+ *
+ * @return The quality to set on the sensor, -1 if unchanged
+ */
+static int _video_adapt_quality(uint8_t level)
+{
+    int quality = video_info.jpeg_quality;
+    if (level >= CONGESTION_LEVEL_HIGH) {
+        video_info.calm_frames = 0;
+        quality += JPEG_QUALITY_BACKOFF_STEP;
+        if (quality > JPEG_QUALITY_WORST) {
+            quality = JPEG_QUALITY_WORST;
+        }
+    }
+    else if (level < CONGESTION_LEVEL_ELEVATED && quality > JPEG_QUALITY) {
+        if (++video_info.calm_frames >= VIDEO_FPS) {
+            video_info.calm_frames = 0;
+            quality -= JPEG_QUALITY_RECOVER_STEP;
+            if (quality < JPEG_QUALITY) {
+                quality = JPEG_QUALITY;
+            }
+        }
+    }
+    else {
+        video_info.calm_frames = 0;
+    }
+
+    if (quality == video_info.jpeg_quality) {
+        return -1;
+    }
+    ESP_LOGD(TAG, "JPEG quality %d -> %d (congestion %d)", video_info.jpeg_quality, quality, level);
+    video_info.jpeg_quality = quality;
+    return quality;
+}
+#endif
+
+#if CONFIG_VIDEO_CODEC_H264
+/**
+ * @brief Create the H.264 encoder for the frame size of the sensor
+ *
+ * Baseline profile without B frames, so every frame can be sent as soon as
+ * it is encoded. IDR frames follow every CONFIG_VIDEO_H264_GOP frames and on
+ * request.
+ */
+static esp_err_t _video_h264_init(void)
+{
+    esp_h264_enc_cfg_sw_t cfg = {
+        .pic_type = ESP_H264_RAW_FMT_YUYV,
+        .gop = CONFIG_VIDEO_H264_GOP,
+        .fps = VIDEO_FPS,
+        .res = {
+            .width = resolution[VIDEO_QUALITY].width,
+            .height = resolution[VIDEO_QUALITY].height,
+        },
+        .rc = {
+            .bitrate = CONFIG_VIDEO_H264_BITRATE,
+            .qp_min = H264_QP_MIN,
+            .qp_max = H264_QP_MAX,
+        },
+    };
+
+    // An IDR frame at the lowest QP stays well below the raw frame size
+    h264_out_buf_len = cfg.res.width * cfg.res.height;
+    h264_out_buf = heap_caps_aligned_calloc(16, 1, h264_out_buf_len, MALLOC_CAP_SPIRAM);
+    if (h264_out_buf == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate the H.264 output buffer (%" PRIu32 " bytes)", h264_out_buf_len);
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_h264_err_t ret = esp_h264_enc_sw_new(&cfg, &h264_encoder);
+    if (ret == ESP_H264_ERR_OK) {
+        ret = esp_h264_enc_open(h264_encoder);
+    }
+    if (ret != ESP_H264_ERR_OK) {
+        ESP_LOGE(TAG, "Failed to create the H.264 encoder: %d", ret);
+        if (h264_encoder != NULL) {
+            esp_h264_enc_del(h264_encoder);
+            h264_encoder = NULL;
+        }
+        heap_caps_free(h264_out_buf);
+        h264_out_buf = NULL;
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "H.264 encoder %dx%d, %d kbit/s, IDR every %d frames",
+             cfg.res.width, cfg.res.height, CONFIG_VIDEO_H264_BITRATE / 1000, CONFIG_VIDEO_H264_GOP);
+    return ESP_OK;
+}
+
+static void _video_h264_deinit(void)
+{
+    if (h264_encoder != NULL) {
+        esp_h264_enc_close(h264_encoder);
+        esp_h264_enc_del(h264_encoder);
+        h264_encoder = NULL;
+    }
+    if (h264_out_buf != NULL) {
+        heap_caps_free(h264_out_buf);
+        h264_out_buf = NULL;
+    }
+}
+
+/**
+ * @brief Find the next NAL unit in an Annex B byte stream
+ *
+ * @param buf     Encoder output
+ * @param len     Length of the output
+ * @param pos     Read position, advanced past the returned NAL unit
+ * @param nal     Start of the NAL unit (after the start code)
+ * @param nal_len Length of the NAL unit
+ * @return true when a NAL unit was found
+ */
+static bool VIDEO_IRAM_ATTR _h264_next_nal(const uint8_t *buf, uint32_t len, uint32_t *pos, const uint8_t **nal, uint32_t *nal_len)
+{
+    uint32_t i = *pos;
+    // Skip the start code (00 00 01 or 00 00 00 01)
+    while (i + 3 <= len && !(buf[i] == 0 && buf[i + 1] == 0 && buf[i + 2] == 1)) {
+        i++;
+    }
+    if (i + 3 > len) {
+        return false;
+    }
+    uint32_t start = i + 3;
+    uint32_t end = start;
+    while (end + 3 <= len && !(buf[end] == 0 && buf[end + 1] == 0 && (buf[end + 2] == 1 ||
+           (buf[end + 2] == 0 && end + 3 < len && buf[end + 3] == 1)))) {
+        end++;
+    }
+    if (end + 3 > len) {
+        end = len;
+    }
+    *pos = end;
+    if (end == start) {
+        return false;
+    }
+    *nal = &buf[start];
+    *nal_len = end - start;
+    return true;
+}
+
+/**
+ * @brief Datagrams needed for a NAL unit: one if it fits, FU-A fragments otherwise
+ */
+static uint32_t VIDEO_IRAM_ATTR _h264_nal_packets(uint32_t nal_len)
+{
+    if (nal_len <= MAX_VIDEO_DATA_SIZE) {
+        return 1;
+    }
+    // The NAL header byte moves into the FU indicator and header of every fragment
+    uint32_t fragment = MAX_VIDEO_DATA_SIZE - H264_FU_HEADER_LEN;
+    return (nal_len - 1 + fragment - 1) / fragment;
+}
+#endif
+
+#if CONFIG_VIDEO_SLICE_UPDATES
+/**
+ * @brief FNV-1a hash of a byte range
+ */
+static uint32_t _video_hash(const uint8_t *buf, uint32_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < len; i++) {
+        hash = (hash ^ buf[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Split a JPEG frame at its restart markers
+ *
+ * Every restart interval starts with a fresh DC prediction, so a slice can be
+ * replaced on its own as long as the tables stay the same.
+ * @return true when the frame has a DRI segment and at most VIDEO_SLICE_MAX intervals
+ */
+static bool _jpeg_find_slices(const uint8_t *buf, uint32_t len, jpeg_slices_t *slices)
+{
+    if (len < 4 || buf[0] != 0xFF || buf[1] != 0xD8) {
+        return false;
+    }
+
+    // Marker segments up to the start of scan
+    bool restart_interval = false;
+    uint32_t i = 2;
+    while (true) {
+        if (i + 4 > len || buf[i] != 0xFF) {
+            return false;
+        }
+        uint8_t marker = buf[i + 1];
+        uint32_t segment_len = ((uint32_t)buf[i + 2] << 8) | buf[i + 3];
+        if (segment_len < 2) {
+            return false;
+        }
+        if (marker == 0xDD && segment_len == 4 && i + 6 <= len) {
+            restart_interval = ((buf[i + 4] << 8) | buf[i + 5]) != 0;
+        }
+        i += 2 + segment_len;
+        if (marker == 0xDA) {
+            break;
+        }
+    }
+    if (!restart_interval || i >= len) {
+        return false;
+    }
+
+    // Entropy-coded data: FF 00 is a stuffed byte, FF D0..D7 ends an interval, FF D9 the frame
+    slices->header_len = i;
+    slices->count = 0;
+    uint32_t start = i;
+    for (; i + 1 < len; i++) {
+        if (buf[i] != 0xFF) {
+            continue;
+        }
+        uint8_t marker = buf[i + 1];
+        if (marker == 0x00) {
+            i++;
+        }
+        else if ((marker >= 0xD0 && marker <= 0xD7) || marker == 0xD9) {
+            if (slices->count == VIDEO_SLICE_MAX || i - start > UINT16_MAX) {
+                return false;
+            }
+            slices->offset[slices->count] = start;
+            slices->length[slices->count] = (uint16_t)(i - start);
+            slices->count++;
+            if (marker == 0xD9) {
+                return true;
+            }
+            start = i + 2;
+            i++;
+        }
+    }
+    return false;  // No EOI
+}
+
+/**
+ * @brief Build a Huffman table from the code counts and values of a DHT segment
+ */
+static void _jpeg_build_huff(const uint8_t *counts, const uint8_t *values, uint32_t total, jpeg_huff_t *huff)
+{
+    int32_t code = 0;
+    int32_t index = 0;
+    for (int len = 1; len <= 16; len++) {
+        huff->maxcode[len] = -1;
+        if (counts[len - 1] > 0) {
+            huff->valoffset[len] = index - code;
+            code += counts[len - 1];
+            index += counts[len - 1];
+            huff->maxcode[len] = code - 1;
+        }
+        code <<= 1;
+    }
+    memcpy(huff->huffval, values, total);
+}
+
+/**
+ * @brief Read the frame size, sampling, Huffman tables and restart interval
+ *
+ * Only baseline frames with one interleaved scan are supported, what the
+ * sensors produce.
+ * @return true when the slices of this header can be compared
+ */
+static bool _jpeg_parse_layout(const uint8_t *buf, uint32_t header_len, jpeg_layout_t *layout)
+{
+    uint8_t ids[JPEG_MAX_COMPONENTS];
+    uint8_t h[JPEG_MAX_COMPONENTS];
+    uint8_t v[JPEG_MAX_COMPONENTS];
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint8_t frame_components = 0;
+    bool tables[4] = { false };  // DC 0, DC 1, AC 0, AC 1
+    memset(layout, 0, sizeof(*layout));
+
+    for (uint32_t i = 2; i + 4 <= header_len; ) {
+        uint8_t marker = buf[i + 1];
+        uint32_t end = i + 2 + (((uint32_t)buf[i + 2] << 8) | buf[i + 3]);
+        const uint8_t *p = &buf[i + 4];
+        if (end > header_len) {
+            return false;
+        }
+        if (marker == 0xC0 || marker == 0xC1) {
+            // SOF: precision, height, width, then id, sampling and quantization table per component
+            frame_components = p[5];
+            if (p[0] != 8 || frame_components == 0 || frame_components > JPEG_MAX_COMPONENTS ||
+                p + 6 + frame_components * 3 > &buf[end]) {
+                return false;
+            }
+            height = (p[1] << 8) | p[2];
+            width = (p[3] << 8) | p[4];
+            for (uint8_t c = 0; c < frame_components; c++) {
+                ids[c] = p[6 + c * 3];
+                h[c] = p[7 + c * 3] >> 4;
+                v[c] = p[7 + c * 3] & 0x0F;
+            }
+        }
+        else if (marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            return false;  // Progressive, lossless or arithmetic coded
+        }
+        else if (marker == 0xC4) {
+            // DHT: one or more tables of class and id, 16 code counts, the values
+            while (p + 17 <= &buf[end]) {
+                uint8_t table_class = p[0] >> 4;
+                uint8_t table_id = p[0] & 0x0F;
+                uint32_t total = 0;
+                for (int n = 1; n <= 16; n++) {
+                    total += p[n];
+                }
+                if (table_class > 1 || table_id > 1 || total > 256 || p + 17 + total > &buf[end]) {
+                    return false;
+                }
+                _jpeg_build_huff(&p[1], &p[17], total,
+                                 table_class ? &layout->ac[table_id] : &layout->dc[table_id]);
+                tables[table_class * 2 + table_id] = true;
+                p += 17 + total;
+            }
+        }
+        else if (marker == 0xDD) {
+            layout->restart_interval = (p[0] << 8) | p[1];
+        }
+        else if (marker == 0xDA) {
+            // SOS: the components of the scan in MCU order, with their table selectors
+            layout->components = p[0];
+            if (layout->components != frame_components || p + 1 + layout->components * 2 > &buf[end]) {
+                return false;
+            }
+            for (uint8_t s = 0; s < layout->components; s++) {
+                uint8_t c = 0;
+                while (c < frame_components && ids[c] != p[1 + s * 2]) {
+                    c++;
+                }
+                if (c == frame_components) {
+                    return false;
+                }
+                layout->h[s] = layout->components > 1 ? h[c] : 1;
+                layout->v[s] = layout->components > 1 ? v[c] : 1;
+                layout->dc_table[s] = p[2 + s * 2] >> 4;
+                layout->ac_table[s] = p[2 + s * 2] & 0x0F;
+                if (layout->dc_table[s] > 1 || layout->ac_table[s] > 1 ||
+                    !tables[layout->dc_table[s]] || !tables[2 + layout->ac_table[s]] ||
+                    layout->h[s] == 0 || layout->v[s] == 0) {
+                    return false;
+                }
+            }
+        }
+        i = end;
+    }
+    if (width == 0 || height == 0 || layout->components == 0 || layout->restart_interval == 0) {
+        return false;
+    }
+
+    // MCUs of the interleaved scan, sized by the largest sampling factors
+    uint8_t h_max = 1;
+    uint8_t v_max = 1;
+    for (uint8_t s = 0; s < layout->components; s++) {
+        h_max = layout->h[s] > h_max ? layout->h[s] : h_max;
+        v_max = layout->v[s] > v_max ? layout->v[s] : v_max;
+    }
+    layout->mcus = ((width + h_max * 8 - 1) / (h_max * 8)) * ((height + v_max * 8 - 1) / (v_max * 8));
+    return true;
+}
+
+// Entropy-coded bits of one restart interval, stuffed bytes skipped
+typedef struct {
+    const uint8_t *buf;
+    uint32_t len;
+    uint32_t pos;
+    uint32_t acc;
+    int bits;
+} jpeg_bits_t;
+
+static inline uint32_t _jpeg_get_bits(jpeg_bits_t *bits, int count)
+{
+    uint32_t value = 0;
+    while (count-- > 0) {
+        if (bits->bits == 0) {
+            uint8_t byte = 0xFF;  // Past the end: the 1 bits of the padding
+            if (bits->pos < bits->len) {
+                byte = bits->buf[bits->pos++];
+                if (byte == 0xFF && bits->pos < bits->len && bits->buf[bits->pos] == 0x00) {
+                    bits->pos++;
+                }
+            }
+            bits->acc = byte;
+            bits->bits = 8;
+        }
+        bits->bits--;
+        value = (value << 1) | ((bits->acc >> bits->bits) & 1);
+    }
+    return value;
+}
+
+static int _jpeg_decode_huff(jpeg_bits_t *bits, const jpeg_huff_t *huff)
+{
+    int32_t code = 0;
+    for (int len = 1; len <= 16; len++) {
+        code = (code << 1) | (int32_t)_jpeg_get_bits(bits, 1);
+        if (code <= huff->maxcode[len]) {
+            return huff->huffval[code + huff->valoffset[len]];
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Decode the luma DC coefficients of a restart interval
+ *
+ * Walks the Huffman codes of every block and skips the AC coefficients, no
+ * dequantization and no IDCT: a few milliseconds per VGA frame.
+ * @param dc Receives the DC coefficient of every luma block, in quantization steps
+ * @return false when the data does not decode
+ */
+static bool _jpeg_slice_dc(const jpeg_layout_t *layout, const uint8_t *data, uint32_t len, uint32_t mcus, int16_t *dc)
+{
+    jpeg_bits_t bits = { .buf = data, .len = len };
+    int32_t pred[JPEG_MAX_COMPONENTS] = { 0 };
+    for (uint32_t mcu = 0; mcu < mcus; mcu++) {
+        for (uint8_t s = 0; s < layout->components; s++) {
+            const jpeg_huff_t *dc_huff = &layout->dc[layout->dc_table[s]];
+            const jpeg_huff_t *ac_huff = &layout->ac[layout->ac_table[s]];
+            for (int block = 0; block < layout->h[s] * layout->v[s]; block++) {
+                int size = _jpeg_decode_huff(&bits, dc_huff);
+                if (size < 0 || size > 11) {
+                    return false;
+                }
+                int32_t diff = 0;
+                if (size > 0) {
+                    diff = (int32_t)_jpeg_get_bits(&bits, size);
+                    if (diff < (1 << (size - 1))) {
+                        diff -= (1 << size) - 1;
+                    }
+                }
+                pred[s] += diff;
+                if (s == 0) {
+                    *dc++ = (int16_t)pred[0];
+                }
+
+                for (int k = 1; k < 64; k++) {
+                    int rs = _jpeg_decode_huff(&bits, ac_huff);
+                    if (rs < 0) {
+                        return false;
+                    }
+                    if ((rs & 0x0F) == 0) {
+                        if (rs != 0xF0) {
+                            break;  // End of block
+                        }
+                        k += 15;    // Sixteen zeros
+                        continue;
+                    }
+                    k += rs >> 4;
+                    if (k > 63) {
+                        return false;
+                    }
+                    _jpeg_get_bits(&bits, rs & 0x0F);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Decode the luma DC coefficients of slice n of the frame into dc_cur
+ */
+static bool _video_slice_decode(const uint8_t *jpeg, uint16_t n)
+{
+    jpeg_slices_t *slices = &jpeg_slices;
+    uint32_t first = n * jpeg_layout.restart_interval;
+    uint32_t mcus = jpeg_layout.mcus - first < jpeg_layout.restart_interval ?
+                    jpeg_layout.mcus - first : jpeg_layout.restart_interval;
+    uint32_t luma_blocks = jpeg_layout.h[0] * jpeg_layout.v[0];
+    slices->decoded[n] = _jpeg_slice_dc(&jpeg_layout, jpeg + slices->offset[n], slices->length[n], mcus,
+                                        &slice_state.dc_cur[first * luma_blocks]);
+    return slices->decoded[n];
+}
+
+/**
+ * @brief Whether a decoded slice differs visibly from the version the client holds
+ *
+ * Sensor noise changes the bytes of nearly every slice from frame to frame,
+ * so a slice only counts as changed when the average brightness of one of
+ * its blocks moved by more than CONFIG_VIDEO_SLICE_DC_THRESHOLD steps.
+ */
+static bool _video_slice_differs(uint16_t n)
+{
+    uint32_t luma_blocks = jpeg_layout.h[0] * jpeg_layout.v[0];
+    uint32_t first = n * jpeg_layout.restart_interval * luma_blocks;
+    uint32_t last = (n + 1) * jpeg_layout.restart_interval * luma_blocks;
+    if (last > jpeg_layout.mcus * luma_blocks) {
+        last = jpeg_layout.mcus * luma_blocks;
+    }
+    for (uint32_t b = first; b < last; b++) {
+        if (abs(slice_state.dc_cur[b] - slice_state.dc_ref[b]) > CONFIG_VIDEO_SLICE_DC_THRESHOLD) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Take slice n of the frame as the version the client holds
+ */
+static void _video_slice_commit(uint16_t n)
+{
+    slice_state.hash[n] = jpeg_slices.hash[n];
+    if (jpeg_slices.decoded[n]) {
+        uint32_t luma_blocks = jpeg_layout.h[0] * jpeg_layout.v[0];
+        uint32_t first = n * jpeg_layout.restart_interval * luma_blocks;
+        uint32_t last = (n + 1) * jpeg_layout.restart_interval * luma_blocks;
+        if (last > jpeg_layout.mcus * luma_blocks) {
+            last = jpeg_layout.mcus * luma_blocks;
+        }
+        memcpy(&slice_state.dc_ref[first], &slice_state.dc_cur[first], (last - first) * sizeof(int16_t));
+    }
+}
+
+/**
+ * @brief Start over with a frame of a new header: parse it and size the DC arrays
+ */
+static bool _video_slice_reset(const uint8_t *jpeg)
+{
+    jpeg_slices_t *slices = &jpeg_slices;
+    if (!_jpeg_parse_layout(jpeg, slices->header_len, &jpeg_layout) ||
+        (jpeg_layout.mcus + jpeg_layout.restart_interval - 1) / jpeg_layout.restart_interval != slices->count) {
+        return false;
+    }
+    uint32_t dc_len = jpeg_layout.mcus * jpeg_layout.h[0] * jpeg_layout.v[0];
+    if (dc_len > slice_state.dc_len) {
+        // Both arrays in one allocation
+        int16_t *dc = heap_caps_realloc_prefer(slice_state.dc_ref, dc_len * 2 * sizeof(int16_t), 2,
+                                               MALLOC_CAP_SPIRAM, MALLOC_CAP_DEFAULT);
+        if (dc == NULL) {
+            ESP_LOGW(TAG, "No memory for the DC coefficients of %" PRIu32 " blocks", dc_len);
+            return false;
+        }
+        slice_state.dc_ref = dc;
+        slice_state.dc_cur = dc + dc_len;
+        slice_state.dc_len = dc_len;
+    }
+    else {
+        slice_state.dc_cur = slice_state.dc_ref + slice_state.dc_len;
+    }
+    return true;
+}
+
+/**
+ * @brief Build the slice update of a frame in slice_buf
+ *
+ * Compares the restart intervals of the frame with the versions the client
+ * holds: equal hashes are unchanged, the others are decoded down to their
+ * luma DC coefficients and compared with a threshold (_video_slice_differs).
+ * The frame goes out whole when the client has nothing to patch, on request,
+ * every CONFIG_VIDEO_SLICE_REFRESH frames, when the tables changed (quality
+ * backoff) and when most of the picture changed.
+ * @return Length of the update, 0 to send the frame whole
+ */
+static uint32_t _video_slice_update(uint32_t frame_id, const uint8_t *jpeg, uint32_t len, bool refresh)
+{
+    jpeg_slices_t *slices = &jpeg_slices;
+    uint32_t header_hash = 0;
+    bool reset = false;
+    bool sliced = _jpeg_find_slices(jpeg, len, slices);
+    if (sliced) {
+        header_hash = _video_hash(jpeg, slices->header_len);
+        reset = !slice_state.valid || header_hash != slice_state.header_hash || slices->count != slice_state.count;
+    }
+    if (!sliced || (reset && !_video_slice_reset(jpeg))) {
+        if (!slice_state.warned) {
+            ESP_LOGW(TAG, "JPEG frames without restart markers or not baseline, sending them whole");
+            slice_state.warned = true;
+        }
+        slice_state.valid = false;
+        return 0;
+    }
+
+    bool full = reset || refresh || ++slice_state.frames_since_refresh >= CONFIG_VIDEO_SLICE_REFRESH;
+    uint32_t update_len = VIDEO_SLICE_UPDATE_HEADER_LEN;
+    uint16_t changed = 0;
+    for (uint16_t n = 0; n < slices->count; n++) {
+        slices->hash[n] = _video_hash(jpeg + slices->offset[n], slices->length[n]);
+        slices->decoded[n] = false;
+        if (!reset && slices->hash[n] == slice_state.hash[n]) {
+            // Byte for byte what the client holds
+            slices->changed[n] = false;
+            continue;
+        }
+        if (!_video_slice_decode(jpeg, n)) {
+            ESP_LOGW(TAG, "Slice %u of frame %" PRIu32 " does not decode, sending it whole", n, frame_id);
+            slice_state.valid = false;
+            return 0;
+        }
+        slices->changed[n] = reset || _video_slice_differs(n);
+        if (slices->changed[n]) {
+            changed++;
+            update_len += VIDEO_SLICE_ENTRY_HEADER_LEN + slices->length[n];
+        }
+    }
+    if (!full && update_len > len / 100 * VIDEO_SLICE_FULL_PERCENT) {
+        full = true;
+    }
+    if (!full && update_len > slice_buf_len) {
+        uint32_t buf_len = (update_len + VIDEO_SLICE_BUF_STEP - 1) / VIDEO_SLICE_BUF_STEP * VIDEO_SLICE_BUF_STEP;
+        uint8_t *buf = heap_caps_realloc_prefer(slice_buf, buf_len, 2, MALLOC_CAP_SPIRAM, MALLOC_CAP_DEFAULT);
+        if (buf == NULL) {
+            ESP_LOGW(TAG, "No memory for a %" PRIu32 " byte slice update", update_len);
+            full = true;
+        }
+        else {
+            slice_buf = buf;
+            slice_buf_len = buf_len;
+        }
+    }
+
+    // The client ends up with the slices sent: all of a whole frame, the changed ones of an update
+    for (uint16_t n = 0; n < slices->count; n++) {
+        if (full || slices->changed[n]) {
+            _video_slice_commit(n);
+        }
+    }
+    slice_state.valid = true;
+    slice_state.header_hash = header_hash;
+    slice_state.count = slices->count;
+    uint32_t base_frame_id = slice_state.base_frame_id;
+    slice_state.base_frame_id = frame_id;
+    if (full) {
+        slice_state.frames_since_refresh = 0;
+        return 0;
+    }
+
+    // Base frame ID, slice count, changed slices, then index, length and data of each
+    uint8_t *out = slice_buf;
+    memcpy(out, &base_frame_id, sizeof(base_frame_id));
+    memcpy(out + 4, &slices->count, sizeof(slices->count));
+    memcpy(out + 6, &changed, sizeof(changed));
+    out += VIDEO_SLICE_UPDATE_HEADER_LEN;
+    for (uint16_t n = 0; n < slices->count; n++) {
+        if (!slices->changed[n]) {
+            continue;
+        }
+        memcpy(out, &n, sizeof(n));
+        memcpy(out + 2, &slices->length[n], sizeof(slices->length[n]));
+        memcpy(out + VIDEO_SLICE_ENTRY_HEADER_LEN, jpeg + slices->offset[n], slices->length[n]);
+        out += VIDEO_SLICE_ENTRY_HEADER_LEN + slices->length[n];
+    }
+    slice_state.updates++;
+    return update_len;
+}
+#endif
+
 // Forward declaration
 /**
  * @brief Capture and send a single frame
@@ -113,8 +949,8 @@ esp_err_t video_manager_init(void)
         .ledc_timer = LEDC_TIMER_0,
         .ledc_channel = LEDC_CHANNEL_0,
 
-        .pixel_format = PIXFORMAT_JPEG,  // JPEG format for compression
-        .frame_size = VIDEO_QUALITY,     // VGA resolution
+        .pixel_format = VIDEO_PIXEL_FORMAT, // JPEG, or YUYV for the H.264 encoder
+        .frame_size = VIDEO_QUALITY,     // VGA resolution (QVGA with H.264)
         .jpeg_quality = JPEG_QUALITY,    // JPEG quality
         .fb_count = 2,                   // Double buffering to reduce contention
         .fb_location = CAMERA_FB_IN_PSRAM,
@@ -122,7 +958,12 @@ esp_err_t video_manager_init(void)
     };
 
     // Initialize the camera
+#if CONFIG_EMULATED_PERIPHERALS
+    (void)config;
+    ret = emulated_camera_init();
+#else
     ret = esp_camera_init(&config);
+#endif
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Camera initialization failed: %s", esp_err_to_name(ret));
         return ret;
@@ -134,15 +975,39 @@ esp_err_t video_manager_init(void)
     video_info.is_streaming = false;
     video_info.frame_id = 0;
     video_info.stop_requested = false;
+    video_info.jpeg_quality = JPEG_QUALITY;
+
+#if CONFIG_VIDEO_CODEC_H264
+    ret = _video_h264_init();
+    if (ret != ESP_OK) {
+        CAMERA_DEINIT();
+        return ret;
+    }
+#endif
 
     // Create mutex for video_info protection
-    video_info_mutex = xSemaphoreCreateMutex();
+    video_info_mutex = timed_mutex_create("video_info");
     if (video_info_mutex == NULL) {
         ESP_LOGE(TAG, "Failed to create video_info mutex");
-        esp_camera_deinit();
+#if CONFIG_VIDEO_CODEC_H264
+        _video_h264_deinit();
+#endif
+        CAMERA_DEINIT();
         return ESP_FAIL;
     }
 
+#if CONFIG_VIDEO_RETRANSMIT
+    // Optional, the stream runs without it
+    retransmit_mutex = timed_mutex_create("retransmit");
+    if (retransmit_mutex != NULL) {
+        retransmit_buf = heap_caps_malloc_prefer(CONFIG_VIDEO_RETRANSMIT_PACKETS * MAX_VIDEO_PACKET_SIZE, 2,
+                                                 MALLOC_CAP_SPIRAM, MALLOC_CAP_DEFAULT);
+    }
+    if (retransmit_buf == NULL) {
+        ESP_LOGW(TAG, "No memory for the retransmit buffer, NACKs are ignored");
+    }
+#endif
+
     ESP_LOGI(TAG, "ESP32-CAM initialized successfully");
     return ESP_OK;
 }
@@ -156,9 +1021,9 @@ static void _video_streaming_task(void *param)
 
     while (should_continue) {
         // Check if we should continue streaming (thread-safe)
-        xSemaphoreTake(video_info_mutex, portMAX_DELAY);
+        TIMED_MUTEX_TAKE(video_info_mutex);
             should_continue = !video_info.stop_requested;
-        xSemaphoreGive(video_info_mutex);
+        TIMED_MUTEX_GIVE(video_info_mutex);
         
         if (should_continue) {
             esp_err_t ret = _video_manager_send_frame();
@@ -170,26 +1035,46 @@ static void _video_streaming_task(void *param)
         }
     }
 
-    xSemaphoreTake(video_info_mutex, portMAX_DELAY);
+    TIMED_MUTEX_TAKE(video_info_mutex);
         video_info.is_streaming = false;
         if (video_info.udp_socket >= 0) {
             close(video_info.udp_socket);
             video_info.udp_socket = -1;
         }
-    xSemaphoreGive(video_info_mutex);
+        uint32_t skipped_frames = video_info.skipped_frames;
+#if CONFIG_VIDEO_CODEC_H264
+        uint32_t keyframes = video_info.keyframes;
+#endif
+    TIMED_MUTEX_GIVE(video_info_mutex);
     
-    ESP_LOGI(TAG, "Video streaming task ended");
+#if CONFIG_VIDEO_CODEC_H264
+    ESP_LOGI(TAG, "Video streaming task ended (%" PRIu32 " frames skipped for congestion, %" PRIu32 " IDR frames)",
+             skipped_frames, keyframes);
+#elif CONFIG_VIDEO_SLICE_UPDATES
+    ESP_LOGI(TAG, "Video streaming task ended (%" PRIu32 " frames skipped for congestion, %" PRIu32
+             " sent as slice updates)", skipped_frames, slice_state.updates);
+#else
+    ESP_LOGI(TAG, "Video streaming task ended (%" PRIu32 " frames skipped for congestion)", skipped_frames);
+#endif
+#if CONFIG_VIDEO_RETRANSMIT
+    if (retransmit_buf != NULL) {
+        TIMED_MUTEX_TAKE(retransmit_mutex);
+            uint32_t resent = retransmit_count;
+        TIMED_MUTEX_GIVE(retransmit_mutex);
+        ESP_LOGI(TAG, "%" PRIu32 " video datagrams resent on NACK", resent);
+    }
+#endif
     video_task_handle = NULL;
     vTaskDelete(NULL);
 }
 
 esp_err_t video_manager_start_streaming(in_addr_t client_ip)
 {
-    xSemaphoreTake(video_info_mutex, portMAX_DELAY);
+    TIMED_MUTEX_TAKE(video_info_mutex);
     
         if (video_info.is_streaming) {
             ESP_LOGW(TAG, "Video streaming already active");
-            xSemaphoreGive(video_info_mutex);
+            TIMED_MUTEX_GIVE(video_info_mutex);
             return ESP_OK;
         }
 
@@ -197,7 +1082,7 @@ esp_err_t video_manager_start_streaming(in_addr_t client_ip)
         video_info.udp_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
         if (video_info.udp_socket < 0) {
             ESP_LOGE(TAG, "Failed to create UDP socket for video");
-            xSemaphoreGive(video_info_mutex);
+            TIMED_MUTEX_GIVE(video_info_mutex);
             return ESP_FAIL;
         }
 
@@ -209,8 +1094,43 @@ esp_err_t video_manager_start_streaming(in_addr_t client_ip)
 
         video_info.is_streaming = true;
         video_info.stop_requested = false;
+
+#if CONFIG_VIDEO_RETRANSMIT
+        // Datagrams of the previous session are not the new client's to ask for
+        if (retransmit_buf != NULL) {
+            TIMED_MUTEX_TAKE(retransmit_mutex);
+                memset(retransmit_slots, 0, sizeof(retransmit_slots));
+                retransmit_next = 0;
+                retransmit_count = 0;
+            TIMED_MUTEX_GIVE(retransmit_mutex);
+        }
+#endif
+
+#if CONFIG_VIDEO_CODEC_H264
+        // Every session starts with an IDR frame
+        video_info.keyframe_requested = true;
+        video_info.last_keyframe_us = 0;
+        video_info.keyframes = 0;
+#else
+        // Every session starts at the configured quality, the sensor is set after the mutex
+        bool reset_quality = video_info.jpeg_quality != JPEG_QUALITY;
+        video_info.jpeg_quality = JPEG_QUALITY;
+#if CONFIG_VIDEO_SLICE_UPDATES
+        // The new client has no frame to patch; the task is not running yet
+        video_info.refresh_requested = true;
+        slice_state.valid = false;
+        slice_state.updates = 0;
+#endif
+#endif
+        video_info.calm_frames = 0;
+        video_info.skipped_frames = 0;
     
-    xSemaphoreGive(video_info_mutex);
+    TIMED_MUTEX_GIVE(video_info_mutex);
+#if !CONFIG_VIDEO_CODEC_H264
+    if (reset_quality) {
+        _video_set_jpeg_quality(JPEG_QUALITY);
+    }
+#endif
 
     // Convert IP for logging
     char ip_str[INET_ADDRSTRLEN];
@@ -221,7 +1141,7 @@ esp_err_t video_manager_start_streaming(in_addr_t client_ip)
     BaseType_t task_created = xTaskCreate(
         _video_streaming_task,
         "video_stream",
-        16384,  // Stack size
+        VIDEO_TASK_STACK,  // Stack size
         NULL,  // Parameters
         4,     // Priority+
         &video_task_handle
@@ -229,11 +1149,11 @@ esp_err_t video_manager_start_streaming(in_addr_t client_ip)
 
     if (task_created != pdPASS) {
         ESP_LOGE(TAG, "Failed to create video streaming task");
-        xSemaphoreTake(video_info_mutex, portMAX_DELAY);
+        TIMED_MUTEX_TAKE(video_info_mutex);
             video_info.is_streaming = false;
             close(video_info.udp_socket);
             video_info.udp_socket = -1;
-        xSemaphoreGive(video_info_mutex);
+        TIMED_MUTEX_GIVE(video_info_mutex);
         return ESP_FAIL;
     }
 
@@ -243,127 +1163,607 @@ esp_err_t video_manager_start_streaming(in_addr_t client_ip)
 
 esp_err_t video_manager_stop_streaming(void)
 {
-    xSemaphoreTake(video_info_mutex, portMAX_DELAY);
+    TIMED_MUTEX_TAKE(video_info_mutex);
         if (!video_info.is_streaming) {
             ESP_LOGW(TAG, "Video streaming not active");
-            xSemaphoreGive(video_info_mutex);
+            TIMED_MUTEX_GIVE(video_info_mutex);
             return ESP_OK;
         }
 
         video_info.stop_requested = true;
 
-    xSemaphoreGive(video_info_mutex);
+    TIMED_MUTEX_GIVE(video_info_mutex);
 
     // Wait for the streaming task to finish
     bool thread_running = true;
     while (thread_running) {
-        xSemaphoreTake(video_info_mutex, portMAX_DELAY);
+        TIMED_MUTEX_TAKE(video_info_mutex);
             thread_running = video_info.is_streaming;
-        xSemaphoreGive(video_info_mutex);
+        TIMED_MUTEX_GIVE(video_info_mutex);
+    }
+
+    return ESP_OK;
+}
+
+/**
+ * @brief Datagrams of the frame being sent, shared by the packets of the frame
+ */
+typedef struct {
+    int udp_socket;
+    struct sockaddr_in dest_addr;
+    uint8_t packet_type;       // Package type and codec of the frame
+    uint32_t frame_id;
+    int64_t time_ms;           // Media timestamp of the frame
+    uint16_t packet_seq;       // Sequence of the next packet
+    uint16_t total_packets;
+#if CONFIG_LATENCY_TRACE
+    int64_t trace_send_start;
+    int64_t trace_send_end;
+#endif
+} video_frame_tx_t;
+
+#if CONFIG_VIDEO_RETRANSMIT
+/**
+ * @brief Keep a copy of a sent datagram for NACKs, in place of the oldest one
+ */
+static void VIDEO_IRAM_ATTR _video_retransmit_store(const video_frame_tx_t *tx, const struct iovec *iov, int iov_count)
+{
+    if (retransmit_buf == NULL) {
+        return;
+    }
+    TIMED_MUTEX_TAKE(retransmit_mutex);
+        video_retransmit_slot_t *slot = &retransmit_slots[retransmit_next];
+        uint8_t *dst = retransmit_buf + retransmit_next * MAX_VIDEO_PACKET_SIZE;
+        uint16_t len = 0;
+        for (int i = 0; i < iov_count; i++) {
+            memcpy(dst + len, iov[i].iov_base, iov[i].iov_len);
+            len += iov[i].iov_len;
+        }
+        slot->frame_id = tx->frame_id;
+        slot->packet_seq = tx->packet_seq;
+        slot->len = len;
+        retransmit_next = (retransmit_next + 1) % CONFIG_VIDEO_RETRANSMIT_PACKETS;
+    TIMED_MUTEX_GIVE(retransmit_mutex);
+}
+#endif
+
+/**
+ * @brief Send one datagram of a frame, then yield before the next one
+ *
+ * @param tx            Frame being sent, its packet sequence is advanced
+ * @param payload       Payload parts, sent after the header without copying
+ * @param payload_count Number of payload parts (1 or 2)
+ * @return ESP_OK on success, ESP_FAIL when the send failed
+ */
+static esp_err_t VIDEO_IRAM_ATTR _video_send_packet(video_frame_tx_t *tx, const struct iovec *payload, int payload_count)
+{
+#if CONFIG_PACKET_TIMING
+    int64_t packet_start_us = esp_timer_get_time();
+#endif
+
+    // Build header in separate buffer (no large memcpy needed)
+    uint8_t header[VIDEO_STREAM_HEADER_LEN];
+    uint16_t packet_length = 0;
+    for (int i = 0; i < payload_count; i++) {
+        packet_length += payload[i].iov_len;
     }
 
+    // Build video packet header efficiently
+    header[VIDEO_HEADER_TYPE_OFFSET] = tx->packet_type;
+    memcpy(&header[VIDEO_HEADER_FRAME_ID_OFFSET], &tx->frame_id, VIDEO_HEADER_FRAME_ID_SIZE);
+    memcpy(&header[VIDEO_HEADER_TIMESTAMP_OFFSET], &tx->time_ms, VIDEO_HEADER_TIMESTAMP_SIZE);
+    memcpy(&header[VIDEO_HEADER_LENGTH_OFFSET], &packet_length, VIDEO_HEADER_LENGTH_SIZE);
+    memcpy(&header[VIDEO_HEADER_PACKET_SEQ_OFFSET], &tx->packet_seq, VIDEO_HEADER_PACKET_SEQ_SIZE);
+    memcpy(&header[VIDEO_HEADER_TOTAL_PACKETS_OFFSET], &tx->total_packets, VIDEO_HEADER_TOTAL_PACKETS_SIZE);
+
+    // Use scatter-gather I/O to avoid copying video data
+    struct iovec iov[3];
+    iov[0].iov_base = header;
+    iov[0].iov_len = VIDEO_STREAM_HEADER_LEN;
+    for (int i = 0; i < payload_count; i++) {
+        iov[i + 1] = payload[i];  // Direct from the frame buffer - zero copy!
+    }
+
+    struct msghdr msg = {
+        .msg_name = &tx->dest_addr,
+        .msg_namelen = sizeof(tx->dest_addr),
+        .msg_iov = iov,
+        .msg_iovlen = payload_count + 1,
+        .msg_control = NULL,
+        .msg_controllen = 0,
+        .msg_flags = 0
+    };
+
+#if CONFIG_LATENCY_TRACE
+    if (tx->packet_seq == 0) {
+        tx->trace_send_start = _trace_now_us();
+    }
+#endif
+
+    // Zero-copy transmission
+    int64_t send_start_us = esp_timer_get_time();
+    int sent = sendmsg(tx->udp_socket, &msg, 0);
+    int send_errno = errno;
+    congestion_monitor_record_send(send_start_us, sent, send_errno);
+#if CONFIG_PACKET_TIMING
+    packet_timing_record(PACKET_TIMING_VIDEO_TX, packet_start_us);
+#endif
+
+    if (sent < 0) {
+        if (send_errno == ENOMEM) {
+            vTaskDelay(pdMS_TO_TICKS(50)); // Back off briefly on memory error
+        }
+        ESP_LOGD(TAG, "Failed to send video packet %d/%d (frame %" PRIu32 ") errno: %s",
+                  tx->packet_seq + 1, tx->total_packets, tx->frame_id, strerror(send_errno));
+        return ESP_FAIL;
+    }
+#if CONFIG_VIDEO_RETRANSMIT
+    _video_retransmit_store(tx, iov, payload_count + 1);
+#endif
+#if CONFIG_LATENCY_TRACE
+    tx->trace_send_end = _trace_now_us();
+#endif
+    tx->packet_seq++;
+
+    // Yield to allow network tasks to handle the packages, longer as the
+    // congestion rises, to minimize ENOMEM errors when sending
+    uint8_t level = congestion_monitor_level();
+    uint32_t gap_ms = VIDEO_PACKET_GAP_MS;
+    if (level >= CONGESTION_LEVEL_ELEVATED) {
+        gap_ms += (VIDEO_PACKET_GAP_EXTRA_MS * level + 50) / 100;
+    }
+    vTaskDelay(pdMS_TO_TICKS(gap_ms));
     return ESP_OK;
 }
 
+#if !CONFIG_VIDEO_CODEC_H264
+/**
+ * @brief Send a JPEG frame or slice update in fragments of MAX_VIDEO_DATA_SIZE
+ */
+static esp_err_t VIDEO_IRAM_ATTR _video_send_fragments(video_frame_tx_t *tx, const uint8_t *buf, uint32_t len)
+{
+    // Calculate number of packets needed
+    uint32_t total_packets = (len + MAX_VIDEO_DATA_SIZE - 1) / MAX_VIDEO_DATA_SIZE;
+    tx->total_packets = (uint16_t)total_packets; // Convert to 16-bit
+
+    // Send frame in packets using zero-copy transmission
+    for (uint32_t packet_seq = 0; packet_seq < total_packets; packet_seq++) {
+        uint32_t offset = packet_seq * MAX_VIDEO_DATA_SIZE;
+        uint32_t packet_data_size = (offset + MAX_VIDEO_DATA_SIZE > len) ?
+                                   (len - offset) : MAX_VIDEO_DATA_SIZE;
+        struct iovec payload = { .iov_base = (void *)(buf + offset), .iov_len = packet_data_size };
+        if (_video_send_packet(tx, &payload, 1) != ESP_OK) {
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+#endif
+
+#if CONFIG_VIDEO_CODEC_H264
+/**
+ * @brief Make the next frame an IDR frame
+ *
+ * The software encoder has no call to insert one, reopening it restarts the
+ * GOP and keeps the allocated buffers.
+ */
+static void _video_h264_restart(void)
+{
+    esp_h264_enc_close(h264_encoder);
+    esp_h264_err_t ret = esp_h264_enc_open(h264_encoder);
+    if (ret != ESP_H264_ERR_OK) {
+        ESP_LOGE(TAG, "Failed to reopen the H.264 encoder: %d", ret);
+    }
+}
+
+/**
+ * @brief Packetize an encoded frame (RFC 6184 style)
+ *
+ * NAL units that fit a datagram are sent whole, larger ones as FU-A fragments
+ * that carry the NAL type, so no start codes go over the air and the receiver
+ * rebuilds the byte stream from the payloads alone.
+ */
+static esp_err_t VIDEO_IRAM_ATTR _video_send_h264(video_frame_tx_t *tx, const uint8_t *buf, uint32_t len)
+{
+    const uint8_t *nal;
+    uint32_t nal_len;
+    uint32_t pos = 0;
+
+    // Count the datagrams first, every header carries the total
+    uint32_t total_packets = 0;
+    while (_h264_next_nal(buf, len, &pos, &nal, &nal_len)) {
+        total_packets += _h264_nal_packets(nal_len);
+    }
+    if (total_packets == 0 || total_packets > UINT16_MAX) {
+        ESP_LOGW(TAG, "Encoded frame %" PRIu32 " has no NAL units to send", tx->frame_id);
+        return ESP_FAIL;
+    }
+    tx->total_packets = (uint16_t)total_packets;
+
+    pos = 0;
+    while (_h264_next_nal(buf, len, &pos, &nal, &nal_len)) {
+        if (nal_len <= MAX_VIDEO_DATA_SIZE) {
+            struct iovec payload = { .iov_base = (void *)nal, .iov_len = nal_len };
+            if (_video_send_packet(tx, &payload, 1) != ESP_OK) {
+                return ESP_FAIL;
+            }
+            continue;
+        }
+
+        // The FU indicator keeps the F and NRI bits of the NAL header, the FU header its type
+        uint8_t fu[H264_FU_HEADER_LEN];
+        fu[0] = (nal[0] & 0xE0) | H264_NAL_TYPE_FU_A;
+        for (uint32_t offset = 1; offset < nal_len; ) {
+            uint32_t chunk = nal_len - offset;
+            if (chunk > MAX_VIDEO_DATA_SIZE - H264_FU_HEADER_LEN) {
+                chunk = MAX_VIDEO_DATA_SIZE - H264_FU_HEADER_LEN;
+            }
+            fu[1] = (nal[0] & 0x1F);
+            if (offset == 1) {
+                fu[1] |= 0x80;  // Start bit
+            }
+            if (offset + chunk == nal_len) {
+                fu[1] |= 0x40;  // End bit
+            }
+            struct iovec payload[2] = {
+                { .iov_base = fu, .iov_len = H264_FU_HEADER_LEN },
+                { .iov_base = (void *)(nal + offset), .iov_len = chunk },
+            };
+            if (_video_send_packet(tx, payload, 2) != ESP_OK) {
+                return ESP_FAIL;
+            }
+            offset += chunk;
+        }
+    }
+    return ESP_OK;
+}
+#endif
+
+esp_err_t video_manager_request_keyframe(void)
+{
+    if (video_info_mutex == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    TIMED_MUTEX_TAKE(video_info_mutex);
+        if (!video_info.is_streaming) {
+            TIMED_MUTEX_GIVE(video_info_mutex);
+            return ESP_ERR_INVALID_STATE;
+        }
+#if CONFIG_VIDEO_CODEC_H264
+        video_info.keyframe_requested = true;
+#elif CONFIG_VIDEO_SLICE_UPDATES
+        video_info.refresh_requested = true;
+#endif
+    TIMED_MUTEX_GIVE(video_info_mutex);
+    return ESP_OK;
+}
+
+#if CONFIG_VIDEO_RETRANSMIT
+esp_err_t video_manager_retransmit(uint32_t frame_id, uint32_t packet_seq)
+{
+    if (video_info_mutex == NULL || retransmit_buf == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    TIMED_MUTEX_TAKE(video_info_mutex);
+        bool streaming = video_info.is_streaming;
+        int udp_socket = video_info.udp_socket;
+        struct sockaddr_in dest_addr = video_info.dest_addr;
+    TIMED_MUTEX_GIVE(video_info_mutex);
+    // A resend into a congested link only adds to the loss
+    if (!streaming || congestion_monitor_level() >= CONGESTION_LEVEL_HIGH) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    TIMED_MUTEX_TAKE(retransmit_mutex);
+        for (uint32_t i = 0; i < CONFIG_VIDEO_RETRANSMIT_PACKETS; i++) {
+            const video_retransmit_slot_t *slot = &retransmit_slots[i];
+            if (slot->len == 0 || (slot->frame_id & RETRANSMIT_ID_MASK) != frame_id ||
+                (slot->packet_seq & RETRANSMIT_ID_MASK) != packet_seq) {
+                continue;
+            }
+            int64_t send_start_us = esp_timer_get_time();
+            int sent = sendto(udp_socket, retransmit_buf + i * MAX_VIDEO_PACKET_SIZE, slot->len, 0,
+                              (struct sockaddr *)&dest_addr, sizeof(dest_addr));
+            congestion_monitor_record_send(send_start_us, sent, errno);
+            if (sent < 0) {
+                ret = ESP_FAIL;
+            } else {
+                retransmit_count++;
+                ret = ESP_OK;
+            }
+            break;
+        }
+    TIMED_MUTEX_GIVE(retransmit_mutex);
+    return ret;
+}
+#endif
+
+#if CONFIG_DOORBELL_THUMBNAIL
+#if CONFIG_DOORBELL_THUMBNAIL_SCALE_2
+#define THUMBNAIL_SCALE 2
+#define THUMBNAIL_JPG_SCALE JPG_SCALE_2X
+#elif CONFIG_DOORBELL_THUMBNAIL_SCALE_8
+#define THUMBNAIL_SCALE 8
+#define THUMBNAIL_JPG_SCALE JPG_SCALE_8X
+#else
+#define THUMBNAIL_SCALE 4
+#define THUMBNAIL_JPG_SCALE JPG_SCALE_4X
+#endif
+#define THUMBNAIL_CAPTURE_TRIES 5      // The stream may hold the frame buffers for a moment
+#define THUMBNAIL_CAPTURE_RETRY_MS 20
+
+/**
+ * @brief Box filter a YUYV frame down by THUMBNAIL_SCALE, keeping YUYV
+ * @param src Frame of width x height pixels
+ * @param dst Buffer for (width / THUMBNAIL_SCALE) x (height / THUMBNAIL_SCALE) pixels
+ */
+static void _thumbnail_downscale_yuyv(const uint8_t *src, uint32_t width, uint32_t height, uint8_t *dst)
+{
+    const uint32_t scale = THUMBNAIL_SCALE;
+    const uint32_t area = scale * scale;
+    uint32_t out_width = width / scale;
+    uint32_t out_height = height / scale;
+
+    for (uint32_t oy = 0; oy < out_height; oy++) {
+        // Two output pixels share their chroma, like the source pairs
+        for (uint32_t ox = 0; ox + 1 < out_width; ox += 2) {
+            uint32_t y_sum[2] = {0, 0};
+            uint32_t u_sum = 0, v_sum = 0;
+            for (uint32_t sy = oy * scale; sy < (oy + 1) * scale; sy++) {
+                const uint8_t *row = src + (sy * width + ox * scale) * 2;
+                for (uint32_t sx = 0; sx < 2 * scale; sx += 2) {
+                    // One source pair: Y0 U Y1 V
+                    y_sum[sx / scale] += row[sx * 2] + row[sx * 2 + 2];
+                    u_sum += row[sx * 2 + 1];
+                    v_sum += row[sx * 2 + 3];
+                }
+            }
+            dst[0] = y_sum[0] / area;
+            dst[1] = u_sum / area;
+            dst[2] = y_sum[1] / area;
+            dst[3] = v_sum / area;
+            dst += 4;
+        }
+    }
+}
+
+esp_err_t video_manager_capture_thumbnail(uint8_t **jpeg, size_t *len)
+{
+    camera_fb_t *fb = NULL;
+    for (int i = 0; i < THUMBNAIL_CAPTURE_TRIES && fb == NULL; i++) {
+        if (i > 0) {
+            vTaskDelay(pdMS_TO_TICKS(THUMBNAIL_CAPTURE_RETRY_MS));
+        }
+        fb = CAMERA_FB_GET();
+    }
+    if (fb == NULL) {
+        ESP_LOGW(TAG, "Thumbnail capture failed");
+        return ESP_FAIL;
+    }
+
+    uint16_t width = fb->width / THUMBNAIL_SCALE;
+    uint16_t height = fb->height / THUMBNAIL_SCALE;
+    pixformat_t format = (fb->format == PIXFORMAT_JPEG) ? PIXFORMAT_RGB565 : PIXFORMAT_YUV422;
+    size_t small_len = (size_t)width * height * 2;  // Both formats take 2 bytes per pixel
+    uint8_t *small = heap_caps_malloc_prefer(small_len, 2, MALLOC_CAP_SPIRAM, MALLOC_CAP_DEFAULT);
+    if (small == NULL) {
+        CAMERA_FB_RETURN(fb);
+        ESP_LOGW(TAG, "No memory for a %ux%u thumbnail", width, height);
+        return ESP_FAIL;
+    }
+
+    // JPEG frames decode at the reduced size: the decoder drops the
+    // coefficients it does not need instead of scaling the full picture
+    bool scaled = true;
+    if (fb->format == PIXFORMAT_JPEG) {
+        scaled = jpg2rgb565(fb->buf, fb->len, small, THUMBNAIL_JPG_SCALE);
+    } else {
+        _thumbnail_downscale_yuyv(fb->buf, fb->width, fb->height, small);
+    }
+    CAMERA_FB_RETURN(fb);
+
+    bool encoded = scaled && fmt2jpg(small, small_len, width, height, format,
+                                     CONFIG_DOORBELL_THUMBNAIL_QUALITY, jpeg, len);
+    heap_caps_free(small);
+    if (!encoded) {
+        ESP_LOGW(TAG, "Thumbnail encoding failed");
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Thumbnail %ux%u, %u bytes", width, height, (unsigned)*len);
+    return ESP_OK;
+}
+#endif
+
 static esp_err_t _video_manager_send_frame(void)
 {
     // Check streaming state (thread-safe)
-    xSemaphoreTake(video_info_mutex, portMAX_DELAY);
+    TIMED_MUTEX_TAKE(video_info_mutex);
     
         if (!video_info.is_streaming) {
-            xSemaphoreGive(video_info_mutex);
+            TIMED_MUTEX_GIVE(video_info_mutex);
             return ESP_ERR_INVALID_STATE;
         }
         
+        // Back off before the stack runs out of buffers: skip the frame when
+        // severely congested, otherwise adapt the quality of the next ones
+        uint8_t congestion = congestion_monitor_level();
+#if !CONFIG_VIDEO_CODEC_H264
+        int new_quality = _video_adapt_quality(congestion);
+#endif
+        if (congestion >= CONGESTION_LEVEL_SEVERE) {
+            video_info.skipped_frames++;
+            TIMED_MUTEX_GIVE(video_info_mutex);
+#if !CONFIG_VIDEO_CODEC_H264
+            if (new_quality >= 0) {
+                _video_set_jpeg_quality(new_quality);
+            }
+#endif
+            ESP_LOGD(TAG, "Frame skipped, congestion level %d", congestion);
+            return ESP_OK;
+        }
+
+#if CONFIG_VIDEO_CODEC_H264
+        // Requests right after an IDR frame are served by that frame's successor at the earliest
+        int64_t now_us = esp_timer_get_time();
+        bool keyframe = video_info.keyframe_requested &&
+                        (video_info.keyframes == 0 ||
+                         now_us - video_info.last_keyframe_us >= VIDEO_KEYFRAME_MIN_INTERVAL_MS * 1000LL);
+        if (keyframe) {
+            video_info.keyframe_requested = false;
+        }
+#elif CONFIG_VIDEO_SLICE_UPDATES
+        bool refresh = video_info.refresh_requested;
+        video_info.refresh_requested = false;
+#endif
+
         // Get next frame ID and increment (thread-safe)
-        uint32_t current_frame_id = video_info.frame_id++;
-        
-        // Copy socket info for use outside mutex
-        int udp_socket = video_info.udp_socket;
-        struct sockaddr_in dest_addr = video_info.dest_addr;
+        video_frame_tx_t tx = {
+            .packet_type = VIDEO_PACKAGE_TYPE,
+            .frame_id = video_info.frame_id++,
+            // Copy socket info for use outside mutex
+            .udp_socket = video_info.udp_socket,
+            .dest_addr = video_info.dest_addr,
+        };
     
-    xSemaphoreGive(video_info_mutex);
+    TIMED_MUTEX_GIVE(video_info_mutex);
+#if !CONFIG_VIDEO_CODEC_H264
+    // Outside the mutex, the SCCB write would hold up stop_streaming and the other takers
+    if (new_quality >= 0) {
+        _video_set_jpeg_quality(new_quality);
+    }
+#endif
 
     
+#if CONFIG_LATENCY_TRACE
+    int64_t trace_capture_start = _trace_now_us();
+#endif
+
     // Capture frame from camera
-    camera_fb_t * fb = esp_camera_fb_get();
+    camera_fb_t * fb = CAMERA_FB_GET();
+    if (fb == NULL) {
+        ESP_LOGW(TAG, "Frame capture failed (frame %" PRIu32 ")", tx.frame_id);
+        return ESP_FAIL;
+    }
+
+#if CONFIG_LATENCY_TRACE
+    int64_t trace_capture_end = _trace_now_us();
+#endif
 
-    // Calculate number of packets needed
-    uint32_t total_packets = (fb->len + MAX_VIDEO_DATA_SIZE - 1) / MAX_VIDEO_DATA_SIZE;
     struct timeval timestamp;
     gettimeofday(&timestamp, NULL); // Get current timestamp
-    int64_t time_ms = (int64_t)timestamp.tv_sec * 1000L + (int64_t)timestamp.tv_usec / 1000L;
-    uint16_t total_packets_16 = (uint16_t)total_packets; // Convert to 16-bit
-
-    // Send frame in packets using zero-copy transmission
-    for (uint32_t packet_seq = 0; packet_seq < total_packets; packet_seq++) {
-        uint32_t offset = packet_seq * MAX_VIDEO_DATA_SIZE;
-        uint32_t packet_data_size = (offset + MAX_VIDEO_DATA_SIZE > fb->len) ? 
-                                   (fb->len - offset) : MAX_VIDEO_DATA_SIZE;
+    tx.time_ms = (int64_t)timestamp.tv_sec * 1000L + (int64_t)timestamp.tv_usec / 1000L;
 
-        // Build header in separate buffer (no large memcpy needed)
-        uint8_t header[VIDEO_STREAM_HEADER_LEN];
-        uint16_t packet_length = packet_data_size;
-        uint16_t packet_seq_16 = (uint16_t)packet_seq;
-        
-        // Build video packet header efficiently
-        header[VIDEO_HEADER_TYPE_OFFSET] = VIDEO_PACKAGE;
-        memcpy(&header[VIDEO_HEADER_FRAME_ID_OFFSET], &current_frame_id, VIDEO_HEADER_FRAME_ID_SIZE);
-        memcpy(&header[VIDEO_HEADER_TIMESTAMP_OFFSET], &time_ms, VIDEO_HEADER_TIMESTAMP_SIZE);
-        memcpy(&header[VIDEO_HEADER_LENGTH_OFFSET], &packet_length, VIDEO_HEADER_LENGTH_SIZE);
-        memcpy(&header[VIDEO_HEADER_PACKET_SEQ_OFFSET], &packet_seq_16, VIDEO_HEADER_PACKET_SEQ_SIZE);
-        memcpy(&header[VIDEO_HEADER_TOTAL_PACKETS_OFFSET], &total_packets_16, VIDEO_HEADER_TOTAL_PACKETS_SIZE);
-
-        // Use scatter-gather I/O to avoid copying video data
-        struct iovec iov[2];
-        iov[0].iov_base = header;
-        iov[0].iov_len = VIDEO_STREAM_HEADER_LEN;
-        iov[1].iov_base = fb->buf + offset;  // Direct from camera buffer - zero copy!
-        iov[1].iov_len = packet_data_size;
-
-        struct msghdr msg = {
-            .msg_name = &dest_addr,
-            .msg_namelen = sizeof(dest_addr),
-            .msg_iov = iov,
-            .msg_iovlen = 2,
-            .msg_control = NULL,
-            .msg_controllen = 0,
-            .msg_flags = 0
-        };
+#if CONFIG_VIDEO_CODEC_H264
+    if (keyframe) {
+        _video_h264_restart();
+    }
 
-        // Zero-copy transmission
-        int sent = sendmsg(udp_socket, &msg, 0);
+    // Encode, then give the raw frame back so the sensor refills it while the packets go out
+    esp_h264_enc_in_frame_t in_frame = {
+        .raw_data = { .buffer = fb->buf, .len = fb->len },
+    };
+    esp_h264_enc_out_frame_t out_frame = {
+        .raw_data = { .buffer = h264_out_buf, .len = h264_out_buf_len },
+    };
+    esp_h264_err_t enc_ret = esp_h264_enc_process(h264_encoder, &in_frame, &out_frame);
+    CAMERA_FB_RETURN(fb);
+    if (enc_ret != ESP_H264_ERR_OK) {
+        ESP_LOGW(TAG, "H.264 encoding failed (frame %" PRIu32 "): %d", tx.frame_id, enc_ret);
+        video_manager_request_keyframe();
+        return ESP_FAIL;
+    }
+    if (out_frame.frame_type == ESP_H264_FRAME_TYPE_IDR) {
+        TIMED_MUTEX_TAKE(video_info_mutex);
+            video_info.keyframes++;
+            video_info.last_keyframe_us = esp_timer_get_time();
+        TIMED_MUTEX_GIVE(video_info_mutex);
+    }
 
-        
-        if (sent < 0) {
-            if (errno == ENOMEM) {
-                vTaskDelay(pdMS_TO_TICKS(50)); // Back off briefly on memory error
-            }
-            ESP_LOGD(TAG, "Failed to send video packet %" PRIu32 "/%" PRIu32 " (frame %" PRIu32 ") errno: %s",
-                      packet_seq + 1, total_packets, current_frame_id, strerror(errno));
-            esp_camera_fb_return(fb);
-            return ESP_FAIL;
-        }
-        // Yield to allow network tasks to handle the packages,
-        // to minimize ENOMEM errors when sending
-        vTaskDelay(pdMS_TO_TICKS(10));
+#if CONFIG_LATENCY_TRACE
+    size_t trace_frame_len = out_frame.length;
+#endif
+    esp_err_t ret = _video_send_h264(&tx, h264_out_buf, out_frame.length);
+    if (ret != ESP_OK) {
+        // The rest of the frame is lost and the client's decoder with it, restart with an IDR frame
+        video_manager_request_keyframe();
+        return ESP_FAIL;
     }
+#else
+    const uint8_t *payload = fb->buf;
+    uint32_t payload_len = fb->len;
+#if CONFIG_VIDEO_SLICE_UPDATES
+    uint32_t update_len = _video_slice_update(tx.frame_id, fb->buf, fb->len, refresh);
+    if (update_len > 0) {
+        // The update is a copy, the sensor can refill its buffer while it goes out
+        CAMERA_FB_RETURN(fb);
+        fb = NULL;
+        payload = slice_buf;
+        payload_len = update_len;
+        tx.packet_type = VIDEO_PACKAGE | (VIDEO_CODEC_MJPEG_SLICES << VIDEO_CODEC_SHIFT);
+    }
+#endif
+    esp_err_t ret = _video_send_fragments(&tx, payload, payload_len);
+
+#if CONFIG_LATENCY_TRACE
+    size_t trace_frame_len = payload_len;
+#endif
 
     // Return the frame buffer back to the driver for reuse
-    esp_camera_fb_return(fb);
+    if (fb != NULL) {
+        CAMERA_FB_RETURN(fb);
+    }
+    if (ret != ESP_OK) {
+#if CONFIG_VIDEO_SLICE_UPDATES
+        // The client misses this frame, the next one goes out whole
+        slice_state.valid = false;
+#endif
+        return ESP_FAIL;
+    }
+#endif
+
+#if CONFIG_LATENCY_TRACE
+    // Logged after the frame buffer is returned, so the UART time does not hold it
+    ESP_LOGI(LATENCY_TAG, "frame=%" PRIu32 " ts=%" PRId64 " cap_start=%" PRId64 " cap_end=%" PRId64
+             " send_start=%" PRId64 " send_end=%" PRId64 " len=%u",
+             tx.frame_id, tx.time_ms, trace_capture_start, trace_capture_end,
+             tx.trace_send_start, tx.trace_send_end, (unsigned)trace_frame_len);
+#endif
     return ESP_OK;
 }
 
 void video_manager_cleanup(void)
 {
     video_manager_stop_streaming();
+
+#if CONFIG_VIDEO_CODEC_H264
+    _video_h264_deinit();
+#endif
+#if CONFIG_VIDEO_SLICE_UPDATES
+    heap_caps_free(slice_buf);
+    slice_buf = NULL;
+    slice_buf_len = 0;
+    heap_caps_free(slice_state.dc_ref);
+    slice_state.dc_ref = NULL;
+    slice_state.dc_cur = NULL;
+    slice_state.dc_len = 0;
+#endif
+#if CONFIG_VIDEO_RETRANSMIT
+    heap_caps_free(retransmit_buf);
+    retransmit_buf = NULL;
+    if (retransmit_mutex != NULL) {
+        timed_mutex_delete(retransmit_mutex);
+        retransmit_mutex = NULL;
+    }
+#endif
     
     // Deinitialize camera
-    esp_camera_deinit();
+    CAMERA_DEINIT();
     
     // Clean up mutex
     if (video_info_mutex != NULL) {
-        vSemaphoreDelete(video_info_mutex);
+        timed_mutex_delete(video_info_mutex);
         video_info_mutex = NULL;
     }
     
@@ -4,6 +4,7 @@
 #include "esp_err.h"
 #include "esp_camera.h"
 #include "lwip/sockets.h"
+#include "sdkconfig.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -19,10 +20,24 @@ extern "C" {
 // Total header length is 19 Bytes (1 + 4 + 8 + 2 + 2 + 2)
 #define VIDEO_STREAM_HEADER_LEN 19
 
+// Video codecs, in the upper nibble of the package type byte
+#define VIDEO_CODEC_MJPEG 0  // Fragments of a JPEG frame
+#define VIDEO_CODEC_H264  1  // H.264 NAL units, FU-A fragmented (RFC 6184)
+#define VIDEO_CODEC_MJPEG_SLICES 2  // Changed restart intervals of a JPEG frame
+#define VIDEO_CODEC_SHIFT 4
+
 // Video streaming configuration
 #define VIDEO_UDP_PORT 12346
 #define MAX_FRAME_SIZE 32768  
+#if CONFIG_VIDEO_CODEC_H264
+#if CONFIG_VIDEO_H264_VGA
+#define VIDEO_QUALITY FRAMESIZE_VGA  // 640x480
+#else
+#define VIDEO_QUALITY FRAMESIZE_QVGA // 320x240, what the software encoder sustains at 15 fps
+#endif
+#else
 #define VIDEO_QUALITY FRAMESIZE_VGA  // 640x480
+#endif
 #define JPEG_QUALITY 40  // JPEG quality (0-63, lower is higher quality)
 
 #define MAX_VIDEO_PACKET_SIZE 1400  // MTU-safe packet size
@@ -48,6 +63,44 @@ esp_err_t video_manager_start_streaming(in_addr_t client_ip);
  */
 esp_err_t video_manager_stop_streaming(void);
 
+/**
+ * @brief Ask for a keyframe, after the client lost part of the stream
+ *
+ * With H.264 the next frame is encoded as an IDR frame, requests are
+ * coalesced to at most one keyframe per VIDEO_KEYFRAME_MIN_INTERVAL_MS.
+ * With CONFIG_VIDEO_SLICE_UPDATES the next JPEG frame is sent whole. Other
+ * MJPEG frames are all keyframes, the request is ignored.
+ * @return ESP_OK on success, ESP_ERR_INVALID_STATE when not streaming
+ */
+esp_err_t video_manager_request_keyframe(void);
+
+#if CONFIG_VIDEO_RETRANSMIT
+/**
+ * @brief Send a video datagram again, after the client reported it lost (NACK)
+ *
+ * Only the last CONFIG_VIDEO_RETRANSMIT_PACKETS datagrams are kept, older
+ * ones and requests while the link is congested are ignored.
+ * @param frame_id   Low 12 bits of the frame id
+ * @param packet_seq Low 12 bits of the packet sequence
+ * @return ESP_OK when resent, ESP_ERR_NOT_FOUND when no longer kept,
+ *         ESP_ERR_INVALID_STATE when not streaming or congested
+ */
+esp_err_t video_manager_retransmit(uint32_t frame_id, uint32_t packet_seq);
+#endif
+
+#if CONFIG_DOORBELL_THUMBNAIL
+/**
+ * @brief Capture a frame and encode a scaled down JPEG of it
+ *
+ * Takes one frame from the sensor, also while streaming, so call it from a
+ * task that may wait for the capture.
+ * @param jpeg Set to the JPEG, free it with free()
+ * @param len Set to the length of the JPEG
+ * @return ESP_OK on success, ESP_FAIL if capture or encoding failed
+ */
+esp_err_t video_manager_capture_thumbnail(uint8_t **jpeg, size_t *len);
+#endif
+
 /**
  * @brief Cleanup video manager resources
  */
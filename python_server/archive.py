@@ -0,0 +1,1345 @@
+#!/usr/bin/env python3
+"""
+Video archive with a per-frame activity index
+
+The recorder stores the JPEG frames of every device in segment files and writes
+a fixed-size index record per frame holding its timestamp, position and an
+activity score. The score is computed while recording from the JPEG size delta
+and from the difference of a 1/8 scale decode (libjpeg only evaluates the DC and
+low-frequency DCT coefficients for it). A per-day summary keeps the highest
+score of every second, so the playback server can find the next activity or
+draw the activity histogram of a day without decoding anything. Timeline
+thumbnails are built as segments close and kept as one sprite file per day.
+"""
+import argparse
+import bisect
+import collections
+import datetime
+import hashlib
+import json
+import multiprocessing
+import os
+import random
+import socket
+import struct
+import sys
+import tempfile
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+import cv2
+import numpy as np
+
+SEGMENT_SUFFIX = '.seg'
+INDEX_SUFFIX = '.idx'
+SUMMARY_NAME = 'activity.bin'
+DEFAULT_SEGMENT_S = 60
+SECONDS_PER_DAY = 86400
+
+# Index record: timestamp_ms u64, offset u32, length u32, activity f32, flags u16, reserved u16
+INDEX_RECORD = struct.Struct('<QIIfHH')
+INDEX_DTYPE = np.dtype([('timestamp', '<u8'), ('offset', '<u4'), ('length', '<u4'),
+                        ('activity', '<f4'), ('flags', '<u2'), ('reserved', '<u2')])
+FLAG_DECODED = 0x0001       # Score from the reduced decode, not carried over from the size gate
+
+# Summary: one byte per second of the day, 0 = nothing recorded,
+# otherwise 1 + ceil(max activity * 254)
+SUMMARY_LEVELS = 254
+
+# Sprites: header (magic, tile width, tile height, interval_s, columns, reserved), then
+# per hour the offset and length of its JPEG sheet (0 = none), then per hour a bit per tile
+SPRITES_NAME = 'sprites.bin'
+SPRITES_MAGIC = b'SPR1'
+SPRITES_HEADER = struct.Struct('<4sHHHHI')
+SPRITES_HOUR = struct.Struct('<II')
+HOURS_PER_DAY = 24
+DEFAULT_THUMB_INTERVAL_S = 10
+DEFAULT_THUMB_WIDTH = 128
+DEFAULT_SPRITE_COLUMNS = 30
+DEFAULT_SPRITE_QUALITY = 70
+# Reduced decodes of libjpeg, largest reduction first
+REDUCED_DECODES = ((8, cv2.IMREAD_REDUCED_COLOR_8), (4, cv2.IMREAD_REDUCED_COLOR_4),
+                   (2, cv2.IMREAD_REDUCED_COLOR_2), (1, cv2.IMREAD_COLOR))
+
+DEFAULT_PIXEL_THRESHOLD = 16
+DEFAULT_SIZE_GATE = 0.005
+DEFAULT_FORCE_DECODE = 15
+DEFAULT_ACTIVITY_THRESHOLD = 0.02
+
+
+def day_of(timestamp_ms):
+    """UTC day (YYYY-MM-DD) of a timestamp in ms since EPOCH"""
+    return datetime.datetime.fromtimestamp(timestamp_ms / 1000, datetime.timezone.utc).strftime('%Y-%m-%d')
+
+
+def day_start_ms(day):
+    start = datetime.datetime.strptime(day, '%Y-%m-%d').replace(tzinfo=datetime.timezone.utc)
+    return int(start.timestamp()) * 1000
+
+
+def segment_name(start_ms, generation=0):
+    """Segment file name without suffix; rewritten segments get a higher generation"""
+    return f"{start_ms:013d}" if generation == 0 else f"{start_ms:013d}.{generation}"
+
+
+def parse_segment_name(name):
+    start, _, generation = name.partition('.')
+    return int(start), int(generation or 0)
+
+
+def quantize_activity(score):
+    """Summary level of a score; never lower than the level of a smaller score"""
+    return 1 + min(SUMMARY_LEVELS, int(np.ceil(max(0.0, score) * SUMMARY_LEVELS)))
+
+
+class ActivityScorer:
+    """Per-frame activity score in [0, 1]
+
+    The score is the fraction of pixels of a 1/8 scale grayscale decode that
+    changed by more than `pixel_threshold` since the previous decoded frame.
+    Frames whose size differs by less than `size_gate` from the last decoded
+    frame are not decoded and inherit its score, but at least every
+    `force_decode`-th frame is decoded to catch changes that keep the size.
+    """
+
+    def __init__(self, pixel_threshold=DEFAULT_PIXEL_THRESHOLD, size_gate=DEFAULT_SIZE_GATE,
+                 force_decode=DEFAULT_FORCE_DECODE):
+        self.pixel_threshold = pixel_threshold
+        self.size_gate = size_gate
+        self.force_decode = force_decode
+        self.reference = None
+        self.reference_size = 0
+        self.last_score = 0.0
+        self.since_decode = 0
+        self.frames = 0
+        self.decoded = 0
+
+    def score(self, jpeg):
+        """Return (score, flags) for the next frame of the stream"""
+        self.frames += 1
+        size = len(jpeg)
+        if self.reference is not None and self.since_decode + 1 < self.force_decode:
+            delta = abs(size - self.reference_size) / max(1, self.reference_size)
+            if delta < self.size_gate:
+                self.since_decode += 1
+                return self.last_score, 0
+
+        image = cv2.imdecode(np.frombuffer(jpeg, np.uint8), cv2.IMREAD_REDUCED_GRAYSCALE_8)
+        if image is None:
+            # Corrupted frame, keep the previous state
+            return self.last_score, 0
+        self.decoded += 1
+        self.since_decode = 0
+        if self.reference is None or self.reference.shape != image.shape:
+            score = 0.0
+        else:
+            changed = cv2.absdiff(image, self.reference) > self.pixel_threshold
+            score = float(np.count_nonzero(changed)) / changed.size
+        self.reference = image
+        self.reference_size = size
+        self.last_score = score
+        return score, FLAG_DECODED
+
+
+class DaySummary:
+    """Writable per-second activity summary of one device and day"""
+
+    def __init__(self, day_dir, day):
+        self.path = os.path.join(day_dir, SUMMARY_NAME)
+        self.start_ms = day_start_ms(day)
+        if os.path.exists(self.path):
+            self.levels = np.fromfile(self.path, np.uint8)
+            if len(self.levels) != SECONDS_PER_DAY:
+                self.levels = np.zeros(SECONDS_PER_DAY, np.uint8)
+        else:
+            self.levels = np.zeros(SECONDS_PER_DAY, np.uint8)
+        self.dirty = False
+
+    def update(self, timestamp_ms, score):
+        second = (timestamp_ms - self.start_ms) // 1000
+        level = quantize_activity(score)
+        if level > self.levels[second]:
+            self.levels[second] = level
+            self.dirty = True
+
+    def flush(self):
+        if not self.dirty:
+            return
+        tmp = self.path + '.tmp'
+        self.levels.tofile(tmp)
+        os.replace(tmp, self.path)
+        self.dirty = False
+
+
+def jpeg_dimensions(jpeg):
+    """(width, height) from the SOF segment of a JPEG, None if there is none"""
+    i = 2
+    while i + 9 <= len(jpeg):
+        if jpeg[i] != 0xFF:
+            return None
+        marker = jpeg[i + 1]
+        if marker == 0xFF:
+            i += 1  # Fill byte
+            continue
+        if 0xC0 <= marker <= 0xCF and marker not in (0xC4, 0xC8, 0xCC):
+            height, width = struct.unpack_from('>HH', jpeg, i + 5)
+            return width, height
+        i += 2 + struct.unpack_from('>H', jpeg, i + 2)[0]
+    return None
+
+
+def decode_thumbnail(jpeg, width, height, scaled=True):
+    """Decode a JPEG to a width x height BGR thumbnail
+
+    With `scaled` libjpeg decodes at the largest reduction (1/2, 1/4, 1/8)
+    that is still at least the thumbnail size: the scaling happens in the IDCT,
+    which only evaluates the low-frequency coefficients, and the full image
+    is never built. An area resize takes it to the exact size.
+    """
+    flag = cv2.IMREAD_COLOR
+    size = jpeg_dimensions(jpeg) if scaled else None
+    if size is not None:
+        for factor, reduced in REDUCED_DECODES:
+            if size[0] // factor >= width and size[1] // factor >= height:
+                flag = reduced
+                break
+    image = cv2.imdecode(np.frombuffer(jpeg, np.uint8), flag)
+    if image is None:
+        return None
+    if image.shape[1] != width or image.shape[0] != height:
+        image = cv2.resize(image, (width, height), interpolation=cv2.INTER_AREA)
+    return image
+
+
+def parse_sprites(data):
+    """Geometry, hour sheets and tile bitmaps of a sprites.bin file
+
+    Returns a dict, `hours` holds per hour of the day a (JPEG sheet or None,
+    bool array of the tiles holding a frame) pair. None if the data is not a
+    sprite file.
+    """
+    if len(data) < SPRITES_HEADER.size:
+        return None
+    magic, tile_width, tile_height, interval_s, columns, _ = SPRITES_HEADER.unpack_from(data)
+    if magic != SPRITES_MAGIC or not interval_s or not columns:
+        return None
+    tiles = 3600 // interval_s
+    bitmap_len = (tiles + 7) // 8
+    table = SPRITES_HEADER.size
+    bitmaps = table + HOURS_PER_DAY * SPRITES_HOUR.size
+    if len(data) < bitmaps + HOURS_PER_DAY * bitmap_len:
+        return None
+    view = memoryview(data)
+    hours = []
+    for hour in range(HOURS_PER_DAY):
+        offset, length = SPRITES_HOUR.unpack_from(data, table + hour * SPRITES_HOUR.size)
+        bits = np.frombuffer(data, np.uint8, bitmap_len, bitmaps + hour * bitmap_len)
+        present = np.unpackbits(bits, bitorder='little')[:tiles].astype(bool)
+        sheet = view[offset:offset + length] if length and offset + length <= len(data) else None
+        hours.append((sheet, present))
+    return {'tile_width': tile_width, 'tile_height': tile_height, 'interval_s': interval_s,
+            'columns': columns, 'tiles_per_hour': tiles, 'hours': hours}
+
+
+class SpriteDay:
+    """Sprite sheets of one device and day while they are built
+
+    The sheet of the hour being filled is kept as pixels and encoded from
+    them on every write, so its tiles go through the JPEG encoder once. An
+    hour that is not in memory (after a restart) is decoded from its sheet.
+    """
+
+    def __init__(self, path, interval_s, tile_width, columns, quality):
+        self.path = path
+        self.interval_s = interval_s
+        self.tile_width = tile_width
+        self.tile_height = None
+        self.columns = columns
+        self.quality = quality
+        self.sheets = [None] * HOURS_PER_DAY
+        self.canvas_hour = None
+        self.canvas = None
+        self.dirty = set()
+        try:
+            with open(path, 'rb') as f:
+                parsed = parse_sprites(f.read())
+        except FileNotFoundError:
+            parsed = None
+        if parsed is not None:
+            # The geometry of a day does not change, new settings apply from the next day
+            self.interval_s = parsed['interval_s']
+            self.tile_width = parsed['tile_width']
+            self.tile_height = parsed['tile_height']
+            self.columns = parsed['columns']
+        self.tiles_per_hour = 3600 // self.interval_s
+        self.rows = (self.tiles_per_hour + self.columns - 1) // self.columns
+        self.present = np.zeros((HOURS_PER_DAY, self.tiles_per_hour), bool)
+        if parsed is not None:
+            for hour, (sheet, present) in enumerate(parsed['hours']):
+                self.sheets[hour] = bytes(sheet) if sheet is not None else None
+                self.present[hour] = present
+
+    def has_tile(self, slot):
+        return bool(self.present.flat[slot])
+
+    def place(self, slot, image):
+        hour, index = divmod(slot, self.tiles_per_hour)
+        if hour != self.canvas_hour:
+            self._open_canvas(hour)
+        row, column = divmod(index, self.columns)
+        w, h = self.tile_width, self.tile_height
+        self.canvas[row * h:(row + 1) * h, column * w:(column + 1) * w] = image
+        self.present[hour, index] = True
+        self.dirty.add(hour)
+
+    def _open_canvas(self, hour):
+        if self.canvas_hour in self.dirty:
+            self._encode(self.canvas_hour)
+        shape = (self.rows * self.tile_height, self.columns * self.tile_width, 3)
+        canvas = None
+        if self.sheets[hour] is not None:
+            canvas = cv2.imdecode(np.frombuffer(self.sheets[hour], np.uint8), cv2.IMREAD_COLOR)
+        if canvas is None or canvas.shape != shape:
+            canvas = np.zeros(shape, np.uint8)
+        self.canvas_hour = hour
+        self.canvas = canvas
+
+    def _encode(self, hour):
+        ok, jpeg = cv2.imencode('.jpg', self.canvas, [cv2.IMWRITE_JPEG_QUALITY, self.quality])
+        if ok:
+            self.sheets[hour] = jpeg.tobytes()
+        self.dirty.discard(hour)
+
+    def write(self):
+        """Encode the changed hour and replace the day file"""
+        if not self.dirty:
+            return 0
+        self._encode(self.canvas_hour)
+        table = bytearray()
+        offset = SPRITES_HEADER.size + HOURS_PER_DAY * (SPRITES_HOUR.size + (self.tiles_per_hour + 7) // 8)
+        for sheet in self.sheets:
+            length = len(sheet) if sheet is not None else 0
+            table += SPRITES_HOUR.pack(offset if length else 0, length)
+            offset += length
+        bitmaps = np.packbits(self.present, axis=1, bitorder='little').tobytes()
+        tmp = self.path + '.tmp'
+        with open(tmp, 'wb') as f:
+            f.write(SPRITES_HEADER.pack(SPRITES_MAGIC, self.tile_width, self.tile_height, self.interval_s,
+                                        self.columns, 0))
+            f.write(table)
+            f.write(bitmaps)
+            for sheet in self.sheets:
+                if sheet is not None:
+                    f.write(sheet)
+        os.replace(tmp, self.path)
+        return offset
+
+
+class SpriteBuilder:
+    """Timeline thumbnails, one sprite file per device and day
+
+    Every `interval_s` of the day has a tile, the first frame recorded in it
+    decoded straight to `tile_width` (see decode_thumbnail). The tiles of an
+    hour form one JPEG sheet of `columns` tiles per row. The sheets of a day
+    and a bit per tile that holds a frame are stored in sprites.bin next to
+    the index, so a timeline opens with one file read.
+
+    Sheets are built as the recorder closes segments: one thread updates
+    them in segment order, a pool of `workers` threads decodes the frames
+    (OpenCV releases the GIL while decoding).
+    """
+
+    def __init__(self, root, interval_s=DEFAULT_THUMB_INTERVAL_S, tile_width=DEFAULT_THUMB_WIDTH,
+                 columns=DEFAULT_SPRITE_COLUMNS, quality=DEFAULT_SPRITE_QUALITY, workers=4, scaled=True):
+        if interval_s <= 0 or 3600 % interval_s:
+            raise ValueError("The thumbnail interval must divide an hour")
+        self.root = root
+        self.interval_s = interval_s
+        self.tile_width = tile_width
+        self.columns = columns
+        self.quality = quality
+        self.scaled = scaled
+        self.jobs = ThreadPoolExecutor(1, thread_name_prefix='sprites')
+        self.decoders = ThreadPoolExecutor(workers, thread_name_prefix='thumbnails')
+        self.days = {}
+        self.stats = collections.Counter()
+        self.segment_ms = []
+        self.decode_s = 0.0
+
+    def segment_closed(self, device, day, base):
+        """Queue the thumbnails of a closed segment, returns a Future"""
+        return self.jobs.submit(self._add_segment, device, day, base)
+
+    def rebuild_day(self, device, day, reader):
+        """Build the sprites of a recorded day from its segments"""
+        path = os.path.join(self.root, device, day, SPRITES_NAME)
+        if os.path.exists(path):
+            os.unlink(path)
+        self.days.pop(device, None)
+        futures = [self.segment_closed(device, day, base) for _, base in reader.segments(device, day)]
+        for future in futures:
+            future.result()
+
+    def close(self):
+        self.jobs.shutdown(wait=True)
+        self.decoders.shutdown(wait=True)
+
+    def _day(self, device, day):
+        # Only the newest day of a device is built, the ones before it are complete
+        current = self.days.get(device)
+        if current is None or current[0] != day:
+            path = os.path.join(self.root, device, day, SPRITES_NAME)
+            current = self.days[device] = (day, SpriteDay(path, self.interval_s, self.tile_width, self.columns,
+                                                          self.quality))
+        return current[1]
+
+    def _add_segment(self, device, day, base):
+        t0 = time.perf_counter()
+        try:
+            records = np.fromfile(base + INDEX_SUFFIX, INDEX_DTYPE)
+        except FileNotFoundError:
+            return  # Compacted meanwhile, its frames are in the next generation
+        if not len(records):
+            return
+        sprites = self._day(device, day)
+        slots = (records['timestamp'].astype(np.int64) - day_start_ms(day)) // (sprites.interval_s * 1000)
+        slots, first = np.unique(slots, return_index=True)
+        # A slot split across two segments keeps the frame of the first one
+        todo = [(int(slot), records[i]) for slot, i in zip(slots, first)
+                if 0 <= slot < HOURS_PER_DAY * sprites.tiles_per_hour and not sprites.has_tile(int(slot))]
+        if not todo:
+            return
+        with open(base + SEGMENT_SUFFIX, 'rb') as f:
+            frames = []
+            for _, record in todo:
+                f.seek(int(record['offset']))
+                frames.append(f.read(int(record['length'])))
+        if sprites.tile_height is None:
+            size = jpeg_dimensions(frames[0]) or (4, 3)
+            sprites.tile_height = max(2, round(sprites.tile_width * size[1] / size[0] / 2) * 2)
+        width, height = sprites.tile_width, sprites.tile_height
+        d0 = time.perf_counter()
+        images = list(self.decoders.map(lambda jpeg: decode_thumbnail(jpeg, width, height, self.scaled), frames))
+        self.decode_s += time.perf_counter() - d0
+        for (slot, _), image in zip(todo, images):
+            if image is None:
+                self.stats['failed'] += 1
+                continue
+            sprites.place(slot, image)
+            self.stats['thumbnails'] += 1
+        self.stats['bytes_written'] += sprites.write()
+        self.stats['segments'] += 1
+        self.segment_ms.append((time.perf_counter() - t0) * 1000)
+
+
+class ArchiveWriter:
+    """Append the frames of one device to the archive
+
+    Timestamps are clamped so that they never go backwards within a device,
+    which keeps every index sorted. With a SpriteBuilder, every closed
+    segment is handed to it for the timeline thumbnails.
+    """
+
+    def __init__(self, root, device, segment_s=DEFAULT_SEGMENT_S, scorer=None, sprites=None):
+        self.device = device
+        self.device_dir = os.path.join(root, device)
+        self.segment_ms = segment_s * 1000
+        self.scorer = scorer or ActivityScorer()
+        self.sprites = sprites
+        self.day = None
+        self.summary = None
+        self.segment_start = None
+        self.segment_base = None
+        self.seg_file = None
+        self.idx_file = None
+        self.last_ts = 0
+        self.last_summary_flush = 0.0
+        self.frames = 0
+        self.bytes = 0
+
+    def add_frame(self, timestamp_ms, jpeg):
+        timestamp_ms = max(timestamp_ms, self.last_ts)
+        self.last_ts = timestamp_ms
+        day = day_of(timestamp_ms)
+        if day != self.day or timestamp_ms - self.segment_start >= self.segment_ms:
+            self._rotate(day, timestamp_ms)
+
+        score, flags = self.scorer.score(jpeg)
+        offset = self.seg_file.tell()
+        self.seg_file.write(jpeg)
+        self.seg_file.flush()
+        # The index record is written after the data, a reader never sees a record without its frame
+        self.idx_file.write(INDEX_RECORD.pack(timestamp_ms, offset, len(jpeg), score, flags, 0))
+        self.idx_file.flush()
+        self.summary.update(timestamp_ms, score)
+        self.frames += 1
+        self.bytes += len(jpeg)
+
+        now = time.monotonic()
+        if now - self.last_summary_flush >= 1.0:
+            self.summary.flush()
+            self.last_summary_flush = now
+        return score
+
+    def _rotate(self, day, timestamp_ms):
+        self._close_segment()
+        if day != self.day:
+            if self.summary is not None:
+                self.summary.flush()
+            day_dir = os.path.join(self.device_dir, day)
+            os.makedirs(day_dir, exist_ok=True)
+            self.day = day
+            self.summary = DaySummary(day_dir, day)
+        base = os.path.join(self.device_dir, day, segment_name(timestamp_ms))
+        self.segment_start = timestamp_ms
+        self.segment_base = base
+        self.seg_file = open(base + SEGMENT_SUFFIX, 'ab')
+        self.idx_file = open(base + INDEX_SUFFIX, 'ab')
+
+    def _close_segment(self):
+        if self.seg_file is not None:
+            self.seg_file.close()
+            self.idx_file.close()
+            self.seg_file = self.idx_file = None
+            if self.sprites is not None:
+                self.sprites.segment_closed(self.device, self.day, self.segment_base)
+
+    def close(self):
+        self._close_segment()
+        if self.summary is not None:
+            self.summary.flush()
+
+
+class ArchiveReader:
+    """Queries on the archive, answered from the index and the day summaries
+
+    Index arrays are cached per segment; segments that are still being
+    written are reloaded when their index grew.
+    """
+
+    def __init__(self, root):
+        self.root = root
+        self.index_cache = {}
+
+    def devices(self):
+        if not os.path.isdir(self.root):
+            return []
+        return sorted(d for d in os.listdir(self.root) if os.path.isdir(os.path.join(self.root, d)))
+
+    def days(self, device):
+        device_dir = os.path.join(self.root, device)
+        if not os.path.isdir(device_dir):
+            return []
+        return sorted(d for d in os.listdir(device_dir) if os.path.isdir(os.path.join(device_dir, d)))
+
+    def segments(self, device, day):
+        """Sorted list of (start_ms, path without suffix) of a day, newest generation of each segment"""
+        day_dir = os.path.join(self.root, device, day)
+        newest = {}
+        for name in os.listdir(day_dir):
+            if name.endswith(INDEX_SUFFIX):
+                start, generation = parse_segment_name(name[:-len(INDEX_SUFFIX)])
+                if generation >= newest.get(start, (-1, None))[0]:
+                    newest[start] = (generation, os.path.join(day_dir, name[:-len(INDEX_SUFFIX)]))
+        return [(start, newest[start][1]) for start in sorted(newest)]
+
+    def summary(self, device, day):
+        path = os.path.join(self.root, device, day, SUMMARY_NAME)
+        try:
+            levels = np.fromfile(path, np.uint8)
+        except FileNotFoundError:
+            return None
+        return levels if len(levels) == SECONDS_PER_DAY else None
+
+    def sprites(self, device, day):
+        """Raw sprite file of a day, None if it has none"""
+        try:
+            with open(os.path.join(self.root, device, day, SPRITES_NAME), 'rb') as f:
+                return f.read()
+        except FileNotFoundError:
+            return None
+
+    def sprite_sheet(self, device, day, hour):
+        """(JPEG sheet, geometry dict) of one hour, None if it has no tile"""
+        data = self.sprites(device, day)
+        parsed = parse_sprites(data) if data is not None else None
+        if parsed is None or not 0 <= hour < HOURS_PER_DAY or parsed['hours'][hour][0] is None:
+            return None
+        sheet, present = parsed['hours'][hour]
+        geometry = {k: parsed[k] for k in ('tile_width', 'tile_height', 'interval_s', 'columns')}
+        geometry['present'] = np.packbits(present, bitorder='little').tobytes().hex()
+        return bytes(sheet), geometry
+
+    def index(self, base):
+        path = base + INDEX_SUFFIX
+        size = os.path.getsize(path)
+        cached = self.index_cache.get(base)
+        if cached is not None and cached[0] == size:
+            return cached[1]
+        count = size // INDEX_RECORD.size
+        records = np.fromfile(path, INDEX_DTYPE, count=count)
+        self.index_cache[base] = (size, records)
+        return records
+
+    def _segment_for(self, segments, timestamp_ms):
+        i = bisect.bisect_right([start for start, _ in segments], timestamp_ms) - 1
+        return max(0, i)
+
+    def _retry(self, query, *args):
+        # A segment rewritten by the compaction disappears between listing and reading it
+        try:
+            return query(*args)
+        except FileNotFoundError:
+            return query(*args)
+
+    def next_activity(self, device, after_ms, threshold=DEFAULT_ACTIVITY_THRESHOLD):
+        """First frame after `after_ms` with a score of at least `threshold`
+
+        Returns (timestamp_ms, score) or None.
+        """
+        return self._retry(self._next_activity, device, after_ms, threshold)
+
+    def _next_activity(self, device, after_ms, threshold):
+        min_level = quantize_activity(threshold)
+        first_day = day_of(after_ms)
+        for day in self.days(device):
+            if day < first_day:
+                continue
+            levels = self.summary(device, day)
+            if levels is None:
+                continue
+            start_ms = day_start_ms(day)
+            first_second = max(0, (after_ms - start_ms) // 1000) if day == first_day else 0
+            candidates = np.flatnonzero(levels[first_second:] >= min_level) + first_second
+            if len(candidates) == 0:
+                continue
+            segments = self.segments(device, day)
+            if not segments:
+                continue
+            for second in candidates:
+                # The summary is an upper bound per second, confirm it with the index
+                lo = max(after_ms + 1, start_ms + int(second) * 1000)
+                hi = start_ms + (int(second) + 1) * 1000
+                i = self._segment_for(segments, lo)
+                while i < len(segments) and segments[i][0] < hi:
+                    records = self.index(segments[i][1])
+                    a, b = np.searchsorted(records['timestamp'], [lo, hi])
+                    hits = np.flatnonzero(records['activity'][a:b] >= threshold)
+                    if len(hits):
+                        record = records[a + hits[0]]
+                        return int(record['timestamp']), float(record['activity'])
+                    i += 1
+        return None
+
+    def histogram(self, device, day, bucket_s=60, threshold=DEFAULT_ACTIVITY_THRESHOLD):
+        """Per-bucket maximum score, active seconds and recorded seconds of a day"""
+        levels = self.summary(device, day)
+        if levels is None:
+            return None
+        buckets = levels[:SECONDS_PER_DAY - SECONDS_PER_DAY % bucket_s].reshape(-1, bucket_s)
+        peak = buckets.max(axis=1).astype(np.int32)
+        return {
+            'day': day,
+            'bucket_s': bucket_s,
+            'max_activity': [round(max(0, p - 1) / SUMMARY_LEVELS, 4) for p in peak],
+            'active_s': np.count_nonzero(buckets >= quantize_activity(threshold), axis=1).tolist(),
+            'recorded_s': np.count_nonzero(buckets, axis=1).tolist(),
+        }
+
+    def frame_at(self, device, timestamp_ms):
+        """JPEG and timestamp of the last frame at or before `timestamp_ms`"""
+        return self._retry(self._frame_at, device, timestamp_ms)
+
+    def _frame_at(self, device, timestamp_ms):
+        day = day_of(timestamp_ms)
+        if day not in self.days(device):
+            return None
+        segments = self.segments(device, day)
+        i = self._segment_for(segments, timestamp_ms)
+        while i >= 0:
+            base = segments[i][1]
+            records = self.index(base)
+            j = np.searchsorted(records['timestamp'], timestamp_ms, side='right') - 1
+            if j >= 0:
+                record = records[j]
+                with open(base + SEGMENT_SUFFIX, 'rb') as f:
+                    f.seek(int(record['offset']))
+                    return int(record['timestamp']), f.read(int(record['length']))
+            i -= 1
+        return None
+
+
+class TokenBucket:
+    """Limit the I/O rate of the compaction to `rate` bytes per second"""
+
+    def __init__(self, rate, burst=None):
+        self.rate = rate
+        self.burst = burst or rate
+        self.tokens = self.burst
+        self.stamp = time.monotonic()
+        self.waited_s = 0.0
+
+    def consume(self, amount):
+        if self.rate <= 0:
+            return
+        now = time.monotonic()
+        self.tokens = min(self.burst, self.tokens + (now - self.stamp) * self.rate)
+        self.stamp = now
+        self.tokens -= amount
+        if self.tokens < 0:
+            # Pay the debt by sleeping, large reads are allowed to go negative
+            delay = -self.tokens / self.rate
+            time.sleep(delay)
+            self.waited_s += delay
+
+
+class _KeptFrame:
+    """Compaction state carried across the segments of a day"""
+
+    def __init__(self):
+        self.slot = None
+        self.digest = None
+        self.image = None
+        self.previous_active = False
+
+
+class Compactor:
+    """Rewrite the segments of old days at reduced frame rates
+
+    Seconds with activity (extended by `margin_s` on both sides) keep
+    `active_fps`, the rest `static_fps`. Of the frames selected that way, a
+    frame that is byte-identical to the last kept one (same BLAKE2b digest)
+    or differs from it in less than `dedup_diff` of the pixels of a 1/8 scale
+    decode is dropped as well. The first frame of every segment is kept.
+
+    Segments are written under the next generation name and the old files are
+    removed afterwards, so a reader always finds a complete segment. Only days
+    older than `after_days` are touched; the recorder never writes to them.
+    """
+
+    def __init__(self, root, after_days, static_fps=1.0, active_fps=5.0,
+                 threshold=DEFAULT_ACTIVITY_THRESHOLD, margin_s=2, dedup_diff=0.002,
+                 pixel_threshold=DEFAULT_PIXEL_THRESHOLD, io_limit=20 * 1024 * 1024):
+        self.reader = ArchiveReader(root)
+        self.after_days = after_days
+        self.static_interval_ms = 1000.0 / static_fps
+        self.active_interval_ms = 1000.0 / active_fps
+        self.threshold = threshold
+        self.margin_s = margin_s
+        self.dedup_diff = dedup_diff
+        self.pixel_threshold = pixel_threshold
+        self.bucket = TokenBucket(io_limit)
+        self.stats = collections.Counter()
+
+    def run(self, now_ms=None):
+        if now_ms is None:
+            now_ms = int(time.time() * 1000)
+        cutoff = now_ms - self.after_days * SECONDS_PER_DAY * 1000
+        for device in self.reader.devices():
+            for day in self.reader.days(device):
+                if day_start_ms(day) + SECONDS_PER_DAY * 1000 <= cutoff:
+                    self.compact_day(device, day)
+        return self.stats
+
+    def compact_day(self, device, day):
+        levels = self.reader.summary(device, day)
+        if levels is None:
+            return
+        active = levels >= quantize_activity(self.threshold)
+        if self.margin_s:
+            window = np.ones(2 * self.margin_s + 1)
+            active = np.convolve(active, window, mode='same') > 0
+        day_start = day_start_ms(day)
+        kept = _KeptFrame()
+        for start, base in self.reader.segments(device, day):
+            generation = parse_segment_name(os.path.basename(base))[1]
+            if generation > 0:
+                self.stats['segments_skipped'] += 1
+                continue
+            self._compact_segment(base, start, active, day_start, kept)
+
+    def _compact_segment(self, base, start, active, day_start, kept):
+        cpu0 = time.process_time()
+        records = self.reader.index(base)
+        seg_path = base + SEGMENT_SUFFIX
+        seg_size = os.path.getsize(seg_path)
+        self.bucket.consume(seg_size + records.nbytes)
+        with open(seg_path, 'rb') as f:
+            data = f.read()
+
+        selected = []
+        for record in records:
+            timestamp = int(record['timestamp'])
+            second = min(SECONDS_PER_DAY - 1, (timestamp - day_start) // 1000)
+            is_active = bool(active[second])
+            first = not selected
+            entering = is_active and not kept.previous_active
+            kept.previous_active = is_active
+            interval = self.active_interval_ms if is_active else self.static_interval_ms
+            if not first and not entering and kept.slot is not None and timestamp - kept.slot < interval:
+                self.stats['dropped_rate'] += 1
+                continue
+            # The frame takes the slot of the reduced rate even if it is then dropped as a duplicate
+            kept.slot = timestamp
+
+            frame = data[record['offset']:record['offset'] + record['length']]
+            digest = hashlib.blake2b(frame, digest_size=16).digest()
+            if not first and digest == kept.digest:
+                self.stats['dropped_identical'] += 1
+                continue
+            image = cv2.imdecode(np.frombuffer(frame, np.uint8), cv2.IMREAD_REDUCED_GRAYSCALE_8)
+            if (not first and image is not None and kept.image is not None
+                    and image.shape == kept.image.shape):
+                changed = cv2.absdiff(image, kept.image) > self.pixel_threshold
+                if np.count_nonzero(changed) < self.dedup_diff * changed.size:
+                    self.stats['dropped_similar'] += 1
+                    continue
+            selected.append((record, frame))
+            kept.digest = digest
+            if image is not None:
+                kept.image = image
+
+        new_base = os.path.join(os.path.dirname(base), segment_name(start, 1))
+        written = self._write_segment(new_base, selected)
+        self.bucket.consume(written)
+        # The new generation is complete before the old one disappears
+        os.unlink(base + INDEX_SUFFIX)
+        os.unlink(seg_path)
+
+        self.stats['segments'] += 1
+        self.stats['frames_in'] += len(records)
+        self.stats['frames_out'] += len(selected)
+        self.stats['bytes_in'] += seg_size + records.nbytes
+        self.stats['bytes_out'] += written
+        self.stats['cpu_s'] += time.process_time() - cpu0
+
+    @staticmethod
+    def _write_segment(new_base, selected):
+        index = bytearray()
+        offset = 0
+        seg_tmp = new_base + SEGMENT_SUFFIX + '.tmp'
+        idx_tmp = new_base + INDEX_SUFFIX + '.tmp'
+        with open(seg_tmp, 'wb') as seg:
+            for record, frame in selected:
+                seg.write(frame)
+                index += INDEX_RECORD.pack(int(record['timestamp']), offset, len(frame),
+                                           float(record['activity']), int(record['flags']), 0)
+                offset += len(frame)
+            seg.flush()
+            os.fsync(seg.fileno())
+        with open(idx_tmp, 'wb') as idx:
+            idx.write(index)
+            idx.flush()
+            os.fsync(idx.fileno())
+        # Data first: the index must never point into a missing segment
+        os.replace(seg_tmp, new_base + SEGMENT_SUFFIX)
+        os.replace(idx_tmp, new_base + INDEX_SUFFIX)
+        return offset + len(index)
+
+
+def _u32_to_ip(value):
+    return socket.inet_ntoa(struct.pack('<I', value))
+
+
+def run_record(args):
+    """Record the video frames published on the frame bus"""
+    from frame_bus import FrameBusReader, KIND_VIDEO_FRAME
+
+    reader = FrameBusReader(args.socket)
+    writers = {}
+    sprites = _sprite_builder(args)
+    print(f"Recording to {args.root}")
+    try:
+        while True:
+            record = reader.read(timeout=1.0)
+            if record is None or record.kind != KIND_VIDEO_FRAME:
+                if record is not None:
+                    reader.release(record)
+                continue
+            jpeg = bytes(record.payload)
+            if not reader.release(record):
+                continue  # Overwritten while copying
+            device = _u32_to_ip(record.source)
+            writer = writers.get(device)
+            if writer is None:
+                writer = writers[device] = ArchiveWriter(args.root, device, args.segment_s,
+                                                         ActivityScorer(args.pixel_threshold, args.size_gate),
+                                                         sprites)
+            writer.add_frame(record.media_ts or int(time.time() * 1000), jpeg)
+    except KeyboardInterrupt:
+        print("\nRecorder stopped")
+    finally:
+        for writer in writers.values():
+            writer.close()
+        if sprites is not None:
+            sprites.close()
+        reader.close()
+
+
+def _sprite_builder(args):
+    if args.no_sprites:
+        return None
+    return SpriteBuilder(args.root, args.thumb_interval_s, args.thumb_width, args.sprite_columns,
+                         args.sprite_quality, args.sprite_workers)
+
+
+def run_import(args):
+    """Import a directory of JPEG files as if they had been recorded at --fps"""
+    from device_simulator import load_frames
+
+    frames = load_frames(args.jpeg_dir)
+    start = args.start if args.start is not None else int(time.time() * 1000)
+    sprites = _sprite_builder(args)
+    writer = ArchiveWriter(args.root, args.device, args.segment_s,
+                           ActivityScorer(args.pixel_threshold, args.size_gate), sprites)
+    for i, frame in enumerate(frames):
+        writer.add_frame(start + int(i * 1000 / args.fps), frame)
+    writer.close()
+    if sprites is not None:
+        sprites.close()
+    print(f"Imported {len(frames)} frames for {args.device}")
+
+
+def run_query(args):
+    reader = ArchiveReader(args.root)
+    t0 = time.perf_counter()
+    if args.histogram:
+        result = reader.histogram(args.device, args.histogram, args.bucket_s, args.threshold)
+    else:
+        found = reader.next_activity(args.device, args.after, args.threshold)
+        result = None if found is None else {'timestamp': found[0], 'activity': found[1]}
+    elapsed = time.perf_counter() - t0
+    print(json.dumps(result))
+    print(f"Answered in {elapsed * 1000:.2f}ms", file=sys.stderr)
+
+
+def run_sprites(args):
+    """Build the sprite files of recorded days that have none, or all of them with --force"""
+    reader = ArchiveReader(args.root)
+    builder = _sprite_builder(args)
+    devices = [args.device] if args.device else reader.devices()
+    for device in devices:
+        for day in ([args.day] if args.day else reader.days(device)):
+            if not args.force and os.path.exists(os.path.join(args.root, device, day, SPRITES_NAME)):
+                continue
+            t0 = time.perf_counter()
+            before = builder.stats['thumbnails']
+            builder.rebuild_day(device, day, reader)
+            print(f"{device} {day}: {builder.stats['thumbnails'] - before} thumbnails in "
+                  f"{time.perf_counter() - t0:.2f}s")
+    builder.close()
+
+
+def run_compact(args):
+    """Compact the days older than --after-days, once or every --loop-s seconds"""
+    if args.nice:
+        os.nice(args.nice)
+    while True:
+        compactor = Compactor(args.root, args.after_days, args.static_fps, args.active_fps, args.threshold,
+                              args.margin_s, args.dedup_diff, args.pixel_threshold, args.io_limit_mb * 1024 * 1024)
+        stats = compactor.run()
+        if stats['segments']:
+            saved = 1 - stats['bytes_out'] / stats['bytes_in']
+            print(f"Compacted {stats['segments']} segments: {stats['frames_in']} -> {stats['frames_out']} frames, "
+                  f"{stats['bytes_in'] / 1e6:.1f} -> {stats['bytes_out'] / 1e6:.1f} MB ({100 * saved:.0f}% saved)")
+        if not args.loop_s:
+            break
+        time.sleep(args.loop_s)
+
+
+def _ingest_worker(root, fps, frame, stop, results):
+    """Live recording of one device, reports the add_frame latencies"""
+    writer = ArchiveWriter(root, 'live')
+    latencies = []
+    next_due = time.monotonic()
+    while not stop.is_set():
+        t0 = time.perf_counter()
+        writer.add_frame(int(time.time() * 1000), frame)
+        latencies.append((time.perf_counter() - t0) * 1000)
+        next_due += 1.0 / fps
+        time.sleep(max(0.0, next_due - time.monotonic()))
+    writer.close()
+    results.put(latencies)
+
+
+def _measure_ingest(root, fps, frame, work):
+    stop = multiprocessing.Event()
+    results = multiprocessing.Queue()
+    worker = multiprocessing.Process(target=_ingest_worker, args=(root, fps, frame, stop, results))
+    worker.start()
+    outcome = work()
+    stop.set()
+    latencies = results.get()
+    worker.join()
+    return outcome, latencies
+
+
+def run_compact_bench(args):
+    """Record old days, compact them while a live device records and report the savings"""
+    rng = random.Random(args.seed)
+    static, motion = _bench_frames(args.width, args.height, args.quality, args.seed)
+    now_ms = int(time.time() * 1000)
+    frame_count = int(args.minutes * 60 * args.fps)
+
+    with tempfile.TemporaryDirectory(prefix='archive_compact_') as root:
+        for day_i in range(args.days):
+            start = day_start_ms(day_of(now_ms)) - (args.after_days + 1 + day_i) * SECONDS_PER_DAY * 1000
+            writer = ArchiveWriter(root, 'bench')
+            events = _bench_events(rng, start, args.minutes * 60, args.event_every_s)
+            _record_timeline(writer, start, frame_count, args.fps, events, static, motion, rng)
+            writer.close()
+
+        _, baseline = _measure_ingest(root, args.fps, static[0], lambda: time.sleep(args.baseline_s))
+        compactor = Compactor(root, args.after_days, args.static_fps, args.active_fps, args.threshold,
+                              args.margin_s, args.dedup_diff, args.pixel_threshold, args.io_limit_mb * 1024 * 1024)
+
+        def compact():
+            t0 = time.perf_counter()
+            compactor.run(now_ms)
+            return time.perf_counter() - t0
+
+        wall_s, during = _measure_ingest(root, args.fps, static[0], compact)
+
+    stats = compactor.stats
+    report = {
+        'benchmark': 'archive_compaction', 'days': args.days, 'minutes_per_day': args.minutes,
+        'fps': args.fps, 'static_fps': args.static_fps, 'active_fps': args.active_fps,
+        'frames_in': stats['frames_in'], 'frames_out': stats['frames_out'],
+        'dropped_rate': stats['dropped_rate'], 'dropped_identical': stats['dropped_identical'],
+        'dropped_similar': stats['dropped_similar'],
+        'bytes_in': stats['bytes_in'], 'bytes_out': stats['bytes_out'],
+        'saved_fraction': 1 - stats['bytes_out'] / max(1, stats['bytes_in']),
+        'wall_s': wall_s, 'cpu_s': stats['cpu_s'], 'throttled_s': compactor.bucket.waited_s,
+        'mb_per_cpu_s': stats['bytes_in'] / 1e6 / max(1e-9, stats['cpu_s']),
+        'ingest_ms_p50_idle': _percentile(baseline, 50), 'ingest_ms_p99_idle': _percentile(baseline, 99),
+        'ingest_ms_p50_compacting': _percentile(during, 50), 'ingest_ms_p99_compacting': _percentile(during, 99),
+    }
+    if args.json:
+        print(json.dumps(report))
+        return
+    print(f"Compacted {args.days} days of {args.minutes:g} minutes at {args.fps:g} fps "
+          f"to {args.active_fps:g} / {args.static_fps:g} fps (active / static)")
+    print(f"  Frames: {report['frames_in']} -> {report['frames_out']} (rate {report['dropped_rate']}, "
+          f"identical {report['dropped_identical']}, similar {report['dropped_similar']})")
+    print(f"  Storage: {report['bytes_in'] / 1e6:.1f} -> {report['bytes_out'] / 1e6:.1f} MB "
+          f"({100 * report['saved_fraction']:.1f}% saved)")
+    print(f"  Throughput: {report['mb_per_cpu_s']:.0f} MB per CPU second, {wall_s:.1f}s wall "
+          f"({report['throttled_s']:.1f}s throttled at {args.io_limit_mb:g} MB/s)")
+    print(f"  Live ingest add_frame: idle p50 {report['ingest_ms_p50_idle']:.2f}ms / p99 "
+          f"{report['ingest_ms_p99_idle']:.2f}ms, compacting p50 {report['ingest_ms_p50_compacting']:.2f}ms / "
+          f"p99 {report['ingest_ms_p99_compacting']:.2f}ms")
+
+
+def _percentile(values, pct):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * pct / 100))]
+
+
+def _bench_frames(width, height, quality, seed):
+    """Pre-encoded pools of static frames (sensor noise only) and of a moving object"""
+    rng = np.random.default_rng(seed)
+    background = cv2.GaussianBlur(rng.integers(0, 255, (height, width, 3), dtype=np.uint8), (31, 31), 0)
+    cv2.rectangle(background, (width // 3, height // 4), (width // 3 + 60, height - 10), (90, 60, 40), -1)
+    params = [cv2.IMWRITE_JPEG_QUALITY, quality]
+
+    def encode(image):
+        noise = rng.normal(0, 2.0, image.shape)
+        noisy = np.clip(image + noise, 0, 255).astype(np.uint8)
+        return cv2.imencode('.jpg', noisy, params)[1].tobytes()
+
+    static = [encode(background) for _ in range(16)]
+    motion = []
+    for step in range(48):
+        image = background.copy()
+        x = int(step * (width - 120) / 47)
+        cv2.rectangle(image, (x, height // 3), (x + 120, height - 20), (200, 210, 220), -1)
+        motion.append(encode(image))
+    return static, motion
+
+
+def _bench_events(rng, start, seconds, event_every_s):
+    """Motion events of 2 - 20 s, about one per `event_every_s`"""
+    events = []
+    t = rng.uniform(5, event_every_s)
+    while t < seconds:
+        length = rng.uniform(2, 20)
+        events.append((start + int(t * 1000), start + int((t + length) * 1000)))
+        t += length + rng.expovariate(1 / event_every_s)
+    return events
+
+
+def _record_timeline(writer, start, frame_count, fps, events, static, motion, rng):
+    """Record static frames with the motion frames during the events, returns the time spent in add_frame"""
+    add_s = 0.0
+    event_i = 0
+    motion_i = 0
+    for i in range(frame_count):
+        ts = start + int(i * 1000.0 / fps)
+        while event_i < len(events) and ts >= events[event_i][1]:
+            event_i += 1
+        if event_i < len(events) and events[event_i][0] <= ts:
+            frame = motion[motion_i % len(motion)]
+            motion_i += 1
+        else:
+            frame = static[rng.randrange(len(static))]
+        t0 = time.perf_counter()
+        writer.add_frame(ts, frame)
+        add_s += time.perf_counter() - t0
+    return add_s
+
+
+def run_sprite_bench(args):
+    """Record a synthetic timeline, build its sprites per segment and time the timeline open"""
+    rng = random.Random(args.seed)
+    static, motion = _bench_frames(args.width, args.height, args.quality, args.seed)
+    day = '2026-01-15'
+    start = day_start_ms(day) + 8 * 3600 * 1000
+    frame_count = int(args.minutes * 60 * args.fps)
+    events = _bench_events(rng, start, args.minutes * 60, args.event_every_s)
+    modes = [('full_1', False, 1), ('scaled_1', True, 1), (f'scaled_{args.workers}', True, args.workers)]
+
+    with tempfile.TemporaryDirectory(prefix='archive_sprites_') as root:
+        writer = ArchiveWriter(root, 'bench', args.segment_s)
+        _record_timeline(writer, start, frame_count, args.fps, events, static, motion, rng)
+        writer.close()
+        reader = ArchiveReader(root)
+        path = os.path.join(root, 'bench', day, SPRITES_NAME)
+
+        results = {}
+        for name, scaled, workers in modes:
+            builder = SpriteBuilder(root, args.interval_s, args.thumb_width, workers=workers, scaled=scaled)
+            t0 = time.perf_counter()
+            builder.rebuild_day('bench', day, reader)
+            wall_s = time.perf_counter() - t0
+            builder.close()
+            results[name] = (builder.stats['thumbnails'] / max(1e-9, builder.decode_s),
+                             builder.stats['thumbnails'] / wall_s, _percentile(builder.segment_ms, 99))
+        thumbnails = builder.stats['thumbnails']
+        sprite_bytes = os.path.getsize(path)
+
+        open_ms = []
+        for _ in range(200):
+            q0 = time.perf_counter()
+            parse_sprites(reader.sprites('bench', day))
+            open_ms.append((time.perf_counter() - q0) * 1000)
+        # The same timeline without sprites: a frame per tile, read and decoded on open
+        tile_height = parse_sprites(reader.sprites('bench', day))['tile_height']
+        q0 = time.perf_counter()
+        for ts in range(start + args.interval_s * 1000, start + int(frame_count * 1000 / args.fps),
+                        args.interval_s * 1000):
+            found = reader.frame_at('bench', ts)
+            decode_thumbnail(found[1], args.thumb_width, tile_height)
+        without_ms = (time.perf_counter() - q0) * 1000
+
+    report = {
+        'benchmark': 'archive_sprites', 'frames': frame_count, 'fps': args.fps,
+        'resolution': f"{args.width}x{args.height}", 'thumbnails': thumbnails,
+        'interval_s': args.interval_s, 'thumb_width': args.thumb_width, 'workers': args.workers,
+        'sprite_bytes': sprite_bytes,
+        'timeline_open_ms_p50': _percentile(open_ms, 50), 'timeline_open_ms_p99': _percentile(open_ms, 99),
+        'timeline_open_ms_without_sprites': without_ms,
+    }
+    for name, (decode_rate, build_rate, p99) in results.items():
+        report[f'decode_per_s_{name}'] = decode_rate
+        report[f'build_per_s_{name}'] = build_rate
+        report[f'segment_ms_p99_{name}'] = p99
+    report['scaled_speedup'] = results['scaled_1'][0] / results['full_1'][0]
+    if args.json:
+        print(json.dumps(report))
+        return
+    print(f"{thumbnails} thumbnails of {args.thumb_width}px every {args.interval_s}s from {frame_count} "
+          f"{report['resolution']} frames, sprite file {sprite_bytes / 1e3:.0f} kB")
+    for name, (decode_rate, build_rate, p99) in results.items():
+        print(f"  {name:<10} decode {decode_rate:6.0f} thumbnails/s, with the sheet updates {build_rate:5.0f}/s, "
+              f"p99 {p99:.1f}ms per segment")
+    print(f"  Timeline open (one read): p50 {report['timeline_open_ms_p50']:.3f}ms, "
+          f"p99 {report['timeline_open_ms_p99']:.3f}ms, {without_ms:.0f}ms decoding the frames without sprites")
+
+
+def run_bench(args):
+    """Record a synthetic timeline with known motion and time the queries"""
+    rng = random.Random(args.seed)
+    static, motion = _bench_frames(args.width, args.height, args.quality, args.seed)
+    day = '2026-01-15'
+    start = day_start_ms(day) + 8 * 3600 * 1000
+    frame_count = int(args.minutes * 60 * args.fps)
+    interval_ms = 1000.0 / args.fps
+    events = _bench_events(rng, start, args.minutes * 60, args.event_every_s)
+
+    with tempfile.TemporaryDirectory(prefix='archive_bench_') as root:
+        writer = ArchiveWriter(root, 'bench', scorer=ActivityScorer(args.pixel_threshold, args.size_gate))
+        t0 = time.perf_counter()
+        score_s = _record_timeline(writer, start, frame_count, args.fps, events, static, motion, rng)
+        record_s = time.perf_counter() - t0
+        writer.close()
+        scorer = writer.scorer
+
+        reader = ArchiveReader(root)
+        end = start + frame_count * interval_ms
+        next_ms = []
+        detected = 0
+        for event_start, event_end in events:
+            q0 = time.perf_counter()
+            found = reader.next_activity('bench', event_start - 3000, args.threshold)
+            next_ms.append((time.perf_counter() - q0) * 1000)
+            if found is not None and event_start - 100 <= found[0] <= event_end:
+                detected += 1
+        false_hits = 0
+        quiet = [(events[i][1] + 1000, events[i + 1][0] - 1000) for i in range(len(events) - 1)]
+        for lo, hi in quiet:
+            found = reader.next_activity('bench', lo, args.threshold)
+            if found is not None and found[0] < hi:
+                false_hits += 1
+        for _ in range(200):
+            q0 = time.perf_counter()
+            reader.next_activity('bench', rng.randrange(start, int(end)), args.threshold)
+            next_ms.append((time.perf_counter() - q0) * 1000)
+        hist_ms = []
+        for _ in range(50):
+            q0 = time.perf_counter()
+            reader.histogram('bench', day, 60, args.threshold)
+            hist_ms.append((time.perf_counter() - q0) * 1000)
+
+    report = {
+        'benchmark': 'archive_activity', 'frames': frame_count, 'fps': args.fps,
+        'resolution': f"{args.width}x{args.height}",
+        'record_fps': frame_count / record_s,
+        'record_us_per_frame': score_s / frame_count * 1e6,
+        'decoded_fraction': scorer.decoded / scorer.frames,
+        'events': len(events), 'events_detected': detected, 'false_activity_gaps': false_hits,
+        'quiet_gaps': len(quiet),
+        'next_activity_ms_p50': _percentile(next_ms, 50), 'next_activity_ms_p99': _percentile(next_ms, 99),
+        'histogram_ms_p50': _percentile(hist_ms, 50), 'histogram_ms_p99': _percentile(hist_ms, 99),
+    }
+    if args.json:
+        print(json.dumps(report))
+        return
+    print(f"Recorded {frame_count} {report['resolution']} frames at {report['record_fps']:.0f} fps "
+          f"({report['record_us_per_frame']:.0f}us per frame incl. scoring, "
+          f"{100 * report['decoded_fraction']:.0f}% decoded)")
+    print(f"  Events detected: {detected}/{len(events)}, quiet gaps with false activity: {false_hits}/{len(quiet)}")
+    print(f"  Next activity: p50 {report['next_activity_ms_p50']:.2f}ms, p99 {report['next_activity_ms_p99']:.2f}ms")
+    print(f"  Day histogram: p50 {report['histogram_ms_p50']:.2f}ms, p99 {report['histogram_ms_p99']:.2f}ms")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--root', default='archive', help="Archive directory")
+    sub = parser.add_subparsers(dest='command', required=True)
+
+    scoring = argparse.ArgumentParser(add_help=False)
+    scoring.add_argument('--segment-s', type=int, default=DEFAULT_SEGMENT_S, help="Segment length in seconds")
+    scoring.add_argument('--pixel-threshold', type=int, default=DEFAULT_PIXEL_THRESHOLD,
+                         help="Gray level change counted as activity")
+    scoring.add_argument('--size-gate', type=float, default=DEFAULT_SIZE_GATE,
+                         help="Relative size change below which a frame is not decoded")
+
+    thumbnails = argparse.ArgumentParser(add_help=False)
+    thumbnails.add_argument('--thumb-interval-s', type=int, default=DEFAULT_THUMB_INTERVAL_S,
+                            help="Seconds of the timeline per thumbnail, must divide an hour")
+    thumbnails.add_argument('--thumb-width', type=int, default=DEFAULT_THUMB_WIDTH)
+    thumbnails.add_argument('--sprite-columns', type=int, default=DEFAULT_SPRITE_COLUMNS,
+                            help="Thumbnails per row of an hour sheet")
+    thumbnails.add_argument('--sprite-quality', type=int, default=DEFAULT_SPRITE_QUALITY)
+    thumbnails.add_argument('--sprite-workers', type=int, default=4, help="Decoding threads")
+    thumbnails.add_argument('--no-sprites', action='store_true', help="Do not build timeline thumbnails")
+
+    record = sub.add_parser('record', parents=[scoring, thumbnails], help="Record the frames published on the frame bus")
+    record.add_argument('--socket', default='/tmp/telrem_frame_bus.sock')
+
+    imp = sub.add_parser('import', parents=[scoring, thumbnails], help="Import a directory of JPEG frames")
+    imp.add_argument('--device', required=True)
+    imp.add_argument('--jpeg-dir', required=True)
+    imp.add_argument('--fps', type=float, default=15.0)
+    imp.add_argument('--start', type=int, help="Timestamp of the first frame in ms since EPOCH")
+
+    query = sub.add_parser('query', help="Next activity after a time, or the histogram of a day")
+    query.add_argument('--device', required=True)
+    query.add_argument('--after', type=int, default=0, help="Timestamp in ms since EPOCH")
+    query.add_argument('--histogram', metavar='DAY', help="Print the histogram of a day (YYYY-MM-DD)")
+    query.add_argument('--bucket-s', type=int, default=60)
+    query.add_argument('--threshold', type=float, default=DEFAULT_ACTIVITY_THRESHOLD)
+
+    sprites = sub.add_parser('sprites', parents=[thumbnails], help="Build the timeline thumbnails of recorded days")
+    sprites.add_argument('--device', help="Only this device")
+    sprites.add_argument('--day', help="Only this day (YYYY-MM-DD)")
+    sprites.add_argument('--force', action='store_true', help="Also rebuild the days that have sprites")
+
+    compaction = argparse.ArgumentParser(add_help=False)
+    compaction.add_argument('--after-days', type=int, default=7, help="Compact days older than this")
+    compaction.add_argument('--static-fps', type=float, default=1.0)
+    compaction.add_argument('--active-fps', type=float, default=5.0)
+    compaction.add_argument('--margin-s', type=int, default=2, help="Seconds kept active around an activity")
+    compaction.add_argument('--dedup-diff', type=float, default=0.002,
+                            help="Changed pixel fraction below which a frame counts as a duplicate")
+    compaction.add_argument('--io-limit-mb', type=float, default=20.0, help="Read and write limit in MB/s")
+    compaction.add_argument('--pixel-threshold', type=int, default=DEFAULT_PIXEL_THRESHOLD)
+    compaction.add_argument('--threshold', type=float, default=DEFAULT_ACTIVITY_THRESHOLD)
+
+    compact = sub.add_parser('compact', parents=[compaction], help="Downsample and deduplicate old days")
+    compact.add_argument('--loop-s', type=float, default=0, help="Repeat every N seconds, 0 = run once")
+    compact.add_argument('--nice', type=int, default=10, help="Added to the process niceness")
+
+    compact_bench = sub.add_parser('compact-bench', parents=[compaction],
+                                   help="Compact synthetic days while a live device records")
+    compact_bench.add_argument('--days', type=int, default=2)
+    compact_bench.add_argument('--minutes', type=float, default=10.0, help="Recorded minutes per day")
+    compact_bench.add_argument('--fps', type=float, default=15.0)
+    compact_bench.add_argument('--width', type=int, default=640)
+    compact_bench.add_argument('--height', type=int, default=480)
+    compact_bench.add_argument('--quality', type=int, default=80)
+    compact_bench.add_argument('--event-every-s', type=float, default=60.0)
+    compact_bench.add_argument('--baseline-s', type=float, default=3.0, help="Live ingest measured alone")
+    compact_bench.add_argument('--seed', type=int, default=1)
+    compact_bench.add_argument('--json', action='store_true', help="Print a machine-readable report")
+
+    bench = sub.add_parser('bench', help="Record a synthetic timeline and time the queries")
+    bench.add_argument('--minutes', type=float, default=20.0)
+    bench.add_argument('--fps', type=float, default=15.0)
+    bench.add_argument('--width', type=int, default=640)
+    bench.add_argument('--height', type=int, default=480)
+    bench.add_argument('--quality', type=int, default=80)
+    bench.add_argument('--event-every-s', type=float, default=60.0, help="Mean time between motion events")
+    bench.add_argument('--pixel-threshold', type=int, default=DEFAULT_PIXEL_THRESHOLD)
+    bench.add_argument('--size-gate', type=float, default=DEFAULT_SIZE_GATE)
+    bench.add_argument('--threshold', type=float, default=DEFAULT_ACTIVITY_THRESHOLD)
+    bench.add_argument('--seed', type=int, default=1)
+    bench.add_argument('--json', action='store_true', help="Print a machine-readable report")
+
+    sprite_bench = sub.add_parser('sprite-bench', help="Build the sprites of a synthetic timeline and time them")
+    sprite_bench.add_argument('--minutes', type=float, default=20.0)
+    sprite_bench.add_argument('--fps', type=float, default=15.0)
+    sprite_bench.add_argument('--width', type=int, default=640)
+    sprite_bench.add_argument('--height', type=int, default=480)
+    sprite_bench.add_argument('--quality', type=int, default=80)
+    sprite_bench.add_argument('--segment-s', type=int, default=DEFAULT_SEGMENT_S)
+    sprite_bench.add_argument('--event-every-s', type=float, default=60.0)
+    sprite_bench.add_argument('--interval-s', type=int, default=DEFAULT_THUMB_INTERVAL_S)
+    sprite_bench.add_argument('--thumb-width', type=int, default=DEFAULT_THUMB_WIDTH)
+    sprite_bench.add_argument('--workers', type=int, default=4)
+    sprite_bench.add_argument('--seed', type=int, default=1)
+    sprite_bench.add_argument('--json', action='store_true', help="Print a machine-readable report")
+
+    args = parser.parse_args()
+    if args.command == 'record':
+        run_record(args)
+    elif args.command == 'import':
+        run_import(args)
+    elif args.command == 'query':
+        run_query(args)
+    elif args.command == 'sprites':
+        run_sprites(args)
+    elif args.command == 'compact':
+        run_compact(args)
+    elif args.command == 'compact-bench':
+        run_compact_bench(args)
+    elif args.command == 'sprite-bench':
+        run_sprite_bench(args)
+    else:
+        run_bench(args)
+
+
+if __name__ == "__main__":
+    main()
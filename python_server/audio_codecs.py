@@ -0,0 +1,420 @@
+#!/usr/bin/env python3
+"""
+Audio codecs of the ESP32 streams on the host
+
+Opus through libopus (ctypes) with the settings of udp_stream.c
+(CONFIG_AUDIO_OPUS: VoIP mode, 20 ms frames, in-band FEC, DTX) and G.711
+mu-law as a reference. The bench measures the encode and decode CPU per
+frame and the bitrate each codec needs for the quality of G.711.
+"""
+import argparse
+import ctypes
+import ctypes.util
+import json
+import sys
+import time
+import wave
+
+import numpy as np
+
+import media_packets
+
+FRAME_MS = 20               # OPUS_FRAME_MS in udp_stream.c
+OPUS_COMPLEXITY = 5         # OPUS_COMPLEXITY in udp_stream.c
+PCM_BLOCK_BYTES = 324       # PCM_BLOCK_BYTES in udp_stream.c
+IP_UDP_OVERHEAD = 28        # IPv4 + UDP header bytes per datagram
+LSD_RANGE_DB = 50           # Spectrum below the peak of the frame that the distance ignores
+
+CODEC_SAMPLE_RATES = {
+    media_packets.CODEC_PCM: 8000,
+    media_packets.CODEC_OPUS_8K: 8000,
+    media_packets.CODEC_OPUS_16K: 16000,
+}
+
+# opus_defines.h
+OPUS_OK = 0
+OPUS_APPLICATION_VOIP = 2048
+OPUS_SIGNAL_VOICE = 3001
+OPUS_SET_BITRATE_REQUEST = 4002
+OPUS_SET_COMPLEXITY_REQUEST = 4010
+OPUS_SET_INBAND_FEC_REQUEST = 4012
+OPUS_SET_PACKET_LOSS_PERC_REQUEST = 4014
+OPUS_SET_DTX_REQUEST = 4016
+OPUS_SET_SIGNAL_REQUEST = 4024
+
+MAX_PACKET_BYTES = media_packets.MAX_PACKET_SIZE - media_packets.AUDIO_HEADER_SIZE
+
+_libopus = None
+
+
+def load_libopus():
+    """Load libopus once; raises RuntimeError when it is not installed"""
+    global _libopus
+    if _libopus is not None:
+        return _libopus
+    path = ctypes.util.find_library('opus')
+    if path is None:
+        raise RuntimeError("libopus not found (install libopus0 / opus)")
+    lib = ctypes.CDLL(path)
+    lib.opus_encoder_create.restype = ctypes.c_void_p
+    lib.opus_encoder_create.argtypes = [ctypes.c_int32, ctypes.c_int, ctypes.c_int, ctypes.POINTER(ctypes.c_int)]
+    lib.opus_encode.restype = ctypes.c_int32
+    lib.opus_encode.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int, ctypes.c_void_p, ctypes.c_int32]
+    lib.opus_encoder_destroy.argtypes = [ctypes.c_void_p]
+    lib.opus_encoder_ctl.restype = ctypes.c_int
+    lib.opus_decoder_create.restype = ctypes.c_void_p
+    lib.opus_decoder_create.argtypes = [ctypes.c_int32, ctypes.c_int, ctypes.POINTER(ctypes.c_int)]
+    lib.opus_decode.restype = ctypes.c_int
+    lib.opus_decode.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int32, ctypes.c_void_p,
+                                ctypes.c_int, ctypes.c_int]
+    lib.opus_decoder_destroy.argtypes = [ctypes.c_void_p]
+    lib.opus_strerror.restype = ctypes.c_char_p
+    lib.opus_strerror.argtypes = [ctypes.c_int]
+    _libopus = lib
+    return lib
+
+
+def opus_available():
+    try:
+        load_libopus()
+        return True
+    except (RuntimeError, OSError):
+        return False
+
+
+class OpusEncoder:
+    """Mono 16 bit Opus encoder configured like the firmware"""
+
+    def __init__(self, sample_rate, bitrate, expected_loss=10, complexity=OPUS_COMPLEXITY, fec=True, dtx=True):
+        self.lib = load_libopus()
+        self.frame_samples = sample_rate * FRAME_MS // 1000
+        err = ctypes.c_int()
+        self.handle = self.lib.opus_encoder_create(sample_rate, 1, OPUS_APPLICATION_VOIP, ctypes.byref(err))
+        if not self.handle or err.value != OPUS_OK:
+            raise RuntimeError(f"opus_encoder_create: {self.lib.opus_strerror(err.value).decode()}")
+        for request, value in ((OPUS_SET_SIGNAL_REQUEST, OPUS_SIGNAL_VOICE),
+                               (OPUS_SET_COMPLEXITY_REQUEST, complexity),
+                               (OPUS_SET_BITRATE_REQUEST, bitrate),
+                               (OPUS_SET_INBAND_FEC_REQUEST, int(fec)),
+                               (OPUS_SET_PACKET_LOSS_PERC_REQUEST, expected_loss if fec else 0),
+                               (OPUS_SET_DTX_REQUEST, int(dtx))):
+            self.lib.opus_encoder_ctl(ctypes.c_void_p(self.handle), ctypes.c_int(request), ctypes.c_int32(value))
+        self.out = ctypes.create_string_buffer(MAX_PACKET_BYTES)
+
+    def encode(self, pcm):
+        """Encode one frame of int16 samples; returns b'' when DTX needs nothing sent"""
+        pcm = np.ascontiguousarray(pcm, dtype='<i2')
+        n = self.lib.opus_encode(self.handle, pcm.ctypes.data, self.frame_samples, self.out, MAX_PACKET_BYTES)
+        if n < 0:
+            raise RuntimeError(f"opus_encode: {self.lib.opus_strerror(n).decode()}")
+        return b'' if n <= 2 else self.out.raw[:n]
+
+    def close(self):
+        if getattr(self, 'handle', None):
+            self.lib.opus_encoder_destroy(self.handle)
+            self.handle = None
+
+    __del__ = close
+
+
+class OpusDecoder:
+    """Mono 16 bit Opus decoder with the FEC and concealment of _udp_decode_opus"""
+
+    def __init__(self, sample_rate):
+        self.lib = load_libopus()
+        self.frame_samples = sample_rate * FRAME_MS // 1000
+        err = ctypes.c_int()
+        self.handle = self.lib.opus_decoder_create(sample_rate, 1, ctypes.byref(err))
+        if not self.handle or err.value != OPUS_OK:
+            raise RuntimeError(f"opus_decoder_create: {self.lib.opus_strerror(err.value).decode()}")
+        self.pcm = np.zeros(self.frame_samples, dtype='<i2')
+
+    def _decode(self, data, fec):
+        if data:
+            n = self.lib.opus_decode(self.handle, data, len(data), self.pcm.ctypes.data, self.frame_samples, int(fec))
+        else:
+            n = self.lib.opus_decode(self.handle, None, 0, self.pcm.ctypes.data, self.frame_samples, 0)
+        if n < 0:
+            raise RuntimeError(f"opus_decode: {self.lib.opus_strerror(n).decode()}")
+        return self.pcm[:n].copy()
+
+    def decode(self, data):
+        return self._decode(data, False)
+
+    def recover(self, next_data):
+        """The frame before `next_data`, rebuilt from its in-band FEC"""
+        return self._decode(next_data, True)
+
+    def conceal(self):
+        """Packet loss concealment (comfort noise after DTX) for one frame"""
+        return self._decode(None, False)
+
+    def close(self):
+        if getattr(self, 'handle', None):
+            self.lib.opus_decoder_destroy(self.handle)
+            self.handle = None
+
+    __del__ = close
+
+
+_MULAW_BIAS = 0x84
+
+
+def mulaw_encode(pcm):
+    """G.711 mu-law, one byte per sample"""
+    x = pcm.astype(np.int32)
+    sign = np.where(x < 0, 0x80, 0)
+    magnitude = np.minimum(np.abs(x), 32635) + _MULAW_BIAS
+    exponent = np.floor(np.log2(magnitude)).astype(np.int32) - 7
+    mantissa = (magnitude >> (exponent + 3)) & 0x0F
+    return (~(sign | (exponent << 4) | mantissa) & 0xFF).astype(np.uint8)
+
+
+def mulaw_decode(codes):
+    codes = ~codes.astype(np.int32) & 0xFF
+    exponent = (codes >> 4) & 0x07
+    magnitude = (((codes & 0x0F) << 3) + _MULAW_BIAS) << exponent
+    return np.where(codes & 0x80, _MULAW_BIAS - magnitude, magnitude - _MULAW_BIAS).astype('<i2')
+
+
+def speech_like(sample_rate, seconds, seed=7):
+    """Deterministic voiced test signal: glottal pulses through moving formants, with pauses
+
+    Not speech, but it has a pitch contour, formant structure, syllable
+    envelopes and silent gaps, which is what the codecs are tuned for. Use
+    --wav with a real recording for numbers that match perception.
+    """
+    rng = np.random.default_rng(seed)
+    n = int(sample_rate * seconds)
+    t = np.arange(n) / sample_rate
+    # Syllables of 120-300 ms, a pause of 300-800 ms after every few
+    envelope = np.zeros(n)
+    pos = 0
+    while pos < n:
+        for _ in range(rng.integers(3, 7)):
+            length = int(sample_rate * rng.uniform(0.12, 0.3))
+            envelope[pos:pos + length] = np.hanning(length)[:max(0, min(length, n - pos))]
+            pos += length
+        pos += int(sample_rate * rng.uniform(0.3, 0.8))
+    f0 = 140 + 40 * np.sin(2 * np.pi * 0.7 * t) + 20 * np.sin(2 * np.pi * 2.3 * t)
+    phase = np.cumsum(f0 / sample_rate)
+    source = (np.diff(np.floor(phase), prepend=0) > 0).astype(float)
+    source += 0.05 * rng.standard_normal(n)
+    signal = np.zeros(n)
+    vowels = [(730, 1090, 2440), (270, 2290, 3010), (300, 870, 2240), (530, 1840, 2480), (570, 840, 2410)]
+    block = int(sample_rate * 0.2)
+    for start in range(0, n, block):
+        formants = vowels[rng.integers(len(vowels))]
+        chunk = source[start:start + block]
+        out = np.zeros(len(chunk))
+        for freq, bandwidth in zip(formants, (80, 100, 120)):
+            if freq >= sample_rate / 2:
+                continue
+            r = np.exp(-np.pi * bandwidth / sample_rate)
+            a1, a2 = -2 * r * np.cos(2 * np.pi * freq / sample_rate), r * r
+            y1 = y2 = 0.0
+            res = np.empty(len(chunk))
+            for i, x in enumerate(chunk):
+                y = x - a1 * y1 - a2 * y2
+                res[i] = y
+                y2, y1 = y1, y
+            out += res
+        signal[start:start + len(out)] = out
+    signal *= envelope
+    signal += 1e-3 * np.max(np.abs(signal)) * rng.standard_normal(n)
+    return (signal / np.max(np.abs(signal)) * 12000).astype('<i2')
+
+
+def read_wav(path, sample_rate):
+    with wave.open(path, 'rb') as wav:
+        if wav.getsampwidth() != 2:
+            raise ValueError(f"{path}: 16 bit PCM expected")
+        pcm = np.frombuffer(wav.readframes(wav.getnframes()), dtype='<i2')
+        if wav.getnchannels() > 1:
+            pcm = pcm[::wav.getnchannels()]
+        rate = wav.getframerate()
+    if rate != sample_rate:
+        t_out = np.arange(int(len(pcm) * sample_rate / rate)) / sample_rate
+        pcm = np.interp(t_out, np.arange(len(pcm)) / rate, pcm.astype(float)).astype('<i2')
+    return pcm
+
+
+def align(reference, decoded, max_lag):
+    """Shift `decoded` by the codec delay found by cross-correlation"""
+    n = min(len(reference), len(decoded)) - max_lag
+    ref = reference[:n].astype(float)
+    best_lag, best = 0, -np.inf
+    for lag in range(max_lag):
+        score = np.dot(ref, decoded[lag:lag + n].astype(float))
+        if score > best:
+            best_lag, best = lag, score
+    return decoded[best_lag:best_lag + n], reference[:n]
+
+
+def log_spectral_distance(reference, decoded, sample_rate):
+    """Mean log spectral distance (dB) over the active 20 ms frames, 100 Hz to Nyquist - 200 Hz
+
+    Both spectra are floored LSD_RANGE_DB below the peak of the input frame,
+    so a noise floor that a codec leaves out does not count as distortion.
+    """
+    frame = sample_rate * FRAME_MS // 1000
+    window = np.hanning(frame)
+    freqs = np.fft.rfftfreq(frame, 1 / sample_rate)
+    band = (freqs >= 100) & (freqs <= sample_rate / 2 - 200)
+    frames = len(reference) // frame
+    ref = reference[:frames * frame].reshape(frames, frame).astype(float)
+    dec = decoded[:frames * frame].reshape(frames, frame).astype(float)
+    energy = np.sum(ref * ref, axis=1)
+    active = energy > np.max(energy) * 1e-4
+    p = np.abs(np.fft.rfft(ref[active] * window, axis=1))[:, band] ** 2
+    q = np.abs(np.fft.rfft(dec[active] * window, axis=1))[:, band] ** 2
+    floor = np.max(p, axis=1, keepdims=True) * 10 ** (-LSD_RANGE_DB / 10)
+    diff = 10 * np.log10(np.maximum(p, floor)) - 10 * np.log10(np.maximum(q, floor))
+    return float(np.mean(np.sqrt(np.mean(diff * diff, axis=1))))
+
+
+def _frames(pcm, frame_samples):
+    count = len(pcm) // frame_samples
+    return pcm[:count * frame_samples].reshape(count, frame_samples)
+
+
+def bench_opus(pcm, sample_rate, bitrate, loss, seed):
+    """Encode and decode a signal like the firmware, clean and with random loss"""
+    encoder = OpusEncoder(sample_rate, bitrate)
+    frames = _frames(pcm, encoder.frame_samples)
+    packets = []
+    start = time.process_time()
+    for frame in frames:
+        packets.append(encoder.encode(frame))
+    encode_s = time.process_time() - start
+    encoder.close()
+
+    decoder = OpusDecoder(sample_rate)
+    out = []
+    start = time.process_time()
+    for packet in packets:
+        out.append(decoder.decode(packet) if packet else decoder.conceal())
+    decode_s = time.process_time() - start
+    decoder.close()
+
+    sent = [p for p in packets if p]
+    seconds = len(frames) * FRAME_MS / 1000
+    decoded, reference = align(pcm, np.concatenate(out), sample_rate * FRAME_MS // 1000)
+    result = {
+        'bitrate_setting': bitrate,
+        'payload_kbps': sum(len(p) for p in sent) * 8 / seconds / 1000,
+        'wire_kbps': sum(len(p) + media_packets.AUDIO_HEADER_SIZE + IP_UDP_OVERHEAD for p in sent) * 8 / seconds / 1000,
+        'dtx_ratio': 1 - len(sent) / len(packets),
+        'encode_us_per_frame': encode_s * 1e6 / len(frames),
+        'decode_us_per_frame': decode_s * 1e6 / len(frames),
+        'lsd_db': log_spectral_distance(reference, decoded, sample_rate),
+    }
+
+    # The same packets with random loss, recovered like _udp_decode_opus and with concealment only
+    lost = np.random.default_rng(seed).random(len(packets)) < loss
+    for use_fec in (True, False):
+        decoder = OpusDecoder(sample_rate)
+        out = []
+        for i, packet in enumerate(packets):
+            if lost[i] or not packet:
+                following = packets[i + 1] if i + 1 < len(packets) and not lost[i + 1] else b''
+                out.append(decoder.recover(following) if use_fec and following else decoder.conceal())
+            else:
+                out.append(decoder.decode(packet))
+        decoder.close()
+        decoded, reference = align(pcm, np.concatenate(out), sample_rate * FRAME_MS // 1000)
+        result['lsd_db_loss_fec' if use_fec else 'lsd_db_loss_plc'] = log_spectral_distance(reference, decoded,
+                                                                                            sample_rate)
+    return result
+
+
+def bench_mulaw(pcm, sample_rate):
+    frames = _frames(pcm, sample_rate * FRAME_MS // 1000)
+    start = time.process_time()
+    encoded = [mulaw_encode(frame) for frame in frames]
+    encode_s = time.process_time() - start
+    start = time.process_time()
+    decoded = np.concatenate([mulaw_decode(codes) for codes in encoded])
+    decode_s = time.process_time() - start
+    packet_bytes = len(encoded[0])
+    return {
+        'payload_kbps': sample_rate * 8 / 1000,
+        'wire_kbps': (packet_bytes + media_packets.AUDIO_HEADER_SIZE + IP_UDP_OVERHEAD) * 8 * 1000 / FRAME_MS / 1000,
+        'encode_us_per_frame': encode_s * 1e6 / len(frames),
+        'decode_us_per_frame': decode_s * 1e6 / len(frames),
+        'lsd_db': log_spectral_distance(pcm[:len(decoded)], decoded, sample_rate),
+    }
+
+
+def run_bench(args):
+    if not opus_available():
+        print("libopus not found, the Opus bench needs it (install libopus0 / opus)")
+        sys.exit(1)
+
+    bitrates = [int(b) for b in args.bitrates.split(',')]
+    report = {'benchmark': 'audio_codecs', 'seconds': args.seconds, 'loss': args.loss,
+              'signal': args.wav or 'speech_like', 'rates': {}}
+    for sample_rate in (8000, 16000):
+        pcm = read_wav(args.wav, sample_rate) if args.wav else speech_like(sample_rate, args.seconds)
+        entry = {'opus': [bench_opus(pcm, sample_rate, b, args.loss, args.seed) for b in bitrates]}
+        if sample_rate == 8000:
+            # The firmware's PCM mode: 324 byte blocks at 8 kHz
+            entry['pcm_wire_kbps'] = ((PCM_BLOCK_BYTES + media_packets.AUDIO_HEADER_SIZE + IP_UDP_OVERHEAD) * 8
+                                      * sample_rate * 2 / PCM_BLOCK_BYTES / 1000)
+            entry['mulaw'] = bench_mulaw(pcm, sample_rate)
+            # Lowest Opus bitrate whose distortion does not exceed G.711's
+            target = entry['mulaw']['lsd_db']
+            equal = [r for r in entry['opus'] if r['lsd_db'] <= target]
+            entry['equal_quality'] = min(equal, key=lambda r: r['bitrate_setting']) if equal else None
+        report['rates'][str(sample_rate)] = entry
+
+    if args.json:
+        print(json.dumps(report))
+        return
+
+    print(f"Signal {report['signal']}, {args.seconds:.0f} s, {args.loss * 100:.0f} % loss for the loss columns")
+    for rate, entry in report['rates'].items():
+        pcm_note = f" (PCM {entry['pcm_wire_kbps']:.0f} kbit/s on the wire)" if 'pcm_wire_kbps' in entry else ''
+        print(f"\n{int(rate) // 1000} kHz{pcm_note}")
+        print(f"  {'codec':<14}{'payload kbps':>13}{'wire kbps':>11}{'DTX':>6}{'enc us':>9}{'dec us':>9}"
+              f"{'LSD dB':>8}{'loss FEC':>10}{'loss PLC':>10}")
+        if 'mulaw' in entry:
+            m = entry['mulaw']
+            print(f"  {'G.711 mu-law':<14}{m['payload_kbps']:>13.1f}{m['wire_kbps']:>11.1f}{'':>6}"
+                  f"{m['encode_us_per_frame']:>9.1f}{m['decode_us_per_frame']:>9.1f}{m['lsd_db']:>8.2f}")
+        for r in entry['opus']:
+            print(f"  {'Opus ' + str(r['bitrate_setting'] // 1000) + 'k':<14}{r['payload_kbps']:>13.1f}"
+                  f"{r['wire_kbps']:>11.1f}{r['dtx_ratio'] * 100:>5.0f}%{r['encode_us_per_frame']:>9.1f}"
+                  f"{r['decode_us_per_frame']:>9.1f}{r['lsd_db']:>8.2f}{r['lsd_db_loss_fec']:>10.2f}"
+                  f"{r['lsd_db_loss_plc']:>10.2f}")
+        if 'equal_quality' in entry:
+            eq = entry['equal_quality']
+            if eq is None:
+                closest = min(entry['opus'], key=lambda r: r['lsd_db'])
+                print(f"  No Opus bitrate reached the distortion of G.711 ({entry['mulaw']['lsd_db']:.2f} dB), closest: "
+                      f"Opus {closest['bitrate_setting'] // 1000}k with {closest['lsd_db']:.2f} dB, "
+                      f"{closest['wire_kbps']:.1f} kbit/s on the wire")
+            else:
+                print(f"  Equal quality to G.711 (64 kbit/s): Opus {eq['bitrate_setting'] // 1000}k, "
+                      f"{eq['payload_kbps']:.1f} kbit/s payload, {eq['wire_kbps']:.1f} kbit/s on the wire")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    sub = parser.add_subparsers(dest='command', required=True)
+
+    bench = sub.add_parser('bench', help="Encode/decode CPU, bitrate and distortion per codec")
+    bench.add_argument('--seconds', type=float, default=20.0, help="Length of the synthetic signal")
+    bench.add_argument('--wav', help="Use a 16 bit WAV recording instead of the synthetic signal")
+    bench.add_argument('--bitrates', default='6000,8000,10000,12000,16000,20000,24000,32000,48000,64000',
+                       help="Opus bitrates to measure (bit/s)")
+    bench.add_argument('--loss', type=float, default=0.1, help="Random packet loss of the loss columns")
+    bench.add_argument('--seed', type=int, default=1)
+    bench.add_argument('--json', action='store_true', help="Print a machine-readable report")
+
+    args = parser.parse_args()
+    run_bench(args)
+
+
+if __name__ == "__main__":
+    main()
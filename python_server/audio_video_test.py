@@ -2,6 +2,7 @@
 """
 Automated ESP32 audio streaming test
 """
+import select
 import socket
 import struct
 import threading
@@ -9,7 +10,6 @@ import time
 import sys
 import numpy as np
 import os
-from collections import defaultdict
 
 # Global variables for thread-safe video display
 current_frame = None
@@ -17,6 +17,10 @@ current_frame_id = None
 frame_condition = threading.Condition()  # Condition variable for frame availability
 import cv2
 
+import media_packets
+import media_playout
+import video_codecs
+
 # ESP32 Command definitions
 class Commands:
     REQUEST_TALK = 0
@@ -26,18 +30,7 @@ class Commands:
     TALK_ENDED = 4
     DOORBELL_RING = 5
     OPEN_DOOR = 6
-
-# Packet type definitions (matching udp_stream.c)
-class PacketTypes:
-    AUDIO_PACKAGE = 0
-    VIDEO_PACKAGE = 1
-
-HEADER_FORMAT = '<BIQH'
-HEADER_SIZE = struct.calcsize(HEADER_FORMAT)
-
-# Video packet header format
-VIDEO_HEADER_FORMAT = '<BIQHHH'
-VIDEO_HEADER_SIZE = struct.calcsize(VIDEO_HEADER_FORMAT)
+    REQUEST_KEYFRAME = 10
 
 # Configuration
 TCP_PORT = 12345
@@ -46,45 +39,17 @@ VIDEO_UDP_PORT = 12346
 CHUNK_SIZE = 324
 SAMPLE_RATE = 8000
 
-def parse_video_header(data):
-    """Parse video packet header and return header info and video data"""
-    if len(data) < VIDEO_HEADER_SIZE:
-        return None, None
-        
-    packet_type, frame_id, timestamp, length, packet_seq, total_packets = struct.unpack(VIDEO_HEADER_FORMAT, data[:VIDEO_HEADER_SIZE])
-    
-    video_data = data[VIDEO_HEADER_SIZE:VIDEO_HEADER_SIZE + length]
-    
-    header_info = {
-        'type': packet_type,
-        'frame_id': frame_id,
-        'timestamp': timestamp,
-        'length': length,
-        'packet_seq': packet_seq,
-        'total_packets': total_packets
-    }
-    
-    return header_info, video_data
-
-def parse_audio_header(data):
-    """Parse UDP packet header and return header info and audio data"""
-    
-    packet_type, seq_num, timestamp, length = struct.unpack(HEADER_FORMAT, data[:HEADER_SIZE])
-
-    audio_data = data[HEADER_SIZE:HEADER_SIZE + length]
-
-    header_info = {
-        'type': packet_type,
-        'sequence': seq_num,
-        'timestamp': timestamp,
-        'length': length
-    }
-
-    return header_info, audio_data
-
 def queue_video_frame_for_display(frame_data, frame_id):
     """Set current frame for main thread display (thread-safe)"""
     global current_frame, current_frame_id
+
+    # Decoded H.264 pictures need no validation
+    if isinstance(frame_data, np.ndarray):
+        with frame_condition:
+            current_frame = frame_data
+            current_frame_id = frame_id
+            frame_condition.notify()
+        return True
     
     # First, validate the JPEG data
     if len(frame_data) < 10:
@@ -110,15 +75,19 @@ def queue_video_frame_for_display(frame_data, frame_id):
 
 def display_frame(frame_data, frame_id):
     """Display the current frame (called from main thread only)"""
-        
-    # Verify JPEG markers
-    if not (frame_data[0] == 0xFF and frame_data[1] == 0xD8 and frame_data[-2] == 0xFF and frame_data[-1] == 0xD9):
-        print(f"Frame {frame_id} has invalid JPEG markers, skipping")
-        return False
-    
-    # Decode JPEG data
-    frame_array = np.frombuffer(frame_data, dtype=np.uint8)
-    frame = cv2.imdecode(frame_array, cv2.IMREAD_COLOR)
+
+    if isinstance(frame_data, np.ndarray):
+        # Already decoded from H.264 by the video thread
+        frame = frame_data.copy()
+    else:
+        # Verify JPEG markers
+        if not (frame_data[0] == 0xFF and frame_data[1] == 0xD8 and frame_data[-2] == 0xFF and frame_data[-1] == 0xD9):
+            print(f"Frame {frame_id} has invalid JPEG markers, skipping")
+            return False
+
+        # Decode JPEG data
+        frame_array = np.frombuffer(frame_data, dtype=np.uint8)
+        frame = cv2.imdecode(frame_array, cv2.IMREAD_COLOR)
     
     if frame is not None:
         # Add frame info overlay
@@ -138,102 +107,34 @@ def display_frame(frame_data, frame_id):
 
     return True
 
-def audio_processing_thread(udp_recv, udp_send, esp32_ip, stats, stop_event):
-    """Dedicated thread for audio packet processing"""
-    # Audio processing variables
-    seq = None
-    audio_store = {}
-    
+def receive_thread(udp_recv, video_udp_recv, udp_send, esp32_ip, receiver, stats, stop_event):
+    """Feed both media sockets to the playout of media_playout.py and queue the frames it shows"""
     while not stop_event.is_set():
         try:
-            data, addr = udp_recv.recvfrom(CHUNK_SIZE + HEADER_SIZE + 50)
-            
-            # Parse the header and extract audio data
-            header_info, audio_data = parse_audio_header(data)
-            
-            if header_info is None:
-                continue
-            
-            if header_info['type'] == PacketTypes.AUDIO_PACKAGE:
-                stats['audio_packets'] += 1
-                
-                # Check for missing sequences
-                if seq is not None and seq + 1 != header_info['sequence']:
-                    print(f"Missing audio sequence: expected {seq + 1}, got {header_info['sequence']}")
-                seq = header_info['sequence']
+            readable, _, _ = select.select([udp_recv, video_udp_recv], [], [], 0.02)
+            now_ms = time.time() * 1000
+            played = []
+            for sock in readable:
+                data, addr = sock.recvfrom(65535)  # Max UDP packet size
+                if sock is udp_recv:
+                    stats['audio_packets'] += 1
+                    # Echo the audio to the ESP32 speaker
+                    udp_send.sendto(data, (esp32_ip, UDP_PORT))
+                else:
+                    stats['video_packets'] += 1
+                played.append(receiver.receive(data, now_ms))
+            if not readable:
+                played.append(receiver.advance(now_ms))
 
-                udp_send.sendto(data, (esp32_ip, UDP_PORT))
-
-                # Prune old entries
-                if len(audio_store) > 2000:
-                    cutoff = seq - 1000
-                    for k in list(audio_store.keys()):
-                        if k < cutoff:
-                            del audio_store[k]
-
-        except socket.timeout:
-            continue
+            for _, frames in played:
+                for frame in frames:
+                    queue_video_frame_for_display(frame.data, frame.frame_id)
         except Exception as e:
             if not stop_event.is_set():
-                print(f"Audio receive error: {e}")
+                print(f"Receive error: {e}")
 
-def video_processing_thread(video_udp_recv, stats, stop_event):
-    """Simple video packet processing thread"""
-    video_frames = defaultdict(dict)
-    video_frame_info = {}
-    
-    while not stop_event.is_set():
-        try:
-            video_data, video_addr = video_udp_recv.recvfrom(65535)  # Max UDP packet size
-            video_header, video_payload = parse_video_header(video_data)
-            
-            if video_header and video_header['type'] == PacketTypes.VIDEO_PACKAGE:
-                stats['video_packets'] += 1
-                frame_id = video_header['frame_id']
-                packet_seq = video_header['packet_seq']
-                total_packets = video_header['total_packets']
-                
-                # Track unique frames
-                stats['unique_frames_seen'].add(frame_id)
-                
-                # Initialize frame info if needed
-                if frame_id not in video_frame_info:
-                    video_frame_info[frame_id] = {
-                        'total_packets': total_packets,
-                        'received_packets': set()
-                    }
-                
-                # Store packet
-                video_frames[frame_id][packet_seq] = video_payload
-                video_frame_info[frame_id]['received_packets'].add(packet_seq)
-                
-                # Check if frame is complete
-                if len(video_frame_info[frame_id]['received_packets']) == total_packets:
-                    
-                    # Assemble frame data quickly
-                    frame_data = b''.join(video_frames[frame_id][i] for i in range(total_packets))
-                    
-                    # Queue frame for display in main thread
-                    queue_video_frame_for_display(frame_data, frame_id)
-                    
-                    stats['completed_frames'] += 1
-                    
-                    # Clean up completed frame
-                    del video_frames[frame_id]
-                    del video_frame_info[frame_id]
-
-        except socket.timeout:
-            # Don't spam timeout messages
-            continue
-        except Exception as e:
-            if not stop_event.is_set():
-                print(f"Video receive error: {e}")
-    
-    print("Video processing thread stopping...")
-    
-    # Report any remaining incomplete frames
-    if len(video_frames) > 0:
-        print(f"{len(video_frames)} incomplete video frames at end")
+    print("Receive thread stopping...")
+    receiver.finish()
 
 def test_esp32_audio_video(esp32_ip: str):
     """Test ESP32 audio and video streaming with multi-threading"""
@@ -317,8 +218,6 @@ def test_esp32_audio_video(esp32_ip: str):
     stats = {
         'audio_packets': 0,
         'video_packets': 0,
-        'completed_frames': 0,
-        'unique_frames_seen': set(),  # Track unique frame IDs
     }
     
     # Threading control
@@ -330,27 +229,35 @@ def test_esp32_audio_video(esp32_ip: str):
     if video_udp_recv:
         video_udp_recv.settimeout(0.1)
     
-    # Start audio processing thread
-    audio_thread = threading.Thread(
-        target=audio_processing_thread,
-        args=(udp_recv, udp_send, esp32_ip, stats, stop_event),
-        name="AudioProcessor"
-    )
-    audio_thread.daemon = True
-    audio_thread.start()
-    threads.append(audio_thread)
-    print("Audio processing thread started")
-    
-    # Start video processing thread
-    video_thread = threading.Thread(
-        target=video_processing_thread,
-        args=(video_udp_recv, stats, stop_event),
-        name="VideoProcessor"
+    def request_keyframe():
+        try:
+            tcp_sock.send(struct.pack('<I', Commands.REQUEST_KEYFRAME))
+        except OSError:
+            pass
+
+    # H.264 frames are decoded in order, created on the first one; a loss asks the ESP32 for a keyframe
+    decoders = {'h264': None, 'slices': video_codecs.SliceReceiver(request_keyframe)}
+
+    def decode(frame, arrival_ms):
+        if frame.codec == media_packets.VIDEO_CODEC_H264:
+            if decoders['h264'] is None:
+                decoders['h264'] = video_codecs.H264Receiver(request_keyframe)
+            return decoders['h264'].frame(frame, arrival_ms)
+        # Slice updates (CONFIG_VIDEO_SLICE_UPDATES) are patched into the last JPEG frame
+        return decoders['slices'].frame(frame, arrival_ms)
+
+    # The jitter buffer and video playout the golden trace suite checks
+    receiver = media_playout.MediaReceiver(video=media_playout.VideoPlayout(decode=decode))
+
+    receive = threading.Thread(
+        target=receive_thread,
+        args=(udp_recv, video_udp_recv, udp_send, esp32_ip, receiver, stats, stop_event),
+        name="MediaReceiver"
     )
-    video_thread.daemon = True
-    video_thread.start()
-    threads.append(video_thread)
-    print("Video processing thread started")
+    receive.daemon = True
+    receive.start()
+    threads.append(receive)
+    print("Receive thread started")
 
     # Start time for test duration
     start_time = time.time()
@@ -362,7 +269,7 @@ def test_esp32_audio_video(esp32_ip: str):
             with frame_condition:
                 frame_condition.wait(timeout=0.1)  # 100ms timeout to check stop_event
                 global current_frame, current_frame_id
-                if current_frame and current_frame_id:
+                if current_frame is not None and current_frame_id:
                     if not display_frame(current_frame, current_frame_id):
                         # User pressed 'q' or ESC to quit
                         print("Video display stopped by user")
@@ -374,7 +281,7 @@ def test_esp32_audio_video(esp32_ip: str):
             # Print periodic stats
             elapsed = time.time() - start_time
             if int(elapsed) % 5 == 0 and elapsed - int(elapsed) < 0.1:  # Every 5 seconds
-                print(f"{elapsed:.1f}s - Audio: {stats['audio_packets']}, Video: {stats['video_packets']}, Frames: {stats['completed_frames']}")
+                print(f"{elapsed:.1f}s - Audio: {stats['audio_packets']}, Video: {stats['video_packets']}, Frames: {receiver.video.assembler.completed_frames}")
     except KeyboardInterrupt:
         print("\nInterrupted by user")
         stop_event.set()
@@ -404,22 +311,30 @@ def test_esp32_audio_video(esp32_ip: str):
     print(f"\nTest Results:")
     print(f"  Audio packets: {stats['audio_packets']}")
     print(f"  Video packets: {stats['video_packets']}")
-    print(f"  Completed video frames: {stats['completed_frames']}")
-    print(f"  Unique frames seen: {len(stats['unique_frames_seen'])}")
-    
+    playout = receiver.stats()
+    frames_seen = playout['frames_complete'] + playout['frames_incomplete']
+    print(f"  Completed video frames: {playout['frames_complete']}")
+    print(f"  Frames seen: {frames_seen}")
+
     # Frame completion analysis
-    if stats['unique_frames_seen']:
-        frame_ids = sorted(list(stats['unique_frames_seen']))
-        unique_frame_count = len(frame_ids)
-        incomplete_frames = stats['completed_frames'] - unique_frame_count
+    if frames_seen:
+        print(f"  Frame completion rate: {playout['frames_complete']}/{frames_seen} ({100*playout['frame_completion']:.1f}%)")
+        if playout['frames_incomplete'] > 0:
+            print(f"  Incomplete frames: {playout['frames_incomplete']}")
+        print(f"  Frames shown: {playout['frames_shown']}, stale: {playout['frames_stale']}, late: {playout['frames_late']}")
+    print(f"  Audio played: {playout['audio_played']}, concealed: {playout['audio_concealed']} "
+          f"({100*playout['audio_concealment_ratio']:.1f}%), lost: {playout['audio_lost']}, late: {playout['audio_late']}")
+    if decoders['h264'] is not None:
+        h264 = decoders['h264']
+        print(f"  H.264: {h264.decoded} frames decoded, {h264.frozen} frozen, {h264.requests} keyframe requests")
+    slices = decoders['slices']
+    if slices.updates or slices.frozen:
+        print(f"  Slice updates: {slices.updates} patched, {slices.frozen} frozen, "
+              f"{slices.requests} full frame requests")
 
-        print(f"  Frame completion rate: {stats['completed_frames']}/{unique_frame_count} ({100*stats['completed_frames']/unique_frame_count:.1f}%)")
-        if incomplete_frames > 0:
-            print(f"  Incomplete frames: {incomplete_frames}")
-    
     print(f"  Audio rate: {stats['audio_packets']/elapsed_time:.1f} packets/sec")
     print(f"  Video rate: {stats['video_packets']/elapsed_time:.1f} packets/sec")
-    print(f"  Video frame rate: {stats['completed_frames']/elapsed_time:.1f} frames/sec")
+    print(f"  Video frame rate: {playout['frames_complete']/elapsed_time:.1f} frames/sec")
 
     expected_audio_rate = (SAMPLE_RATE * 2 / CHUNK_SIZE)
     print(f"  Expected audio rate: {expected_audio_rate:.1f} packets/sec")
@@ -447,8 +362,8 @@ def test_esp32_audio_video(esp32_ip: str):
         video_udp_recv.close()
     
     # Report video results
-    if stats['completed_frames'] > 0:
-        print(f"Displayed {stats['completed_frames']} video frames in real-time using separate threads")
+    if playout['frames_shown'] > 0:
+        print(f"Displayed {playout['frames_shown']} video frames in real-time through media_playout")
 
     return stats['audio_packets'] > 0
 
@@ -0,0 +1,497 @@
+#!/usr/bin/env python3
+"""
+Benchmark runner and result history
+
+Runs the host benchmarks (the bench subcommands of the tools in this
+directory) on pinned CPUs with repeated trials, stores every result with the
+commit and machine it ran on in a local SQLite database, and compares runs:
+per metric the median of both runs and a bootstrap confidence interval of the
+change, flagged only when the interval excludes zero and a permutation test
+agrees.
+"""
+import argparse
+import ctypes.util
+import importlib.util
+import json
+import os
+import platform
+import shutil
+import sqlite3
+import subprocess
+import sys
+import time
+
+import numpy as np
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+DEFAULT_DB = os.path.join(HERE, 'bench_results.sqlite')
+
+HIGHER = 'higher'
+LOWER = 'lower'
+
+
+def _golden_metrics(report):
+    metrics = {}
+    for name, trace in report['traces'].items():
+        metrics[f"{name}.cpu_us_per_packet"] = (trace['metrics']['cpu_us_per_packet'], LOWER)
+        metrics[f"{name}.frame_completion"] = (trace['metrics']['frame_completion'], HIGHER)
+        metrics[f"{name}.audio_concealment_ratio"] = (trace['metrics']['audio_concealment_ratio'], LOWER)
+    return metrics
+
+
+# Benchmark name -> command line (relative to this directory, a Python tool or a native program) and the
+# metrics taken from its JSON report.
+# A metric is (value, better direction).
+BENCHMARKS = {
+    'frame_bus': {
+        'cmd': ['frame_bus.py', 'bench', '--consumers', '4', '--seconds', '3', '--json'],
+        'metrics': lambda r: {
+            'publish_rate': (r['publish_rate'], HIGHER),
+            'latency_p99_us': (max(c['latency_p99_us'] for c in r['per_consumer']), LOWER),
+        },
+    },
+    'relay_cluster': {
+        'cmd': ['relay_server.py', 'cluster-bench', '--seconds', '3', '--json'],
+        'metrics': lambda r: {
+            'forward_us_p50': (r['forward_us_p50'], LOWER),
+            'forward_us_p99': (r['forward_us_p99'], LOWER),
+            'subscribe_ms_forwarded_p50': (r['subscribe_ms_forwarded_p50'], LOWER),
+            'rebalance_s': (r['join']['rebalance_s'], LOWER),
+        },
+    },
+    'relay_join': {
+        'cmd': ['relay_server.py', 'join-bench', '--joins', '20', '--json'],
+        'metrics': lambda r: {
+            'first_frame_ms_p50': (r['cache_on']['first_frame_ms_p50'], LOWER),
+            'first_frame_ms_p95': (r['cache_on']['first_frame_ms_p95'], LOWER),
+        },
+    },
+    'relay_nack': {
+        'cmd': ['relay_server.py', 'nack-bench', '--viewers', '1,16', '--seconds', '2', '--json'],
+        'metrics': lambda r: {
+            'upstream_nacks_per_s_16': (r['proxy'][-1]['upstream_nacks_per_s'], LOWER),
+            'upstream_reduction_16': (r['proxy'][-1]['upstream_reduction'], HIGHER),
+        },
+    },
+    'relay_congestion': {
+        'cmd': ['relay_server.py', 'congestion-bench', '--warmup', '2', '--seconds', '3', '--json'],
+        'metrics': lambda r: {
+            'video_ms_p95': (r['managed']['slow']['video_ms_p95'], LOWER),
+            'slow_fps': (r['managed']['slow']['fps'], HIGHER),
+            'audio_loss': (r['managed']['slow']['audio_loss'], LOWER),
+        },
+    },
+    'relay_timeshift': {
+        'cmd': ['relay_server.py', 'timeshift-bench', '--viewers', '50', '--history-s', '5', '--seconds', '5',
+                '--json'],
+        'metrics': lambda r: {
+            'playout_us_p50': (r['playout_us_p50'], LOWER),
+            'seek_ack_ms_p50': (r['seek_ack_ms_p50'], LOWER),
+            'catchup_error_ms_p50': (r['catchup_error_ms_p50'], LOWER),
+        },
+    },
+    'relay_uplink': {
+        'cmd': ['relay_server.py', 'uplink-bench', '--viewers', '1,16', '--seconds', '2', '--json'],
+        'metrics': lambda r: {
+            'device_pps_16': (r['rounds'][-1]['device_pps'], LOWER),
+            'session_start_ms_p50': (r['rounds'][0]['session_start_ms_p50'], LOWER),
+            'session_stop_ms': (r['rounds'][0]['session_stop_ms'], LOWER),
+        },
+    },
+    'audio_codecs': {
+        'cmd': ['audio_codecs.py', 'bench', '--seconds', '10', '--bitrates', '8000,12000,16000,20000,24000', '--json'],
+        'metrics': lambda r: {
+            'opus8k_encode_us': (r['rates']['8000']['opus'][1]['encode_us_per_frame'], LOWER),
+            'opus8k_decode_us': (r['rates']['8000']['opus'][1]['decode_us_per_frame'], LOWER),
+            'opus16k_encode_us': (r['rates']['16000']['opus'][2]['encode_us_per_frame'], LOWER),
+            'opus8k_12k_lsd_db': (r['rates']['8000']['opus'][1]['lsd_db'], LOWER),
+            # The firmware default, the lowest bitrate that carries in-band FEC
+            'opus8k_20k_loss_fec_lsd_db': (r['rates']['8000']['opus'][3]['lsd_db_loss_fec'], LOWER),
+        },
+        'available': lambda: ctypes.util.find_library('opus') is not None,
+    },
+    'video_codecs': {
+        'cmd': ['video_codecs.py', 'bench', '--seconds', '10', '--bitrates', '100000,300000', '--json'],
+        'metrics': lambda r: {
+            'h264_300k_encode_ms': (r['h264'][1]['encode_ms_per_frame'], LOWER),
+            'h264_300k_decode_ms': (r['h264'][1]['decode_ms_per_frame'], LOWER),
+            'h264_300k_psnr_db': (r['h264'][1]['psnr_db'], HIGHER),
+            'h264_300k_loss_frozen': (r['h264'][1]['loss_frozen'], LOWER),
+        },
+        'available': lambda: importlib.util.find_spec('av') is not None,
+    },
+    'video_slices': {
+        'cmd': ['video_codecs.py', 'slices', '--seconds', '6', '--restart-mcus', '10', '--json'],
+        'metrics': lambda r: {
+            'slices_wire_kbps': (r['slices'][0]['wire_kbps'], LOWER),
+            'slices_psnr_db': (r['slices'][0]['psnr_db'], HIGHER),
+            'slices_loss_frozen': (r['slices'][0]['loss_frozen'], LOWER),
+        },
+    },
+    'archive': {
+        'cmd': ['archive.py', 'bench', '--minutes', '5', '--json'],
+        'metrics': lambda r: {
+            'record_us_per_frame': (r['record_us_per_frame'], LOWER),
+            'next_activity_ms_p50': (r['next_activity_ms_p50'], LOWER),
+            'histogram_ms_p50': (r['histogram_ms_p50'], LOWER),
+        },
+    },
+    'archive_compaction': {
+        'cmd': ['archive.py', 'compact-bench', '--days', '1', '--minutes', '5', '--baseline-s', '1', '--json'],
+        'metrics': lambda r: {
+            'mb_per_cpu_s': (r['mb_per_cpu_s'], HIGHER),
+            'saved_fraction': (r['saved_fraction'], HIGHER),
+            'ingest_ms_p99_compacting': (r['ingest_ms_p99_compacting'], LOWER),
+        },
+    },
+    'archive_sprites': {
+        'cmd': ['archive.py', 'sprite-bench', '--minutes', '10', '--json'],
+        'metrics': lambda r: {
+            'decode_per_s_scaled_4': (r['decode_per_s_scaled_4'], HIGHER),
+            'segment_ms_p99_scaled_4': (r['segment_ms_p99_scaled_4'], LOWER),
+            'timeline_open_ms_p50': (r['timeline_open_ms_p50'], LOWER),
+        },
+    },
+    'capture_analyzer': {
+        'cmd': [os.path.join('..', 'capture_analyzer', 'build', 'capture_analyzer'), '--bench-mb', '1024', '--json'],
+        'metrics': lambda r: {
+            'scan_gbps': (r['scan_gbps'], HIGHER),
+            'total_gbps': (r['total_gbps'], HIGHER),
+        },
+        # Native, needs a cmake build of capture_analyzer/
+        'available': lambda: os.path.exists(os.path.join(HERE, '..', 'capture_analyzer', 'build', 'capture_analyzer')),
+    },
+    'golden_traces': {
+        'cmd': ['golden_traces.py', 'run', '--json'],
+        'metrics': _golden_metrics,
+        # Budget failures exit with 1 but still produce a report
+        'ok_returncodes': (0, 1),
+    },
+    'qemu_e2e': {
+        'cmd': ['qemu_perf_test.py', 'qemu', '--seconds', '20', '--json'],
+        'metrics': lambda r: {
+            'grant_ms': (r['sessions'][0]['grant_ms'], LOWER),
+            'first_frame_ms': (r['sessions'][0]['first_frame_ms'], LOWER),
+            'fps': (r['sessions'][0]['fps'], HIGHER),
+            'frame_completion': (r['sessions'][0]['frame_completion'], HIGHER),
+        },
+        # Needs Espressif's QEMU and a -DQEMU=1 firmware build
+        'available': lambda: shutil.which('qemu-system-xtensa') is not None and
+        os.path.exists(os.path.join(HERE, '..', 'esp32_firmware', 'build_qemu', 'flash_args')),
+    },
+    'qemu_rejoin': {
+        'cmd': ['qemu_perf_test.py', 'rejoin', '--boots', '3', '--json'],
+        'metrics': lambda r: {
+            'cold_ip_ms': (r['cold_ip_ms'], LOWER),
+            'warm_ip_ms': (r['warm_ip_ms'], LOWER),
+            'warm_dhcp_ms': (r['warm_dhcp_ms'], LOWER),
+        },
+        'available': lambda: shutil.which('qemu-system-xtensa') is not None and
+        os.path.exists(os.path.join(HERE, '..', 'esp32_firmware', 'build_qemu', 'flash_args')),
+    },
+}
+
+SCHEMA = """
+CREATE TABLE IF NOT EXISTS runs (
+    id INTEGER PRIMARY KEY,
+    started TEXT NOT NULL,
+    label TEXT,
+    git_commit TEXT,
+    git_dirty INTEGER,
+    git_branch TEXT,
+    machine TEXT,
+    cpu_model TEXT,
+    cpu_count INTEGER,
+    pinned_cpus TEXT,
+    governor TEXT,
+    kernel TEXT,
+    python TEXT,
+    trials INTEGER
+);
+CREATE TABLE IF NOT EXISTS results (
+    run_id INTEGER NOT NULL REFERENCES runs(id),
+    benchmark TEXT NOT NULL,
+    metric TEXT NOT NULL,
+    direction TEXT NOT NULL,
+    trial INTEGER NOT NULL,
+    value REAL
+);
+CREATE TABLE IF NOT EXISTS reports (
+    run_id INTEGER NOT NULL REFERENCES runs(id),
+    benchmark TEXT NOT NULL,
+    trial INTEGER NOT NULL,
+    report TEXT NOT NULL
+);
+CREATE INDEX IF NOT EXISTS results_run ON results(run_id, benchmark, metric);
+"""
+
+
+def open_db(path):
+    db = sqlite3.connect(path)
+    db.executescript(SCHEMA)
+    return db
+
+
+def _git(*args):
+    try:
+        return subprocess.run(['git', *args], cwd=HERE, capture_output=True, text=True, check=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def _read_first_line(path, prefix=''):
+    try:
+        with open(path) as f:
+            for line in f:
+                if line.startswith(prefix):
+                    return line.split(':', 1)[-1].strip() if prefix else line.strip()
+    except OSError:
+        pass
+    return None
+
+
+def machine_info(cpus):
+    status = _git('status', '--porcelain', '--untracked-files=no')
+    return {
+        'git_commit': _git('rev-parse', 'HEAD'),
+        'git_dirty': None if status is None else int(bool(status)),
+        'git_branch': _git('rev-parse', '--abbrev-ref', 'HEAD'),
+        'machine': platform.node(),
+        'cpu_model': _read_first_line('/proc/cpuinfo', 'model name') or platform.processor(),
+        'cpu_count': os.cpu_count(),
+        'pinned_cpus': ','.join(map(str, sorted(cpus))) if cpus else None,
+        'governor': _read_first_line('/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor'),
+        'kernel': platform.platform(),
+        'python': platform.python_version(),
+    }
+
+
+def default_cpus(count):
+    """The last `count` CPUs this process may use; CPU 0 takes most interrupts"""
+    if not hasattr(os, 'sched_getaffinity'):
+        return None
+    allowed = sorted(os.sched_getaffinity(0))
+    if len(allowed) <= count:
+        return set(allowed)
+    return set(allowed[-count:])
+
+
+def run_benchmark(name, spec, cpus, timeout):
+    """Run one trial; returns the parsed JSON report"""
+    program = os.path.join(HERE, spec['cmd'][0])
+    # Python tools run with this interpreter, native ones directly
+    cmd = [sys.executable, program] if program.endswith('.py') else [program]
+    cmd += spec['cmd'][1:]
+    env = dict(os.environ, PYTHONHASHSEED='0')
+    pin = (lambda: os.sched_setaffinity(0, cpus)) if cpus else None
+    proc = subprocess.run(cmd, cwd=HERE, env=env, preexec_fn=pin, capture_output=True, text=True, timeout=timeout)
+    if proc.returncode not in spec.get('ok_returncodes', (0,)):
+        raise RuntimeError(f"{name} exited with {proc.returncode}: {proc.stderr.strip()[-500:]}")
+    # The report is the last JSON line, progress output may come before it
+    for line in reversed(proc.stdout.splitlines()):
+        if line.startswith('{'):
+            return json.loads(line)
+    raise RuntimeError(f"{name} printed no JSON report")
+
+
+def run(args):
+    names = args.benchmarks or list(BENCHMARKS)
+    unknown = [n for n in names if n not in BENCHMARKS]
+    if unknown:
+        print(f"Unknown benchmark(s): {', '.join(unknown)}; available: {', '.join(BENCHMARKS)}")
+        return 2
+    cpus = None if args.no_pin else ({int(c) for c in args.cpus.split(',')} if args.cpus else default_cpus(args.pin_count))
+
+    db = open_db(args.db)
+    info = machine_info(cpus)
+    cur = db.execute(
+        'INSERT INTO runs (started, label, trials, ' + ', '.join(info) + ') VALUES (?, ?, ?' + ', ?' * len(info) + ')',
+        (time.strftime('%Y-%m-%dT%H:%M:%S'), args.label, args.trials, *info.values()))
+    run_id = cur.lastrowid
+    db.commit()
+    commit = (info['git_commit'] or 'unknown')[:10] + ('+' if info['git_dirty'] else '')
+    print(f"Run {run_id} at {commit} on {info['machine']}, CPUs {info['pinned_cpus'] or 'not pinned'}")
+
+    failed = 0
+    for name in names:
+        spec = BENCHMARKS[name]
+        if 'available' in spec and not spec['available']():
+            print(f"  {name}: skipped, not available on this host")
+            continue
+        try:
+            for _ in range(args.warmup):
+                run_benchmark(name, spec, cpus, args.timeout)
+            for trial in range(args.trials):
+                report = run_benchmark(name, spec, cpus, args.timeout)
+                db.execute('INSERT INTO reports VALUES (?, ?, ?, ?)', (run_id, name, trial, json.dumps(report)))
+                db.executemany('INSERT INTO results VALUES (?, ?, ?, ?, ?, ?)',
+                               [(run_id, name, metric, direction, trial, value)
+                                for metric, (value, direction) in spec['metrics'](report).items()])
+                db.commit()
+        except (RuntimeError, subprocess.TimeoutExpired, KeyError, ValueError) as e:
+            print(f"  {name}: failed, {e}")
+            failed += 1
+            continue
+        medians = db.execute('SELECT metric, value FROM results WHERE run_id = ? AND benchmark = ? ORDER BY metric',
+                             (run_id, name)).fetchall()
+        summary = {}
+        for metric, value in medians:
+            summary.setdefault(metric, []).append(value)
+        print(f"  {name}: " + ', '.join(f"{m} {np.median(v):.4g}" for m, v in summary.items()))
+    db.close()
+    return 1 if failed else 0
+
+
+def resolve_run(db, ref):
+    """A run id, 'latest', a label or a commit prefix (newest matching run)"""
+    if ref == 'latest':
+        row = db.execute('SELECT id FROM runs ORDER BY id DESC LIMIT 1').fetchone()
+    elif ref.isdigit():
+        row = db.execute('SELECT id FROM runs WHERE id = ?', (int(ref),)).fetchone()
+    else:
+        row = db.execute('SELECT id FROM runs WHERE label = ? OR git_commit LIKE ? ORDER BY id DESC LIMIT 1',
+                         (ref, ref + '%')).fetchone()
+    if row is None:
+        raise ValueError(f"No run matches {ref}")
+    return row[0]
+
+
+def load_results(db, run_id):
+    results = {}
+    for benchmark, metric, direction, value in db.execute(
+            'SELECT benchmark, metric, direction, value FROM results WHERE run_id = ? ORDER BY trial', (run_id,)):
+        if value is not None:
+            results.setdefault((benchmark, metric), (direction, []))[1].append(value)
+    return results
+
+
+def bootstrap_change(base, new, resamples, confidence, rng):
+    """Relative change of the median and its bootstrap confidence interval"""
+    base = np.asarray(base)
+    new = np.asarray(new)
+    base_medians = np.median(rng.choice(base, (resamples, len(base))), axis=1)
+    new_medians = np.median(rng.choice(new, (resamples, len(new))), axis=1)
+    valid = base_medians != 0
+    changes = (new_medians[valid] - base_medians[valid]) / np.abs(base_medians[valid])
+    change = (np.median(new) - np.median(base)) / abs(np.median(base)) if np.median(base) else 0.0
+    if not len(changes):
+        return change, 0.0, 0.0
+    tail = (1 - confidence) / 2 * 100
+    low, high = np.percentile(changes, [tail, 100 - tail])
+    return change, low, high
+
+
+def permutation_p(base, new, resamples, rng):
+    """Two-sided p-value of the difference of the medians under random relabelling"""
+    pooled = np.concatenate([base, new])
+    observed = abs(np.median(new) - np.median(base))
+    shuffled = np.array([rng.permutation(pooled) for _ in range(resamples)])
+    diffs = np.abs(np.median(shuffled[:, len(base):], axis=1) - np.median(shuffled[:, :len(base)], axis=1))
+    return (np.count_nonzero(diffs >= observed - 1e-12) + 1) / (resamples + 1)
+
+
+def compare(args):
+    db = open_db(args.db)
+    try:
+        base_id, new_id = resolve_run(db, args.base), resolve_run(db, args.new)
+    except ValueError as e:
+        print(e)
+        return 2
+    runs = {row[0]: row for row in db.execute(
+        'SELECT id, git_commit, git_dirty, machine, cpu_model, pinned_cpus FROM runs WHERE id IN (?, ?)',
+        (base_id, new_id))}
+    base_run, new_run = runs[base_id], runs[new_id]
+    print(f"Base run {base_id} ({(base_run[1] or '?')[:10]}{'+' if base_run[2] else ''}) -> "
+          f"run {new_id} ({(new_run[1] or '?')[:10]}{'+' if new_run[2] else ''})")
+    if base_run[3:] != new_run[3:]:
+        print("Warning: the runs differ in machine, CPU model or pinning, differences may not be meaningful")
+
+    base, new = load_results(db, base_id), load_results(db, new_id)
+    db.close()
+    rng = np.random.default_rng(0)
+    regressions = improvements = 0
+    rows = []
+    for key in sorted(set(base) & set(new)):
+        direction, base_values = base[key]
+        new_values = new[key][1]
+        change, low, high = bootstrap_change(base_values, new_values, args.resamples, args.confidence, rng)
+        p = permutation_p(base_values, new_values, args.resamples // 10, rng)
+        significant = (low > 0 or high < 0) and p < 1 - args.confidence and abs(change) >= args.threshold
+        worse = change < 0 if direction == HIGHER else change > 0
+        verdict = ''
+        if significant:
+            verdict = 'REGRESSION' if worse else 'improved'
+            regressions += worse
+            improvements += not worse
+        if significant or args.all:
+            rows.append((f"{key[0]}.{key[1]}", np.median(base_values), np.median(new_values), change, low, high, p,
+                         verdict))
+
+    if args.json:
+        print(json.dumps({'base_run': base_id, 'new_run': new_id, 'regressions': regressions,
+                          'improvements': improvements,
+                          'metrics': [dict(zip(('metric', 'base_median', 'new_median', 'change', 'ci_low', 'ci_high',
+                                                'p_value', 'verdict'), row)) for row in rows]}))
+    else:
+        print(f"  {'metric':<48}{'base':>11}{'new':>11}{'change':>9}   {100 * args.confidence:.0f}% CI{'':<14}p")
+        for metric, old, value, change, low, high, p, verdict in rows:
+            ci = f"[{100 * low:+.1f}%, {100 * high:+.1f}%]"
+            print(f"  {metric:<48}{old:>11.4g}{value:>11.4g}{100 * change:>+8.1f}%   {ci:<20}{p:<7.3f}{verdict}")
+        only = set(base) ^ set(new)
+        if only:
+            print(f"  {len(only)} metric(s) only in one of the runs")
+        print(f"{regressions} regression(s), {improvements} improvement(s)")
+    return 1 if regressions and args.fail_on_regression else 0
+
+
+def list_runs(args):
+    db = open_db(args.db)
+    for row in db.execute('SELECT r.id, r.started, r.label, r.git_commit, r.git_dirty, r.machine, r.trials, '
+                          'COUNT(DISTINCT s.benchmark) FROM runs r LEFT JOIN results s ON s.run_id = r.id '
+                          'GROUP BY r.id ORDER BY r.id DESC LIMIT ?', (args.limit,)):
+        run_id, started, label, commit, dirty, machine, trials, benchmarks = row
+        print(f"{run_id:>5}  {started}  {(commit or '?')[:10]}{'+' if dirty else ' '}  {machine:<16} "
+              f"{benchmarks} benchmark(s) x {trials}  {label or ''}")
+    db.close()
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--db', default=DEFAULT_DB, help="Results database")
+    sub = parser.add_subparsers(dest='command', required=True)
+
+    run_parser = sub.add_parser('run', help="Run benchmarks and store the results")
+    run_parser.add_argument('benchmarks', nargs='*', help=f"Benchmarks to run: {', '.join(BENCHMARKS)} (default all)")
+    run_parser.add_argument('--trials', type=int, default=5)
+    run_parser.add_argument('--warmup', type=int, default=1, help="Untimed runs before the trials")
+    run_parser.add_argument('--cpus', help="Pin to these CPUs, e.g. 2,3")
+    run_parser.add_argument('--pin-count', type=int, default=4, help="Without --cpus, pin to the last N CPUs")
+    run_parser.add_argument('--no-pin', action='store_true', help="Do not pin the benchmarks")
+    run_parser.add_argument('--label', help="Name of the run, usable instead of the id")
+    run_parser.add_argument('--timeout', type=float, default=600, help="Per trial, seconds")
+
+    compare_parser = sub.add_parser('compare', help="Compare two runs")
+    compare_parser.add_argument('base', help="Run id, label, commit prefix or 'latest'")
+    compare_parser.add_argument('new', nargs='?', default='latest')
+    compare_parser.add_argument('--confidence', type=float, default=0.95)
+    compare_parser.add_argument('--resamples', type=int, default=10000, help="Bootstrap resamples")
+    compare_parser.add_argument('--threshold', type=float, default=0.02,
+                                help="Ignore significant changes smaller than this fraction")
+    compare_parser.add_argument('--all', action='store_true', help="Also show unchanged metrics")
+    compare_parser.add_argument('--fail-on-regression', action='store_true', help="Exit with 1 on a regression")
+    compare_parser.add_argument('--json', action='store_true', help="Print a machine-readable report")
+
+    list_parser = sub.add_parser('list', help="List the stored runs")
+    list_parser.add_argument('--limit', type=int, default=20)
+
+    args = parser.parse_args()
+    if args.command == 'run':
+        return run(args)
+    if args.command == 'compare':
+        return compare(args)
+    return list_runs(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
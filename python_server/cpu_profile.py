@@ -0,0 +1,395 @@
+#!/usr/bin/env python3
+"""
+CPU profile of the device
+
+Fetches the samples of the firmware's CPU profiler (CONFIG_CPU_PROFILER: a
+timer interrupt per core records the interrupted PC and a few callers while a
+session runs) over the control connection, symbolizes them against the
+firmware ELF and reports the hot functions, or writes a pprof profile or
+folded stacks for flamegraph.pl / speedscope.
+"""
+import argparse
+import bisect
+import collections
+import gzip
+import json
+import os
+import socket
+import struct
+import subprocess
+import sys
+import time
+
+import media_packets
+
+PROFILE_MAGIC = b'CPRF'  # CPU_PROFILE_MAGIC in cpu_profiler.h
+PROFILE_VERSION = 1
+PROFILE_HEADER = '<4sHHBBHIII'  # magic, version, rate (Hz), cores, tasks, reserved, samples, overwritten, sampled ms
+PROFILE_HEADER_SIZE = struct.calcsize(PROFILE_HEADER)
+TASK_NAME_LEN = 16
+SAMPLE_HEADER = '<BBBx'          # core, task, frames
+SAMPLE_HEADER_SIZE = struct.calcsize(SAMPLE_HEADER)
+UNKNOWN_TASK = 0xFF
+
+# The stack walk starts in the timer interrupt, these frames come before the interrupted code
+ISR_FUNCTIONS = {'_sample_isr', 'gptimer_default_isr', 'shared_intr_isr'}
+ISR_PREFIXES = ('_xt_lowint', '_xt_medint', '_xt_highint', '_xt_user_exc', '_xt_int')
+
+DEFAULT_ELF = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'esp32_firmware', 'build',
+                           'tfg_project.elf')
+FETCH_TIMEOUT_S = 10.0
+
+
+class Profile:
+    """Decoded CPU_PROFILE dump"""
+
+    def __init__(self, data):
+        (magic, version, self.rate_hz, self.cores, task_count, _, sample_count,
+         self.overwritten, self.sampled_ms) = struct.unpack_from(PROFILE_HEADER, data)
+        if magic != PROFILE_MAGIC or version != PROFILE_VERSION:
+            raise ValueError(f"Not a CPU profile (magic {magic!r}, version {version})")
+        offset = PROFILE_HEADER_SIZE
+        self.tasks = []
+        for _ in range(task_count):
+            self.tasks.append(data[offset:offset + TASK_NAME_LEN].split(b'\0', 1)[0].decode(errors='replace'))
+            offset += TASK_NAME_LEN
+        # (core, task name, PCs innermost first)
+        self.samples = []
+        for _ in range(sample_count):
+            core, task, frames = struct.unpack_from(SAMPLE_HEADER, data, offset)
+            offset += SAMPLE_HEADER_SIZE
+            pcs = struct.unpack_from(f'<{frames}I', data, offset)
+            offset += 4 * frames
+            name = self.tasks[task] if task < len(self.tasks) else '?'
+            self.samples.append((core, name, pcs))
+
+    @property
+    def period_ns(self):
+        return 1e9 / self.rate_hz
+
+
+class ElfSymbols:
+    """Function symbols of an ELF file, for address to name lookups
+
+    Reads the symbol table directly (ELF32 and ELF64, little endian), so no
+    toolchain is needed for function level profiles.
+    """
+
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            data = f.read()
+        if data[:4] != b'\x7fELF' or data[5] != 1:
+            raise ValueError(f"{path} is not a little endian ELF file")
+        elf64 = data[4] == 2
+        if elf64:
+            shoff, = struct.unpack_from('<Q', data, 0x28)
+            shentsize, shnum = struct.unpack_from('<HH', data, 0x3A)
+            section_format, symbol_format = '<IIQQQQIIQQ', '<IBBHQQ'
+        else:
+            shoff, = struct.unpack_from('<I', data, 0x20)
+            shentsize, shnum = struct.unpack_from('<HH', data, 0x2E)
+            section_format, symbol_format = '<IIIIIIIIII', '<IIIBBH'
+        sections = [struct.unpack_from(section_format, data, shoff + i * shentsize) for i in range(shnum)]
+
+        # Executable sections, a PC outside them has no function even after the last symbol
+        self.code = [(section[3], section[3] + section[5]) for section in sections
+                     if section[2] & 0x4 and section[3]]  # SHF_EXECINSTR
+        functions = {}
+        for section in sections:
+            if section[1] != 2:  # SHT_SYMTAB
+                continue
+            offset, size, link, entsize = section[4], section[5], section[6], section[9]
+            strtab = sections[link]
+            for pos in range(offset, offset + size, entsize):
+                if elf64:
+                    name, info, _, _, value, length = struct.unpack_from(symbol_format, data, pos)
+                else:
+                    name, value, length, info, _, _ = struct.unpack_from(symbol_format, data, pos)
+                if info & 0xF != 2 or value == 0:  # STT_FUNC
+                    continue
+                end = data.index(b'\0', strtab[4] + name)
+                # Keep the global one of aliases at the same address
+                if value not in functions or info >> 4 == 1:
+                    functions[value] = (data[strtab[4] + name:end].decode(errors='replace'), length)
+        self.starts = sorted(functions)
+        self.functions = [functions[start] for start in self.starts]
+
+    def lookup(self, pc):
+        """Function name and start address of a PC, (None, None) outside all functions"""
+        i = bisect.bisect_right(self.starts, pc) - 1
+        if i < 0 or not any(start <= pc < end for start, end in self.code):
+            return None, None
+        name, length = self.functions[i]
+        start = self.starts[i]
+        # Assembly symbols often have no size, accept the PC up to the next symbol
+        if length and pc >= start + length:
+            return None, None
+        return name, start
+
+
+def addr2line_lines(tool, elf, pcs):
+    """File and line of every PC via the toolchain's addr2line: pc -> (file, line)"""
+    pcs = sorted(pcs)
+    result = subprocess.run([tool, '-e', elf], input=''.join(f'{pc:#x}\n' for pc in pcs),
+                            capture_output=True, text=True, check=True)
+    lines = {}
+    for pc, text in zip(pcs, result.stdout.splitlines()):
+        path, _, line = text.rpartition(':')
+        line = line.split()[0] if line else '0'
+        if path and path != '??':
+            lines[pc] = (path, int(line) if line.isdigit() else 0)
+    return lines
+
+
+class Symbolizer:
+    def __init__(self, elf, addr2line=None):
+        self.symbols = ElfSymbols(elf)
+        self.elf = elf
+        self.addr2line = addr2line
+        self.lines = {}
+
+    def load_lines(self, pcs):
+        if self.addr2line:
+            self.lines = addr2line_lines(self.addr2line, self.elf, pcs)
+
+    def name(self, pc):
+        name, _ = self.symbols.lookup(pc)
+        return name if name is not None else f'{pc:#010x}'
+
+
+def is_isr_frame(name):
+    return name in ISR_FUNCTIONS or name.startswith(ISR_PREFIXES)
+
+
+def symbolize(profile, symbolizer, keep_isr=False):
+    """Aggregate the samples: (core, task, PCs innermost first) -> count, ISR frames stripped"""
+    stacks = collections.Counter()
+    for core, task, pcs in profile.samples:
+        pcs = list(pcs)
+        if not keep_isr:
+            while pcs and is_isr_frame(symbolizer.name(pcs[0])):
+                pcs.pop(0)
+        if pcs:
+            stacks[(core, task, tuple(pcs))] += 1
+    return stacks
+
+
+def function_table(stacks, symbolizer):
+    """Per function: samples with it on top (self) and anywhere in the stack (total)"""
+    own = collections.Counter()
+    total = collections.Counter()
+    for (_, _, pcs), count in stacks.items():
+        names = [symbolizer.name(pc) for pc in pcs]
+        own[names[0]] += count
+        for name in set(names):
+            total[name] += count
+    return own, total
+
+
+def folded_stacks(stacks, symbolizer):
+    """Lines of flamegraph.pl input: task;outermost;...;innermost count"""
+    folded = collections.Counter()
+    for (_, task, pcs), count in stacks.items():
+        frames = [task] + [symbolizer.name(pc) for pc in reversed(pcs)]
+        folded[';'.join(frame.replace(';', ':') for frame in frames)] += count
+    return [f'{stack} {count}' for stack, count in sorted(folded.items())]
+
+
+class ProtoWriter:
+    """Just enough protobuf encoding for profile.proto"""
+
+    def __init__(self):
+        self.parts = []
+
+    @staticmethod
+    def _varint(value):
+        out = bytearray()
+        value &= (1 << 64) - 1
+        while True:
+            byte = value & 0x7F
+            value >>= 7
+            if value:
+                out.append(byte | 0x80)
+            else:
+                out.append(byte)
+                return bytes(out)
+
+    def int(self, field, value):
+        if value:
+            self.parts.append(self._varint(field << 3) + self._varint(value))
+        return self
+
+    def bytes(self, field, value):
+        self.parts.append(self._varint(field << 3 | 2) + self._varint(len(value)) + value)
+        return self
+
+    def message(self, field, writer):
+        return self.bytes(field, writer.encode())
+
+    def packed(self, field, values):
+        if values:
+            self.bytes(field, b''.join(self._varint(v) for v in values))
+        return self
+
+    def encode(self):
+        return b''.join(self.parts)
+
+
+def pprof_profile(profile, stacks, symbolizer):
+    """gzipped profile.proto for `go tool pprof` / pprof"""
+    strings = {'': 0}
+
+    def string(text):
+        if text not in strings:
+            strings[text] = len(strings)
+        return strings[text]
+
+    def value_type(kind, unit):
+        return ProtoWriter().int(1, string(kind)).int(2, string(unit))
+
+    period = int(profile.period_ns)
+    out = ProtoWriter()
+    out.message(1, value_type('samples', 'count'))
+    out.message(1, value_type('cpu', 'nanoseconds'))
+
+    pcs = sorted({pc for (_, _, stack) in stacks for pc in stack})
+    symbolizer.load_lines(pcs)
+    location_ids = {pc: i + 1 for i, pc in enumerate(pcs)}
+    function_ids = {}
+    for (core, task, stack), count in sorted(stacks.items()):
+        sample = ProtoWriter().packed(1, [location_ids[pc] for pc in stack]).packed(2, [count, count * period])
+        sample.message(3, ProtoWriter().int(1, string('task')).int(2, string(task)))
+        sample.message(3, ProtoWriter().int(1, string('core')).int(2, string(str(core))))
+        out.message(2, sample)
+
+    mapping = (ProtoWriter().int(1, 1).int(3, (1 << 32) - 1)
+               .int(5, string(os.path.basename(symbolizer.elf))).int(7, 1)
+               .int(8, 1 if symbolizer.lines else 0).int(9, 1 if symbolizer.lines else 0))
+    out.message(3, mapping)
+    functions = []
+    for pc in pcs:
+        name = symbolizer.name(pc)
+        path, line = symbolizer.lines.get(pc, ('', 0))
+        if name not in function_ids:
+            function_ids[name] = len(function_ids) + 1
+            functions.append(ProtoWriter().int(1, function_ids[name]).int(2, string(name))
+                             .int(3, string(name)).int(4, string(path)))
+        line_entry = ProtoWriter().int(1, function_ids[name]).int(2, line)
+        out.message(4, ProtoWriter().int(1, location_ids[pc]).int(2, 1).int(3, pc).message(4, line_entry))
+    for function in functions:
+        out.message(5, function)
+    for text in strings:
+        out.bytes(6, text.encode())
+    out.int(9, time.time_ns())
+    out.int(10, profile.sampled_ms * 1000000)
+    out.message(11, value_type('cpu', 'nanoseconds'))
+    out.int(12, period)
+    return gzip.compress(out.encode())
+
+
+def fetch_profile(host, port, timeout=FETCH_TIMEOUT_S):
+    """Ask the device for its samples on a control connection of its own"""
+    with socket.create_connection((host, port), timeout=timeout) as sock:
+        sock.sendall(struct.pack('<I', media_packets.CMD_CPU_PROFILE))
+        reader = media_packets.ControlReader()
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            data = sock.recv(65536)
+            if not data:
+                break
+            for command, _, payload in reader.feed(data):
+                if command == media_packets.CMD_CPU_PROFILE:
+                    return payload
+    raise TimeoutError("No CPU_PROFILE reply, is the firmware built with CONFIG_CPU_PROFILER?")
+
+
+def report(args, profile, stacks, symbolizer):
+    own, total = function_table(stacks, symbolizer)
+    # Callers without self samples follow the ones that have them
+    hottest = sorted(total, key=lambda name: (own[name], total[name]), reverse=True)[:args.top]
+    samples = sum(stacks.values())
+    tasks = collections.Counter()
+    for (_, task, _), count in stacks.items():
+        tasks[task] += count
+    if args.json:
+        print(json.dumps({
+            'rate_hz': profile.rate_hz, 'cores': profile.cores, 'sampled_ms': profile.sampled_ms,
+            'samples': samples, 'overwritten': profile.overwritten,
+            'tasks': dict(tasks.most_common()),
+            'functions': [{'name': name, 'self': own[name], 'total': total[name]} for name in hottest],
+        }))
+        return
+    # The timer also fires in the idle tasks, missing periods were spent with the flash cache disabled
+    coverage = samples / max(1.0, profile.sampled_ms / 1000.0 * profile.rate_hz * profile.cores)
+    print(f"{samples} samples at {profile.rate_hz} Hz on {profile.cores} cores over {profile.sampled_ms / 1000:.1f} s "
+          f"({coverage:.0%} of the timer periods), {profile.overwritten} overwritten by the ring")
+    print("Tasks:")
+    for task, count in tasks.most_common():
+        print(f"  {count / samples:6.1%} {task}")
+    print(f"Functions (top {args.top} by self samples):")
+    print(f"  {'self':>6} {'total':>6}  function")
+    for name in hottest:
+        print(f"  {own[name] / samples:6.1%} {total[name] / samples:6.1%}  {name}")
+
+
+def load(args):
+    with open(args.profile, 'rb') as f:
+        profile = Profile(f.read())
+    symbolizer = Symbolizer(args.elf, args.addr2line)
+    return profile, symbolize(profile, symbolizer, args.keep_isr), symbolizer
+
+
+def run_fetch(args):
+    data = fetch_profile(args.device, args.port)
+    with open(args.output, 'wb') as f:
+        f.write(data)
+    profile = Profile(data)
+    print(f"Wrote {len(profile.samples)} samples ({len(data)} bytes) to {args.output}")
+    return 0
+
+
+def run_report(args):
+    profile, stacks, symbolizer = load(args)
+    if not stacks:
+        print("The profile holds no samples, run a session first")
+        return 1
+    if args.pprof:
+        with open(args.pprof, 'wb') as f:
+            f.write(pprof_profile(profile, stacks, symbolizer))
+        print(f"Wrote {args.pprof}, view it with: go tool pprof -http=: {args.pprof}")
+    if args.folded:
+        with open(args.folded, 'w') as f:
+            f.write('\n'.join(folded_stacks(stacks, symbolizer)) + '\n')
+        print(f"Wrote {args.folded}, render it with: flamegraph.pl {args.folded} > profile.svg")
+    if not args.pprof and not args.folded or args.json:
+        report(args, profile, stacks, symbolizer)
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    sub = parser.add_subparsers(dest='command', required=True)
+
+    fetch = sub.add_parser('fetch', help="Fetch the samples of the device (and clear them there)")
+    fetch.add_argument('device', help="Address of the device")
+    fetch.add_argument('--port', type=int, default=media_packets.CONTROL_TCP_PORT)
+    fetch.add_argument('-o', '--output', default='cpu_profile.bin')
+
+    show = sub.add_parser('report', help="Symbolize a fetched profile and report or convert it")
+    show.add_argument('profile')
+    show.add_argument('--elf', default=DEFAULT_ELF, help="Firmware ELF of the build that took the samples")
+    show.add_argument('--addr2line', help="Toolchain addr2line (e.g. xtensa-esp32s3-elf-addr2line) for source lines")
+    show.add_argument('--pprof', help="Write a gzipped pprof profile")
+    show.add_argument('--folded', help="Write folded stacks for flamegraph.pl or speedscope")
+    show.add_argument('--top', type=int, default=25)
+    show.add_argument('--keep-isr', action='store_true', help="Keep the frames of the sampling interrupt")
+    show.add_argument('--json', action='store_true', help="Print a machine-readable report")
+
+    args = parser.parse_args()
+    if args.command == 'fetch':
+        return run_fetch(args)
+    return run_report(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
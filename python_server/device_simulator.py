@@ -0,0 +1,340 @@
+#!/usr/bin/env python3
+"""
+ESP32 device simulator
+
+Runs any number of simulated doorbells in one process. Each device listens for
+the TCP control protocol of device_manager.c on its own loopback address and,
+once a client is granted talk permission, streams audio and video datagrams to
+that client exactly like udp_stream.c and video_manager.c do.
+"""
+import argparse
+import collections
+import heapq
+import ipaddress
+import os
+import random
+import selectors
+import socket
+import struct
+import sys
+import time
+
+import media_packets
+
+AUDIO_CHUNK_SIZE = 324
+AUDIO_SAMPLE_RATE = 8000
+AUDIO_INTERVAL_S = AUDIO_CHUNK_SIZE / (AUDIO_SAMPLE_RATE * 2)
+UPLINK_RETRY_S = 2.0            # CONFIG_RELAY_UPLINK_RETRY_MS
+RETRANSMIT_PACKETS = 48         # CONFIG_VIDEO_RETRANSMIT_PACKETS
+
+
+def load_frames(jpeg_dir):
+    """Load all JPEG files of a directory, sorted by name"""
+    frames = []
+    for name in sorted(os.listdir(jpeg_dir)):
+        if name.lower().endswith(('.jpg', '.jpeg')):
+            with open(os.path.join(jpeg_dir, name), 'rb') as f:
+                frames.append(f.read())
+    if not frames:
+        raise ValueError(f"No JPEG files found in {jpeg_dir}")
+    return frames
+
+
+def synthetic_frames(count, size, seed):
+    """JPEG-shaped frames (SOI ... EOI) with random content, enough for transport tests"""
+    rng = random.Random(seed)
+    frames = []
+    for _ in range(count):
+        length = max(16, int(rng.gauss(size, size * 0.1)))
+        frames.append(b'\xff\xd8' + rng.randbytes(length - 4) + b'\xff\xd9')
+    return frames
+
+
+class SimulatedDevice:
+    """One doorbell: control server, talker arbitration and media senders"""
+
+    def __init__(self, ip, args, frames):
+        self.ip = ip
+        self.args = args
+        self.frames = frames
+        self.frame_index = random.randrange(len(frames))
+        self.clients = {}
+        self.talker = None
+        self.stream_ip = None
+        self.uplink_conn = None
+        self.audio_seq = 0
+        self.frame_id = 0
+        self.audio_block = bytes(AUDIO_CHUNK_SIZE)
+        self.sessions = 0
+        self.packets_sent = 0
+        self.sent_video = collections.OrderedDict()  # (frame id, packet seq), 12 bits each -> datagram
+        self.nacks = 0
+        self.retransmits = 0
+
+        self.listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listener.bind((ip, args.control_port))
+        self.listener.listen(5)  # MAX_CLIENTS in device_manager.h
+        self.listener.setblocking(False)
+
+        # The firmware sends audio and video from separate sockets
+        self.audio_sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.audio_sock.bind((ip, 0))
+        self.video_sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.video_sock.bind((ip, 0))
+
+    @property
+    def streaming(self):
+        return self.stream_ip is not None
+
+    def start_stream(self, dest_ip):
+        self.stream_ip = dest_ip
+        self.sessions += 1
+        self.sent_video.clear()
+
+    def stop_stream(self):
+        self.stream_ip = None
+
+    def handle_command(self, conn, command):
+        reply = None
+        if command == media_packets.CMD_REQUEST_TALK:
+            if self.talker is None:
+                self.talker = conn
+                reply = media_packets.CMD_GRANT_TALK
+                self.start_stream(self.clients[conn])
+            else:
+                reply = media_packets.CMD_DENY_TALK
+        elif command == media_packets.CMD_END_TALK:
+            if self.talker is conn:
+                self.talker = None
+                self.stop_stream()
+                reply = media_packets.CMD_TALK_ENDED
+            else:
+                reply = media_packets.CMD_TALK_DID_NOT_END
+        elif command == media_packets.CMD_OPEN_DOOR:
+            reply = media_packets.CMD_OPEN_DOOR
+        elif command & 0xFF == media_packets.CMD_SET_CODEC:
+            # Only PCM is simulated, like firmware built without CONFIG_AUDIO_OPUS
+            reply = media_packets.CMD_CODEC_SELECTED | media_packets.CODEC_PCM << 8
+        elif command & 0xFF == media_packets.CMD_NACK:
+            if self.talker is conn and self.streaming:
+                self.retransmit(command >> 8)
+        if reply is not None:
+            try:
+                conn.send(struct.pack('<I', reply))
+            except OSError:
+                pass
+
+    def drop_client(self, conn):
+        self.clients.pop(conn, None)
+        if self.talker is conn:
+            self.talker = None
+            self.stop_stream()
+        conn.close()
+
+    def send_audio(self):
+        packet = media_packets.build_audio_packet(self.audio_seq, media_packets.now_ms(), self.audio_block)
+        self.audio_seq += 1
+        self._send(self.audio_sock, packet, self.args.audio_port)
+
+    def send_frame(self, trace=None):
+        cap_start = time.time_ns() // 1000
+        frame = self.frames[self.frame_index]
+        self.frame_index = (self.frame_index + 1) % len(self.frames)
+        cap_end = time.time_ns() // 1000
+        timestamp = media_packets.now_ms()
+        packets = media_packets.build_video_packets(self.frame_id, timestamp, frame)
+        send_start = time.time_ns() // 1000
+        for packet_seq, packet in enumerate(packets):
+            self._send(self.video_sock, packet, self.args.video_port)
+            # Kept like video_manager.c does with CONFIG_VIDEO_RETRANSMIT
+            key = (self.frame_id & media_packets.NACK_ID_MASK, packet_seq & media_packets.NACK_ID_MASK)
+            self.sent_video[key] = packet
+            self.sent_video.move_to_end(key)
+            if len(self.sent_video) > RETRANSMIT_PACKETS:
+                self.sent_video.popitem(last=False)
+        send_end = time.time_ns() // 1000
+        if trace is not None:
+            # Same line as the firmware logs with CONFIG_LATENCY_TRACE
+            uptime_ms = time.monotonic_ns() // 1000000
+            trace.write(f"I ({uptime_ms}) LATENCY: frame={self.frame_id} ts={timestamp} cap_start={cap_start} "
+                        f"cap_end={cap_end} send_start={send_start} send_end={send_end} len={len(frame)}\n")
+        self.frame_id += 1
+
+    def retransmit(self, argument):
+        self.nacks += 1
+        key = (argument & media_packets.NACK_ID_MASK,
+               argument >> media_packets.NACK_SEQ_SHIFT & media_packets.NACK_ID_MASK)
+        packet = self.sent_video.get(key)
+        if packet is not None:
+            self.retransmits += 1
+            self._send(self.video_sock, packet, self.args.video_port)
+
+    def _send(self, sock, packet, port):
+        if self.args.loss and random.random() < self.args.loss:
+            return
+        try:
+            sock.sendto(packet, (self.stream_ip, port))
+            self.packets_sent += 1
+        except OSError:
+            pass
+
+
+class DeviceSimulator:
+    """Event loop driving all simulated devices from a single thread"""
+
+    def __init__(self, args):
+        if args.jpeg_dir:
+            frames = load_frames(args.jpeg_dir)
+        else:
+            frames = synthetic_frames(32, args.frame_size, args.seed)
+
+        base = ipaddress.IPv4Address(args.base_ip)
+        self.devices = [SimulatedDevice(str(base + i), args, frames) for i in range(args.devices)]
+        self.args = args
+        self.trace = open(args.trace_log, 'a', buffering=1) if args.trace_log else None
+        self.selector = selectors.DefaultSelector()
+        self.timers = []
+        for device in self.devices:
+            self.selector.register(device.listener, selectors.EVENT_READ, (device, None))
+            # Spread the devices so that they do not all send at the same instant
+            offset = random.random()
+            heapq.heappush(self.timers, (time.monotonic() + offset * AUDIO_INTERVAL_S, id(device), 'audio', device))
+            heapq.heappush(self.timers, (time.monotonic() + offset / args.fps, id(device) + 1, 'video', device))
+        self.uplink = None
+        if args.uplink:
+            host, port = args.uplink.rsplit(':', 1)
+            self.uplink = (host, int(port))
+            for device in self.devices:
+                self._connect_uplink(device)
+
+    def run(self, duration=None):
+        end = None if duration is None else time.monotonic() + duration
+        while end is None or time.monotonic() < end:
+            timeout = max(0.0, self.timers[0][0] - time.monotonic()) if self.timers else 0.1
+            for key, _ in self.selector.select(timeout):
+                device, conn = key.data
+                if conn is None:
+                    self._accept(device)
+                else:
+                    self._read_command(device, conn)
+            self._run_timers()
+
+    def _accept(self, device):
+        try:
+            conn, addr = device.listener.accept()
+        except BlockingIOError:
+            return
+        conn.setblocking(False)
+        conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        device.clients[conn] = addr[0]
+        self.selector.register(conn, selectors.EVENT_READ, (device, conn))
+
+    def _connect_uplink(self, device):
+        """Outbound control connection of CONFIG_RELAY_UPLINK, served like an accepted client"""
+        conn = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        conn.bind((device.ip, 0))
+        conn.settimeout(1.0)
+        try:
+            conn.connect(self.uplink)
+        except OSError:
+            conn.close()
+            heapq.heappush(self.timers, (time.monotonic() + UPLINK_RETRY_S, id(device) + 2, 'uplink', device))
+            return
+        conn.setblocking(False)
+        conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        device.clients[conn] = self.uplink[0]
+        device.uplink_conn = conn
+        self.selector.register(conn, selectors.EVENT_READ, (device, conn))
+
+    def _read_command(self, device, conn):
+        try:
+            data = conn.recv(4)
+        except (BlockingIOError, InterruptedError):
+            return
+        except OSError:
+            data = b''
+        if len(data) < 4:
+            self.selector.unregister(conn)
+            device.drop_client(conn)
+            if conn is device.uplink_conn:
+                device.uplink_conn = None
+                heapq.heappush(self.timers, (time.monotonic() + UPLINK_RETRY_S, id(device) + 2, 'uplink', device))
+            return
+        device.handle_command(conn, struct.unpack('<I', data)[0])
+
+    def _run_timers(self):
+        now = time.monotonic()
+        while self.timers and self.timers[0][0] <= now:
+            due, key, kind, device = heapq.heappop(self.timers)
+            if kind == 'uplink':
+                self._connect_uplink(device)
+                continue
+            if kind == 'audio':
+                if device.streaming:
+                    device.send_audio()
+                interval = AUDIO_INTERVAL_S
+            else:
+                if device.streaming:
+                    device.send_frame(self.trace)
+                interval = 1.0 / self.args.fps
+            # Keep the nominal rate even if the loop was late
+            next_due = due + interval
+            if next_due < now:
+                next_due = now + interval
+            heapq.heappush(self.timers, (next_due, key, kind, device))
+
+    def close(self):
+        for device in self.devices:
+            for conn in list(device.clients):
+                device.drop_client(conn)
+            device.listener.close()
+            device.audio_sock.close()
+            device.video_sock.close()
+        if self.trace is not None:
+            self.trace.close()
+        self.selector.close()
+
+
+def build_parser():
+    parser = argparse.ArgumentParser(description="Simulate ESP32 doorbells on loopback addresses")
+    parser.add_argument('--devices', type=int, default=1, help="Number of simulated devices")
+    parser.add_argument('--base-ip', default='127.0.1.1', help="Address of the first device, the rest follow")
+    parser.add_argument('--control-port', type=int, default=media_packets.CONTROL_TCP_PORT)
+    parser.add_argument('--audio-port', type=int, default=media_packets.AUDIO_UDP_PORT,
+                        help="Destination port of the audio stream")
+    parser.add_argument('--video-port', type=int, default=media_packets.VIDEO_UDP_PORT,
+                        help="Destination port of the video stream")
+    parser.add_argument('--fps', type=float, default=15.0)
+    parser.add_argument('--frame-size', type=int, default=20000, help="Mean synthetic frame size in bytes")
+    parser.add_argument('--jpeg-dir', help="Stream the JPEG files of this directory instead of synthetic frames")
+    parser.add_argument('--loss', type=float, default=0.0, help="Random datagram loss ratio")
+    parser.add_argument('--duration', type=float, help="Stop after this many seconds")
+    parser.add_argument('--trace-log', help="Append the latency trace lines of CONFIG_LATENCY_TRACE to this file")
+    parser.add_argument('--uplink', metavar='HOST:PORT',
+                        help="Connect every device to this relay uplink port, like CONFIG_RELAY_UPLINK")
+    parser.add_argument('--seed', type=int, default=1)
+    return parser
+
+
+def main():
+    args = build_parser().parse_args()
+    random.seed(args.seed)
+    simulator = DeviceSimulator(args)
+    last_ip = simulator.devices[-1].ip
+    print(f"Simulating {args.devices} devices on {args.base_ip} - {last_ip} (control port {args.control_port})")
+    try:
+        simulator.run(args.duration)
+    except KeyboardInterrupt:
+        print("\nSimulator stopped")
+    finally:
+        sessions = sum(device.sessions for device in simulator.devices)
+        packets = sum(device.packets_sent for device in simulator.devices)
+        nacks = sum(device.nacks for device in simulator.devices)
+        retransmits = sum(device.retransmits for device in simulator.devices)
+        print(f"Sessions: {sessions}, packets sent: {packets}, NACKs: {nacks} ({retransmits} resent)")
+        simulator.close()
+
+
+if __name__ == "__main__":
+    sys.exit(main())
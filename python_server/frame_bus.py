@@ -0,0 +1,499 @@
+#!/usr/bin/env python3
+"""
+Shared-memory frame bus for local consumers
+
+One ingest process receives the ESP32 datagrams, reassembles them and publishes
+each video frame and audio block once into a memfd-backed ring. Local consumers
+(viewer, recorder, analytics, gateway) map the same ring and read records in
+place. The writer never waits for readers: a reader that falls more than one
+ring behind is detected and skipped forward to the newest record.
+"""
+import argparse
+import array
+import ctypes
+import ctypes.util
+import json
+import mmap
+import multiprocessing
+import os
+import platform
+import select
+import socket
+import struct
+import sys
+import threading
+import time
+
+import media_packets
+
+DEFAULT_SOCKET_PATH = '/tmp/telrem_frame_bus.sock'
+DEFAULT_CAPACITY = 16 * 1024 * 1024
+
+# Record kinds
+KIND_PAD = 0
+KIND_VIDEO_FRAME = 1
+KIND_AUDIO_BLOCK = 2
+
+# Control block layout, each hot field lives on its own cache line
+BUS_MAGIC = 0x53554254  # 'TBUS'
+BUS_VERSION = 1
+CONTROL_SIZE = 4096
+MAGIC_OFFSET = 0            # magic u32, version u32, capacity u64
+RESERVE_OFFSET = 64         # reserve_pos u64 (end of the record being written)
+COMMIT_OFFSET = 128         # commit_pos u64, commit_seq u64, last_record_pos u64
+FUTEX_OFFSET = 192          # notification counter u32
+
+# Record header: kind u16, flags u16, length u32, seq u64, media timestamp u64,
+# publish time (CLOCK_MONOTONIC ns) u64, id u32 (frame id / sequence), source u32 (IPv4)
+RECORD_HEADER = struct.Struct('<HHIQQQII')
+RECORD_ALIGN = 8
+
+_u32 = struct.Struct('<I')
+_u64 = struct.Struct('<Q')
+_commit = struct.Struct('<QQQ')
+
+FUTEX_WAIT = 0
+FUTEX_WAKE = 1
+_SYS_FUTEX = {'x86_64': 202, 'aarch64': 98, 'armv7l': 240, 'i686': 240}
+
+_libc = ctypes.CDLL(ctypes.util.find_library('c'), use_errno=True)
+
+
+class _Timespec(ctypes.Structure):
+    _fields_ = [('tv_sec', ctypes.c_long), ('tv_nsec', ctypes.c_long)]
+
+
+def _futex(address, op, value, timeout=None):
+    """Raw futex(2) call on a shared (non-private) word"""
+    timespec = None
+    if timeout is not None:
+        timespec = ctypes.byref(_Timespec(int(timeout), int((timeout % 1) * 1e9)))
+    return _libc.syscall(_SYS_FUTEX[platform.machine()], ctypes.c_void_p(address),
+                         op, value, timespec, None, 0)
+
+
+def _align(length):
+    return (length + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1)
+
+
+class BusRecord:
+    """A record read in place from the ring; `payload` is a memoryview into the mapping"""
+    __slots__ = ('kind', 'seq', 'media_ts', 'publish_ns', 'id', 'source', 'payload', 'position')
+
+    def __init__(self, kind, seq, media_ts, publish_ns, record_id, source, payload, position):
+        self.kind = kind
+        self.seq = seq
+        self.media_ts = media_ts
+        self.publish_ns = publish_ns
+        self.id = record_id
+        self.source = source
+        self.payload = payload
+        self.position = position
+
+
+class _BusMapping:
+    """Common mapping of the memfd shared by writer and readers"""
+
+    def __init__(self, fd, capacity):
+        self.fd = fd
+        self.capacity = capacity
+        self.mm = mmap.mmap(fd, CONTROL_SIZE + capacity, mmap.MAP_SHARED,
+                            mmap.PROT_READ | mmap.PROT_WRITE)
+        self.view = memoryview(self.mm)
+        self._anchor = ctypes.c_char.from_buffer(self.mm)
+        self.futex_address = ctypes.addressof(self._anchor) + FUTEX_OFFSET
+
+    def commit_state(self):
+        return _commit.unpack_from(self.mm, COMMIT_OFFSET)
+
+    def reserve_pos(self):
+        return _u64.unpack_from(self.mm, RESERVE_OFFSET)[0]
+
+    def close(self):
+        self.view.release()
+        del self._anchor
+        self.mm.close()
+        os.close(self.fd)
+
+
+class FrameBusWriter(_BusMapping):
+    """Single producer side of the bus
+
+    Serves the memfd to consumers over a Unix socket (SCM_RIGHTS) so that any
+    number of local processes can attach while the ingest is running.
+    """
+
+    def __init__(self, capacity=DEFAULT_CAPACITY, socket_path=DEFAULT_SOCKET_PATH):
+        capacity = _align(capacity)
+        fd = os.memfd_create('telrem_frame_bus', os.MFD_CLOEXEC)
+        os.ftruncate(fd, CONTROL_SIZE + capacity)
+        super().__init__(fd, capacity)
+        struct.pack_into('<IIQ', self.mm, MAGIC_OFFSET, BUS_MAGIC, BUS_VERSION, capacity)
+
+        self.seq = 0
+        self.position = 0
+        self.socket_path = socket_path
+        self._listener = None
+        self._stop = threading.Event()
+        if socket_path:
+            self._start_fd_server()
+
+    def _start_fd_server(self):
+        if os.path.exists(self.socket_path):
+            os.unlink(self.socket_path)
+        self._listener = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self._listener.bind(self.socket_path)
+        self._listener.listen(16)
+        self._listener.settimeout(0.2)
+        thread = threading.Thread(target=self._serve_fd, name='FrameBusFdServer', daemon=True)
+        thread.start()
+
+    def _serve_fd(self):
+        while not self._stop.is_set():
+            try:
+                conn, _ = self._listener.accept()
+            except socket.timeout:
+                continue
+            except OSError:
+                break
+            with conn:
+                socket.send_fds(conn, [_u64.pack(self.capacity)], [self.fd])
+
+    def publish(self, kind, payload, record_id=0, source=0, media_ts=0):
+        """Copy one record into the ring and wake waiting readers"""
+        length = len(payload)
+        need = _align(RECORD_HEADER.size + length)
+        if need > self.capacity // 2:
+            raise ValueError(f"Record of {length} bytes does not fit a {self.capacity} byte ring")
+
+        start = self.position
+        offset = start % self.capacity
+        if offset + need > self.capacity:
+            # Not enough room before the end of the ring, pad and wrap around
+            start += self.capacity - offset
+        end = start + need
+
+        # Announce the overwrite before touching the data so readers can detect it
+        _u64.pack_into(self.mm, RESERVE_OFFSET, end)
+        if start != self.position and self.capacity - offset >= RECORD_HEADER.size:
+            RECORD_HEADER.pack_into(self.mm, CONTROL_SIZE + offset, KIND_PAD, 0, 0, 0, 0, 0, 0, 0)
+
+        data_offset = CONTROL_SIZE + start % self.capacity
+        RECORD_HEADER.pack_into(self.mm, data_offset, kind, 0, length, self.seq, media_ts,
+                                time.monotonic_ns(), record_id & 0xFFFFFFFF, source & 0xFFFFFFFF)
+        body = data_offset + RECORD_HEADER.size
+        self.view[body:body + length] = payload
+
+        self.seq += 1
+        self.position = end
+        _commit.pack_into(self.mm, COMMIT_OFFSET, end, self.seq, start)
+
+        notify = (_u32.unpack_from(self.mm, FUTEX_OFFSET)[0] + 1) & 0xFFFFFFFF
+        _u32.pack_into(self.mm, FUTEX_OFFSET, notify)
+        _futex(self.futex_address, FUTEX_WAKE, 0x7FFFFFFF)
+        return self.seq - 1
+
+    def close(self):
+        self._stop.set()
+        if self._listener is not None:
+            self._listener.close()
+            if os.path.exists(self.socket_path):
+                os.unlink(self.socket_path)
+        super().close()
+
+
+class FrameBusReader(_BusMapping):
+    """Consumer side of the bus
+
+    Records are returned in place. A consumer that keeps `record.payload` while
+    processing should call `release(record)` afterwards: it returns False if the
+    writer lapped the record in the meantime and the data must be discarded.
+    """
+
+    def __init__(self, socket_path=DEFAULT_SOCKET_PATH, from_start=False):
+        with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as conn:
+            conn.connect(socket_path)
+            msg, fds, _, _ = socket.recv_fds(conn, 64, 1)
+        if not fds:
+            raise ConnectionError("Frame bus did not pass a memory descriptor")
+        super().__init__(fds[0], _u64.unpack(msg[:8])[0])
+
+        magic, version = struct.unpack_from('<II', self.mm, MAGIC_OFFSET)
+        if magic != BUS_MAGIC or version != BUS_VERSION:
+            raise ValueError(f"Unexpected frame bus header {magic:#x} v{version}")
+
+        commit_pos, commit_seq, last_record = self.commit_state()
+        self.position = 0 if from_start else commit_pos
+        self.expected_seq = 0 if from_start else commit_seq
+        self.received = 0
+        self.skipped = 0
+        self.lapped = 0
+        self.overruns = 0
+
+    def _intact(self, start):
+        return self.reserve_pos() - start <= self.capacity
+
+    def read(self, timeout=None):
+        """Return the next BusRecord, or None if nothing arrived within timeout"""
+        deadline = None if timeout is None else time.monotonic() + timeout
+        while True:
+            notify = _u32.unpack_from(self.mm, FUTEX_OFFSET)[0]
+            commit_pos, _, last_record = self.commit_state()
+
+            if self.position < commit_pos:
+                if commit_pos - self.position > self.capacity or not self._intact(self.position):
+                    # Slow reader: the writer already overwrote our position, jump to the newest record
+                    self.lapped += 1
+                    self.position = last_record
+
+                record = self._parse(self.position)
+                if record is None or record.kind == KIND_PAD:
+                    continue
+                if record.seq > self.expected_seq:
+                    self.skipped += record.seq - self.expected_seq
+                self.received += 1
+                self.expected_seq = record.seq + 1
+                return record
+
+            remaining = None
+            if deadline is not None:
+                remaining = deadline - time.monotonic()
+                if remaining <= 0:
+                    return None
+            _futex(self.futex_address, FUTEX_WAIT, notify, remaining)
+
+    def _parse(self, start):
+        offset = start % self.capacity
+        if self.capacity - offset < RECORD_HEADER.size:
+            self.position = start + self.capacity - offset
+            return BusRecord(KIND_PAD, 0, 0, 0, 0, 0, None, start)
+
+        data_offset = CONTROL_SIZE + offset
+        kind, _, length, seq, media_ts, publish_ns, record_id, source = \
+            RECORD_HEADER.unpack_from(self.mm, data_offset)
+        if kind == KIND_PAD:
+            self.position = start + self.capacity - offset
+            return BusRecord(KIND_PAD, 0, 0, 0, 0, 0, None, start)
+        if not self._intact(start):
+            # Header was overwritten while we were reading it, resync on the next loop
+            self.overruns += 1
+            return None
+
+        body = data_offset + RECORD_HEADER.size
+        self.position = start + _align(RECORD_HEADER.size + length)
+        return BusRecord(kind, seq, media_ts, publish_ns, record_id, source,
+                         self.view[body:body + length], start)
+
+    def release(self, record):
+        """True if the record payload was still intact when the consumer finished with it"""
+        if record.payload is not None:
+            record.payload.release()
+        if self._intact(record.position):
+            return True
+        self.overruns += 1
+        return False
+
+
+def _ip_to_u32(ip):
+    return struct.unpack('<I', socket.inet_aton(ip))[0]
+
+
+def run_ingest(args):
+    """Receive ESP32 datagrams, reassemble them and publish them on the bus"""
+    writer = FrameBusWriter(args.capacity, args.socket)
+    print(f"Frame bus ready on {args.socket} ({args.capacity // 1024} KiB ring)")
+
+    audio_sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    video_sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    for sock, port in ((audio_sock, args.audio_port), (video_sock, args.video_port)):
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 * 1024 * 1024)
+        sock.bind((args.bind, port))
+        sock.setblocking(False)
+
+    assemblers = {}
+    patchers = {}   # Slice updates become whole JPEG frames before they are published
+    try:
+        while True:
+            readable, _, _ = select.select([audio_sock, video_sock], [], [], 0.05)
+            for sock in readable:
+                data, addr = sock.recvfrom(65535)
+                source = _ip_to_u32(addr[0])
+                if sock is audio_sock:
+                    header, payload = media_packets.parse_audio_packet(data)
+                    if header is not None:
+                        writer.publish(KIND_AUDIO_BLOCK, payload, header.sequence, source, header.timestamp)
+                    continue
+
+                header, payload = media_packets.parse_video_packet(data)
+                if header is None:
+                    continue
+                assembler = assemblers.setdefault(source, media_packets.FrameAssembler())
+                frame = assembler.add(header, payload)
+                if frame is None:
+                    continue
+                data = patchers.setdefault(source, media_packets.SlicePatcher()).patch(frame)
+                if data is not None:
+                    writer.publish(KIND_VIDEO_FRAME, data, frame.frame_id, source, frame.timestamp)
+
+            for assembler in assemblers.values():
+                assembler.expire()
+    except KeyboardInterrupt:
+        print("\nIngest stopped")
+    finally:
+        audio_sock.close()
+        video_sock.close()
+        writer.close()
+
+
+def _percentile(values, pct):
+    if not values:
+        return 0.0
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(len(ordered) * pct / 100))]
+
+
+def _bench_consumer(socket_path, seconds, delay_s, ready, results):
+    reader = FrameBusReader(socket_path)
+    latencies = array.array('d')
+    lost = 0
+    ready.wait()
+    end = time.monotonic() + seconds + 0.5
+    while time.monotonic() < end:
+        record = reader.read(timeout=0.1)
+        if record is None:
+            continue
+        latencies.append((time.monotonic_ns() - record.publish_ns) / 1000.0)
+        # Touch both ends of the payload the way a real consumer would
+        _ = record.payload[0] + record.payload[-1]
+        if delay_s:
+            time.sleep(delay_s)
+        if not reader.release(record):
+            lost += 1
+    results.put({
+        'received': reader.received,
+        'skipped': reader.skipped,
+        'lapped': reader.lapped,
+        'overruns': reader.overruns + lost,
+        'latency_p50_us': _percentile(latencies, 50),
+        'latency_p99_us': _percentile(latencies, 99),
+    })
+    reader.close()
+
+
+def run_bench(args):
+    """1 producer, N consumers; reports publish rate, delivery and latency"""
+    socket_path = f"{args.socket}.bench{os.getpid()}"
+    writer = FrameBusWriter(args.capacity, socket_path)
+    ctx = multiprocessing.get_context('fork')
+    ready = ctx.Event()
+    results = ctx.Queue()
+    consumers = []
+    for i in range(args.consumers):
+        delay = args.slow_delay_ms / 1000.0 if i < args.slow else 0.0
+        proc = ctx.Process(target=_bench_consumer, args=(socket_path, args.seconds, delay, ready, results))
+        proc.start()
+        consumers.append(proc)
+    time.sleep(0.5)  # Let every consumer attach before publishing
+    ready.set()
+
+    frame = os.urandom(args.frame_size)
+    audio = os.urandom(324)
+    interval = 1.0 / args.rate if args.rate else 0.0
+    published = 0
+    start = time.monotonic()
+    next_send = start
+    while time.monotonic() - start < args.seconds:
+        writer.publish(KIND_VIDEO_FRAME, frame, published, 0, media_packets.now_ms())
+        writer.publish(KIND_AUDIO_BLOCK, audio, published, 0, media_packets.now_ms())
+        published += 2
+        if interval:
+            next_send += interval
+            delay = next_send - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+    elapsed = time.monotonic() - start
+
+    stats = [results.get() for _ in consumers]
+    for proc in consumers:
+        proc.join()
+    writer.close()
+
+    report = {
+        'benchmark': 'frame_bus',
+        'consumers': args.consumers,
+        'slow_consumers': args.slow,
+        'frame_size': args.frame_size,
+        'published_records': published,
+        'publish_rate': published / elapsed,
+        'publish_mb_s': published / 2 * (args.frame_size + 324) / elapsed / 1e6,
+        'per_consumer': stats,
+    }
+    if args.json:
+        print(json.dumps(report))
+        return
+
+    print(f"Published {published} records in {elapsed:.1f}s "
+          f"({report['publish_rate']:.0f} rec/s, {report['publish_mb_s']:.1f} MB/s)")
+    for i, s in enumerate(stats):
+        kind = "slow" if i < args.slow else "fast"
+        print(f"  consumer {i} ({kind}): received {s['received']}, skipped {s['skipped']} "
+              f"(lapped {s['lapped']}x), overruns {s['overruns']}, "
+              f"latency p50 {s['latency_p50_us']:.0f}us p99 {s['latency_p99_us']:.0f}us")
+
+
+def run_dump(args):
+    """Attach as a consumer and print the records as they arrive"""
+    reader = FrameBusReader(args.socket)
+    try:
+        while True:
+            record = reader.read(timeout=1.0)
+            if record is None:
+                continue
+            kind = 'video' if record.kind == KIND_VIDEO_FRAME else 'audio'
+            source = socket.inet_ntoa(_u32.pack(record.source))
+            print(f"{source} {kind} id={record.id} ts={record.media_ts} "
+                  f"len={len(record.payload)} skipped={reader.skipped}")
+            reader.release(record)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        reader.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--socket', default=DEFAULT_SOCKET_PATH, help="Unix socket used to hand out the ring")
+    parser.add_argument('--capacity', type=int, default=DEFAULT_CAPACITY, help="Ring size in bytes")
+    sub = parser.add_subparsers(dest='command', required=True)
+
+    ingest = sub.add_parser('ingest', help="Receive ESP32 datagrams and publish them")
+    ingest.add_argument('--bind', default='0.0.0.0')
+    ingest.add_argument('--audio-port', type=int, default=media_packets.AUDIO_UDP_PORT)
+    ingest.add_argument('--video-port', type=int, default=media_packets.VIDEO_UDP_PORT)
+
+    sub.add_parser('dump', help="Print records published on the bus")
+
+    bench = sub.add_parser('bench', help="1 producer / N consumers benchmark")
+    bench.add_argument('--consumers', type=int, default=8)
+    bench.add_argument('--seconds', type=float, default=5.0)
+    bench.add_argument('--frame-size', type=int, default=30000, help="Video frame payload in bytes")
+    bench.add_argument('--rate', type=float, default=0, help="Frames per second, 0 = as fast as possible")
+    bench.add_argument('--slow', type=int, default=0, help="How many consumers process slowly")
+    bench.add_argument('--slow-delay-ms', type=float, default=20.0)
+    bench.add_argument('--json', action='store_true', help="Print a machine-readable report")
+
+    args = parser.parse_args()
+    if args.command == 'ingest':
+        run_ingest(args)
+    elif args.command == 'dump':
+        run_dump(args)
+    else:
+        run_bench(args)
+
+
+if __name__ == "__main__":
+    if sys.platform != 'linux':
+        print("The frame bus needs Linux (memfd and futex)")
+        sys.exit(1)
+    main()
@@ -0,0 +1,302 @@
+#!/usr/bin/env python3
+"""
+Golden trace regression suite
+
+Plays a fixed set of datagram traces (clean, lossy, bursty, reordered) through
+the receive path of a viewer (media_playout.py: jitter buffer, frame
+reassembly and playout) at full speed and checks the results against
+performance budgets: frame completion, audio concealment, added latency and
+CPU time per packet. The JSON report of a run can be compared with the report
+of another commit, a regression fails the run.
+
+The traces are capture files of packet_capture.py. The built-in ones are
+generated deterministically from a seed; recorded captures can be added to the
+suite by giving them a budget entry.
+"""
+import argparse
+import json
+import os
+import random
+import subprocess
+import sys
+import time
+
+import numpy as np
+
+import device_simulator
+import media_packets
+import media_playout
+import packet_capture
+
+DEFAULT_TRACE_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'golden_traces')
+DEFAULT_BUDGETS = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'golden_budgets.json')
+
+TRACE_SOURCE = '127.0.1.1'
+TRACE_EPOCH_MS = 1760000000000
+LINK_PACKET_MS = 0.3            # Air time of a full datagram, spaces the fragments of a frame
+
+# Impairment profiles of the built-in traces
+PROFILES = {
+    # Low, steady jitter, nothing lost
+    'clean': {'seed': 1, 'jitter_ms': 0.5},
+    # Independent random loss
+    'lossy': {'seed': 2, 'jitter_ms': 1.0, 'loss': 0.02},
+    # Gilbert-Elliott loss bursts and Wi-Fi stalls that release the queued packets at once
+    'bursty': {'seed': 3, 'jitter_ms': 2.0, 'burst_enter': 0.005, 'burst_exit': 0.3, 'burst_loss': 0.7,
+               'stall_per_s': 0.5, 'stall_ms': (40, 150)},
+    # Some packets overtaken by later ones
+    'reordered': {'seed': 4, 'jitter_ms': 1.0, 'reorder': 0.05, 'reorder_ms': (2, 30)},
+}
+
+# Direction of every budgeted metric: 'min' is a lower bound, 'max' an upper bound
+METRIC_DIRECTIONS = {
+    'frame_completion': 'min',
+    'frames_shown_ratio': 'min',
+    'audio_concealment_ratio': 'max',
+    'audio_added_latency_ms_p95': 'max',
+    'video_added_latency_ms_p95': 'max',
+    'cpu_us_per_packet': 'max',
+}
+
+
+def synthesize_session(seconds, fps, frame_size, seed):
+    """Datagrams of a streaming session as sent by the device: (send ms, port, payload)"""
+    frames = device_simulator.synthetic_frames(32, frame_size, seed)
+    interval_ms = device_simulator.AUDIO_INTERVAL_S * 1000
+    audio_block = bytes(device_simulator.AUDIO_CHUNK_SIZE)
+    sent = []
+    for seq in range(int(seconds * 1000 / interval_ms)):
+        t = TRACE_EPOCH_MS + seq * interval_ms
+        sent.append((t, media_packets.AUDIO_UDP_PORT, media_packets.build_audio_packet(seq, int(t), audio_block)))
+    for frame_id in range(int(seconds * fps)):
+        t = TRACE_EPOCH_MS + 7 + frame_id * 1000 / fps
+        packets = media_packets.build_video_packets(frame_id, int(t), frames[frame_id % len(frames)])
+        for i, packet in enumerate(packets):
+            sent.append((t + i * LINK_PACKET_MS, media_packets.VIDEO_UDP_PORT, packet))
+    sent.sort(key=lambda entry: entry[0])
+    return sent
+
+
+def impair(sent, profile, base_delay_ms=3.0):
+    """Apply an impairment profile; returns the delivered datagrams as (arrival ms, port, payload)
+
+    The link is a FIFO: a packet never arrives before the one sent ahead of it,
+    unless the profile reorders it explicitly.
+    """
+    rng = random.Random(profile['seed'])
+    stalls = []
+    if profile.get('stall_per_s'):
+        duration_s = (sent[-1][0] - sent[0][0]) / 1000
+        for _ in range(int(duration_s * profile['stall_per_s'])):
+            start = sent[0][0] + rng.uniform(0, duration_s * 1000)
+            stalls.append((start, start + rng.uniform(*profile['stall_ms'])))
+    bursting = False
+    link_free_ms = 0.0
+    delivered = []
+    for send_ms, port, payload in sent:
+        if profile.get('burst_enter'):
+            bursting = rng.random() >= profile['burst_exit'] if bursting else rng.random() < profile['burst_enter']
+        lost = rng.random() < (profile['burst_loss'] if bursting else profile.get('loss', 0.0))
+        arrival = send_ms + base_delay_ms + rng.expovariate(1 / profile['jitter_ms'])
+        for start, end in stalls:
+            if start <= send_ms < end:
+                arrival = max(arrival, end + base_delay_ms)
+        if profile.get('reorder') and rng.random() < profile['reorder']:
+            # Held back outside of the FIFO
+            arrival += rng.uniform(*profile['reorder_ms'])
+        else:
+            arrival = max(arrival, link_free_ms)
+            link_free_ms = arrival + LINK_PACKET_MS / 10
+        if not lost:
+            delivered.append((arrival, port, payload))
+    delivered.sort(key=lambda entry: entry[0])
+    return delivered
+
+
+def generate_trace(path, profile, seconds, fps, frame_size):
+    sent = synthesize_session(seconds, fps, frame_size, profile['seed'])
+    with packet_capture.CaptureWriter(path) as writer:
+        for arrival_ms, port, payload in impair(sent, profile):
+            writer.write(port, TRACE_SOURCE, int(arrival_ms * 1000000), payload)
+
+
+def ensure_traces(args, names):
+    os.makedirs(args.trace_dir, exist_ok=True)
+    for name in names:
+        path = os.path.join(args.trace_dir, f"{name}.tcap")
+        if name in PROFILES and (args.regenerate or not os.path.exists(path)):
+            generate_trace(path, PROFILES[name], args.seconds, args.fps, args.frame_size)
+
+
+def load_trace(path):
+    """Datagrams of a capture as (arrival ms, payload), device log lines skipped"""
+    return [(record.timestamp_ns / 1e6, bytes(record.payload)) for record in packet_capture.read_capture(path)
+            if record.port != packet_capture.PORT_DEVICE_LOG]
+
+
+def play_trace(datagrams):
+    """Run the trace through a fresh receiver; returns (receiver, CPU seconds)"""
+    receiver = media_playout.MediaReceiver()
+    t0 = time.process_time()
+    for arrival_ms, data in datagrams:
+        receiver.receive(data, arrival_ms)
+    receiver.finish()
+    return receiver, time.process_time() - t0
+
+
+def measure(datagrams, repeat):
+    """Metrics of one trace; the CPU time is the best of `repeat` runs"""
+    cpu = []
+    for _ in range(repeat):
+        receiver, seconds = play_trace(datagrams)
+        cpu.append(seconds)
+    metrics = receiver.stats()
+    video = receiver.video
+    frames_sent = metrics['frames_complete'] + metrics['frames_incomplete']
+    metrics.update({
+        'frames_shown_ratio': video.shown / frames_sent if frames_sent else 0.0,
+        'audio_added_latency_ms_p50': float(np.percentile(receiver.audio.delays_ms, 50)),
+        'audio_added_latency_ms_p95': float(np.percentile(receiver.audio.delays_ms, 95)),
+        'video_added_latency_ms_p50': float(np.percentile(video.delays_ms, 50)) if video.delays_ms else None,
+        'video_added_latency_ms_p95': float(np.percentile(video.delays_ms, 95)) if video.delays_ms else None,
+        'cpu_us_per_packet': min(cpu) * 1e6 / max(1, len(datagrams)),
+    })
+    return metrics
+
+
+def check_budgets(metrics, budgets):
+    failures = []
+    for metric, bounds in budgets.items():
+        value = metrics.get(metric)
+        if value is None:
+            failures.append(f"{metric} missing")
+        elif 'min' in bounds and value < bounds['min']:
+            failures.append(f"{metric} {value:.4g} below {bounds['min']}")
+        elif 'max' in bounds and value > bounds['max']:
+            failures.append(f"{metric} {value:.4g} above {bounds['max']}")
+    return failures
+
+
+def git_commit():
+    try:
+        return subprocess.run(['git', 'rev-parse', '--short', 'HEAD'], capture_output=True, text=True,
+                              cwd=os.path.dirname(os.path.abspath(__file__)), check=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def run_suite(args):
+    with open(args.budgets) as f:
+        budgets = json.load(f)
+    names = args.traces or sorted(budgets)
+    ensure_traces(args, names)
+
+    report = {'benchmark': 'golden_traces', 'commit': git_commit(), 'traces': {}}
+    for name in names:
+        datagrams = load_trace(os.path.join(args.trace_dir, f"{name}.tcap"))
+        metrics = measure(datagrams, args.repeat)
+        failures = check_budgets(metrics, budgets.get(name, {}))
+        report['traces'][name] = {'metrics': metrics, 'budgets': budgets.get(name, {}), 'failures': failures}
+    report['passed'] = all(not t['failures'] for t in report['traces'].values())
+
+    if args.report:
+        with open(args.report, 'w') as f:
+            json.dump(report, f, indent=2)
+    if args.json:
+        print(json.dumps(report))
+    else:
+        print_report(report)
+    return 0 if report['passed'] else 1
+
+
+def print_report(report):
+    print(f"Golden traces at {report['commit'] or 'unknown commit'}")
+    for name, trace in report['traces'].items():
+        m = trace['metrics']
+        status = 'PASS' if not trace['failures'] else 'FAIL'
+        print(f"  {name:<10} {status}  frames {100 * m['frame_completion']:.1f}% complete, "
+              f"{100 * m['frames_shown_ratio']:.1f}% shown, "
+              f"audio {100 * m['audio_concealment_ratio']:.2f}% concealed, "
+              f"added latency audio {m['audio_added_latency_ms_p95']:.1f}ms "
+              f"video {m['video_added_latency_ms_p95'] or 0:.1f}ms (p95), "
+              f"{m['cpu_us_per_packet']:.1f}us CPU/packet")
+        for failure in trace['failures']:
+            print(f"             {failure}")
+
+
+def run_compare(args):
+    """Flag metrics of `new` that are worse than `base` by more than the tolerance"""
+    with open(args.base) as f:
+        base = json.load(f)
+    with open(args.new) as f:
+        new = json.load(f)
+    regressions = 0
+    print(f"{base.get('commit')} -> {new.get('commit')}")
+    for name, trace in new['traces'].items():
+        before = base['traces'].get(name)
+        if before is None:
+            print(f"  {name}: not in the base report")
+            continue
+        for metric, direction in METRIC_DIRECTIONS.items():
+            old, value = before['metrics'].get(metric), trace['metrics'].get(metric)
+            if old is None or value is None:
+                continue
+            tolerance = args.cpu_tolerance if metric == 'cpu_us_per_packet' else args.tolerance
+            change = (value - old) / abs(old) if old else (0.0 if value == old else float('inf'))
+            worse = change < -tolerance if direction == 'min' else change > tolerance
+            # Absolute floor for ratios near zero (e.g. no concealment at all)
+            worse = worse and abs(value - old) > args.min_delta
+            regressions += worse
+            if worse or args.verbose:
+                print(f"  {name:<10} {metric:<28} {old:>10.4g} -> {value:<10.4g} {100 * change:+.1f}%"
+                      f"{'  REGRESSION' if worse else ''}")
+    print(f"{regressions} regression(s)")
+    return 1 if regressions else 0
+
+
+def run_generate(args):
+    names = args.traces or sorted(PROFILES)
+    args.regenerate = True
+    ensure_traces(args, names)
+    for name in names:
+        print(f"Wrote {os.path.join(args.trace_dir, name + '.tcap')}")
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--trace-dir', default=DEFAULT_TRACE_DIR)
+    parser.add_argument('--seconds', type=float, default=30.0, help="Length of the generated traces")
+    parser.add_argument('--fps', type=float, default=15.0)
+    parser.add_argument('--frame-size', type=int, default=20000)
+    sub = parser.add_subparsers(dest='command', required=True)
+
+    generate = sub.add_parser('generate', help="(Re)generate the built-in traces")
+    generate.add_argument('traces', nargs='*', help=f"Traces to generate: {', '.join(sorted(PROFILES))}")
+
+    run = sub.add_parser('run', help="Run the suite and check the budgets")
+    run.add_argument('traces', nargs='*', help="Traces to run, all traces with a budget by default")
+    run.add_argument('--budgets', default=DEFAULT_BUDGETS)
+    run.add_argument('--repeat', type=int, default=3, help="Runs per trace, the fastest one sets the CPU time")
+    run.add_argument('--regenerate', action='store_true', help="Regenerate the built-in traces first")
+    run.add_argument('--report', help="Also write the JSON report to this file")
+    run.add_argument('--json', action='store_true', help="Print the JSON report")
+
+    compare = sub.add_parser('compare', help="Compare two reports of the suite")
+    compare.add_argument('base')
+    compare.add_argument('new')
+    compare.add_argument('--tolerance', type=float, default=0.02, help="Allowed relative change of quality metrics")
+    compare.add_argument('--cpu-tolerance', type=float, default=0.15, help="Allowed relative change of CPU time")
+    compare.add_argument('--min-delta', type=float, default=1e-3, help="Ignore absolute changes below this")
+    compare.add_argument('--verbose', action='store_true', help="Show unchanged metrics too")
+
+    args = parser.parse_args()
+    if args.command == 'generate':
+        return run_generate(args)
+    if args.command == 'run':
+        return run_suite(args)
+    return run_compare(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,324 @@
+#!/usr/bin/env python3
+"""
+End-to-end latency budget analyzer
+
+Joins the per-frame trace events of the device (CONFIG_LATENCY_TRACE log lines:
+capture, packetize, send) with the client side timestamps of the same frame
+(receive, reassemble, decode, display), matched by frame id and media
+timestamp, and reports a per-stage latency waterfall with percentiles for every
+session. Works on capture files of packet_capture.py or on a live session.
+"""
+import argparse
+import collections
+import json
+import re
+import select
+import sys
+import time
+
+import cv2
+import numpy as np
+
+import media_packets
+import packet_capture
+
+TRACE_PATTERN = re.compile(rb'LATENCY: frame=(\d+) ts=(\d+) cap_start=(\d+) cap_end=(\d+) '
+                           rb'send_start=(\d+) send_end=(\d+)')
+
+# A new session starts when the media timestamps jump by more than this
+SESSION_GAP_MS = 2000
+
+STAGES = ('capture', 'packetize', 'network', 'receive', 'reassemble', 'decode', 'display')
+
+DeviceEvent = collections.namedtuple('DeviceEvent', 'frame_id timestamp cap_start cap_end send_start send_end')
+
+
+class ClientFrame:
+    """Client side timestamps of one frame, in us since EPOCH"""
+
+    __slots__ = ('source', 'frame_id', 'timestamp', 'first_rx', 'last_rx', 'complete', 'decoded', 'displayed')
+
+    def __init__(self, source, frame_id, timestamp, first_rx):
+        self.source = source
+        self.frame_id = frame_id
+        self.timestamp = timestamp
+        self.first_rx = first_rx
+        self.last_rx = first_rx
+        self.complete = None
+        self.decoded = None
+        self.displayed = None
+
+
+def parse_trace_line(line):
+    match = TRACE_PATTERN.search(line)
+    if match is None:
+        return None
+    return DeviceEvent(*(int(v) for v in match.groups()))
+
+
+class ClientPipeline:
+    """Receive side of a viewer: reassembly, decode and optional display
+
+    Datagrams are fed with their arrival time. The stages after the arrival
+    are measured with the local clock while the frame is processed, so offline
+    analysis reports the decode cost of this host.
+    """
+
+    def __init__(self, decode=True, display=False):
+        self.decode = decode
+        self.display = display
+        self.pending = {}
+        self.frames = []
+
+    def add(self, source, data, arrival_us):
+        header, payload = media_packets.parse_video_packet(data)
+        if header is None:
+            return
+        key = (source, header.frame_id)
+        entry = self.pending.get(key)
+        if entry is None:
+            entry = self.pending[key] = (ClientFrame(source, header.frame_id, header.timestamp, arrival_us), {})
+        frame, fragments = entry
+        frame.first_rx = min(frame.first_rx, arrival_us)
+        frame.last_rx = max(frame.last_rx, arrival_us)
+        fragments[header.packet_seq] = bytes(payload)
+        if len(fragments) < header.total_packets:
+            return
+
+        # Processing time is measured on the local clock and added to the arrival time
+        t0 = time.perf_counter()
+        del self.pending[key]
+        if any(i not in fragments for i in range(header.total_packets)):
+            return
+        jpeg = b''.join(fragments[i] for i in range(header.total_packets))
+        t1 = time.perf_counter()
+        frame.complete = frame.last_rx + (t1 - t0) * 1e6
+        if self.decode:
+            image = cv2.imdecode(np.frombuffer(jpeg, np.uint8), cv2.IMREAD_COLOR)
+            t2 = time.perf_counter()
+            if image is not None:
+                frame.decoded = frame.complete + (t2 - t1) * 1e6
+                if self.display:
+                    cv2.imshow(f"Latency {source}", image)
+                    cv2.waitKey(1)
+                    frame.displayed = frame.decoded + (time.perf_counter() - t2) * 1e6
+        self.frames.append(frame)
+
+    def expire(self, now_us, timeout_us=1000000):
+        for key in [k for k, (f, _) in self.pending.items() if now_us - f.first_rx > timeout_us]:
+            del self.pending[key]
+
+
+def split_sessions(frames):
+    """Group frames per source and split at media timestamp jumps or frame id resets"""
+    sessions = []
+    current = {}
+    for frame in sorted(frames, key=lambda f: (f.source, f.first_rx)):
+        session = current.get(frame.source)
+        if session is not None:
+            last = session[-1]
+            if frame.timestamp - last.timestamp > SESSION_GAP_MS or frame.frame_id < last.frame_id:
+                session = None
+        if session is None:
+            session = current[frame.source] = []
+            sessions.append(session)
+        session.append(frame)
+    return sessions
+
+
+def _summary(values):
+    if not values:
+        return None
+    arr = np.asarray(values) / 1000.0
+    return {'p50': float(np.percentile(arr, 50)), 'p95': float(np.percentile(arr, 95)),
+            'p99': float(np.percentile(arr, 99)), 'mean': float(arr.mean()), 'count': len(values)}
+
+
+def analyze_session(frames, events, min_delay_ms=0.0):
+    """Per-stage latencies (ms) of one session
+
+    The device and client clocks are aligned with the minimum delay method:
+    the fastest frame of the session is assumed to have crossed the network
+    in `min_delay_ms`.
+    """
+    traced = [(f, events[(f.frame_id, f.timestamp)]) for f in frames if (f.frame_id, f.timestamp) in events]
+    stages = collections.defaultdict(list)
+    total = []
+    if traced:
+        offset = min(f.first_rx - e.send_start for f, e in traced) - min_delay_ms * 1000
+        for f, e in traced:
+            stages['capture'].append(e.cap_end - e.cap_start)
+            stages['packetize'].append(e.send_start - e.cap_end)
+            stages['network'].append(f.first_rx - offset - e.send_start)
+            stages['device_send'].append(e.send_end - e.send_start)
+            start = e.cap_start + offset
+            _client_stages(f, stages, total, start)
+    else:
+        # Without device events, the media timestamp (taken after the capture) is the anchor
+        offset = min(f.first_rx - f.timestamp * 1000 for f in frames) - min_delay_ms * 1000
+        for f in frames:
+            stages['network'].append(f.first_rx - offset - f.timestamp * 1000)
+            _client_stages(f, stages, total, f.timestamp * 1000 + offset)
+
+    return {
+        'source': frames[0].source,
+        'first_frame': frames[0].frame_id,
+        'frames': len(frames),
+        'traced_frames': len(traced),
+        'clock_offset_ms': offset / 1000.0,
+        'stages': {name: _summary(stages[name]) for name in STAGES + ('device_send',) if stages[name]},
+        'total': _summary(total),
+    }
+
+
+def _client_stages(frame, stages, total, start):
+    stages['receive'].append(frame.last_rx - frame.first_rx)
+    end = frame.complete
+    stages['reassemble'].append(frame.complete - frame.last_rx)
+    if frame.decoded is not None:
+        stages['decode'].append(frame.decoded - frame.complete)
+        end = frame.decoded
+    if frame.displayed is not None:
+        stages['display'].append(frame.displayed - frame.decoded)
+        end = frame.displayed
+    total.append(end - start)
+
+
+def analyze(frames, events, min_delay_ms=0.0):
+    return [analyze_session(session, events, min_delay_ms) for session in split_sessions(frames)]
+
+
+def print_report(sessions, width=40):
+    for i, s in enumerate(sessions, 1):
+        print(f"Session {i}: {s['source']} from frame {s['first_frame']}, {s['frames']} frames "
+              f"({s['traced_frames']} with device trace), clock offset {s['clock_offset_ms']:.1f}ms")
+        if s['total'] is None:
+            continue
+        scale = width / max(1e-9, sum(v['p50'] for k, v in s['stages'].items() if k != 'device_send'))
+        print(f"  {'stage':<12}{'p50':>9}{'p95':>9}{'p99':>9}   waterfall (p50)")
+        position = 0.0
+        for name in STAGES:
+            stats = s['stages'].get(name)
+            if stats is None:
+                continue
+            bar_start = int(round(position * scale))
+            bar_len = max(1, int(round(stats['p50'] * scale)))
+            position += stats['p50']
+            bar = ' ' * bar_start + '#' * bar_len
+            print(f"  {name:<12}{stats['p50']:>9.2f}{stats['p95']:>9.2f}{stats['p99']:>9.2f}   |{bar:<{width + 1}}|")
+        send = s['stages'].get('device_send')
+        if send is not None:
+            print(f"  {'device send':<12}{send['p50']:>9.2f}{send['p95']:>9.2f}{send['p99']:>9.2f}   "
+                  f"(first to last packet on the device, overlaps receive)")
+        t = s['total']
+        print(f"  {'total':<12}{t['p50']:>9.2f}{t['p95']:>9.2f}{t['p99']:>9.2f}   ms")
+
+
+def load_capture(path, decode, display=False):
+    pipeline = ClientPipeline(decode, display)
+    events = {}
+    for record in packet_capture.read_capture(path):
+        if record.port == packet_capture.PORT_DEVICE_LOG:
+            event = parse_trace_line(record.payload)
+            if event is not None:
+                events[(event.frame_id, event.timestamp)] = event
+        elif media_packets.packet_type(record.payload) == media_packets.VIDEO_PACKAGE:
+            pipeline.add(record.source, record.payload, record.timestamp_ns / 1000.0)
+    return pipeline.frames, events
+
+
+def load_device_log(path, events):
+    with open(path, 'rb') as f:
+        for line in f:
+            event = parse_trace_line(line)
+            if event is not None:
+                events[(event.frame_id, event.timestamp)] = event
+
+
+def run_live(args):
+    socks = packet_capture.open_media_sockets(args.bind, args.audio_port, args.video_port)
+    video_socks = [s for s, port in socks.items() if port == args.video_port]
+    control = media_packets.request_talk(args.device) if args.device else None
+    follower = packet_capture.LogFollower(args.device_log) if args.device_log else None
+    writer = packet_capture.CaptureWriter(args.save) if args.save else None
+    pipeline = ClientPipeline(decode=True, display=args.display)
+    events = {}
+    end = time.monotonic() + args.seconds
+    try:
+        while time.monotonic() < end:
+            readable, _, _ = select.select(list(socks), [], [], 0.05)
+            for sock in readable:
+                while True:
+                    received = packet_capture.receive_timestamped(sock)
+                    if received is None:
+                        break
+                    data, source, arrival_ns = received
+                    if writer is not None:
+                        writer.write(socks[sock], source, arrival_ns, data)
+                    if sock in video_socks:
+                        pipeline.add(source, data, arrival_ns / 1000.0)
+            if follower is not None:
+                for line in follower.lines():
+                    if writer is not None:
+                        writer.write(packet_capture.PORT_DEVICE_LOG, args.device or '0.0.0.0', time.time_ns(), line)
+                    event = parse_trace_line(line)
+                    if event is not None:
+                        events[(event.frame_id, event.timestamp)] = event
+            pipeline.expire(time.time_ns() / 1000.0)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        if control is not None:
+            control.close()
+        if follower is not None:
+            follower.close()
+        if writer is not None:
+            writer.close()
+        for sock in socks:
+            sock.close()
+    return pipeline.frames, events
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--min-delay-ms', type=float, default=0.0,
+                        help="One-way network delay of the fastest frame, e.g. half the ping time")
+    parser.add_argument('--json', action='store_true', help="Print a machine-readable report")
+    sub = parser.add_subparsers(dest='command', required=True)
+
+    offline = sub.add_parser('capture', help="Analyze a capture file of packet_capture.py")
+    offline.add_argument('capture')
+    offline.add_argument('--device-log', help="Device log with the LATENCY lines, if not in the capture")
+    offline.add_argument('--no-decode', action='store_true', help="Skip the decode stage")
+
+    live = sub.add_parser('live', help="Receive a live session and analyze it")
+    live.add_argument('--device', help="Request talk permission from this device")
+    live.add_argument('--device-log', help="Follow this device log file (output of idf.py monitor)")
+    live.add_argument('--seconds', type=float, default=10.0)
+    live.add_argument('--display', action='store_true', help="Show the frames and measure the display stage")
+    live.add_argument('--save', help="Also write the session to this capture file")
+    live.add_argument('--bind', default='0.0.0.0')
+    live.add_argument('--audio-port', type=int, default=media_packets.AUDIO_UDP_PORT)
+    live.add_argument('--video-port', type=int, default=media_packets.VIDEO_UDP_PORT)
+
+    args = parser.parse_args()
+    if args.command == 'capture':
+        frames, events = load_capture(args.capture, not args.no_decode)
+        if args.device_log:
+            load_device_log(args.device_log, events)
+    else:
+        frames, events = run_live(args)
+
+    if not frames:
+        print("No complete video frame found")
+        return 1
+    sessions = analyze(frames, events, args.min_delay_ms)
+    if args.json:
+        print(json.dumps({'sessions': sessions}))
+    else:
+        print_report(sessions)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,558 @@
+#!/usr/bin/env python3
+"""
+Shared definitions for the ESP32 audio and video datagrams.
+
+The layouts mirror udp_stream.c and video_manager.c, see docs/PACKET_FORMATS.md.
+"""
+import socket
+import struct
+import time
+from collections import namedtuple
+
+# Packet type definitions (matching udp_stream.c and video_manager.c)
+AUDIO_PACKAGE = 0
+VIDEO_PACKAGE = 1
+
+# Audio codecs, in the upper nibble of the audio type byte (udp_stream_codec_t)
+CODEC_PCM = 0
+CODEC_OPUS_8K = 1
+CODEC_OPUS_16K = 2
+CODEC_NAMES = {CODEC_PCM: 'pcm', CODEC_OPUS_8K: 'opus8k', CODEC_OPUS_16K: 'opus16k'}
+
+# Video codecs, in the upper nibble of the video type byte (CONFIG_VIDEO_CODEC_*)
+VIDEO_CODEC_MJPEG = 0
+VIDEO_CODEC_H264 = 1
+VIDEO_CODEC_MJPEG_SLICES = 2    # Changed restart intervals of a JPEG frame (CONFIG_VIDEO_SLICE_UPDATES)
+VIDEO_CODEC_NAMES = {VIDEO_CODEC_MJPEG: 'mjpeg', VIDEO_CODEC_H264: 'h264', VIDEO_CODEC_MJPEG_SLICES: 'slices'}
+
+# H.264 NAL unit types (RFC 6184)
+NAL_TYPE_IDR = 5
+NAL_TYPE_FU_A = 28
+ANNEXB_START_CODE = b'\x00\x00\x00\x01'
+
+AUDIO_HEADER_FORMAT = '<BIQH'
+AUDIO_HEADER_SIZE = struct.calcsize(AUDIO_HEADER_FORMAT)
+
+VIDEO_HEADER_FORMAT = '<BIQHHH'
+VIDEO_HEADER_SIZE = struct.calcsize(VIDEO_HEADER_FORMAT)
+
+# Slice update payload: base frame ID, slice count, changed slices; per slice index and length
+SLICE_UPDATE_HEADER_FORMAT = '<IHH'
+SLICE_UPDATE_HEADER_SIZE = struct.calcsize(SLICE_UPDATE_HEADER_FORMAT)
+SLICE_ENTRY_HEADER_FORMAT = '<HH'
+SLICE_ENTRY_HEADER_SIZE = struct.calcsize(SLICE_ENTRY_HEADER_FORMAT)
+
+# Control commands (matching device_command_t in device_manager.c)
+CMD_REQUEST_TALK = 0
+CMD_END_TALK = 1
+CMD_GRANT_TALK = 2
+CMD_DENY_TALK = 3
+CMD_TALK_ENDED = 4
+CMD_TALK_DID_NOT_END = 5
+CMD_DOORBELL_RING = 6
+CMD_OPEN_DOOR = 7
+CMD_SET_CODEC = 8           # Codec in the upper 24 bits, applies from the next talk
+CMD_CODEC_SELECTED = 9      # Reply with the codec the device will use
+CMD_REQUEST_KEYFRAME = 10   # Encode the next frame as IDR / send it whole, no reply
+CMD_DOORBELL_THUMBNAIL = 11 # Opt in to ring thumbnails; from the device: JPEG length in the upper 24 bits, then the JPEG
+CMD_NACK = 12               # Resend a lost video fragment (CONFIG_VIDEO_RETRANSMIT), no reply
+CMD_CPU_PROFILE = 13        # Fetch the CPU samples (CONFIG_CPU_PROFILER); reply: length in the upper 24 bits, then the profile
+
+# NACK argument: low 12 bits of the frame id, then 12 bits of the packet sequence
+NACK_ID_MASK = 0xFFF
+NACK_SEQ_SHIFT = 12
+
+# Network configuration
+CONTROL_TCP_PORT = 12345
+AUDIO_UDP_PORT = 12345
+VIDEO_UDP_PORT = 12346
+
+MAX_PACKET_SIZE = 1400
+MAX_VIDEO_DATA_SIZE = MAX_PACKET_SIZE - VIDEO_HEADER_SIZE
+
+AudioHeader = namedtuple('AudioHeader', 'type sequence timestamp length')
+AudioHeader.codec = property(lambda header: header.type >> 4)
+VideoHeader = namedtuple('VideoHeader', 'type frame_id timestamp length packet_seq total_packets')
+VideoHeader.codec = property(lambda header: header.type >> 4)
+# data is a JPEG image, an H.264 access unit in Annex B format or a slice update
+VideoFrame = namedtuple('VideoFrame', 'frame_id timestamp data codec', defaults=(VIDEO_CODEC_MJPEG,))
+
+_audio_struct = struct.Struct(AUDIO_HEADER_FORMAT)
+_video_struct = struct.Struct(VIDEO_HEADER_FORMAT)
+_slice_update_struct = struct.Struct(SLICE_UPDATE_HEADER_FORMAT)
+_slice_entry_struct = struct.Struct(SLICE_ENTRY_HEADER_FORMAT)
+
+
+def packet_type(data):
+    """Return the package type of a datagram (without the codec), or None if it is empty"""
+    return data[0] & 0x0F if data else None
+
+
+def parse_audio_packet(data):
+    """Parse an audio datagram and return (AudioHeader, payload) or (None, None)"""
+    if len(data) < AUDIO_HEADER_SIZE:
+        return None, None
+    header = AudioHeader(*_audio_struct.unpack_from(data))
+    if header.type & 0x0F != AUDIO_PACKAGE:
+        return None, None
+    return header, data[AUDIO_HEADER_SIZE:AUDIO_HEADER_SIZE + header.length]
+
+
+def parse_video_packet(data):
+    """Parse a video datagram and return (VideoHeader, payload) or (None, None)"""
+    if len(data) < VIDEO_HEADER_SIZE:
+        return None, None
+    header = VideoHeader(*_video_struct.unpack_from(data))
+    if header.type & 0x0F != VIDEO_PACKAGE or header.total_packets == 0:
+        return None, None
+    return header, data[VIDEO_HEADER_SIZE:VIDEO_HEADER_SIZE + header.length]
+
+
+def build_audio_packet(sequence, timestamp, payload, codec=CODEC_PCM):
+    """Build an audio datagram the same way _udp_stream_write does"""
+    return _audio_struct.pack(AUDIO_PACKAGE | codec << 4, sequence & 0xFFFFFFFF, timestamp,
+                              len(payload)) + bytes(payload)
+
+
+def build_video_packets(frame_id, timestamp, frame, codec=VIDEO_CODEC_MJPEG):
+    """Fragment a JPEG frame (or slice update) the same way _video_send_fragments does"""
+    total_packets = max(1, (len(frame) + MAX_VIDEO_DATA_SIZE - 1) // MAX_VIDEO_DATA_SIZE)
+    packets = []
+    for packet_seq in range(total_packets):
+        chunk = frame[packet_seq * MAX_VIDEO_DATA_SIZE:(packet_seq + 1) * MAX_VIDEO_DATA_SIZE]
+        header = _video_struct.pack(VIDEO_PACKAGE | codec << 4, frame_id & 0xFFFFFFFF, timestamp,
+                                    len(chunk), packet_seq, total_packets)
+        packets.append(header + bytes(chunk))
+    return packets
+
+
+def h264_nal_units(stream):
+    """Split an Annex B byte stream into NAL units (without start codes)"""
+    nals = []
+    start = None
+    i = 0
+    while True:
+        found = stream.find(b'\x00\x00\x01', i)
+        if found < 0:
+            break
+        if start is not None:
+            end = found - 1 if found > 0 and stream[found - 1] == 0 else found
+            nals.append(stream[start:end])
+        start = i = found + 3
+    if start is not None and start < len(stream):
+        nals.append(stream[start:])
+    return [nal for nal in nals if nal]
+
+
+def build_h264_packets(frame_id, timestamp, access_unit):
+    """Packetize an H.264 access unit the same way _video_send_h264 does
+
+    NAL units that fit a datagram are sent whole, larger ones as FU-A fragments.
+    """
+    payloads = []
+    fragment = MAX_VIDEO_DATA_SIZE - 2
+    for nal in h264_nal_units(access_unit):
+        if len(nal) <= MAX_VIDEO_DATA_SIZE:
+            payloads.append(nal)
+            continue
+        indicator = (nal[0] & 0xE0) | NAL_TYPE_FU_A
+        for offset in range(1, len(nal), fragment):
+            fu_header = nal[0] & 0x1F
+            if offset == 1:
+                fu_header |= 0x80
+            if offset + fragment >= len(nal):
+                fu_header |= 0x40
+            payloads.append(bytes([indicator, fu_header]) + nal[offset:offset + fragment])
+    packet_type = VIDEO_PACKAGE | VIDEO_CODEC_H264 << 4
+    return [_video_struct.pack(packet_type, frame_id & 0xFFFFFFFF, timestamp, len(payload), packet_seq,
+                               len(payloads)) + payload
+            for packet_seq, payload in enumerate(payloads)]
+
+
+def h264_depacketize(payloads):
+    """Rebuild the Annex B access unit from the payloads of a frame, in packet order
+
+    Missing payloads may be passed as None: the NAL units they belong to are
+    left out, the complete ones are kept.
+    """
+    out = []
+    fu = None
+    for payload in payloads:
+        if not payload:
+            fu = None
+            continue
+        nal_type = payload[0] & 0x1F
+        if nal_type != NAL_TYPE_FU_A:
+            out.append(ANNEXB_START_CODE + payload)
+            fu = None
+            continue
+        if len(payload) < 2:
+            fu = None
+            continue
+        start, end = payload[1] & 0x80, payload[1] & 0x40
+        if start:
+            fu = [bytes([(payload[0] & 0xE0) | (payload[1] & 0x1F)])]
+        if fu is None:
+            continue
+        fu.append(payload[2:])
+        if end:
+            out.append(ANNEXB_START_CODE + b''.join(fu))
+            fu = None
+    return b''.join(out)
+
+
+def h264_is_keyframe(access_unit):
+    """True if an Annex B access unit holds an IDR slice, decodable without earlier frames"""
+    return any(nal[0] & 0x1F == NAL_TYPE_IDR for nal in h264_nal_units(access_unit))
+
+
+def jpeg_slices(jpeg):
+    """Split a JPEG frame at its restart markers like _jpeg_find_slices
+
+    Returns (header, slices): the bytes up to the end of the SOS segment and
+    the entropy-coded data of every restart interval without its RST marker.
+    None if the frame has no DRI segment or is malformed.
+    """
+    if len(jpeg) < 4 or jpeg[0:2] != b'\xff\xd8':
+        return None
+    restart_interval = False
+    i = 2
+    while True:
+        if i + 4 > len(jpeg) or jpeg[i] != 0xFF:
+            return None
+        marker = jpeg[i + 1]
+        length = jpeg[i + 2] << 8 | jpeg[i + 3]
+        if length < 2:
+            return None
+        if marker == 0xDD and length == 4 and i + 6 <= len(jpeg):
+            restart_interval = (jpeg[i + 4] << 8 | jpeg[i + 5]) != 0
+        i += 2 + length
+        if marker == 0xDA:
+            break
+    if not restart_interval or i >= len(jpeg):
+        return None
+
+    header = bytes(jpeg[:i])
+    slices = []
+    start = i
+    while True:
+        i = jpeg.find(b'\xff', i)
+        if i < 0 or i + 1 >= len(jpeg):
+            return None     # No EOI
+        marker = jpeg[i + 1]
+        if 0xD0 <= marker <= 0xD7 or marker == 0xD9:
+            slices.append(bytes(jpeg[start:i]))
+            if marker == 0xD9:
+                return header, slices
+            start = i + 2
+            i += 2
+        elif marker == 0x00:
+            i += 2
+        else:
+            i += 1
+
+
+def jpeg_from_slices(header, slices):
+    """Rebuild a JPEG frame: the header, the intervals separated by RST0..RST7, EOI"""
+    out = [header]
+    for n, data in enumerate(slices):
+        if n:
+            out.append(bytes([0xFF, 0xD0 + (n - 1) % 8]))
+        out.append(data)
+    out.append(b'\xff\xd9')
+    return b''.join(out)
+
+
+def parse_slice_update(payload):
+    """Split a slice update into (base_frame_id, slice count, {index: data})
+
+    Raises ValueError if the payload is truncated.
+    """
+    if len(payload) < _slice_update_struct.size:
+        raise ValueError("Slice update shorter than its header")
+    base_frame_id, count, changed = _slice_update_struct.unpack_from(payload)
+    offset = _slice_update_struct.size
+    slices = {}
+    for _ in range(changed):
+        if offset + _slice_entry_struct.size > len(payload):
+            raise ValueError("Slice update truncated")
+        index, length = _slice_entry_struct.unpack_from(payload, offset)
+        offset += _slice_entry_struct.size
+        if offset + length > len(payload) or index >= count:
+            raise ValueError("Slice update truncated")
+        slices[index] = bytes(payload[offset:offset + length])
+        offset += length
+    return base_frame_id, count, slices
+
+
+def build_slice_update(base_frame_id, count, changed):
+    """Build a slice update the same way _video_slice_update does; changed maps index to slice data"""
+    payload = [_slice_update_struct.pack(base_frame_id & 0xFFFFFFFF, count, len(changed))]
+    for index in sorted(changed):
+        payload.append(_slice_entry_struct.pack(index, len(changed[index])) + changed[index])
+    return b''.join(payload)
+
+
+def set_codec(sock, codec):
+    """Ask for an audio codec before requesting talk; returns the codec the device selected
+
+    Firmware without codec support does not answer, PCM is assumed then.
+    """
+    sock.sendall(struct.pack('<I', CMD_SET_CODEC | codec << 8))
+    timeout = sock.gettimeout()
+    sock.settimeout(1.0)
+    try:
+        reply = sock.recv(4)
+    except socket.timeout:
+        return CODEC_PCM
+    finally:
+        sock.settimeout(timeout)
+    if len(reply) < 4:
+        raise ConnectionError("Control connection closed")
+    value = struct.unpack('<I', reply)[0]
+    if value & 0xFF != CMD_CODEC_SELECTED:
+        raise ConnectionError(f"Unexpected reply {value} to the codec request")
+    return value >> 8
+
+
+def request_keyframe(sock):
+    """Ask the device for an IDR frame (H.264) or a whole JPEG frame (slice updates)
+    after losing video; only the talker is served"""
+    sock.sendall(struct.pack('<I', CMD_REQUEST_KEYFRAME))
+
+
+def nack_command(frame_id, packet_seq):
+    """NACK command word for one lost video fragment"""
+    argument = (frame_id & NACK_ID_MASK) | (packet_seq & NACK_ID_MASK) << NACK_SEQ_SHIFT
+    return CMD_NACK | argument << 8
+
+
+def send_nacks(sock, frame_id, packet_seqs):
+    """Ask the device to resend lost fragments of a frame; only the talker is
+    served, and only fragments of the last few frames"""
+    sock.sendall(b''.join(struct.pack('<I', nack_command(frame_id, seq)) for seq in packet_seqs))
+
+
+def request_talk(device_ip, port=CONTROL_TCP_PORT, timeout=5.0):
+    """Open the control connection and request talk permission
+
+    Returns the connected socket once the device granted the request; the
+    device streams to the address of that connection until it is closed.
+    Raises ConnectionError if the request is denied.
+    """
+    sock = socket.create_connection((device_ip, port), timeout=timeout)
+    try:
+        sock.sendall(struct.pack('<I', CMD_REQUEST_TALK))
+        reply = sock.recv(4)
+    except OSError:
+        sock.close()
+        raise
+    if len(reply) < 4 or struct.unpack('<I', reply)[0] != CMD_GRANT_TALK:
+        sock.close()
+        raise ConnectionError(f"Talk request denied by {device_ip}")
+    return sock
+
+
+def subscribe_thumbnails(sock):
+    """Ask for a JPEG thumbnail after each DOORBELL_RING
+
+    The device answers with an empty thumbnail; firmware without
+    CONFIG_DOORBELL_THUMBNAIL does not answer. Read the connection with a
+    ControlReader from then on.
+    """
+    sock.sendall(struct.pack('<I', CMD_DOORBELL_THUMBNAIL))
+
+
+def now_ms():
+    """Milliseconds since EPOCH, the clock used in the packet timestamps"""
+    return time.time_ns() // 1000000
+
+
+class SlicePatcher:
+    """Keep the last whole JPEG frame of a stream and patch slice updates into it
+
+    patch() returns the JPEG frame to use, or None for an update whose base is
+    not the last frame (one was lost): the picture stays as it was until the
+    next whole frame.
+    """
+
+    def __init__(self):
+        self.header = None
+        self.slices = None
+        self.last_id = None
+
+    def patch(self, frame):
+        if frame.codec != VIDEO_CODEC_MJPEG_SLICES:
+            parsed = jpeg_slices(frame.data)
+            self.header, self.slices = parsed if parsed is not None else (None, None)
+            self.last_id = frame.frame_id
+            return frame.data
+        try:
+            base_frame_id, count, changed = parse_slice_update(frame.data)
+        except ValueError:
+            return None
+        if self.slices is None or base_frame_id != self.last_id or count != len(self.slices):
+            return None
+        for index, data in changed.items():
+            self.slices[index] = data
+        self.last_id = frame.frame_id
+        return jpeg_from_slices(self.header, self.slices)
+
+
+class ControlReader:
+    """Split the bytes of a control connection into commands
+
+    feed() returns a (command, argument, payload) tuple per complete command.
+    The payload is the JPEG of a DOORBELL_THUMBNAIL or the profile of a
+    CPU_PROFILE, b'' for the other commands.
+    """
+
+    def __init__(self):
+        self.buffer = b''
+
+    def feed(self, data):
+        self.buffer += data
+        commands = []
+        while len(self.buffer) >= 4:
+            value = struct.unpack_from('<I', self.buffer)[0]
+            command, argument = value & 0xFF, value >> 8
+            length = argument if command in (CMD_DOORBELL_THUMBNAIL, CMD_CPU_PROFILE) else 0
+            if len(self.buffer) < 4 + length:
+                break
+            commands.append((command, argument, self.buffer[4:4 + length]))
+            self.buffer = self.buffer[4 + length:]
+        return commands
+
+
+class FrameAssembler:
+    """Reassemble fragmented video frames
+
+    Frames that do not complete within `timeout_ms` (see docs/PACKET_FORMATS.md)
+    are dropped and counted as incomplete.
+    """
+
+    def __init__(self, timeout_ms=55):
+        self.timeout_ms = timeout_ms
+        self.pending = {}
+        self.completed_frames = 0
+        self.incomplete_frames = 0
+        self.last_completed_id = None
+
+    def add(self, header, payload, arrival_ms=None):
+        """Add a fragment; returns a VideoFrame once all fragments are present"""
+        if arrival_ms is None:
+            arrival_ms = now_ms()
+
+        entry = self.pending.get(header.frame_id)
+        if entry is None:
+            entry = self.pending[header.frame_id] = {
+                'codec': header.codec,
+                'total_packets': header.total_packets,
+                'timestamp': header.timestamp,
+                'first_arrival': arrival_ms,
+                'fragments': {},
+            }
+        entry['fragments'][header.packet_seq] = bytes(payload)
+
+        if len(entry['fragments']) < entry['total_packets']:
+            return None
+
+        del self.pending[header.frame_id]
+        fragments = entry['fragments']
+        try:
+            payloads = [fragments[i] for i in range(entry['total_packets'])]
+        except KeyError:
+            # Sequence numbers outside of total_packets, treat as corrupted
+            self.incomplete_frames += 1
+            return None
+        if entry['codec'] == VIDEO_CODEC_H264:
+            data = h264_depacketize(payloads)
+        else:
+            data = b''.join(payloads)
+        self.completed_frames += 1
+        self.last_completed_id = header.frame_id
+        return VideoFrame(header.frame_id, entry['timestamp'], data, entry['codec'])
+
+    def expire(self, now=None):
+        """Drop incomplete frames older than the timeout, returns how many were dropped"""
+        if now is None:
+            now = now_ms()
+        expired = [frame_id for frame_id, entry in self.pending.items()
+                   if now - entry['first_arrival'] > self.timeout_ms]
+        for frame_id in expired:
+            del self.pending[frame_id]
+        self.incomplete_frames += len(expired)
+        return len(expired)
+
+
+class NackTracker:
+    """Find the video fragments a receiver lost, to NACK them
+
+    The device sends the fragments of a frame in order, so a fragment counts
+    as lost once a later fragment of its frame or a fragment of a later frame
+    arrived. add() returns the fragments found lost by a datagram as
+    (frame_id, [packet_seq, ...]) pairs, retries() the ones still missing
+    `retry_ms` after their last NACK, up to `retries` times. Frames more than
+    `window` frames behind the newest one are given up. Whole lost frames
+    cannot be NACKed (their size is unknown); they are the keyframe
+    request's job.
+    """
+
+    def __init__(self, retry_ms=150, retries=2, window=4):
+        self.retry_ms = retry_ms
+        self.max_retries = retries
+        self.window = window
+        self.frames = {}
+        self.newest = None
+        self.nacks = 0
+
+    def add(self, header, arrival_ms=None):
+        if arrival_ms is None:
+            arrival_ms = now_ms()
+        lost = []
+        newer = self.newest is None or 0 < (header.frame_id - self.newest) & 0xFFFFFFFF < 0x80000000
+        if newer:
+            self.newest = header.frame_id
+            self.frames = {frame_id: frame for frame_id, frame in self.frames.items()
+                           if (self.newest - frame_id) & 0xFFFFFFFF <= self.window}
+            # The tails of the frames before it are lost
+            for frame_id, frame in self.frames.items():
+                missing = [s for s in range(frame['highest'] + 1, frame['total']) if s not in frame['received']]
+                frame['highest'] = frame['total'] - 1
+                if missing:
+                    lost.append((frame_id, missing))
+        elif (self.newest - header.frame_id) & 0xFFFFFFFF > self.window:
+            return lost
+
+        frame = self.frames.get(header.frame_id)
+        if frame is None:
+            frame = self.frames[header.frame_id] = {
+                'total': header.total_packets, 'received': set(), 'highest': -1, 'nacked': {}}
+        frame['received'].add(header.packet_seq)
+        frame['nacked'].pop(header.packet_seq, None)
+        if header.packet_seq > frame['highest']:
+            missing = [s for s in range(frame['highest'] + 1, header.packet_seq) if s not in frame['received']]
+            frame['highest'] = header.packet_seq
+            if missing:
+                lost.append((header.frame_id, missing))
+
+        for frame_id, seqs in lost:
+            nacked = self.frames[frame_id]['nacked']
+            for seq in seqs:
+                nacked[seq] = (arrival_ms, 1)
+            self.nacks += len(seqs)
+        return lost
+
+    def retries(self, now=None):
+        if now is None:
+            now = now_ms()
+        due = []
+        for frame_id, frame in self.frames.items():
+            seqs = [seq for seq, (sent, count) in frame['nacked'].items()
+                    if now - sent >= self.retry_ms and count <= self.max_retries]
+            for seq in seqs:
+                frame['nacked'][seq] = (now, frame['nacked'][seq][1] + 1)
+            if seqs:
+                due.append((frame_id, seqs))
+                self.nacks += len(seqs)
+        return due
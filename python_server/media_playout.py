@@ -0,0 +1,296 @@
+#!/usr/bin/env python3
+"""
+Receive side playout of the ESP32 media streams.
+
+The audio jitter buffer and the video playout scheduler a viewer runs behind
+its sockets. Both are driven with explicit arrival times (ms), so the same
+code plays a live session or a capture file at full speed.
+"""
+import heapq
+
+import numpy as np
+
+import audio_codecs
+import media_packets
+
+AUDIO_SAMPLE_RATE = 8000        # I2S_SAMPLE_RATE in audio_pipeline_manager.c
+AUDIO_PACKET_BYTES = 324        # buffer_len of the sending I2S stream
+AUDIO_PACKET_MS = AUDIO_PACKET_BYTES / 2 * 1000 / AUDIO_SAMPLE_RATE
+
+# Concealment repeats the last packet with this gain per repetition, silence after CONCEAL_MAX_REPEATS
+CONCEAL_GAIN = 0.5
+CONCEAL_MAX_REPEATS = 3
+
+# A sequence jump larger than this starts a new stream
+SEQUENCE_RESET = 1000
+
+
+def _seq_diff(a, b):
+    """a - b for 32-bit wrapping sequence numbers"""
+    return ((a - b + 0x80000000) & 0xFFFFFFFF) - 0x80000000
+
+
+class JitterBuffer:
+    """Adaptive audio jitter buffer
+
+    Packets are played one per packet interval, `target_ms` after the arrival
+    of the first packet. The target follows the interarrival jitter (RFC 3550
+    estimator). A missing packet is concealed: when later packets are waiting
+    it is counted as lost and skipped, when the buffer ran empty the playout is
+    stretched by one slot instead, so a delayed packet is still played. Packets
+    that stay longer than needed shorten the next slot by half (time compression).
+
+    Opus packets are decoded with libopus. A missing Opus frame is rebuilt
+    from the in-band FEC of the next packet when that one is buffered, and
+    concealed by the decoder otherwise.
+    """
+
+    def __init__(self, packet_ms=AUDIO_PACKET_MS, min_delay_ms=20.0, max_delay_ms=200.0, jitter_factor=3.0):
+        self.packet_ms = packet_ms
+        self.min_delay_ms = min_delay_ms
+        self.max_delay_ms = max_delay_ms
+        self.jitter_factor = jitter_factor
+        self.packets = {}
+        self.jitter_ms = 0.0
+        self.last_transit = None
+        self.next_seq = None
+        self.next_play_ms = None
+        self.last_samples = None
+        self.conceal_run = 0
+        self.stretch_run = 0
+        self.played = 0
+        self.concealed = 0
+        self.lost = 0
+        self.late = 0
+        self.delays_ms = []
+        self.codec = media_packets.CODEC_PCM
+        self.decoder = None
+        self.recovered = 0
+
+    @property
+    def target_ms(self):
+        target = self.jitter_factor * self.jitter_ms + self.packet_ms
+        return min(self.max_delay_ms, max(self.min_delay_ms, target))
+
+    def _set_codec(self, codec):
+        """Switch codec; the sequence numbers restart with the new stream"""
+        decoder = None
+        if codec != media_packets.CODEC_PCM:
+            if codec not in audio_codecs.CODEC_SAMPLE_RATES:
+                raise RuntimeError(f"Unknown audio codec {codec}")
+            decoder = audio_codecs.OpusDecoder(audio_codecs.CODEC_SAMPLE_RATES[codec])
+        self.codec = codec
+        self.decoder = decoder
+        self.packet_ms = AUDIO_PACKET_MS if decoder is None else audio_codecs.FRAME_MS
+        self.next_seq = None
+        self.last_samples = None
+
+    def put(self, header, payload, arrival_ms):
+        if header.codec != self.codec:
+            self._set_codec(header.codec)
+        transit = arrival_ms - header.timestamp
+        if self.last_transit is not None:
+            self.jitter_ms += (abs(transit - self.last_transit) - self.jitter_ms) / 16
+        self.last_transit = transit
+
+        if self.next_seq is None or abs(_seq_diff(header.sequence, self.next_seq)) > SEQUENCE_RESET:
+            self.packets.clear()
+            self.next_seq = header.sequence
+            self.next_play_ms = arrival_ms + self.target_ms
+        elif _seq_diff(header.sequence, self.next_seq) < 0:
+            self.late += 1
+            return
+        self.packets[header.sequence] = (payload, arrival_ms)
+
+    def pull(self, now_ms):
+        """Play every slot due by `now_ms`; returns the PCM blocks in playout order"""
+        out = []
+        while self.next_play_ms is not None and self.next_play_ms <= now_ms:
+            out.append(self._play_slot())
+        return out
+
+    def drain(self):
+        """Play the buffered packets at the end of a stream, without concealment"""
+        out = []
+        while self.packets:
+            if self.next_seq in self.packets:
+                out.append(self._play_slot())
+            else:
+                self.next_seq = (self.next_seq + 1) & 0xFFFFFFFF
+        return out
+
+    def _play_slot(self):
+        slot_ms = self.next_play_ms
+        entry = self.packets.pop(self.next_seq, None)
+        interval = self.packet_ms
+        if entry is not None:
+            payload, arrival_ms = entry
+            if self.decoder is not None:
+                samples = self.decoder.decode(payload)
+            else:
+                samples = np.frombuffer(payload[:len(payload) & ~1], dtype='<i2')
+            self.last_samples = samples
+            self.conceal_run = 0
+            self.stretch_run = 0
+            self.next_seq = (self.next_seq + 1) & 0xFFFFFFFF
+            self.played += 1
+            delay = slot_ms - arrival_ms
+            self.delays_ms.append(delay)
+            if delay > self.target_ms + self.packet_ms and self.packets:
+                interval = self.packet_ms / 2
+        else:
+            samples = self._conceal()
+            if self.packets or self.stretch_run * self.packet_ms >= self.max_delay_ms:
+                # Lost (or given up on): skip the sequence number
+                self.next_seq = (self.next_seq + 1) & 0xFFFFFFFF
+                self.lost += 1
+                self.stretch_run = 0
+            else:
+                self.stretch_run += 1
+        self.next_play_ms = slot_ms + interval
+        return samples
+
+    def _conceal(self):
+        self.concealed += 1
+        self.conceal_run += 1
+        if self.decoder is not None:
+            following = self.packets.get((self.next_seq + 1) & 0xFFFFFFFF)
+            if following is not None:
+                self.recovered += 1
+                return self.decoder.recover(following[0])
+            return self.decoder.conceal()
+        if self.last_samples is None or self.conceal_run > CONCEAL_MAX_REPEATS:
+            return np.zeros(int(self.packet_ms * AUDIO_SAMPLE_RATE / 1000), dtype='<i2')
+        gain = CONCEAL_GAIN ** self.conceal_run
+        return (self.last_samples * gain).astype('<i2')
+
+
+class VideoPlayout:
+    """Frame reassembly and display scheduling
+
+    A complete frame is shown at its media timestamp mapped to the local clock
+    (minimum transit seen so far) plus `delay_ms`, the audio playout delay for
+    lip sync, or immediately when it completes later than that. Frames older
+    than the last shown one are dropped.
+
+    `decode(frame, arrival_ms)` sees every complete frame in the order they
+    complete, before any is dropped, as H.264 and slice updates need. It
+    returns the data to show (a picture or a JPEG frame) or None when there
+    is nothing to show.
+    """
+
+    def __init__(self, reassembly_timeout_ms=55, decode=None):
+        self.assembler = media_packets.FrameAssembler(timeout_ms=reassembly_timeout_ms)
+        self.decode = decode
+        self.offset_ms = None
+        self.queue = []
+        self.last_shown_id = None
+        self.shown = 0
+        self.stale = 0
+        self.late = 0
+        self.delays_ms = []
+
+    def put(self, header, payload, arrival_ms, delay_ms):
+        self.assembler.expire(arrival_ms)
+        frame = self.assembler.add(header, payload, arrival_ms)
+        if frame is None:
+            return
+        if self.decode is not None:
+            data = self.decode(frame, arrival_ms)
+            if data is None:
+                return
+            frame = frame._replace(data=data)
+        if self.last_shown_id is not None and _seq_diff(frame.frame_id, self.last_shown_id) <= 0:
+            self.stale += 1
+            return
+        transit = arrival_ms - frame.timestamp
+        self.offset_ms = transit if self.offset_ms is None else min(self.offset_ms, transit)
+        due_ms = frame.timestamp + self.offset_ms + delay_ms
+        if arrival_ms > due_ms:
+            self.late += 1
+        heapq.heappush(self.queue, (max(due_ms, arrival_ms), frame.frame_id, arrival_ms, frame))
+
+    def pull(self, now_ms):
+        """Frames to show by `now_ms`; of several due frames only the newest is shown"""
+        self.assembler.expire(now_ms)
+        due = []
+        while self.queue and self.queue[0][0] <= now_ms:
+            due.append(heapq.heappop(self.queue))
+        if not due:
+            return []
+        newest = max(due, key=lambda entry: entry[1])
+        self.stale += len(due) - 1
+        show_ms, _, arrival_ms, frame = newest
+        self.last_shown_id = frame.frame_id
+        self.shown += 1
+        self.delays_ms.append(show_ms - arrival_ms)
+        return [frame]
+
+    def drain(self):
+        out = []
+        while self.queue:
+            out += self.pull(self.queue[0][0])
+        self.assembler.expire(float('inf'))
+        return out
+
+
+class MediaReceiver:
+    """Audio jitter buffer and video playout behind the two media sockets"""
+
+    def __init__(self, jitter_buffer=None, video=None):
+        self.audio = jitter_buffer if jitter_buffer is not None else JitterBuffer()
+        self.video = video if video is not None else VideoPlayout()
+        self.packets = 0
+        self.invalid = 0
+
+    def receive(self, data, arrival_ms):
+        """Feed one datagram; plays out everything due before it arrived, see advance()"""
+        played = self.advance(arrival_ms)
+        self.packets += 1
+        kind = media_packets.packet_type(data)
+        if kind == media_packets.AUDIO_PACKAGE:
+            header, payload = media_packets.parse_audio_packet(data)
+            if header is not None:
+                try:
+                    self.audio.put(header, payload, arrival_ms)
+                    return played
+                except RuntimeError:
+                    # Unknown codec, or Opus without libopus on this host
+                    pass
+        elif kind == media_packets.VIDEO_PACKAGE:
+            header, payload = media_packets.parse_video_packet(data)
+            if header is not None:
+                self.video.put(header, payload, arrival_ms, self.audio.target_ms)
+                return played
+        self.invalid += 1
+        return played
+
+    def advance(self, now_ms):
+        """Returns the audio blocks and the video frames due by `now_ms`"""
+        return self.audio.pull(now_ms), self.video.pull(now_ms)
+
+    def finish(self):
+        self.audio.drain()
+        self.video.drain()
+
+    def stats(self):
+        audio, video = self.audio, self.video
+        frames = video.assembler.completed_frames + video.assembler.incomplete_frames
+        slots = audio.played + audio.concealed
+        return {
+            'packets': self.packets,
+            'invalid_packets': self.invalid,
+            'audio_played': audio.played,
+            'audio_concealed': audio.concealed,
+            'audio_lost': audio.lost,
+            'audio_recovered': audio.recovered,
+            'audio_late': audio.late,
+            'audio_concealment_ratio': audio.concealed / slots if slots else 0.0,
+            'audio_jitter_ms': audio.jitter_ms,
+            'frames_complete': video.assembler.completed_frames,
+            'frames_incomplete': video.assembler.incomplete_frames,
+            'frame_completion': video.assembler.completed_frames / frames if frames else 0.0,
+            'frames_shown': video.shown,
+            'frames_stale': video.stale,
+            'frames_late': video.late,
+        }
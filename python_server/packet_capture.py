@@ -0,0 +1,257 @@
+#!/usr/bin/env python3
+"""
+Capture and replay of ESP32 media sessions
+
+Records the audio and video datagrams of a session with their arrival time
+into a capture file (.tcap), optionally together with the device log lines
+(latency trace events), and replays such a file to a receiver with the
+original timing. Captures are the input of latency_analyzer.py.
+"""
+import argparse
+import collections
+import mmap
+import os
+import select
+import socket
+import struct
+import sys
+import time
+
+import media_packets
+
+CAPTURE_MAGIC = b'TCAP'
+CAPTURE_VERSION = 1
+FILE_HEADER = struct.Struct('<4sHHQ')      # magic, version, reserved, creation time (ns since EPOCH)
+RECORD_HEADER = struct.Struct('<HHIQ')     # destination port, length, source IPv4, arrival time (ns since EPOCH)
+RECORD_ALIGN = 8
+
+# Records with destination port 0 hold a line of the device log (UTF-8)
+PORT_DEVICE_LOG = 0
+
+SO_TIMESTAMPNS = getattr(socket, 'SO_TIMESTAMPNS', 35)
+
+CaptureRecord = collections.namedtuple('CaptureRecord', 'port source timestamp_ns payload')
+
+
+def ip_to_u32(ip):
+    return struct.unpack('<I', socket.inet_aton(ip))[0]
+
+
+def u32_to_ip(value):
+    return socket.inet_ntoa(struct.pack('<I', value))
+
+
+class CaptureWriter:
+    def __init__(self, path):
+        self.file = open(path, 'wb')
+        self.file.write(FILE_HEADER.pack(CAPTURE_MAGIC, CAPTURE_VERSION, 0, time.time_ns()))
+        self.records = 0
+
+    def write(self, port, source, timestamp_ns, payload):
+        """Append a record; `source` is an IPv4 address string"""
+        length = len(payload)
+        self.file.write(RECORD_HEADER.pack(port, length, ip_to_u32(source), timestamp_ns))
+        self.file.write(payload)
+        pad = -(RECORD_HEADER.size + length) % RECORD_ALIGN
+        if pad:
+            self.file.write(bytes(pad))
+        self.records += 1
+
+    def close(self):
+        self.file.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *_):
+        self.close()
+
+
+def read_capture(path):
+    """Iterate over the records of a capture file; a truncated last record is ignored"""
+    with open(path, 'rb') as f:
+        size = os.fstat(f.fileno()).st_size
+        if size < FILE_HEADER.size:
+            raise ValueError(f"{path} is not a capture file")
+        with mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as data:
+            magic, version, _, _ = FILE_HEADER.unpack_from(data)
+            if magic != CAPTURE_MAGIC or version != CAPTURE_VERSION:
+                raise ValueError(f"{path} is not a version {CAPTURE_VERSION} capture file")
+            pos = FILE_HEADER.size
+            while pos + RECORD_HEADER.size <= size:
+                port, length, source, timestamp_ns = RECORD_HEADER.unpack_from(data, pos)
+                start = pos + RECORD_HEADER.size
+                if start + length > size:
+                    break
+                yield CaptureRecord(port, u32_to_ip(source), timestamp_ns, data[start:start + length])
+                pos = start + length + (-(RECORD_HEADER.size + length) % RECORD_ALIGN)
+
+
+def open_media_sockets(bind, audio_port, video_port):
+    """UDP sockets for the audio and video streams with kernel receive timestamps"""
+    socks = {}
+    for port in (audio_port, video_port):
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 * 1024 * 1024)
+        try:
+            sock.setsockopt(socket.SOL_SOCKET, SO_TIMESTAMPNS, 1)
+        except OSError:
+            pass
+        sock.bind((bind, port))
+        sock.setblocking(False)
+        socks[sock] = port
+    return socks
+
+
+def receive_timestamped(sock):
+    """Return (data, source ip, arrival ns) or None when the socket is drained"""
+    try:
+        data, ancdata, _, addr = sock.recvmsg(65535, socket.CMSG_SPACE(16))
+    except BlockingIOError:
+        return None
+    for level, kind, value in ancdata:
+        if level == socket.SOL_SOCKET and kind == SO_TIMESTAMPNS and len(value) >= 16:
+            sec, nsec = struct.unpack('qq', value[:16])
+            return data, addr[0], sec * 1000000000 + nsec
+    return data, addr[0], time.time_ns()
+
+
+class LogFollower:
+    """Read the lines appended to a log file (e.g. the output of `idf.py monitor`)"""
+
+    def __init__(self, path, from_start=False):
+        self.file = open(path, 'rb')
+        if not from_start:
+            self.file.seek(0, os.SEEK_END)
+        self.partial = b''
+
+    def lines(self):
+        chunk = self.file.read()
+        if not chunk:
+            return []
+        lines = (self.partial + chunk).split(b'\n')
+        self.partial = lines.pop()
+        return [line.rstrip(b'\r') for line in lines if line.strip()]
+
+    def close(self):
+        self.file.close()
+
+
+def run_record(args):
+    socks = open_media_sockets(args.bind, args.audio_port, args.video_port)
+    control = media_packets.request_talk(args.device) if args.device else None
+    follower = LogFollower(args.device_log) if args.device_log else None
+    end = time.monotonic() + args.seconds if args.seconds else None
+    counts = collections.Counter()
+    print(f"Capturing to {args.output}" + (f" from {args.device}" if args.device else ""))
+    with CaptureWriter(args.output) as writer:
+        try:
+            while end is None or time.monotonic() < end:
+                readable, _, _ = select.select(list(socks), [], [], 0.05)
+                for sock in readable:
+                    while True:
+                        received = receive_timestamped(sock)
+                        if received is None:
+                            break
+                        data, source, timestamp_ns = received
+                        writer.write(socks[sock], source, timestamp_ns, data)
+                        counts[socks[sock]] += 1
+                if follower is not None:
+                    for line in follower.lines():
+                        writer.write(PORT_DEVICE_LOG, args.device or '0.0.0.0', time.time_ns(), line)
+                        counts[PORT_DEVICE_LOG] += 1
+        except KeyboardInterrupt:
+            pass
+        finally:
+            if control is not None:
+                control.close()
+            if follower is not None:
+                follower.close()
+            for sock in socks:
+                sock.close()
+    print(f"Captured {counts[args.audio_port]} audio, {counts[args.video_port]} video datagrams "
+          f"and {counts[PORT_DEVICE_LOG]} log lines")
+
+
+def run_info(args):
+    per_port = collections.Counter()
+    sources = set()
+    first = last = None
+    assembler = media_packets.FrameAssembler()
+    for record in read_capture(args.capture):
+        per_port[record.port] += 1
+        sources.add(record.source)
+        first = record.timestamp_ns if first is None else first
+        last = record.timestamp_ns
+        if record.port != PORT_DEVICE_LOG and media_packets.packet_type(record.payload) == media_packets.VIDEO_PACKAGE:
+            header, payload = media_packets.parse_video_packet(record.payload)
+            if header is not None:
+                assembler.add(header, payload, record.timestamp_ns // 1000000)
+                assembler.expire(record.timestamp_ns // 1000000)
+    assembler.expire(float('inf'))
+    duration = (last - first) / 1e9 if first is not None else 0.0
+    print(f"{args.capture}: {sum(per_port.values())} records over {duration:.1f}s from {', '.join(sorted(sources))}")
+    for port, count in sorted(per_port.items()):
+        name = 'device log' if port == PORT_DEVICE_LOG else f"port {port}"
+        print(f"  {name}: {count}")
+    print(f"  Video frames: {assembler.completed_frames} complete, {assembler.incomplete_frames} incomplete")
+
+
+def run_replay(args):
+    """Send the datagrams of a capture to a receiver with the original spacing"""
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    if args.source_ip:
+        sock.bind((args.source_ip, 0))
+    start_wall = None
+    start_capture = None
+    sent = 0
+    for record in read_capture(args.capture):
+        if record.port == PORT_DEVICE_LOG:
+            continue
+        if start_capture is None:
+            start_capture = record.timestamp_ns
+            start_wall = time.monotonic_ns()
+        due = start_wall + (record.timestamp_ns - start_capture) / args.speed
+        delay = (due - time.monotonic_ns()) / 1e9
+        if delay > 0:
+            time.sleep(delay)
+        sock.sendto(record.payload, (args.target, record.port))
+        sent += 1
+    sock.close()
+    print(f"Replayed {sent} datagrams to {args.target}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    sub = parser.add_subparsers(dest='command', required=True)
+
+    record = sub.add_parser('record', help="Capture a live session")
+    record.add_argument('output', help="Capture file (.tcap)")
+    record.add_argument('--device', help="Request talk permission from this device first")
+    record.add_argument('--device-log', help="Also capture the lines appended to this device log file")
+    record.add_argument('--bind', default='0.0.0.0')
+    record.add_argument('--audio-port', type=int, default=media_packets.AUDIO_UDP_PORT)
+    record.add_argument('--video-port', type=int, default=media_packets.VIDEO_UDP_PORT)
+    record.add_argument('--seconds', type=float, help="Stop after this many seconds")
+
+    info = sub.add_parser('info', help="Summarize a capture")
+    info.add_argument('capture')
+
+    replay = sub.add_parser('replay', help="Send a capture to a receiver with the original timing")
+    replay.add_argument('capture')
+    replay.add_argument('--target', default='127.0.0.1')
+    replay.add_argument('--source-ip', help="Send from this local address")
+    replay.add_argument('--speed', type=float, default=1.0, help="Replay speed factor")
+
+    args = parser.parse_args()
+    if args.command == 'record':
+        run_record(args)
+    elif args.command == 'info':
+        run_info(args)
+    else:
+        run_replay(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,151 @@
+#!/usr/bin/env python3
+"""
+Playback server for the video archive
+
+Serves timeline queries and frames of the archive written by archive.py over
+HTTP. Activity queries are answered from the per-second day summaries and the
+frame index only, no frame is decoded. Timeline thumbnails are served from the
+sprite file of the day.
+"""
+import argparse
+import json
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+
+from archive import DEFAULT_ACTIVITY_THRESHOLD, ArchiveReader
+
+
+class PlaybackHandler(BaseHTTPRequestHandler):
+    """Routes:
+
+    GET /devices
+    GET /devices/<device>/days
+    GET /devices/<device>/next_activity?after=<ms>&threshold=<score>
+    GET /devices/<device>/histogram?day=<YYYY-MM-DD>&bucket=<s>&threshold=<score>
+    GET /devices/<device>/frame?t=<ms>
+    GET /devices/<device>/sprites?day=<YYYY-MM-DD>
+    GET /devices/<device>/sprite?day=<YYYY-MM-DD>&hour=<0-23>
+    """
+
+    server_version = 'PlaybackServer/1.0'
+
+    def do_GET(self):
+        url = urlparse(self.path)
+        parts = [p for p in url.path.split('/') if p]
+        query = {k: v[-1] for k, v in parse_qs(url.query).items()}
+        t0 = time.perf_counter()
+        try:
+            if parts == ['devices']:
+                self._json(self.server.reader().devices(), t0)
+            elif len(parts) == 3 and parts[0] == 'devices':
+                self._device_route(parts[1], parts[2], query, t0)
+            else:
+                self.send_error(404)
+        except (KeyError, ValueError) as e:
+            self.send_error(400, f"Bad request: {e}")
+
+    def _device_route(self, device, route, query, t0):
+        reader = self.server.reader()
+        if device not in reader.devices():
+            self.send_error(404, "Unknown device")
+        elif route == 'days':
+            self._json(reader.days(device), t0)
+        elif route == 'next_activity':
+            found = reader.next_activity(device, int(query['after']),
+                                         float(query.get('threshold', DEFAULT_ACTIVITY_THRESHOLD)))
+            result = None if found is None else {'timestamp': found[0], 'activity': found[1]}
+            self._json(result, t0)
+        elif route == 'histogram':
+            result = reader.histogram(device, query['day'], int(query.get('bucket', 60)),
+                                      float(query.get('threshold', DEFAULT_ACTIVITY_THRESHOLD)))
+            if result is None:
+                self.send_error(404, "No recording on that day")
+            else:
+                self._json(result, t0)
+        elif route == 'frame':
+            found = reader.frame_at(device, int(query['t']))
+            if found is None:
+                self.send_error(404, "No frame at that time")
+                return
+            timestamp, jpeg = found
+            self.send_response(200)
+            self.send_header('Content-Type', 'image/jpeg')
+            self.send_header('Content-Length', str(len(jpeg)))
+            self.send_header('X-Frame-Timestamp', str(timestamp))
+            self.end_headers()
+            self.wfile.write(jpeg)
+        elif route == 'sprites':
+            data = reader.sprites(device, query['day'])
+            if data is None:
+                self.send_error(404, "No thumbnails for that day")
+                return
+            self.send_response(200)
+            self.send_header('Content-Type', 'application/octet-stream')
+            self.send_header('Content-Length', str(len(data)))
+            self.end_headers()
+            self.wfile.write(data)
+        elif route == 'sprite':
+            found = reader.sprite_sheet(device, query['day'], int(query['hour']))
+            if found is None:
+                self.send_error(404, "No thumbnails in that hour")
+                return
+            sheet, geometry = found
+            self.send_response(200)
+            self.send_header('Content-Type', 'image/jpeg')
+            self.send_header('Content-Length', str(len(sheet)))
+            self.send_header('X-Tile-Size', f"{geometry['tile_width']}x{geometry['tile_height']}")
+            self.send_header('X-Tile-Interval', str(geometry['interval_s']))
+            self.send_header('X-Tile-Columns', str(geometry['columns']))
+            self.send_header('X-Tiles-Present', geometry['present'])
+            self.end_headers()
+            self.wfile.write(sheet)
+        else:
+            self.send_error(404)
+
+    def _json(self, result, t0):
+        body = json.dumps({'result': result, 'query_ms': (time.perf_counter() - t0) * 1000}).encode()
+        self.send_response(200)
+        self.send_header('Content-Type', 'application/json')
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, format, *args):
+        if self.server.verbose:
+            super().log_message(format, *args)
+
+
+class PlaybackServer(ThreadingHTTPServer):
+    daemon_threads = True
+
+    def __init__(self, address, root, verbose=False):
+        super().__init__(address, PlaybackHandler)
+        self.verbose = verbose
+        # Shared by the handler threads, its index cache only ever gains or replaces entries
+        self.archive = ArchiveReader(root)
+
+    def reader(self):
+        return self.archive
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Serve the video archive over HTTP")
+    parser.add_argument('--root', default='archive', help="Archive directory")
+    parser.add_argument('--bind', default='0.0.0.0')
+    parser.add_argument('--port', type=int, default=8080)
+    parser.add_argument('--verbose', action='store_true', help="Log every request")
+    args = parser.parse_args()
+
+    server = PlaybackServer((args.bind, args.port), args.root, args.verbose)
+    print(f"Serving {args.root} on http://{args.bind}:{args.port}")
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        print("\nPlayback server stopped")
+    finally:
+        server.server_close()
+
+
+if __name__ == "__main__":
+    main()
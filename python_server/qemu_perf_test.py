@@ -0,0 +1,651 @@
+#!/usr/bin/env python3
+"""
+QEMU end-to-end firmware performance test
+
+Runs the real firmware image (built with -DQEMU=1, CONFIG_EMULATED_PERIPHERALS)
+in Espressif's QEMU with the emulated OpenCores Ethernet, camera frames from a
+flash partition and the paced I2S stand-in, then plays a scripted session
+against it: request talk, stream, end talk. Reports packet rates, frame
+completion and the session start and stop latencies, so firmware changes get
+a performance signal without hardware. The scenario can also be played
+against a board or device_simulator.py.
+
+With CONFIG_PACKET_TIMING the firmware logs per-packet latency statistics;
+`timing` compares them between serial logs and `iram` runs the scenario on
+builds with and without CONFIG_MEDIA_IRAM and compares them. `rejoin` boots
+the same flash image repeatedly and reports the time to IP of each boot, the
+DHCP lease reuse of CONFIG_FAST_REJOIN.
+"""
+import argparse
+import csv
+import json
+import os
+import re
+import select
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+import media_packets
+
+FRAMES_MAGIC = 0x4D524654       # 'TFRM', EMULATED_FRAMES_MAGIC in emulated_camera.h
+READY_MARKER = b'control server listening on port'
+DEFAULT_FIRMWARE_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'esp32_firmware')
+DEFAULT_HOST_CONTROL_PORT = 22345
+DEFAULT_HOST_AUDIO_PORT = 22346
+
+# Logged by network/packet_timing.c every 5 s per stream
+TIMING_LINE = re.compile(r'PKT_TIMING: (stream=.*)')
+TIMING_STREAMS = ('audio_tx', 'audio_rx', 'video_tx')
+AUDIO_SEND_INTERVAL_S = 0.02025  # One 324 byte PCM block at 8 kHz
+
+# Logged by network/fast_rejoin.c once per boot
+REJOIN_LINE = re.compile(r'NET_REJOIN: (iface=.*)')
+REJOIN_FIELDS = ('start_ms', 'link_ms', 'dhcp_ms', 'ip_ms')
+
+# Logged by control/lock_profiler.c every 5 s per mutex call site
+LOCK_LINE = re.compile(r'LOCK_TIMING: (lock=.*)')
+LOCK_BUCKETS = 20  # LOCK_PROFILER_BUCKETS: 0 us, then [2^(k-1), 2^k) us, the last one open
+
+
+def build_frames_image(frames, capacity):
+    """Frames partition contents: magic, count, then length-prefixed JPEGs padded to 4 bytes"""
+    image = bytearray(struct.pack('<II', FRAMES_MAGIC, len(frames)))
+    for frame in frames:
+        image += struct.pack('<I', len(frame)) + frame + bytes(-len(frame) % 4)
+    if len(image) > capacity:
+        raise ValueError(f"Frames need {len(image)} bytes, the partition holds {capacity}")
+    return bytes(image)
+
+
+def partition_table(path):
+    """Name -> (offset, size) of a partition table CSV"""
+    sizes = {'K': 1024, 'M': 1024 * 1024}
+    table = {}
+    with open(path) as f:
+        for row in csv.reader(line for line in f if line.strip() and not line.startswith('#')):
+            name, _, _, offset, size = (field.strip() for field in row[:5])
+            size = int(size[:-1]) * sizes[size[-1]] if size[-1] in sizes else int(size, 0)
+            table[name] = (int(offset, 0), size)
+    return table
+
+
+def load_frames(args):
+    from device_simulator import load_frames as load_jpeg_dir
+    if args.jpeg_dir:
+        return load_jpeg_dir(args.jpeg_dir)
+    # Encoded test frames: a gradient with a moving bar, decodable by the clients
+    import cv2
+    import numpy as np
+    frames = []
+    gradient = np.tile(np.linspace(40, 200, 640, dtype=np.uint8), (480, 1))
+    for i in range(args.synthetic_frames):
+        image = cv2.cvtColor(gradient, cv2.COLOR_GRAY2BGR)
+        x = i * 640 // args.synthetic_frames
+        cv2.rectangle(image, (x, 120), (x + 60, 360), (230, 230, 230), -1)
+        frames.append(cv2.imencode('.jpg', image, [cv2.IMWRITE_JPEG_QUALITY, 60])[1].tobytes())
+    return frames
+
+
+def build_flash_image(args, output):
+    """Merge the firmware build and the frames partition into a QEMU flash image"""
+    subprocess.run([sys.executable, '-m', 'esptool', '--chip', args.chip, 'merge_bin', '-o', output,
+                    '--fill-flash-size', args.flash_size, '@flash_args'], cwd=args.build_dir, check=True,
+                   stdout=subprocess.DEVNULL)
+    offset, size = partition_table(args.partitions)['frames']
+    image = build_frames_image(load_frames(args), size)
+    with open(output, 'r+b') as f:
+        f.seek(offset)
+        f.write(image)
+
+
+class QemuTarget:
+    """QEMU running the firmware, with the control port forwarded to the host"""
+
+    def __init__(self, args, flash_image):
+        self.serial_log = open(args.serial_log, 'wb') if args.serial_log else None
+        self.ready = threading.Event()
+        # Only the control port is forwarded: the firmware streams to the source of the control
+        # connection, the user mode gateway, which delivers the datagrams to the host ports
+        # (and the audio port, for the talk direction of --send-audio)
+        forwards = (f"hostfwd=tcp:127.0.0.1:{args.host_control_port}-:{media_packets.CONTROL_TCP_PORT},"
+                    f"hostfwd=udp:127.0.0.1:{args.host_audio_port}-:{media_packets.AUDIO_UDP_PORT}")
+        cmd = [args.qemu, '-nographic', '-machine', args.chip, '-m', args.psram,
+               '-drive', f"file={flash_image},if=mtd,format=raw",
+               '-nic', f"user,model=open_eth,{forwards}", '-serial', 'stdio']
+        self.proc = subprocess.Popen(cmd, stdin=subprocess.DEVNULL, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+        self.reader = threading.Thread(target=self._read_serial, daemon=True)
+        self.reader.start()
+
+    def _read_serial(self):
+        for line in self.proc.stdout:
+            if self.serial_log is not None:
+                self.serial_log.write(line)
+                self.serial_log.flush()
+            if READY_MARKER in line:
+                self.ready.set()
+
+    def wait_ready(self, timeout):
+        if not self.ready.wait(timeout):
+            raise TimeoutError("Firmware did not start its control server in QEMU")
+
+    def close(self):
+        self.proc.terminate()
+        try:
+            self.proc.wait(timeout=5)
+        except subprocess.TimeoutExpired:
+            self.proc.kill()
+        if self.serial_log is not None:
+            self.serial_log.close()
+
+
+class SessionStats:
+    def __init__(self):
+        self.audio_packets = 0
+        self.video_packets = 0
+        self.audio_gaps = 0
+        self.last_audio_seq = None
+        self.first_audio = None
+        self.first_video = None
+        self.first_frame = None
+        self.last_packet = None
+        self.assembler = media_packets.FrameAssembler(timeout_ms=500)
+
+    def add(self, data, now):
+        self.last_packet = now
+        kind = media_packets.packet_type(data)
+        if kind == media_packets.AUDIO_PACKAGE:
+            header, _ = media_packets.parse_audio_packet(data)
+            if header is None:
+                return
+            self.audio_packets += 1
+            if self.first_audio is None:
+                self.first_audio = now
+            if self.last_audio_seq is not None and header.sequence != (self.last_audio_seq + 1) & 0xFFFFFFFF:
+                self.audio_gaps += 1
+            self.last_audio_seq = header.sequence
+        elif kind == media_packets.VIDEO_PACKAGE:
+            header, payload = media_packets.parse_video_packet(data)
+            if header is None:
+                return
+            self.video_packets += 1
+            if self.first_video is None:
+                self.first_video = now
+            if self.assembler.add(header, payload, now * 1000) is not None and self.first_frame is None:
+                self.first_frame = now
+
+
+class AudioSender:
+    """Talk direction: silent PCM packets to the device at the audio packet rate"""
+
+    def __init__(self, sock, dest):
+        self.sock = sock
+        self.dest = dest
+        self.sequence = 0
+        self.next_send = time.monotonic()
+        self.payload = bytes(324)
+
+    def poll(self, now):
+        while now >= self.next_send:
+            packet = media_packets.build_audio_packet(self.sequence, media_packets.now_ms(), self.payload)
+            try:
+                self.sock.sendto(packet, self.dest)
+            except OSError:
+                pass
+            self.sequence += 1
+            self.next_send += AUDIO_SEND_INTERVAL_S
+        return self.next_send - now
+
+
+def _drain(socks, stats, until, sender=None):
+    while True:
+        now = time.monotonic()
+        timeout = until - now
+        if timeout <= 0:
+            return
+        wait = min(timeout, 0.05)
+        if sender is not None:
+            wait = min(wait, sender.poll(now))
+        readable, _, _ = select.select(socks, [], [], wait)
+        for sock in readable:
+            while True:
+                try:
+                    data = sock.recv(65535)
+                except BlockingIOError:
+                    break
+                stats.add(data, time.monotonic())
+        stats.assembler.expire(time.monotonic() * 1000)
+
+
+def run_session(args, host, port, socks, audio_dest=None):
+    """Request talk, stream for --seconds, end talk; all times in ms"""
+    stats = SessionStats()
+    t0 = time.monotonic()
+    control = media_packets.request_talk(host, port, timeout=10.0)
+    granted = time.monotonic()
+    try:
+        stream_end = granted + args.seconds
+        sender = AudioSender(socks[0], audio_dest) if args.send_audio and audio_dest else None
+        _drain(socks, stats, stream_end, sender)
+
+        end_sent = time.monotonic()
+        control.sendall(struct.pack('<I', media_packets.CMD_END_TALK))
+        control.settimeout(5.0)
+        reply = control.recv(4)
+        end_acked = time.monotonic()
+        if len(reply) < 4 or struct.unpack('<I', reply)[0] != media_packets.CMD_TALK_ENDED:
+            raise ConnectionError("END_TALK was not acknowledged")
+        # Packets still in flight after the acknowledgement
+        _drain(socks, stats, end_acked + args.quiet_s)
+    finally:
+        control.close()
+
+    stats.assembler.expire(float('inf'))
+    streamed_s = max(1e-9, stream_end - granted)
+
+    def since(start, stamp):
+        return None if stamp is None else (stamp - start) * 1000
+
+    return {
+        'grant_ms': since(t0, granted),
+        'first_audio_ms': since(granted, stats.first_audio),
+        'first_video_ms': since(granted, stats.first_video),
+        'first_frame_ms': since(granted, stats.first_frame),
+        'end_ack_ms': since(end_sent, end_acked),
+        'last_packet_after_end_ms': max(0.0, since(end_sent, stats.last_packet) or 0.0),
+        'audio_pps': stats.audio_packets / streamed_s,
+        'video_pps': stats.video_packets / streamed_s,
+        'audio_sequence_gaps': stats.audio_gaps,
+        'frames_complete': stats.assembler.completed_frames,
+        'frames_incomplete': stats.assembler.incomplete_frames,
+        'fps': stats.assembler.completed_frames / streamed_s,
+        'frame_completion': stats.assembler.completed_frames / max(
+            1, stats.assembler.completed_frames + stats.assembler.incomplete_frames),
+    }
+
+
+def run_scenario(args, host, port, audio_dest=None):
+    socks = []
+    for media_port in (args.audio_port, args.video_port):
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 * 1024 * 1024)
+        sock.bind((args.bind, media_port))
+        sock.setblocking(False)
+        socks.append(sock)
+    try:
+        sessions = []
+        for _ in range(args.sessions):
+            sessions.append(run_session(args, host, port, socks, audio_dest))
+            time.sleep(args.pause_s)
+        return sessions
+    finally:
+        for sock in socks:
+            sock.close()
+
+
+def report(args, target, sessions):
+    result = {'benchmark': 'qemu_e2e', 'target': target, 'seconds': args.seconds, 'sessions': sessions}
+    if args.json:
+        print(json.dumps(result))
+        return
+    print(f"End-to-end test against {target}, {len(sessions)} session(s) of {args.seconds:g}s")
+    for i, s in enumerate(sessions, 1):
+        def ms(value):
+            return 'n/a' if value is None else f"{value:.0f}ms"
+        print(f"  Session {i}: grant {ms(s['grant_ms'])}, first audio {ms(s['first_audio_ms'])}, "
+              f"first video {ms(s['first_video_ms'])}, first frame {ms(s['first_frame_ms'])}")
+        print(f"    Audio {s['audio_pps']:.1f} pkt/s ({s['audio_sequence_gaps']} sequence gaps), "
+              f"video {s['video_pps']:.1f} pkt/s, {s['fps']:.1f} fps, "
+              f"{100 * s['frame_completion']:.1f}% frames complete")
+        print(f"    End talk acknowledged in {ms(s['end_ack_ms'])}, "
+              f"last packet {ms(s['last_packet_after_end_ms'])} after END_TALK")
+
+
+def _run_in_qemu(args):
+    flash_image = os.path.join(args.build_dir, 'qemu_flash.bin')
+    build_flash_image(args, flash_image)
+    target = QemuTarget(args, flash_image)
+    try:
+        target.wait_ready(args.boot_timeout)
+        return run_scenario(args, '127.0.0.1', args.host_control_port,
+                            ('127.0.0.1', args.host_audio_port))
+    finally:
+        target.close()
+
+
+def run_qemu(args):
+    if shutil.which(args.qemu) is None:
+        print(f"{args.qemu} not found, install Espressif's QEMU (idf_tools.py install qemu-xtensa)")
+        return 1
+    report(args, 'qemu', _run_in_qemu(args))
+    return 0
+
+
+def run_device(args):
+    sessions = run_scenario(args, args.device, args.control_port,
+                            (args.device, media_packets.AUDIO_UDP_PORT))
+    report(args, args.device, sessions)
+    return 0
+
+
+def parse_timing(lines):
+    """Pool the PKT_TIMING intervals of a serial log: stream -> statistics
+
+    Mean and standard deviation are pooled exactly over the intervals; the
+    firmware keeps no histogram across them, so p99 is the worst interval's.
+    """
+    intervals = {}
+    build = {}
+    for line in lines:
+        match = TIMING_LINE.search(line)
+        if match is None:
+            continue
+        fields = dict(item.split('=', 1) for item in match.group(1).split())
+        intervals.setdefault(fields['stream'], []).append(fields)
+        build = {'iram': int(fields['iram']), 'load_kb': int(fields['load_kb'])}
+
+    streams = {}
+    for stream, rows in intervals.items():
+        n = sum(int(r['n']) for r in rows)
+        if n == 0:
+            continue
+        mean = sum(int(r['n']) * float(r['mean_us']) for r in rows) / n
+        second_moment = sum(int(r['n']) * (float(r['sd_us']) ** 2 + float(r['mean_us']) ** 2) for r in rows) / n
+        streams[stream] = {
+            'packets': n,
+            'intervals': len(rows),
+            'mean_us': mean,
+            'sd_us': max(0.0, second_moment - mean * mean) ** 0.5,
+            'p50_us_median': sorted(int(r['p50_us']) for r in rows)[len(rows) // 2],
+            'p99_us_worst': max(int(r['p99_us']) for r in rows),
+            'max_us': max(int(r['max_us']) for r in rows),
+        }
+    return {**build, 'streams': streams}
+
+
+def report_timing(args, runs):
+    """runs: list of (label, parse_timing result); the first one is the baseline"""
+    result = {'benchmark': 'packet_timing', 'runs': [{'label': label, **timing} for label, timing in runs]}
+    if args.json:
+        print(json.dumps(result))
+        return
+    print("Per-packet latency (us), first run is the baseline")
+    for label, timing in runs:
+        print(f"  {label}: IRAM media paths {'on' if timing.get('iram') else 'off'}, "
+              f"PSRAM load {timing.get('load_kb', 0)} KB")
+    print(f"  {'stream':9} {'run':24} {'packets':>8} {'mean':>7} {'sd':>7} {'p50':>5} {'p99 worst':>9} "
+          f"{'max':>6} {'sd vs base':>10}")
+    for stream in TIMING_STREAMS:
+        base = runs[0][1]['streams'].get(stream)
+        for label, timing in runs:
+            s = timing['streams'].get(stream)
+            if s is None:
+                continue
+            ratio = f"{s['sd_us'] / base['sd_us']:.2f}x" if base and base['sd_us'] > 0 else 'n/a'
+            print(f"  {stream:9} {label[:24]:24} {s['packets']:8d} {s['mean_us']:7.1f} {s['sd_us']:7.1f} "
+                  f"{s['p50_us_median']:5d} {s['p99_us_worst']:9d} {s['max_us']:6d} {ratio:>10}")
+
+
+def run_timing(args):
+    runs = []
+    for path in args.logs:
+        with open(path, errors='replace') as f:
+            runs.append((os.path.basename(path), parse_timing(f)))
+    if not any(timing['streams'] for _, timing in runs):
+        print("No PKT_TIMING lines found, build with CONFIG_PACKET_TIMING")
+        return 1
+    report_timing(args, runs)
+    return 0
+
+
+def run_iram(args):
+    if shutil.which(args.qemu) is None:
+        print(f"{args.qemu} not found, install Espressif's QEMU (idf_tools.py install qemu-xtensa)")
+        return 1
+    runs = []
+    with tempfile.TemporaryDirectory() as tmp:
+        for build_dir in args.build_dirs.split(','):
+            args.build_dir = build_dir
+            args.serial_log = os.path.join(tmp, f"serial_{len(runs)}.log")
+            _run_in_qemu(args)
+            with open(args.serial_log, errors='replace') as f:
+                runs.append((os.path.basename(os.path.normpath(build_dir)), parse_timing(f)))
+    if not all(timing['streams'] for _, timing in runs):
+        print("A build logged no PKT_TIMING lines, build both with CONFIG_PACKET_TIMING")
+        return 1
+    report_timing(args, runs)
+    return 0
+
+
+def parse_rejoin(lines):
+    """The NET_REJOIN line of a boot's serial log, None without one"""
+    for line in lines:
+        match = REJOIN_LINE.search(line)
+        if match is None:
+            continue
+        fields = dict(item.split('=', 1) for item in match.group(1).split())
+        boot = {'iface': fields['iface'], 'path': fields['path'], 'lease': int(fields['lease'])}
+        boot.update((name, int(fields[name])) for name in REJOIN_FIELDS)
+        return boot
+    return None
+
+
+def _lock_hist(text):
+    counts = [int(c) for c in text.split(',')] if text else []
+    return counts + [0] * (LOCK_BUCKETS - len(counts))
+
+
+def _lock_percentile(hist, max_us, fraction):
+    """Upper edge of the bucket holding the given share of the takes (us)"""
+    target = sum(hist) * fraction
+    seen = 0
+    for bucket, count in enumerate(hist[:-1]):
+        seen += count
+        if seen >= target:
+            return min(1 << bucket if bucket else 0, max_us)
+    return max_us
+
+
+def _lock_total_us(hist):
+    """Time in the histogram, each bucket counted at the middle of its range"""
+    return sum(count * 0.75 * (1 << bucket) for bucket, count in enumerate(hist) if bucket)
+
+
+def parse_locks(lines):
+    """Pool the LOCK_TIMING intervals of a serial log: (lock, site) -> statistics
+
+    The histograms add up over the intervals, so the percentiles are exact to
+    a power of two; the blocker is the one of the interval with the longest wait.
+    """
+    sites = {}
+    for line in lines:
+        match = LOCK_LINE.search(line)
+        if match is None:
+            continue
+        fields = dict(item.split('=', 1) for item in match.group(1).split())
+        site = sites.setdefault((fields['lock'], fields['site']), {
+            'lock': fields['lock'], 'site': fields['site'], 'takes': 0, 'contended': 0,
+            'wait_max_us': 0, 'hold_max_us': 0, 'blocked_by': '-',
+            'wait_hist': [0] * LOCK_BUCKETS, 'hold_hist': [0] * LOCK_BUCKETS})
+        site['task'] = fields['task']
+        site['takes'] += int(fields['n'])
+        site['contended'] += int(fields['contended'])
+        if int(fields['contended']) and int(fields['wait_max_us']) >= site['wait_max_us']:
+            site['blocked_by'] = fields['blocked_by']
+        site['wait_max_us'] = max(site['wait_max_us'], int(fields['wait_max_us']))
+        site['hold_max_us'] = max(site['hold_max_us'], int(fields['hold_max_us']))
+        for name in ('wait_hist', 'hold_hist'):
+            site[name] = [a + b for a, b in zip(site[name], _lock_hist(fields.get(name, '')))]
+
+    result = []
+    for site in sites.values():
+        for kind in ('wait', 'hold'):
+            hist, max_us = site[f'{kind}_hist'], site[f'{kind}_max_us']
+            site[f'{kind}_p50_us'] = _lock_percentile(hist, max_us, 0.5)
+            site[f'{kind}_p99_us'] = _lock_percentile(hist, max_us, 0.99)
+            site[f'{kind}_total_ms'] = _lock_total_us(hist) / 1000
+        result.append(site)
+    # The sites that cost the most waiting first
+    return sorted(result, key=lambda s: (s['wait_total_ms'], s['hold_total_ms']), reverse=True)
+
+
+def run_locks(args):
+    lines = []
+    for path in args.logs:
+        with open(path, errors='replace') as f:
+            lines.extend(f)
+    sites = parse_locks(lines)
+    if not sites:
+        print("No LOCK_TIMING lines found, build with CONFIG_LOCK_PROFILER")
+        return 1
+    if args.json:
+        print(json.dumps({'benchmark': 'locks', 'sites': sites}))
+        return 0
+    print("Mutex call sites by time spent waiting (us, total in ms), power of two resolution")
+    print(f"  {'lock':10} {'site':26} {'task':16} {'takes':>7} {'cont':>6} {'wait p99':>8} {'max':>7} "
+          f"{'total':>8} {'hold p99':>8} {'max':>7} {'total':>8}  blocked by")
+    for s in sites[:args.top]:
+        contended = f"{100.0 * s['contended'] / s['takes']:.1f}%" if s['takes'] else '-'
+        print(f"  {s['lock'][:10]:10} {s['site'][:26]:26} {s['task'][:16]:16} {s['takes']:7d} {contended:>6} "
+              f"{s['wait_p99_us']:8d} {s['wait_max_us']:7d} {s['wait_total_ms']:8.1f} "
+              f"{s['hold_p99_us']:8d} {s['hold_max_us']:7d} {s['hold_total_ms']:8.1f}  {s['blocked_by']}")
+    return 0
+
+
+def run_rejoin(args):
+    if shutil.which(args.qemu) is None:
+        print(f"{args.qemu} not found, install Espressif's QEMU (idf_tools.py install qemu-xtensa)")
+        return 1
+    boots = []
+    with tempfile.TemporaryDirectory() as tmp:
+        # One image for all boots: QEMU writes the flash back, so NVS keeps the lease like a power cut
+        flash_image = os.path.join(args.build_dir, 'qemu_flash.bin')
+        build_flash_image(args, flash_image)
+        for i in range(args.boots):
+            args.serial_log = os.path.join(tmp, f"serial_{i}.log")
+            target = QemuTarget(args, flash_image)
+            try:
+                target.wait_ready(args.boot_timeout)
+            finally:
+                target.close()
+            with open(args.serial_log, errors='replace') as f:
+                boot = parse_rejoin(f)
+            if boot is None:
+                print(f"Boot {i + 1} logged no NET_REJOIN line, is the firmware older than CONFIG_FAST_REJOIN?")
+                return 1
+            boots.append(boot)
+
+    cold, warm = boots[0], boots[1:]
+    result = {'benchmark': 'rejoin', 'boots': boots,
+              'cold_dhcp_ms': cold['dhcp_ms'], 'cold_ip_ms': cold['ip_ms'],
+              'warm_dhcp_ms': min((b['dhcp_ms'] for b in warm), default=None),
+              'warm_ip_ms': min((b['ip_ms'] for b in warm), default=None)}
+    if args.json:
+        print(json.dumps(result))
+        return 0
+    print("Time to IP per boot (ms), the first boot starts from an empty NVS")
+    print(f"  {'boot':>4} {'iface':5} {'path':6} {'lease':>5} {'start':>6} {'link':>6} {'dhcp':>6} {'ip':>6}")
+    for i, b in enumerate(boots):
+        print(f"  {i + 1:4d} {b['iface']:5} {b['path']:6} {'yes' if b['lease'] else 'no':>5} {b['start_ms']:6d} "
+              f"{b['link_ms']:6d} {b['dhcp_ms']:6d} {b['ip_ms']:6d}")
+    if warm and not any(b['lease'] for b in warm):
+        print("  No boot found a stored lease, build with CONFIG_FAST_REJOIN")
+    return 0
+
+
+def run_frames(args):
+    offset, size = partition_table(args.partitions)['frames']
+    image = build_frames_image(load_frames(args), size)
+    with open(args.output, 'wb') as f:
+        f.write(image)
+    print(f"Wrote {len(image)} bytes, flash with: esptool.py write_flash {offset:#x} {args.output}")
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--partitions', default=os.path.join(DEFAULT_FIRMWARE_DIR, 'config', 'partitions_qemu.csv'))
+    parser.add_argument('--jpeg-dir', help="Camera frames, instead of the generated test frames")
+    parser.add_argument('--synthetic-frames', type=int, default=30)
+    sub = parser.add_subparsers(dest='command', required=True)
+
+    scenario = argparse.ArgumentParser(add_help=False)
+    scenario.add_argument('--seconds', type=float, default=60.0, help="Streaming time per session")
+    scenario.add_argument('--sessions', type=int, default=1)
+    scenario.add_argument('--pause-s', type=float, default=1.0, help="Pause between sessions")
+    scenario.add_argument('--quiet-s', type=float, default=1.0, help="Time to wait for late packets after END_TALK")
+    scenario.add_argument('--bind', default='0.0.0.0')
+    scenario.add_argument('--audio-port', type=int, default=media_packets.AUDIO_UDP_PORT)
+    scenario.add_argument('--video-port', type=int, default=media_packets.VIDEO_UDP_PORT)
+    scenario.add_argument('--send-audio', action='store_true',
+                          help="Send silent PCM to the device while streaming (its audio receive path)")
+    scenario.add_argument('--json', action='store_true', help="Print a machine-readable report")
+
+    emulator = argparse.ArgumentParser(add_help=False)
+    emulator.add_argument('--qemu', default='qemu-system-xtensa')
+    emulator.add_argument('--chip', default='esp32s3')
+    emulator.add_argument('--psram', default='8M', help="Emulated PSRAM size (camera frame buffers)")
+    emulator.add_argument('--flash-size', default='4MB')
+    emulator.add_argument('--host-control-port', type=int, default=DEFAULT_HOST_CONTROL_PORT,
+                          help="Host port forwarded to the control port of the firmware")
+    emulator.add_argument('--host-audio-port', type=int, default=DEFAULT_HOST_AUDIO_PORT,
+                          help="Host UDP port forwarded to the audio port of the firmware")
+    emulator.add_argument('--boot-timeout', type=float, default=60.0)
+
+    qemu = sub.add_parser('qemu', parents=[scenario, emulator], help="Boot the firmware in QEMU and run the scenario")
+    qemu.add_argument('--build-dir', default=os.path.join(DEFAULT_FIRMWARE_DIR, 'build_qemu'))
+    qemu.add_argument('--serial-log', help="Write the firmware console to this file")
+
+    device = sub.add_parser('device', parents=[scenario], help="Run the scenario against a board or simulator")
+    device.add_argument('device', help="Address of the device")
+    device.add_argument('--control-port', type=int, default=media_packets.CONTROL_TCP_PORT)
+
+    frames = sub.add_parser('frames', help="Write the frames partition image for a board")
+    frames.add_argument('output')
+
+    timing = sub.add_parser('timing', help="Compare the PKT_TIMING statistics of serial logs")
+    timing.add_argument('logs', nargs='+', help="Serial logs of CONFIG_PACKET_TIMING builds, the first is the baseline")
+    timing.add_argument('--json', action='store_true', help="Print a machine-readable report")
+
+    iram = sub.add_parser('iram', parents=[scenario, emulator],
+                          help="Run the scenario on QEMU builds with and without CONFIG_MEDIA_IRAM, compare the timing")
+    iram.add_argument('--build-dirs', default=','.join(
+        os.path.join(DEFAULT_FIRMWARE_DIR, name) for name in ('build_qemu_flash', 'build_qemu_iram')),
+        help="Comma separated CONFIG_PACKET_TIMING builds, the first is the baseline")
+    iram.set_defaults(send_audio=True)
+
+    rejoin = sub.add_parser('rejoin', parents=[emulator],
+                            help="Boot the same QEMU image repeatedly and report the time to IP of each boot")
+    rejoin.add_argument('--build-dir', default=os.path.join(DEFAULT_FIRMWARE_DIR, 'build_qemu'))
+    rejoin.add_argument('--boots', type=int, default=3, help="Boots, the first one without a stored lease")
+    rejoin.add_argument('--json', action='store_true', help="Print a machine-readable report")
+
+    locks = sub.add_parser('locks', help="Rank the mutex call sites of serial logs by LOCK_TIMING wait time")
+    locks.add_argument('logs', nargs='+', help="Serial logs of CONFIG_LOCK_PROFILER builds, pooled")
+    locks.add_argument('--top', type=int, default=20, help="Sites to list")
+    locks.add_argument('--json', action='store_true', help="Print a machine-readable report")
+
+    args = parser.parse_args()
+    if args.command == 'qemu':
+        return run_qemu(args)
+    if args.command == 'device':
+        return run_device(args)
+    if args.command == 'timing':
+        return run_timing(args)
+    if args.command == 'iram':
+        return run_iram(args)
+    if args.command == 'rejoin':
+        return run_rejoin(args)
+    if args.command == 'locks':
+        return run_locks(args)
+    return run_frames(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,2229 @@
+#!/usr/bin/env python3
+"""
+Media relay cluster with consistent-hash device placement
+
+A relay node holds the talk session with an ESP32 device, receives its audio
+and video datagrams once and fans them out to any number of viewers. Several
+nodes form a cluster: every device is owned by exactly one node, chosen on a
+consistent hash ring, so that adding or removing a node only moves the devices
+of the ring segments that changed hands.
+
+Viewers may send their subscription to any node; it is forwarded to the owner,
+which then streams to the viewer directly.
+
+Devices built with CONFIG_RELAY_UPLINK connect to a node themselves (uplink
+port) instead of being placed on the ring; that node owns them and asks for the
+stream only while they have viewers.
+
+The owner keeps the last seconds of every stream, so a viewer can rewind and
+play it out at real time or faster until it is back at live.
+
+Viewers that report what they receive get a paced send queue, so a slow
+downlink costs them whole video frames instead of seconds of latency.
+"""
+import argparse
+import base64
+import bisect
+import collections
+import hashlib
+import ipaddress
+import json
+import os
+import random
+import selectors
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import threading
+import time
+
+import media_packets
+
+DEFAULT_CONTROL_PORT = 13000
+DEFAULT_UPLINK_PORT = 13001     # CONFIG_RELAY_UPLINK_PORT
+DEFAULT_VNODES = 128
+
+HEARTBEAT_INTERVAL_S = 0.25
+MEMBER_TIMEOUT_S = 1.0
+TOMBSTONE_S = 5.0
+SETTLE_S = 1.0
+SESSION_RETRY_S = 0.1
+SUBSCRIPTION_TTL_S = 10.0
+TICK_S = 0.02
+DEFAULT_JOIN_AUDIO_MS = 300
+KEYFRAME_REQUEST_INTERVAL_S = 0.5  # VIDEO_KEYFRAME_MIN_INTERVAL_MS in video_manager.c
+DEFAULT_NACK_CACHE = 256        # Video datagrams per device, about a second of VGA JPEG
+NACK_RETRY_S = 0.1              # An unanswered upstream NACK is sent again after this
+NACK_PENDING_S = 1.0
+MAX_NACK_PACKETS = 64           # Fragments per viewer request
+DEFAULT_TIMESHIFT_S = 30
+DEFAULT_TIMESHIFT_MB = 16
+TIMESHIFT_ENTRY_BYTES = 120     # Python overhead of a ring entry, counted against the memory limit
+MAX_TIMESHIFT_SPEED = 8.0
+PACING_TICK_S = 0.01            # Time shift playout and viewer queues
+DEFAULT_QUEUE_TARGET_MS = 150
+LEG_RATE_WINDOW_S = 1.0         # Delivered rates of a viewer the pacing rate is taken from
+LEG_SATURATED = 0.95            # Backlog grown by more than the rest of the sent bytes: the downlink is queueing
+LEG_REPORT_SLACK_S = 0.05       # Datagrams sent this shortly before a report may not be in it yet
+LEG_MAX_BACKLOG_S = 0.1         # Backlog left in the downlink, at the delivered rate, before it is drained
+LEG_DRAIN_GAIN = 0.9            # Pace below the delivered rate so the downlink queue drains
+LEG_PROBE_GAIN = 1.25           # Raised per report while the downlink keeps up
+LEG_MIN_RATE = 16000            # Bytes per second
+
+VIDEO_HEADER = struct.Struct(media_packets.VIDEO_HEADER_FORMAT)
+
+
+def _hash64(key):
+    return struct.unpack('<Q', hashlib.blake2b(key.encode(), digest_size=8).digest())[0]
+
+
+class HashRing:
+    """Consistent hash ring with virtual nodes"""
+
+    def __init__(self, nodes=(), vnodes=DEFAULT_VNODES):
+        self.vnodes = vnodes
+        self._points = []
+        self._owners = []
+        self._nodes = set()
+        for node in nodes:
+            self.add(node)
+
+    @property
+    def nodes(self):
+        return set(self._nodes)
+
+    def add(self, node):
+        if node in self._nodes:
+            return
+        self._nodes.add(node)
+        for i in range(self.vnodes):
+            point = _hash64(f"{node}#{i}")
+            index = bisect.bisect(self._points, point)
+            self._points.insert(index, point)
+            self._owners.insert(index, node)
+
+    def remove(self, node):
+        if node not in self._nodes:
+            return
+        self._nodes.discard(node)
+        keep = [(p, o) for p, o in zip(self._points, self._owners) if o != node]
+        self._points = [p for p, _ in keep]
+        self._owners = [o for _, o in keep]
+
+    def owner(self, key):
+        if not self._points:
+            return None
+        index = bisect.bisect(self._points, _hash64(key)) % len(self._points)
+        return self._owners[index]
+
+
+def parse_device_list(spec):
+    """'127.0.1.1-127.0.1.40' or a comma separated list of addresses"""
+    devices = []
+    for part in spec.split(','):
+        part = part.strip()
+        if not part:
+            continue
+        if '-' in part:
+            first, last = (ipaddress.IPv4Address(p) for p in part.split('-'))
+            devices.extend(str(ipaddress.IPv4Address(i)) for i in range(int(first), int(last) + 1))
+        else:
+            devices.append(str(ipaddress.IPv4Address(part)))
+    return devices
+
+
+def percentile(values, pct):
+    if not values:
+        return 0.0
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(len(ordered) * pct / 100))]
+
+
+class DeviceSession:
+    """Control connection from the owning node to a device
+
+    The node takes the talk permission so that the device streams to it; a DENY
+    means another node (the previous owner) still holds it, so we retry.
+    """
+
+    def __init__(self, device, port, local_ip, reason_mono):
+        self.device = device
+        self.port = port
+        self.local_ip = local_ip
+        self.sock = None
+        self.state = 'idle'
+        self.retry_at = 0.0
+        self.buffer = b''
+        self.reason_mono = reason_mono
+        self.granted_mono = None
+        self.first_media_mono = None
+
+    def connect(self):
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.sock.setblocking(False)
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        # The device streams to the address the control connection comes from
+        self.sock.bind((self.local_ip, 0))
+        self.sock.connect_ex((self.device, self.port))
+        self.state = 'connecting'
+
+    def close(self):
+        if self.sock is not None:
+            try:
+                if self.state == 'streaming':
+                    self.sock.send(struct.pack('<I', media_packets.CMD_END_TALK))
+            except OSError:
+                pass
+            self.sock.close()
+            self.sock = None
+        self.state = 'idle'
+
+
+class UplinkSession:
+    """Control connection a device in uplink mode opened to this node
+
+    The node acts as a client of the device's control protocol on it: it
+    requests talk permission while the device has viewers and ends the talk
+    when the last one leaves, so the device sends one stream whatever the
+    number of viewers.
+    """
+
+    def __init__(self, device, sock):
+        self.device = device
+        self.sock = sock
+        self.state = 'idle'
+        self.retry_at = 0.0
+        self.reader = media_packets.ControlReader()
+        self.requested_mono = None
+        self.granted_mono = None
+        self.first_media_mono = None
+        self.sessions = 0
+
+    def send(self, command):
+        try:
+            self.sock.send(struct.pack('<I', command))
+            return True
+        except OSError:
+            return False
+
+
+class FrameCollector:
+    """Fragments of the newest video frame of a stream
+
+    Late fragments of older frames are ignored. `add` returns the datagrams
+    of a frame that completed and decodes on its own, with the tag given with
+    its first fragment, else None.
+    """
+
+    def __init__(self):
+        self.frame_id = None
+        self.tag = None
+        self.parts = {}
+
+    def add(self, data, tag=None):
+        if len(data) < media_packets.VIDEO_HEADER_SIZE:
+            return None
+        packet_type, frame_id, _, _, packet_seq, total_packets = VIDEO_HEADER.unpack_from(data)
+        if frame_id != self.frame_id:
+            if self.frame_id is not None and (self.frame_id - frame_id) & 0xFFFFFFFF < 0x80000000:
+                return None  # Late fragment of an older frame
+            self.frame_id = frame_id
+            self.tag = tag
+            self.parts = {}
+        self.parts[packet_seq] = data
+        if len(self.parts) != total_packets:
+            return None
+        frame = [self.parts.get(i) for i in range(total_packets)]
+        self.parts = {}
+        if None in frame or not self._decodable(packet_type, frame):
+            return None
+        return frame, self.tag
+
+    @staticmethod
+    def _decodable(packet_type, frame):
+        """Whole JPEG frames always, H.264 frames only if they hold an IDR slice,
+        slice updates never (they patch the frame before them)"""
+        codec = packet_type >> 4
+        if codec == media_packets.VIDEO_CODEC_MJPEG:
+            return True
+        if codec != media_packets.VIDEO_CODEC_H264:
+            return False
+        payloads = [data[media_packets.VIDEO_HEADER_SIZE:] for data in frame]
+        return media_packets.h264_is_keyframe(media_packets.h264_depacketize(payloads))
+
+
+class TimeShiftRing:
+    """The last `window_ms` of the audio and video datagrams of a device
+
+    Datagrams are kept in arrival order with their arrival time and addressed
+    by a position that keeps counting as old ones are dropped, so the cursor
+    of a rewound viewer is one integer. A datagram is dropped when it is
+    older than the window or the ring holds more than `max_bytes`. The
+    position of the first datagram of every decodable frame is indexed,
+    playback starts there.
+    """
+
+    def __init__(self, window_ms, max_bytes):
+        self.window_ms = window_ms
+        self.max_bytes = max_bytes
+        self.entries = []    # (arrival ms, is video, datagram) from position self.base on
+        self.base = 0
+        self.tail = 0        # Oldest position kept
+        self.head = 0        # Next position
+        self.bytes = 0
+        self.keyframes = []  # (arrival ms, position) from self.keyframes_start on
+        self.keyframes_start = 0
+        self.collector = FrameCollector()
+
+    def add(self, is_video, data, now_ms):
+        self.entries.append((now_ms, is_video, data))
+        self.bytes += len(data) + TIMESHIFT_ENTRY_BYTES
+        complete = self.collector.add(data, (now_ms, self.head)) if is_video else None
+        if complete is not None:
+            self.keyframes.append(complete[1])
+        self.head += 1
+        while self.tail < self.head and (self.bytes > self.max_bytes or
+                                         now_ms - self.entries[self.tail - self.base][0] > self.window_ms):
+            self.bytes -= len(self.entries[self.tail - self.base][2]) + TIMESHIFT_ENTRY_BYTES
+            self.tail += 1
+        # Drop the expired entries in bulk, amortized O(1) per datagram
+        if self.tail - self.base > len(self.entries) // 2:
+            del self.entries[:self.tail - self.base]
+            self.base = self.tail
+        while self.keyframes_start < len(self.keyframes) and self.keyframes[self.keyframes_start][1] < self.tail:
+            self.keyframes_start += 1
+        if self.keyframes_start > len(self.keyframes) // 2:
+            del self.keyframes[:self.keyframes_start]
+            self.keyframes_start = 0
+
+    def entry(self, position):
+        return self.entries[position - self.base]
+
+    def newest_ms(self):
+        return self.entries[-1][0] if self.head > self.tail else None
+
+    def seek(self, target_ms):
+        """Position of the last keyframe at or before `target_ms`, else of
+        the oldest one kept; None without a keyframe"""
+        keyframes = self.keyframes
+        i = bisect.bisect_right(keyframes, (target_ms, float('inf')), self.keyframes_start) - 1
+        if i < self.keyframes_start:
+            i = self.keyframes_start
+        return keyframes[i][1] if i < len(keyframes) else None
+
+
+class TimeShiftCursor:
+    """Playout position of a rewound viewer: the next ring position and the
+    arrival time that is due at `anchor_mono`, advancing at `speed`"""
+
+    __slots__ = ('position', 'anchor_ms', 'anchor_mono', 'speed')
+
+    def __init__(self, position, anchor_ms, anchor_mono, speed):
+        self.position = position
+        self.anchor_ms = anchor_ms
+        self.anchor_mono = anchor_mono
+        self.speed = speed
+
+
+class ViewerLeg:
+    """Send queue of a viewer that reports the bytes it receives
+
+    Datagrams are paced at the rate the viewer's downlink delivers, so the
+    backlog builds up here and not in the network. When the queue would
+    hold more than `target_ms` at the rate the next shortfall sets (the
+    current rate if lower), or its head has waited longer, whole video
+    frames followed by a newer frame are dropped first, then incomplete
+    frames (fragments missing or still arriving), then the rest of the
+    frame going out. The newest whole frame and audio are never dropped.
+    Later fragments of a dropped frame are dropped too.
+
+    The backlog of a report is the bytes sent until LEG_REPORT_SLACK_S
+    before it that the viewer has not received, so a frame still in flight
+    does not count. When it grows between two reports by more than
+    1 - LEG_SATURATED of the bytes sent, or holds more than
+    LEG_MAX_BACKLOG_S at the delivered rate, the downlink is falling
+    behind. Until the first such report nothing is paced. While it keeps
+    up, the rate is raised by LEG_PROBE_GAIN per report, so the pacing
+    follows a downlink that recovers.
+    """
+
+    def __init__(self, target_ms, now):
+        self.target_ms = target_ms
+        self.queue = collections.deque()  # (queued at, is video, datagram, frame id or None, total packets)
+        self.queued_bytes = 0
+        self.rate = None                  # Bytes per second, None = not paced
+        self.tokens = 0.0
+        self.refilled = now
+        self.sent_bytes = 0
+        self.sending_id = None            # Frame whose fragments are going out
+        self.report = None                # (time, bytes received by the viewer, backlog, bytes sent by then)
+        self.sent_log = collections.deque([(now, 0)])  # (time, bytes sent), back to LEG_REPORT_SLACK_S
+        self.delivered = collections.deque()
+        self.dropped_ids = collections.deque(maxlen=16)
+        self.dropped_stale = 0
+        self.dropped_incomplete = 0
+        self.dropped_sending = 0
+        self.dropped_bytes = 0
+        self.delays_ms = collections.deque(maxlen=2000)
+
+    def on_report(self, now, received):
+        self._trim_sent_log(now)
+        sent = self.sent_log[0][1]
+        # Bytes received early, sent within the slack, are no backlog either
+        backlog = max(0, sent - received)
+        if self.report is not None:
+            then, received_then, backlog_then, sent_then = self.report
+            if now - then <= 0:
+                return
+            self.delivered.append((now, (received - received_then) / (now - then)))
+            while self.delivered[0][0] < now - LEG_RATE_WINDOW_S:
+                self.delivered.popleft()
+            delivered = max(rate for _, rate in self.delivered)
+            if (backlog - backlog_then > (1 - LEG_SATURATED) * (sent - sent_then)
+                    or backlog > LEG_MAX_BACKLOG_S * delivered):
+                self.rate = max(LEG_MIN_RATE, LEG_DRAIN_GAIN * delivered)
+            elif self.rate is not None:
+                self.rate *= LEG_PROBE_GAIN
+        self.report = (now, received, backlog, sent)
+
+    def _trim_sent_log(self, now):
+        """Keep the last entry at or before LEG_REPORT_SLACK_S ago and the newer ones"""
+        while len(self.sent_log) > 1 and self.sent_log[1][0] <= now - LEG_REPORT_SLACK_S:
+            self.sent_log.popleft()
+
+    def enqueue(self, now, is_video, data):
+        frame_id = total = None
+        if is_video and len(data) >= media_packets.VIDEO_HEADER_SIZE:
+            _, frame_id, _, _, _, total = VIDEO_HEADER.unpack_from(data)
+            if frame_id in self.dropped_ids:
+                self.dropped_bytes += len(data)
+                return
+        self.queue.append((now, is_video, data, frame_id, total))
+        self.queued_bytes += len(data)
+        if self.rate is not None:
+            # At the rate a shortfall in the next report sets, or the queued datagrams outwait the target;
+            # a head that waited longer already shows the rate fell further
+            drain_rate = self.rate
+            if self.delivered:
+                drain_rate = min(drain_rate, max(LEG_MIN_RATE, LEG_DRAIN_GAIN * max(r for _, r in self.delivered)))
+            while self.queue and (self.queued_bytes * 1000.0 / drain_rate > self.target_ms
+                                  or (now - self.queue[0][0]) * 1000.0 > self.target_ms) and self._drop_frame():
+                pass
+
+    def _drop_frame(self):
+        """Drop the video frame of the lowest priority, False if none may go"""
+        frames = {}
+        newest = None
+        for _, is_video, _, frame_id, total in self.queue:
+            if frame_id is not None:
+                frames[frame_id] = (frames.get(frame_id, (0, total))[0] + 1, total)
+                newest = frame_id
+        stale = [f for f, (count, total) in frames.items()
+                 if count == total and f != self.sending_id and f != newest]
+        if stale:
+            victim = stale[0]
+            self.dropped_stale += 1
+        else:
+            # Fragments missing, or still arriving: none of it went out yet, the viewer loses it whole
+            incomplete = [f for f, (count, total) in frames.items() if count != total and f != self.sending_id]
+            if not incomplete:
+                # The frame going out, only if nothing else is left
+                if self.sending_id not in frames:
+                    return False
+                victim = self.sending_id
+                self.dropped_sending += 1
+            else:
+                victim = incomplete[0]
+                self.dropped_incomplete += 1
+        kept = collections.deque()
+        for entry in self.queue:
+            if entry[3] == victim:
+                self.queued_bytes -= len(entry[2])
+                self.dropped_bytes += len(entry[2])
+            else:
+                kept.append(entry)
+        self.queue = kept
+        self.dropped_ids.append(victim)
+        return True
+
+    def drain(self, now, send):
+        """Send what the pacing rate allows, `send(is_video, data)`"""
+        if self.rate is not None:
+            burst = max(2 * media_packets.MAX_PACKET_SIZE, 2 * PACING_TICK_S * self.rate)
+            self.tokens = min(burst, self.tokens + (now - self.refilled) * self.rate)
+        self.refilled = now
+        while self.queue and (self.rate is None or self.tokens > 0):
+            queued, is_video, data, frame_id, _ = self.queue.popleft()
+            send(is_video, data)
+            self.queued_bytes -= len(data)
+            self.sent_bytes += len(data)
+            if self.rate is not None:
+                # Unpaced sends would leave the bucket in debt when the pacing starts
+                self.tokens -= len(data)
+            self.delays_ms.append((now - queued) * 1000.0)
+            if frame_id is not None:
+                self.sending_id = frame_id
+        if self.sent_bytes != self.sent_log[-1][1]:
+            self.sent_log.append((now, self.sent_bytes))
+            self._trim_sent_log(now)
+
+
+class Source:
+    """Media state of a device owned by this node
+
+    With the join cache enabled it keeps the datagrams of the newest complete
+    frame and of the last few hundred milliseconds of audio, so that a viewer
+    joining mid-stream can be served a picture immediately. Of an H.264 stream
+    only IDR frames are kept, the others cannot be decoded on their own.
+
+    With the NACK cache it also keeps the last `nack_cache` video datagrams,
+    to resend the fragments viewers report lost without asking the device.
+
+    With time shift it keeps the last seconds of the stream in a ring;
+    viewers with a cursor are served from the ring instead of live.
+
+    Viewers that send receiver reports get a ViewerLeg, their datagrams go
+    through its queue.
+    """
+
+    def __init__(self, join_cache=False, audio_cache_ms=0, nack_cache=0, timeshift_ms=0, timeshift_bytes=0):
+        self.viewers = {}
+        self.packets_in = 0
+        self.join_cache = join_cache
+        self.audio_cache_ms = audio_cache_ms
+        self.audio_cache = collections.deque()
+        self.collector = FrameCollector()
+        self.last_frame = None
+        self.keyframe_requested = None
+        self.nack_cache = nack_cache
+        self.fragments = collections.OrderedDict()  # (frame id, packet seq) -> datagram, oldest first
+        self.nack_pending = {}                       # Fragments NACKed upstream -> time of the NACK
+        self.timeshift = TimeShiftRing(timeshift_ms, timeshift_bytes) if timeshift_ms else None
+        self.cursors = {}                            # Rewound viewers -> TimeShiftCursor
+        self.legs = {}                               # Reporting viewers -> ViewerLeg
+
+    def cache_audio(self, data, now_ms):
+        self.audio_cache.append((now_ms, data))
+        while self.audio_cache and now_ms - self.audio_cache[0][0] > self.audio_cache_ms:
+            self.audio_cache.popleft()
+
+    def cache_video(self, data):
+        complete = self.collector.add(data)
+        if complete is not None:
+            self.last_frame = complete[0]
+
+    def cache_fragment(self, data):
+        """Keep a video datagram for NACKs
+
+        Returns None for a fragment that is cached already (a resend the
+        viewers have), else whether it answers an upstream NACK.
+        """
+        if len(data) < media_packets.VIDEO_HEADER_SIZE:
+            return False
+        _, frame_id, _, _, packet_seq, _ = VIDEO_HEADER.unpack_from(data)
+        key = (frame_id, packet_seq)
+        if key in self.fragments:
+            return None
+        self.fragments[key] = data
+        if len(self.fragments) > self.nack_cache:
+            self.fragments.popitem(last=False)
+        return self.nack_pending.pop(key, None) is not None
+
+    def fragment_expired(self, frame_id):
+        """Whether a frame is older than the cache; the device keeps fewer
+        datagrams, so it cannot resend its fragments either"""
+        if len(self.fragments) < self.nack_cache:
+            return False
+        oldest = next(iter(self.fragments))[0]
+        return 0 < (oldest - frame_id) & 0xFFFFFFFF < 0x80000000
+
+    def cached_datagrams(self):
+        """(video, audio) datagrams to send to a viewer that just joined"""
+        video = self.last_frame or []
+        return video, [data for _, data in self.audio_cache]
+
+
+class RelayNode:
+    def __init__(self, args):
+        self.node_id = args.node
+        self.media_ip = args.media_ip
+        self.control_addr = (args.media_ip, args.control_port)
+        self.devices = parse_device_list(args.devices)
+        self.device_port = args.device_port
+        self.seeds = [tuple(s.rsplit(':', 1)) for s in args.seeds.split(',') if s] if args.seeds else []
+        self.seeds = [(host, int(port)) for host, port in self.seeds]
+        self.incarnation = time.time_ns()
+
+        self.members = {self.node_id: self._self_entry()}
+        self.last_seen = {}
+        self.departed = {}
+        self.ring = HashRing([self.node_id], args.vnodes)
+        self.membership_changed = time.monotonic()
+        self.start_mono = time.monotonic()
+        self.reconciled = False
+
+        self.sessions = {}
+        self.uplinks = {}
+        self.remote_uplinks = {}
+        self.sources = {}
+        self.join_cache = args.join_cache
+        self.join_audio_ms = args.join_audio_ms
+        self.nack_cache = args.nack_cache
+        self.timeshift_ms = args.timeshift_s * 1000
+        self.timeshift_bytes = int(args.timeshift_mb * 1024 * 1024)
+        self.next_playout = 0.0
+        self.queue_target_ms = args.queue_target_ms
+        self.stopping = False
+
+        self.packets_in = 0
+        self.packets_out = 0
+        self.subscribes_forwarded = 0
+        self.join_bursts = 0
+        self.nacks_in = 0
+        self.nacks_served = 0
+        self.nacks_aggregated = 0
+        self.nacks_expired = 0
+        self.nacks_upstream = 0
+        self.nacks_recovered = 0
+        self.timeshift_seeks = 0
+        self.timeshift_out = 0
+        self.timeshift_skips = 0
+        self.timeshift_live = 0
+        self.reports_in = 0
+        self.forward_ns = collections.deque(maxlen=20000)
+        self.playout_ns = collections.deque(maxlen=20000)  # Per cursor and playout tick
+
+        self.selector = selectors.DefaultSelector()
+        self.control_sock = self._udp_socket(self.control_addr)
+        self.audio_sock = self._udp_socket((self.media_ip, args.audio_port))
+        self.video_sock = self._udp_socket((self.media_ip, args.video_port))
+        self.selector.register(self.control_sock, selectors.EVENT_READ, ('control', None))
+        self.selector.register(self.audio_sock, selectors.EVENT_READ, ('media', None))
+        self.selector.register(self.video_sock, selectors.EVENT_READ, ('media', None))
+        self.uplink_listener = None
+        if args.uplink_port:
+            self.uplink_listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            self.uplink_listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+            self.uplink_listener.bind((args.media_ip, args.uplink_port))
+            self.uplink_listener.listen(64)
+            self.uplink_listener.setblocking(False)
+            self.selector.register(self.uplink_listener, selectors.EVENT_READ, ('uplink_listen', None))
+        self.next_heartbeat = 0.0
+
+    def _self_entry(self):
+        return {'control': list(self.control_addr), 'media_ip': self.media_ip, 'incarnation': self.incarnation}
+
+    @staticmethod
+    def _udp_socket(addr):
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 * 1024 * 1024)
+        sock.bind(addr)
+        sock.setblocking(False)
+        return sock
+
+    # ---- Main loop -------------------------------------------------------
+
+    def run(self):
+        print(f"Relay {self.node_id} on {self.media_ip} (control {self.control_addr[1]}), "
+              f"{len(self.devices)} devices")
+        while not self.stopping:
+            for key, mask in self.selector.select(TICK_S):
+                kind, session = key.data
+                if kind == 'media':
+                    self._drain_media(key.fileobj)
+                elif kind == 'control':
+                    self._drain_control()
+                elif kind == 'uplink_listen':
+                    self._accept_uplink()
+                elif kind == 'uplink':
+                    self._uplink_event(session)
+                else:
+                    self._session_event(session, mask)
+            self._tick()
+        self._leave()
+
+    def stop(self, *_):
+        self.stopping = True
+
+    def _tick(self):
+        now = time.monotonic()
+        if now >= self.next_heartbeat:
+            self.next_heartbeat = now + HEARTBEAT_INTERVAL_S
+            self._send_heartbeats()
+            self._expire_members(now)
+            self._expire_viewers(now)
+            self._expire_nacks(now)
+
+        if now >= self.next_playout:
+            self.next_playout = now + PACING_TICK_S
+            self._play_timeshift(now)
+            self._drain_legs(now)
+
+        if not self.reconciled and now - self.start_mono >= SETTLE_S:
+            self.reconciled = True
+            self._reconcile()
+
+        for session in self.sessions.values():
+            if session.state == 'idle' and now >= session.retry_at:
+                self._open_session(session)
+            elif session.state == 'denied' and now >= session.retry_at:
+                self._request_talk(session)
+        for uplink in self.uplinks.values():
+            if uplink.state == 'denied' and now >= uplink.retry_at:
+                uplink.state = 'idle'
+                self._update_uplink(uplink)
+
+    # ---- Media path -------------------------------------------------------
+
+    def _drain_media(self, sock):
+        while True:
+            try:
+                data, addr = sock.recvfrom(65535)
+            except BlockingIOError:
+                return
+            start = time.perf_counter_ns()
+            self.packets_in += 1
+            source = self.sources.get(addr[0])
+            if source is None:
+                continue
+            session = self.sessions.get(addr[0]) or self.uplinks.get(addr[0])
+            if session is not None and session.first_media_mono is None:
+                session.first_media_mono = time.monotonic()
+            source.packets_in += 1
+            if sock is self.video_sock and source.nack_cache:
+                recovered = source.cache_fragment(data)
+                if recovered is None:
+                    continue  # Resent by the device, the viewers have it already
+                self.nacks_recovered += recovered
+            if source.timeshift is not None:
+                source.timeshift.add(sock is self.video_sock, data, time.monotonic() * 1000.0)
+            if source.join_cache:
+                if sock is self.video_sock:
+                    source.cache_video(data)
+                else:
+                    source.cache_audio(data, time.monotonic() * 1000.0)
+            self._forward(source, sock, data)
+            self.forward_ns.append(time.perf_counter_ns() - start)
+
+    def _source(self, device):
+        source = self.sources.get(device)
+        if source is None:
+            source = self.sources[device] = Source(self.join_cache, self.join_audio_ms, self.nack_cache,
+                                                   self.timeshift_ms, self.timeshift_bytes)
+        return source
+
+    def _forward(self, source, sock, data):
+        cursors = source.cursors
+        legs = source.legs
+        now = time.monotonic() if legs else None
+        for viewer in source.viewers:
+            if cursors and viewer in cursors:
+                continue  # Played out from the ring
+            leg = legs.get(viewer) if legs else None
+            if leg is not None:
+                self._send_leg(leg, viewer, now, sock is self.video_sock, data)
+                continue
+            try:
+                sock.sendto(data, viewer)
+                self.packets_out += 1
+            except OSError:
+                pass
+
+    def _send_leg(self, leg, viewer, now, is_video, data):
+        leg.enqueue(now, is_video, data)
+        leg.drain(now, lambda is_video, data: self._send_media(viewer, is_video, data))
+
+    def _send_media(self, viewer, is_video, data):
+        try:
+            (self.video_sock if is_video else self.audio_sock).sendto(data, viewer)
+            self.packets_out += 1
+        except OSError:
+            pass
+
+    def _drain_legs(self, now):
+        for source in self.sources.values():
+            for viewer, leg in source.legs.items():
+                if leg.queue:
+                    leg.drain(now, lambda is_video, data, viewer=viewer: self._send_media(viewer, is_video, data))
+
+    def _play_timeshift(self, now):
+        """Send every rewound viewer the datagrams that are due, switch the
+        ones that reached the newest datagram back to live"""
+        for device, source in self.sources.items():
+            ring = source.timeshift
+            if not source.cursors or ring is None:
+                continue
+            for viewer, cursor in list(source.cursors.items()):
+                start = time.perf_counter_ns()
+                if cursor.position < ring.tail:
+                    # Overtaken by the end of the ring, continue at its oldest keyframe
+                    position = ring.seek(0.0)
+                    if position is None:
+                        position = ring.head
+                    else:
+                        cursor.anchor_ms = ring.entry(position)[0]
+                        cursor.anchor_mono = now
+                    cursor.position = position
+                    self.timeshift_skips += 1
+                due_ms = cursor.anchor_ms + (now - cursor.anchor_mono) * 1000.0 * cursor.speed
+                while cursor.position < ring.head:
+                    arrival_ms, is_video, data = ring.entry(cursor.position)
+                    if arrival_ms > due_ms:
+                        break
+                    leg = source.legs.get(viewer)
+                    if leg is not None:
+                        self._send_leg(leg, viewer, now, is_video, data)
+                    else:
+                        self._send_media(viewer, is_video, data)
+                    self.timeshift_out += 1
+                    cursor.position += 1
+                if cursor.position >= ring.head:
+                    del source.cursors[viewer]
+                    self.timeshift_live += 1
+                    self._send({'op': 'live', 'device': device}, viewer)
+                self.playout_ns.append(time.perf_counter_ns() - start)
+
+    # ---- Device sessions --------------------------------------------------
+
+    def _reconcile(self):
+        """Open sessions for devices this node owns, hand off the ones it lost"""
+        if not self.reconciled:
+            return
+        for device in self.devices:
+            owner = self.ring.owner(device)
+            if owner == self.node_id and device not in self.sessions:
+                session = DeviceSession(device, self.device_port, self.media_ip, self.membership_changed)
+                self.sessions[device] = session
+                self._source(device)
+                self._open_session(session)
+            elif owner != self.node_id and device in self.sessions:
+                self._handoff(device, owner)
+
+    def _open_session(self, session):
+        session.buffer = b''
+        session.connect()
+        self.selector.register(session.sock, selectors.EVENT_WRITE, ('session', session))
+
+    def _close_session(self, session):
+        if session.sock is not None:
+            self.selector.unregister(session.sock)
+        session.close()
+
+    def _retry_session(self, session):
+        self._close_session(session)
+        session.retry_at = time.monotonic() + SESSION_RETRY_S
+
+    def _request_talk(self, session):
+        try:
+            session.sock.send(struct.pack('<I', media_packets.CMD_REQUEST_TALK))
+            session.state = 'requesting'
+        except OSError:
+            self._retry_session(session)
+
+    def _session_event(self, session, mask):
+        if session.state == 'connecting':
+            if session.sock.getsockopt(socket.SOL_SOCKET, socket.SO_ERROR) != 0:
+                self._retry_session(session)
+                return
+            self.selector.modify(session.sock, selectors.EVENT_READ, ('session', session))
+            self._request_talk(session)
+            return
+
+        try:
+            data = session.sock.recv(64)
+        except BlockingIOError:
+            return
+        except OSError:
+            data = b''
+        if not data:
+            self._retry_session(session)
+            return
+
+        session.buffer += data
+        while len(session.buffer) >= 4:
+            reply = struct.unpack('<I', session.buffer[:4])[0]
+            session.buffer = session.buffer[4:]
+            if reply == media_packets.CMD_GRANT_TALK:
+                session.state = 'streaming'
+                session.granted_mono = time.monotonic()
+            elif reply == media_packets.CMD_DENY_TALK:
+                # The previous owner has not released the device yet
+                session.state = 'denied'
+                session.retry_at = time.monotonic() + SESSION_RETRY_S
+
+    def _handoff(self, device, new_owner):
+        session = self.sessions.pop(device)
+        self._close_session(session)
+        self._handoff_viewers(device, new_owner)
+
+    def _handoff_viewers(self, device, new_owner):
+        source = self.sources.pop(device, None)
+        if source is None or not source.viewers or new_owner in (None, self.node_id):
+            return
+        now = time.monotonic()
+        viewers = [[ip, port, max(0.0, expiry - now)] for (ip, port), expiry in source.viewers.items()]
+        self._send_to_node(new_owner, {'op': 'handoff', 'device': device, 'viewers': viewers})
+
+    # ---- Device uplinks ---------------------------------------------------
+
+    def _accept_uplink(self):
+        while True:
+            try:
+                sock, addr = self.uplink_listener.accept()
+            except BlockingIOError:
+                return
+            device = addr[0]
+            old = self.uplinks.get(device)
+            if old is not None:
+                # The device reconnected before we noticed the old connection was gone
+                self._close_uplink(old)
+            sock.setblocking(False)
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            uplink = self.uplinks[device] = UplinkSession(device, sock)
+            self.selector.register(sock, selectors.EVENT_READ, ('uplink', uplink))
+            self._source(device)
+            print(f"Relay {self.node_id}: uplink from {device}")
+            uplink.send(media_packets.CMD_DOORBELL_THUMBNAIL)
+            self._update_uplink(uplink)
+
+    def _close_uplink(self, uplink):
+        self.selector.unregister(uplink.sock)
+        uplink.sock.close()
+        if self.uplinks.get(uplink.device) is uplink:
+            del self.uplinks[uplink.device]
+
+    def _update_uplink(self, uplink):
+        """Start the stream when the device has viewers, end it when it has none"""
+        source = self.sources.get(uplink.device)
+        wanted = source is not None and bool(source.viewers)
+        if wanted and uplink.state == 'idle':
+            if uplink.send(media_packets.CMD_REQUEST_TALK):
+                uplink.state = 'requesting'
+                uplink.requested_mono = time.monotonic()
+                uplink.first_media_mono = None
+        elif not wanted and uplink.state == 'streaming':
+            if uplink.send(media_packets.CMD_END_TALK):
+                uplink.state = 'ending'
+
+    def _uplink_event(self, uplink):
+        try:
+            data = uplink.sock.recv(65536)
+        except BlockingIOError:
+            return
+        except OSError:
+            data = b''
+        if not data:
+            print(f"Relay {self.node_id}: uplink from {uplink.device} closed")
+            self._close_uplink(uplink)
+            return
+
+        for reply, _, payload in uplink.reader.feed(data):
+            if reply == media_packets.CMD_GRANT_TALK:
+                uplink.state = 'streaming'
+                uplink.granted_mono = time.monotonic()
+                uplink.sessions += 1
+            elif reply == media_packets.CMD_DENY_TALK:
+                # A local client of the device is talking
+                uplink.state = 'denied'
+                uplink.retry_at = time.monotonic() + SESSION_RETRY_S
+            elif reply in (media_packets.CMD_TALK_ENDED, media_packets.CMD_TALK_DID_NOT_END):
+                uplink.state = 'idle'
+            elif reply == media_packets.CMD_DOORBELL_RING:
+                source = self.sources.get(uplink.device)
+                for viewer in (source.viewers if source is not None else ()):
+                    self._send({'op': 'ring', 'device': uplink.device}, viewer)
+            elif reply == media_packets.CMD_DOORBELL_THUMBNAIL and payload:
+                # Follows the ring; the empty one only acknowledges the opt-in
+                source = self.sources.get(uplink.device)
+                jpeg = base64.b64encode(payload).decode()
+                for viewer in (source.viewers if source is not None else ()):
+                    self._send({'op': 'ring_thumbnail', 'device': uplink.device, 'jpeg': jpeg}, viewer)
+        self._update_uplink(uplink)
+
+    # ---- Control plane ----------------------------------------------------
+
+    def _drain_control(self):
+        while True:
+            try:
+                data, addr = self.control_sock.recvfrom(65535)
+            except BlockingIOError:
+                return
+            try:
+                msg = json.loads(data)
+            except ValueError:
+                continue
+            handler = getattr(self, '_on_' + str(msg.get('op')), None)
+            if handler is not None:
+                handler(msg, addr)
+
+    def _send(self, msg, addr):
+        try:
+            self.control_sock.sendto(json.dumps(msg).encode(), tuple(addr))
+        except OSError:
+            pass
+
+    def _send_to_node(self, node_id, msg):
+        member = self.members.get(node_id)
+        if member is not None:
+            self._send(msg, member['control'])
+
+    def _owner(self, device):
+        """Node holding the uplink of the device, else its ring owner; None if unknown"""
+        if device in self.uplinks:
+            return self.node_id
+        for node_id, devices in self.remote_uplinks.items():
+            if device in devices and node_id in self.members:
+                return node_id
+        return self.ring.owner(device) if device in self.devices else None
+
+    def _on_subscribe(self, msg, addr):
+        device = msg.get('device')
+        viewer = tuple(msg.get('viewer') or addr)
+        owner = self._owner(device)
+        if owner is None:
+            self._send({'op': 'error', 'device': device, 'reason': 'unknown device'}, viewer)
+            return
+        if owner != self.node_id:
+            self.subscribes_forwarded += 1
+            self._send_to_node(owner, {'op': 'subscribe', 'device': device, 'viewer': list(viewer),
+                                       'via': self.node_id})
+            return
+        source = self._source(device)
+        joining = viewer not in source.viewers
+        source.viewers[viewer] = time.monotonic() + SUBSCRIPTION_TTL_S
+        self._send({'op': 'subscribed', 'device': device, 'node': self.node_id,
+                    'via': msg.get('via', self.node_id)}, viewer)
+        if joining and source.join_cache:
+            self._send_join_burst(source, viewer)
+        if joining and device in self.uplinks:
+            self._update_uplink(self.uplinks[device])
+
+    def _send_join_burst(self, source, viewer):
+        """Serve the cached frame and audio right away, live datagrams follow"""
+        video, audio = source.cached_datagrams()
+        for sock, datagrams in ((self.video_sock, video), (self.audio_sock, audio)):
+            for data in datagrams:
+                try:
+                    sock.sendto(data, viewer)
+                    self.packets_out += 1
+                except OSError:
+                    pass
+        if video:
+            self.join_bursts += 1
+
+    def _on_unsubscribe(self, msg, addr):
+        device = msg.get('device')
+        viewer = tuple(msg.get('viewer') or addr)
+        owner = self._owner(device)
+        if owner is not None and owner != self.node_id:
+            self._send_to_node(owner, {'op': 'unsubscribe', 'device': device, 'viewer': list(viewer)})
+            return
+        source = self.sources.get(device)
+        if source is not None:
+            source.viewers.pop(viewer, None)
+            source.cursors.pop(viewer, None)
+            source.legs.pop(viewer, None)
+        if device in self.uplinks:
+            self._update_uplink(self.uplinks[device])
+
+    def _on_timeshift(self, msg, addr):
+        """A viewer rewinds by `offset_ms` and plays out at `speed` until it is
+        back at live; offset 0 returns it to live at once"""
+        device = msg.get('device')
+        viewer = tuple(msg.get('viewer') or addr)
+        owner = self._owner(device)
+        if owner is not None and owner != self.node_id:
+            self._send_to_node(owner, dict(msg, viewer=list(viewer)))
+            return
+        source = self.sources.get(device)
+        offset_ms = msg.get('offset_ms', 0)
+        speed = msg.get('speed', 1.0)
+        if source is None or viewer not in source.viewers or not isinstance(offset_ms, (int, float)) \
+                or not isinstance(speed, (int, float)):
+            return
+        ring = source.timeshift
+        newest_ms = ring.newest_ms() if ring is not None else None
+        position = ring.seek(newest_ms - offset_ms) if newest_ms is not None and offset_ms > 0 else None
+        if position is None:
+            source.cursors.pop(viewer, None)
+            self._send({'op': 'live', 'device': device}, viewer)
+            return
+        anchor_ms = ring.entry(position)[0]
+        speed = min(max(float(speed), 1.0), MAX_TIMESHIFT_SPEED)
+        source.cursors[viewer] = TimeShiftCursor(position, anchor_ms, time.monotonic(), speed)
+        self.timeshift_seeks += 1
+        self._send({'op': 'timeshifted', 'device': device, 'offset_ms': round(newest_ms - anchor_ms),
+                    'speed': speed}, viewer)
+
+    def _on_report(self, msg, addr):
+        """Receiver report of a viewer: the media bytes it received from the
+        device so far, sets the pacing of its queue"""
+        device = msg.get('device')
+        viewer = tuple(msg.get('viewer') or addr)
+        owner = self._owner(device)
+        if owner is not None and owner != self.node_id:
+            self._send_to_node(owner, dict(msg, viewer=list(viewer)))
+            return
+        source = self.sources.get(device)
+        received = msg.get('bytes')
+        if not self.queue_target_ms or source is None or viewer not in source.viewers \
+                or not isinstance(received, int):
+            return
+        now = time.monotonic()
+        leg = source.legs.get(viewer)
+        if leg is None:
+            leg = source.legs[viewer] = ViewerLeg(self.queue_target_ms, now)
+        leg.on_report(now, received)
+        self.reports_in += 1
+
+    def _on_keyframe(self, msg, addr):
+        """A viewer lost H.264 video or a slice update: ask the device for an IDR
+        or whole frame, once for all viewers"""
+        device = msg.get('device')
+        owner = self._owner(device)
+        if owner is not None and owner != self.node_id:
+            self._send_to_node(owner, {'op': 'keyframe', 'device': device})
+            return
+        source = self.sources.get(device)
+        session = self.sessions.get(device) or self.uplinks.get(device)
+        if source is None or session is None or session.state != 'streaming':
+            return
+        now = time.monotonic()
+        if source.keyframe_requested is not None and now - source.keyframe_requested < KEYFRAME_REQUEST_INTERVAL_S:
+            return
+        source.keyframe_requested = now
+        try:
+            session.sock.send(struct.pack('<I', media_packets.CMD_REQUEST_KEYFRAME))
+        except OSError:
+            pass
+
+    def _on_nack(self, msg, addr):
+        """A viewer lost video fragments: resend them from the cache and pass
+        on only the ones this node missed too, once for all viewers"""
+        device = msg.get('device')
+        viewer = tuple(msg.get('viewer') or addr)
+        owner = self._owner(device)
+        if owner is not None and owner != self.node_id:
+            self._send_to_node(owner, dict(msg, viewer=list(viewer)))
+            return
+        source = self.sources.get(device)
+        frame_id = msg.get('frame_id')
+        packets = msg.get('packets')
+        if source is None or viewer not in source.viewers or viewer in source.cursors \
+                or not isinstance(frame_id, int) or not isinstance(packets, list):
+            return
+        now = time.monotonic()
+        upstream = []
+        for seq in packets[:MAX_NACK_PACKETS]:
+            if not isinstance(seq, int):
+                continue
+            self.nacks_in += 1
+            data = source.fragments.get((frame_id, seq))
+            if data is not None:
+                try:
+                    self.video_sock.sendto(data, viewer)
+                    self.packets_out += 1
+                    self.nacks_served += 1
+                except OSError:
+                    pass
+                continue
+            if source.nack_cache:
+                # Missed here as well, so every viewer lost it: one NACK serves them all
+                if source.fragment_expired(frame_id):
+                    self.nacks_expired += 1
+                    continue
+                sent = source.nack_pending.get((frame_id, seq))
+                if sent is not None and now - sent < NACK_RETRY_S:
+                    self.nacks_aggregated += 1
+                    continue
+                source.nack_pending[(frame_id, seq)] = now
+            upstream.append(seq)
+        session = self.sessions.get(device) or self.uplinks.get(device)
+        if not upstream or session is None or session.state != 'streaming':
+            return
+        try:
+            session.sock.send(b''.join(struct.pack('<I', media_packets.nack_command(frame_id, seq))
+                                       for seq in upstream))
+            self.nacks_upstream += len(upstream)
+        except OSError:
+            pass
+
+    def _on_handoff(self, msg, addr):
+        device = msg.get('device')
+        source = self._source(device)
+        now = time.monotonic()
+        for ip, port, ttl in msg.get('viewers', []):
+            source.viewers[(ip, port)] = max(source.viewers.get((ip, port), 0.0), now + ttl)
+        if self.ring.owner(device) != self.node_id:
+            # Our view of the ring is behind or ahead of the sender's, pass it on
+            self._handoff_viewers(device, self.ring.owner(device))
+
+    def _on_heartbeat(self, msg, addr):
+        sender = msg.get('node')
+        now = time.monotonic()
+        changed = False
+        for node_id, entry in msg.get('members', {}).items():
+            if node_id == self.node_id:
+                continue
+            if node_id in self.departed and self.departed[node_id][1] >= entry['incarnation']:
+                continue
+            known = self.members.get(node_id)
+            if known is None or known['incarnation'] < entry['incarnation']:
+                self.members[node_id] = entry
+                self.departed.pop(node_id, None)
+                self.last_seen[node_id] = now
+                changed = True
+        if sender in self.members:
+            self.last_seen[sender] = now
+            self.remote_uplinks[sender] = set(msg.get('uplinks', ()))
+        if not self.reconciled:
+            # We learned the cluster from a peer, no need to wait for the settle time
+            self.reconciled = True
+            changed = True
+        if changed:
+            self._membership_changed()
+
+    def _on_leave(self, msg, addr):
+        node_id = msg.get('node')
+        if node_id in self.members and node_id != self.node_id:
+            self._remove_member(node_id)
+            self._membership_changed()
+
+    def _on_stats(self, msg, addr):
+        forward_us = [ns / 1000.0 for ns in self.forward_ns]
+        self._send({
+            'op': 'stats',
+            'node': self.node_id,
+            'members': sorted(self.members),
+            'owned': sorted(d for d in self.devices if self.ring.owner(d) == self.node_id),
+            'streaming': {d: {'first_media_mono': s.first_media_mono, 'reason_mono': s.reason_mono}
+                          for d, s in self.sessions.items() if s.first_media_mono is not None},
+            'sessions': len(self.sessions),
+            'uplinks': {d: {'state': u.state, 'sessions': u.sessions, 'requested_mono': u.requested_mono,
+                            'first_media_mono': u.first_media_mono,
+                            'packets_in': self.sources[d].packets_in if d in self.sources else 0}
+                        for d, u in self.uplinks.items()},
+            'viewers': sum(len(s.viewers) for s in self.sources.values()),
+            'packets_in': self.packets_in,
+            'packets_out': self.packets_out,
+            'subscribes_forwarded': self.subscribes_forwarded,
+            'join_bursts': self.join_bursts,
+            'nacks_in': self.nacks_in,
+            'nacks_served': self.nacks_served,
+            'nacks_aggregated': self.nacks_aggregated,
+            'nacks_expired': self.nacks_expired,
+            'nacks_upstream': self.nacks_upstream,
+            'nacks_recovered': self.nacks_recovered,
+            'timeshift_viewers': sum(len(s.cursors) for s in self.sources.values()),
+            'timeshift_bytes': sum(s.timeshift.bytes for s in self.sources.values() if s.timeshift is not None),
+            'timeshift_seconds': {d: (s.timeshift.newest_ms() - s.timeshift.entry(s.timeshift.tail)[0]) / 1000.0
+                                  for d, s in self.sources.items()
+                                  if s.timeshift is not None and s.timeshift.head > s.timeshift.tail},
+            'timeshift_seeks': self.timeshift_seeks,
+            'timeshift_out': self.timeshift_out,
+            'timeshift_skips': self.timeshift_skips,
+            'timeshift_live': self.timeshift_live,
+            'reports_in': self.reports_in,
+            'legs': [{'device': d, 'viewer': f"{v[0]}:{v[1]}",
+                      'rate_kbps': leg.rate * 8 / 1000 if leg.rate is not None else None,
+                      'queued_ms': leg.queued_bytes * 1000.0 / leg.rate if leg.rate else 0.0,
+                      'delay_ms_p50': percentile(list(leg.delays_ms), 50),
+                      'delay_ms_p99': percentile(list(leg.delays_ms), 99),
+                      'dropped_stale': leg.dropped_stale, 'dropped_incomplete': leg.dropped_incomplete,
+                      'dropped_sending': leg.dropped_sending, 'dropped_bytes': leg.dropped_bytes, 'sent_bytes': leg.sent_bytes}
+                     for d, s in self.sources.items() for v, leg in s.legs.items()],
+            'playout_us_p50': percentile([ns / 1000.0 for ns in self.playout_ns], 50),
+            'playout_us_p99': percentile([ns / 1000.0 for ns in self.playout_ns], 99),
+            'forward_us_p50': percentile(forward_us, 50),
+            'forward_us_p99': percentile(forward_us, 99),
+        }, addr)
+
+    def _send_heartbeats(self):
+        msg = {'op': 'heartbeat', 'node': self.node_id, 'members': self.members, 'uplinks': sorted(self.uplinks)}
+        targets = {tuple(m['control']) for n, m in self.members.items() if n != self.node_id}
+        targets.update(self.seeds)
+        targets.discard(self.control_addr)
+        for target in targets:
+            self._send(msg, target)
+
+    def _expire_members(self, now):
+        dead = [n for n in self.members if n != self.node_id
+                and now - self.last_seen.get(n, now) > MEMBER_TIMEOUT_S]
+        for node_id in dead:
+            self._remove_member(node_id)
+        for node_id in [n for n, (t, _) in self.departed.items() if now - t > TOMBSTONE_S]:
+            del self.departed[node_id]
+        if dead:
+            self._membership_changed()
+
+    def _remove_member(self, node_id):
+        entry = self.members.pop(node_id)
+        self.last_seen.pop(node_id, None)
+        self.remote_uplinks.pop(node_id, None)
+        self.departed[node_id] = (time.monotonic(), entry['incarnation'])
+
+    def _membership_changed(self):
+        self.membership_changed = time.monotonic()
+        ring = HashRing(self.members, self.ring.vnodes)
+        self.ring = ring
+        self._reconcile()
+
+    def _expire_viewers(self, now):
+        for source in self.sources.values():
+            for viewer in [v for v, expiry in source.viewers.items() if expiry < now]:
+                del source.viewers[viewer]
+                source.cursors.pop(viewer, None)
+                source.legs.pop(viewer, None)
+        for uplink in self.uplinks.values():
+            self._update_uplink(uplink)
+
+    def _expire_nacks(self, now):
+        for source in self.sources.values():
+            for key in [k for k, sent in source.nack_pending.items() if now - sent > NACK_PENDING_S]:
+                del source.nack_pending[key]
+
+    def _leave(self):
+        """Graceful leave: tell the others and hand our devices to their next owners"""
+        for node_id in list(self.members):
+            if node_id != self.node_id:
+                self._send_to_node(node_id, {'op': 'leave', 'node': self.node_id})
+        self.ring.remove(self.node_id)
+        for device in list(self.sessions):
+            self._handoff(device, self.ring.owner(device))
+        for uplink in list(self.uplinks.values()):
+            # The device reconnects to the relay it is configured for
+            if uplink.state == 'streaming':
+                uplink.send(media_packets.CMD_END_TALK)
+            self._close_uplink(uplink)
+        print(f"Relay {self.node_id} left the cluster")
+
+
+# ---- Cluster benchmark ----------------------------------------------------
+
+class BenchViewers(threading.Thread):
+    """Viewers of the benchmark, all served by one selector thread"""
+
+    def __init__(self, count, devices, ip='127.0.3.1'):
+        super().__init__(name='BenchViewers', daemon=True)
+        self.selector = selectors.DefaultSelector()
+        self.viewers = []
+        self.stop_event = threading.Event()
+        self.lock = threading.Lock()
+        for i in range(count):
+            sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+            sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1024 * 1024)
+            sock.bind((ip, 0))
+            sock.setblocking(False)
+            viewer = {'sock': sock, 'device': devices[i % len(devices)], 'packets': 0,
+                      'last_video': None, 'max_gap': 0.0, 'sub_sent': {}, 'sub_rtt': []}
+            self.viewers.append(viewer)
+            self.selector.register(sock, selectors.EVENT_READ, viewer)
+
+    def subscribe_all(self, nodes):
+        with self.lock:
+            for viewer in self.viewers:
+                entry = random.choice(nodes)
+                viewer['sub_sent'][entry[0]] = time.perf_counter()
+                msg = json.dumps({'op': 'subscribe', 'device': viewer['device']}).encode()
+                viewer['sock'].sendto(msg, entry[1])
+
+    def reset_gaps(self):
+        with self.lock:
+            for viewer in self.viewers:
+                viewer['max_gap'] = 0.0
+
+    def run(self):
+        while not self.stop_event.is_set():
+            for key, _ in self.selector.select(0.1):
+                viewer = key.data
+                while True:
+                    try:
+                        data, _ = viewer['sock'].recvfrom(65535)
+                    except BlockingIOError:
+                        break
+                    now = time.perf_counter()
+                    with self.lock:
+                        if data[:1] == b'{':
+                            msg = json.loads(data)
+                            sent = viewer['sub_sent'].pop(msg.get('via'), None)
+                            if msg.get('op') == 'subscribed' and sent is not None:
+                                viewer['sub_rtt'].append((msg['via'] != msg['node'], now - sent))
+                            continue
+                        viewer['packets'] += 1
+                        if data[0] == media_packets.VIDEO_PACKAGE:
+                            if viewer['last_video'] is not None:
+                                viewer['max_gap'] = max(viewer['max_gap'], now - viewer['last_video'])
+                            viewer['last_video'] = now
+
+
+class ClusterBench:
+    def __init__(self, args):
+        self.args = args
+        self.devices = parse_device_list(f"127.0.1.1-127.0.1.{args.devices}")
+        self.procs = {}
+        self.stats_sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.stats_sock.bind(('127.0.0.1', 0))
+        self.stats_sock.settimeout(0.2)
+        script = os.path.abspath(__file__)
+        self.script_dir = os.path.dirname(script)
+        self.script = script
+
+    def node_addr(self, index):
+        return (f"127.0.2.{index}", DEFAULT_CONTROL_PORT)
+
+    def start_node(self, index, extra=()):
+        node = f"relay-{index}"
+        seeds = ','.join(f"{ip}:{port}" for ip, port in (self.node_addr(1), self.node_addr(2)))
+        cmd = [sys.executable, self.script, 'run', '--node', node, '--media-ip', self.node_addr(index)[0],
+               '--devices', f"127.0.1.1-127.0.1.{self.args.devices}", '--seeds', seeds, *extra]
+        self.procs[node] = subprocess.Popen(cmd, stdout=subprocess.DEVNULL, cwd=self.script_dir)
+        return node
+
+    def stop_node(self, node):
+        proc = self.procs.pop(node)
+        proc.send_signal(signal.SIGTERM)
+        proc.wait(timeout=5)
+
+    def node_list(self):
+        return [(n, self.node_addr(int(n.split('-')[1]))) for n in self.procs]
+
+    def poll_stats(self):
+        stats = {}
+        for node, addr in self.node_list():
+            self.stats_sock.sendto(b'{"op": "stats"}', addr)
+        deadline = time.monotonic() + 1.0
+        while len(stats) < len(self.procs) and time.monotonic() < deadline:
+            try:
+                data, _ = self.stats_sock.recvfrom(1 << 20)
+            except socket.timeout:
+                continue
+            msg = json.loads(data)
+            stats[msg['node']] = msg
+        return stats
+
+    def wait_converged(self, timeout=30.0):
+        """Wait until every device streams to its ring owner and nowhere else"""
+        ring = HashRing(self.procs, DEFAULT_VNODES)
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            stats = self.poll_stats()
+            if len(stats) == len(self.procs) and all(
+                    set(s['members']) == set(self.procs) for s in stats.values()):
+                placement = {}
+                for node, s in stats.items():
+                    for device in s['streaming']:
+                        placement.setdefault(device, []).append(node)
+                if all(placement.get(d) == [ring.owner(d)] for d in self.devices):
+                    return stats, ring
+            time.sleep(0.05)
+        raise TimeoutError("Cluster did not converge")
+
+    def measure_rebalance(self, before_ring, t0):
+        stats, ring = self.wait_converged()
+        moved = [d for d in self.devices if before_ring.owner(d) != ring.owner(d)]
+        times = [stats[ring.owner(d)]['streaming'][d]['first_media_mono'] - t0 for d in moved]
+        return {
+            'moved_devices': len(moved),
+            'moved_fraction': len(moved) / len(self.devices),
+            'rebalance_s': max(times) if times else 0.0,
+            'rebalance_median_s': percentile(times, 50),
+        }, stats
+
+    def run(self):
+        args = self.args
+        sim = subprocess.Popen([sys.executable, os.path.join(self.script_dir, 'device_simulator.py'),
+                                '--devices', str(args.devices), '--frame-size', str(args.frame_size)],
+                               stdout=subprocess.DEVNULL, cwd=self.script_dir)
+        viewers = None
+        report = {'benchmark': 'relay_cluster', 'nodes': args.nodes, 'devices': args.devices,
+                  'viewers': args.viewers}
+        try:
+            time.sleep(0.5)
+            for i in range(1, args.nodes + 1):
+                self.start_node(i)
+            t0 = time.monotonic()
+            stats, ring = self.wait_converged()
+            report['startup_s'] = time.monotonic() - t0
+
+            viewers = BenchViewers(args.viewers, self.devices)
+            viewers.start()
+            viewers.subscribe_all(self.node_list())
+            time.sleep(args.seconds)
+            stats = self.poll_stats()
+            rtts = [rtt for v in viewers.viewers for fwd, rtt in v['sub_rtt']]
+            direct = [rtt * 1000 for v in viewers.viewers for fwd, rtt in v['sub_rtt'] if not fwd]
+            forwarded = [rtt * 1000 for v in viewers.viewers for fwd, rtt in v['sub_rtt'] if fwd]
+            report['subscribe_ms_direct_p50'] = percentile(direct, 50)
+            report['subscribe_ms_forwarded_p50'] = percentile(forwarded, 50)
+            report['subscriptions_acked'] = len(rtts)
+            report['forward_us_p50'] = percentile([s['forward_us_p50'] for s in stats.values()], 50)
+            report['forward_us_p99'] = max(s['forward_us_p99'] for s in stats.values())
+            report['packets_out'] = sum(s['packets_out'] for s in stats.values())
+
+            # Node join
+            viewers.reset_gaps()
+            before = ring
+            t0 = time.monotonic()
+            self.start_node(args.nodes + 1)
+            report['join'], stats = self.measure_rebalance(before, t0)
+            viewers.subscribe_all(self.node_list())
+            time.sleep(1.0)
+            report['join']['viewer_max_gap_s'] = max(v['max_gap'] for v in viewers.viewers)
+
+            # Graceful leave of the first node
+            viewers.reset_gaps()
+            before = HashRing(self.procs, DEFAULT_VNODES)
+            t0 = time.monotonic()
+            self.stop_node('relay-1')
+            report['leave'], stats = self.measure_rebalance(before, t0)
+            viewers.subscribe_all(self.node_list())
+            time.sleep(1.0)
+            report['leave']['viewer_max_gap_s'] = max(v['max_gap'] for v in viewers.viewers)
+        finally:
+            if viewers is not None:
+                viewers.stop_event.set()
+            for node in list(self.procs):
+                self.stop_node(node)
+            sim.terminate()
+            sim.wait()
+
+        if args.json:
+            print(json.dumps(report))
+            return
+        print(f"Cluster of {args.nodes} relays, {args.devices} devices, {args.viewers} viewers")
+        print(f"  Startup placement: {report['startup_s']:.2f}s")
+        print(f"  Subscribe ack: direct {report['subscribe_ms_direct_p50']:.2f}ms, "
+              f"forwarded {report['subscribe_ms_forwarded_p50']:.2f}ms (p50)")
+        print(f"  Relay processing per datagram: p50 {report['forward_us_p50']:.1f}us, "
+              f"p99 {report['forward_us_p99']:.1f}us")
+        for event in ('join', 'leave'):
+            r = report[event]
+            print(f"  Node {event}: moved {r['moved_devices']} devices ({100 * r['moved_fraction']:.0f}%), "
+                  f"rebalanced in {r['rebalance_s'] * 1000:.0f}ms "
+                  f"(median {r['rebalance_median_s'] * 1000:.0f}ms), "
+                  f"max viewer gap {r['viewer_max_gap_s'] * 1000:.0f}ms")
+
+
+class JoinBench(ClusterBench):
+    """Time from subscribe to the first complete frame, with and without the join cache"""
+
+    def measure_join(self, addr, device):
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1024 * 1024)
+        sock.bind(('127.0.3.1', 0))
+        sock.settimeout(0.05)
+        assembler = media_packets.FrameAssembler(timeout_ms=1000)
+        sent = time.perf_counter()
+        sock.sendto(json.dumps({'op': 'subscribe', 'device': device}).encode(), addr)
+        first_frame = None
+        try:
+            while time.perf_counter() - sent < 2.0:
+                try:
+                    data = sock.recv(65535)
+                except socket.timeout:
+                    continue
+                if data[:1] != bytes([media_packets.VIDEO_PACKAGE]):
+                    continue
+                header, payload = media_packets.parse_video_packet(data)
+                if header is not None and assembler.add(header, payload) is not None:
+                    first_frame = time.perf_counter() - sent
+                    break
+        finally:
+            sock.sendto(json.dumps({'op': 'unsubscribe', 'device': device}).encode(), addr)
+            sock.close()
+        return first_frame
+
+    def run_mode(self, join_cache):
+        args = self.args
+        self.start_node(1, ['--join-cache' if join_cache else '--no-join-cache'])
+        try:
+            self.wait_converged()
+            time.sleep(0.5)  # Let the cache fill
+            addr = self.node_addr(1)
+            samples = []
+            misses = 0
+            for _ in range(args.joins):
+                # Join at a random phase of the frame interval
+                time.sleep(random.uniform(0.0, 1.0 / args.fps))
+                latency = self.measure_join(addr, self.devices[0])
+                if latency is None:
+                    misses += 1
+                else:
+                    samples.append(latency * 1000)
+        finally:
+            self.stop_node('relay-1')
+        return {
+            'joins': args.joins,
+            'no_frame': misses,
+            'first_frame_ms_p50': percentile(samples, 50),
+            'first_frame_ms_p95': percentile(samples, 95),
+            'first_frame_ms_p99': percentile(samples, 99),
+        }
+
+    def run(self):
+        args = self.args
+        sim = subprocess.Popen([sys.executable, os.path.join(self.script_dir, 'device_simulator.py'),
+                                '--devices', '1', '--fps', str(args.fps), '--frame-size', str(args.frame_size),
+                                '--loss', str(args.loss)],
+                               stdout=subprocess.DEVNULL, cwd=self.script_dir)
+        report = {'benchmark': 'relay_join', 'fps': args.fps, 'frame_size': args.frame_size, 'loss': args.loss}
+        try:
+            time.sleep(0.5)
+            report['cache_off'] = self.run_mode(False)
+            report['cache_on'] = self.run_mode(True)
+        finally:
+            for node in list(self.procs):
+                self.stop_node(node)
+            sim.terminate()
+            sim.wait()
+
+        if args.json:
+            print(json.dumps(report))
+            return
+        print(f"Late join, {args.fps:g} fps, {args.frame_size} byte frames, loss {args.loss:g}")
+        for mode in ('cache_off', 'cache_on'):
+            r = report[mode]
+            print(f"  {mode.replace('_', ' ')}: first frame p50 {r['first_frame_ms_p50']:.1f}ms, "
+                  f"p95 {r['first_frame_ms_p95']:.1f}ms, p99 {r['first_frame_ms_p99']:.1f}ms, "
+                  f"{r['no_frame']}/{r['joins']} joins without a frame")
+
+
+class UplinkBench(ClusterBench):
+    """Device cost and session start in uplink mode for a growing number of viewers"""
+
+    def wait_uplinks(self, timeout=10.0):
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            stats = self.poll_stats().get('relay-1')
+            if stats is not None and len(stats['uplinks']) == len(self.devices):
+                return stats
+            time.sleep(0.05)
+        raise TimeoutError("Devices did not connect their uplinks")
+
+    def wait_states(self, state, timeout=5.0):
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            stats = self.poll_stats()['relay-1']
+            if all(u['state'] == state for u in stats['uplinks'].values()):
+                return stats
+            time.sleep(0.01)
+        raise TimeoutError(f"Uplinks did not reach state {state}")
+
+    def run_round(self, count):
+        """`count` viewers per device"""
+        args = self.args
+        addr = self.node_addr(1)
+        viewers = BenchViewers(count * len(self.devices), self.devices)
+        viewers.start()
+        try:
+            t0 = time.monotonic()
+            viewers.subscribe_all([('relay-1', addr)])
+            stats = self.wait_states('streaming')
+            while any(u['first_media_mono'] is None for u in stats['uplinks'].values()):
+                time.sleep(0.01)
+                stats = self.poll_stats()['relay-1']
+            start_ms = [(u['first_media_mono'] - t0) * 1000 for u in stats['uplinks'].values()]
+
+            time.sleep(0.5)
+            before = self.poll_stats()['relay-1']
+            received_before = sum(v['packets'] for v in viewers.viewers)
+            time.sleep(args.seconds)
+            after = self.poll_stats()['relay-1']
+            received = sum(v['packets'] for v in viewers.viewers) - received_before
+
+            device_in = sum(after['uplinks'][d]['packets_in'] - before['uplinks'][d]['packets_in']
+                            for d in self.devices)
+            for viewer in viewers.viewers:
+                viewer['sock'].sendto(json.dumps({'op': 'unsubscribe', 'device': viewer['device']}).encode(), addr)
+            t1 = time.monotonic()
+            self.wait_states('idle')
+            stop_ms = (time.monotonic() - t1) * 1000
+        finally:
+            viewers.stop_event.set()
+            viewers.join()
+            for viewer in viewers.viewers:
+                viewer['sock'].close()
+        return {
+            'viewers': count,
+            'device_pps': device_in / args.seconds / len(self.devices),
+            'relay_out_pps': (after['packets_out'] - before['packets_out']) / args.seconds,
+            'viewer_pps': received / args.seconds / len(viewers.viewers),
+            'session_start_ms_p50': percentile(start_ms, 50),
+            'session_stop_ms': stop_ms,
+        }
+
+    def run(self):
+        args = self.args
+        relay = self.node_addr(1)[0]
+        sim = subprocess.Popen([sys.executable, os.path.join(self.script_dir, 'device_simulator.py'),
+                                '--devices', str(args.devices), '--frame-size', str(args.frame_size),
+                                '--uplink', f"{relay}:{DEFAULT_UPLINK_PORT}"],
+                               stdout=subprocess.DEVNULL, cwd=self.script_dir)
+        report = {'benchmark': 'relay_uplink', 'devices': args.devices, 'frame_size': args.frame_size, 'rounds': []}
+        try:
+            node = 'relay-1'
+            cmd = [sys.executable, self.script, 'run', '--node', node, '--media-ip', relay]
+            self.procs[node] = subprocess.Popen(cmd, stdout=subprocess.DEVNULL, cwd=self.script_dir)
+            # The simulator retries its uplinks until the relay listens
+            self.wait_uplinks(timeout=10.0)
+            idle = self.poll_stats()[node]
+            time.sleep(0.5)
+            report['idle_packets_in'] = self.poll_stats()[node]['packets_in'] - idle['packets_in']
+            for count in (int(c) for c in args.viewers.split(',')):
+                report['rounds'].append(self.run_round(count))
+        finally:
+            for node in list(self.procs):
+                self.stop_node(node)
+            sim.terminate()
+            sim.wait()
+
+        if args.json:
+            print(json.dumps(report))
+            return
+        print(f"Uplink mode, {args.devices} device(s), {args.frame_size} byte frames")
+        print(f"  Without viewers: {report['idle_packets_in']} packets from the devices in 0.5s")
+        print(f"  {'viewers/device':>14}{'device pkt/s':>14}{'relay out pkt/s':>17}{'viewer pkt/s':>14}"
+              f"{'start ms':>10}{'stop ms':>9}")
+        for r in report['rounds']:
+            print(f"  {r['viewers']:>14}{r['device_pps']:>14.1f}{r['relay_out_pps']:>17.1f}{r['viewer_pps']:>14.1f}"
+                  f"{r['session_start_ms_p50']:>10.1f}{r['session_stop_ms']:>9.1f}")
+
+
+class NackViewers(BenchViewers):
+    """Bench viewers that drop part of the video they receive and NACK the gaps"""
+
+    def __init__(self, count, devices, loss, addr, seed=1):
+        super().__init__(count, devices)
+        self.loss = loss
+        self.addr = addr
+        self.rng = random.Random(seed)
+        for viewer in self.viewers:
+            viewer['tracker'] = media_packets.NackTracker()
+            viewer['assembler'] = media_packets.FrameAssembler(timeout_ms=500)
+            viewer['done'] = collections.deque(maxlen=32)
+
+    def _nack(self, viewer, lost):
+        for frame_id, seqs in lost:
+            msg = {'op': 'nack', 'device': viewer['device'], 'frame_id': frame_id, 'packets': seqs}
+            viewer['sock'].sendto(json.dumps(msg).encode(), self.addr)
+
+    def _receive(self, viewer, data, now):
+        if data[:1] == b'{' or data[0] != media_packets.VIDEO_PACKAGE:
+            return
+        # Loss between the relay and this viewer
+        if self.rng.random() < self.loss:
+            return
+        header, payload = media_packets.parse_video_packet(data)
+        if header is None or header.frame_id in viewer['done']:
+            return
+        viewer['packets'] += 1
+        if viewer['assembler'].add(header, payload, now) is not None:
+            viewer['done'].append(header.frame_id)
+        self._nack(viewer, viewer['tracker'].add(header, now))
+
+    def run(self):
+        while not self.stop_event.is_set():
+            events = self.selector.select(0.02)
+            now = media_packets.now_ms()
+            with self.lock:
+                for key, _ in events:
+                    viewer = key.data
+                    while True:
+                        try:
+                            data, _ = viewer['sock'].recvfrom(65535)
+                        except BlockingIOError:
+                            break
+                        self._receive(viewer, data, now)
+                for viewer in self.viewers:
+                    self._nack(viewer, viewer['tracker'].retries(now))
+                    viewer['assembler'].expire(now)
+
+    def totals(self):
+        with self.lock:
+            return (sum(v['tracker'].nacks for v in self.viewers),
+                    sum(v['assembler'].completed_frames for v in self.viewers),
+                    sum(v['assembler'].incomplete_frames for v in self.viewers))
+
+
+class NackBench(ClusterBench):
+    """NACKs reaching the device with and without the relay's fragment cache,
+    for a growing number of lossy viewers"""
+
+    def run_round(self, count, nack_cache):
+        args = self.args
+        self.start_node(1, ['--nack-cache', str(nack_cache), '--no-join-cache'])
+        viewers = None
+        try:
+            self.wait_converged()
+            addr = self.node_addr(1)
+            viewers = NackViewers(count, self.devices, args.viewer_loss, addr, seed=count)
+            viewers.start()
+            viewers.subscribe_all([('relay-1', addr)])
+            time.sleep(0.5)
+            before = self.poll_stats()['relay-1']
+            nacks_before, complete_before, incomplete_before = viewers.totals()
+            time.sleep(args.seconds)
+            after = self.poll_stats()['relay-1']
+            nacks, complete, incomplete = viewers.totals()
+        finally:
+            if viewers is not None:
+                viewers.stop_event.set()
+                viewers.join()
+                for viewer in viewers.viewers:
+                    viewer['sock'].close()
+            self.stop_node('relay-1')
+        viewer_nacks = nacks - nacks_before
+        upstream = after['nacks_upstream'] - before['nacks_upstream']
+        frames = (complete - complete_before) + (incomplete - incomplete_before)
+        return {
+            'viewers': count,
+            'viewer_nacks_per_s': viewer_nacks / args.seconds,
+            'upstream_nacks_per_s': upstream / args.seconds,
+            'served_locally': after['nacks_served'] - before['nacks_served'],
+            'aggregated': after['nacks_aggregated'] - before['nacks_aggregated'],
+            'upstream_reduction': 1.0 - upstream / viewer_nacks if viewer_nacks else 0.0,
+            'frames_complete': (complete - complete_before) / frames if frames else 0.0,
+        }
+
+    def run(self):
+        args = self.args
+        sim = subprocess.Popen([sys.executable, os.path.join(self.script_dir, 'device_simulator.py'),
+                                '--devices', '1', '--fps', str(args.fps), '--frame-size', str(args.frame_size),
+                                '--loss', str(args.loss)],
+                               stdout=subprocess.DEVNULL, cwd=self.script_dir)
+        report = {'benchmark': 'relay_nack', 'fps': args.fps, 'frame_size': args.frame_size, 'loss': args.loss,
+                  'viewer_loss': args.viewer_loss, 'pass_through': [], 'proxy': []}
+        try:
+            time.sleep(0.5)
+            for count in (int(c) for c in args.viewers.split(',')):
+                report['pass_through'].append(self.run_round(count, 0))
+                report['proxy'].append(self.run_round(count, args.nack_cache))
+        finally:
+            for node in list(self.procs):
+                self.stop_node(node)
+            sim.terminate()
+            sim.wait()
+
+        if args.json:
+            print(json.dumps(report))
+            return
+        print(f"Viewer NACKs, {args.fps:g} fps, {args.frame_size} byte frames, "
+              f"loss {args.loss:g} to the relay and {args.viewer_loss:g} to each viewer")
+        print(f"  {'mode':<13}{'viewers':>8}{'viewer NACK/s':>15}{'device NACK/s':>15}{'reduction':>11}"
+              f"{'served':>8}{'merged':>8}{'complete':>10}")
+        for mode in ('pass_through', 'proxy'):
+            for r in report[mode]:
+                print(f"  {mode.replace('_', ' '):<13}{r['viewers']:>8}{r['viewer_nacks_per_s']:>15.1f}"
+                      f"{r['upstream_nacks_per_s']:>15.1f}{100 * r['upstream_reduction']:>10.0f}%"
+                      f"{r['served_locally']:>8}{r['aggregated']:>8}{100 * r['frames_complete']:>9.1f}%")
+
+
+class TimeShiftViewers(BenchViewers):
+    """Bench viewers that rewind after subscribing, half of them at real
+    time and half at twice the speed, so those catch up to live"""
+
+    def __init__(self, count, devices, addr, max_offset_s, seed=1):
+        super().__init__(count, devices)
+        self.addr = addr
+        rng = random.Random(seed)
+        for i, viewer in enumerate(self.viewers):
+            viewer['offset_ms'] = rng.uniform(1.0, max_offset_s) * 1000.0
+            viewer['speed'] = 1.0 if i % 2 == 0 else 2.0
+            viewer.update(sent=None, acked=None, offset_acked=None, first_video=None, live=None, video=0)
+
+    def rewind_all(self):
+        with self.lock:
+            for viewer in self.viewers:
+                viewer['sent'] = time.perf_counter()
+                msg = {'op': 'timeshift', 'device': viewer['device'], 'offset_ms': viewer['offset_ms'],
+                       'speed': viewer['speed']}
+                viewer['sock'].sendto(json.dumps(msg).encode(), self.addr)
+
+    def run(self):
+        while not self.stop_event.is_set():
+            for key, _ in self.selector.select(0.1):
+                viewer = key.data
+                while True:
+                    try:
+                        data, _ = viewer['sock'].recvfrom(65535)
+                    except BlockingIOError:
+                        break
+                    now = time.perf_counter()
+                    with self.lock:
+                        if data[:1] == b'{':
+                            msg = json.loads(data)
+                            if msg.get('op') == 'timeshifted':
+                                viewer['acked'] = now
+                                viewer['offset_acked'] = msg['offset_ms']
+                            elif msg.get('op') == 'live' and viewer['acked'] is not None:
+                                viewer['live'] = now
+                            continue
+                        viewer['packets'] += 1
+                        if data[0] == media_packets.VIDEO_PACKAGE and viewer['acked'] is not None:
+                            viewer['video'] += 1
+                            if viewer['first_video'] is None:
+                                viewer['first_video'] = now
+
+
+class TimeShiftBench(ClusterBench):
+    """Many viewers rewound to different offsets of one device: playout cost
+    per cursor, pacing and the time to catch up to live"""
+
+    def run(self):
+        args = self.args
+        sim = subprocess.Popen([sys.executable, os.path.join(self.script_dir, 'device_simulator.py'),
+                                '--devices', '1', '--fps', str(args.fps), '--frame-size', str(args.frame_size)],
+                               stdout=subprocess.DEVNULL, cwd=self.script_dir)
+        viewers = None
+        try:
+            time.sleep(0.5)
+            self.start_node(1, ['--timeshift-s', str(args.timeshift_s), '--no-join-cache'])
+            self.wait_converged()
+            addr = self.node_addr(1)
+            time.sleep(args.history_s)
+            viewers = TimeShiftViewers(args.viewers, self.devices, addr, args.history_s - 1.0)
+            viewers.start()
+            viewers.subscribe_all([('relay-1', addr)])
+            time.sleep(0.3)
+            before = self.poll_stats()['relay-1']
+            viewers.rewind_all()
+            time.sleep(args.seconds)
+            after = self.poll_stats()['relay-1']
+        finally:
+            if viewers is not None:
+                viewers.stop_event.set()
+                viewers.join()
+            for node in list(self.procs):
+                self.stop_node(node)
+            sim.terminate()
+            sim.wait()
+
+        with viewers.lock:
+            acked = [v for v in viewers.viewers if v['acked'] is not None]
+            ack_ms = [(v['acked'] - v['sent']) * 1000 for v in acked]
+            first_ms = [(v['first_video'] - v['sent']) * 1000 for v in acked if v['first_video'] is not None]
+            # At twice the speed a viewer gains a second per second: live after its offset
+            fast = [v for v in acked if v['speed'] > 1.0]
+            catchup_error = [abs((v['live'] - v['acked']) * 1000 - v['offset_acked'] / (v['speed'] - 1.0))
+                             for v in fast if v['live'] is not None]
+            slow = [v for v in acked if v['speed'] == 1.0]
+            slow_live = sum(1 for v in slow if v['live'] is not None)
+            video_rate = {id(v): v['video'] / (args.seconds - (v['acked'] - v['sent'])) for v in slow}
+        live_rate = (after['packets_in'] - before['packets_in']) / args.seconds
+        report = {
+            'benchmark': 'relay_timeshift', 'viewers': args.viewers, 'fps': args.fps, 'frame_size': args.frame_size,
+            'timeshift_s': args.timeshift_s,
+            'ring_mb': after['timeshift_bytes'] / 1e6,
+            'ring_seconds': max(after['timeshift_seconds'].values(), default=0.0),
+            'acked': len(acked),
+            'seek_ack_ms_p50': percentile(ack_ms, 50),
+            'first_video_ms_p50': percentile(first_ms, 50),
+            'caught_up': sum(1 for v in fast if v['live'] is not None), 'fast_viewers': len(fast),
+            'catchup_error_ms_p50': percentile(catchup_error, 50),
+            'catchup_error_ms_max': max(catchup_error, default=0.0),
+            'realtime_left_shifted': len(slow) - slow_live, 'realtime_viewers': len(slow),
+            'realtime_video_pps_p50': percentile(list(video_rate.values()), 50),
+            'skips': after['timeshift_skips'] - before['timeshift_skips'],
+            'timeshift_pps': (after['timeshift_out'] - before['timeshift_out']) / args.seconds,
+            'device_pps': live_rate,
+            'playout_us_p50': after['playout_us_p50'], 'playout_us_p99': after['playout_us_p99'],
+            'forward_us_p99': after['forward_us_p99'],
+        }
+        if args.json:
+            print(json.dumps(report))
+            return
+        print(f"Time shift: {args.viewers} viewers rewound 1 - {args.history_s - 1:g}s, half at 1x and half at 2x, "
+              f"{args.fps:g} fps, {args.frame_size} byte frames")
+        print(f"  Ring: {report['ring_mb']:.1f} MB for {report['ring_seconds']:.1f}s of the device")
+        print(f"  Seek: ack p50 {report['seek_ack_ms_p50']:.1f}ms, first video p50 {report['first_video_ms_p50']:.1f}ms "
+              f"({report['acked']}/{args.viewers} acked)")
+        print(f"  2x viewers back at live: {report['caught_up']}/{report['fast_viewers']}, "
+              f"catch-up error p50 {report['catchup_error_ms_p50']:.0f}ms / max {report['catchup_error_ms_max']:.0f}ms")
+        print(f"  1x viewers still shifted: {report['realtime_left_shifted']}/{report['realtime_viewers']}, "
+              f"video p50 {report['realtime_video_pps_p50']:.1f} datagrams/s")
+        print(f"  Played out {report['timeshift_pps']:.0f} datagrams/s from the ring ({report['device_pps']:.0f}/s "
+              f"from the device), {report['skips']} cursors overtaken")
+        print(f"  Playout per cursor and tick: p50 {report['playout_us_p50']:.1f}us, "
+              f"p99 {report['playout_us_p99']:.1f}us; live forward p99 {report['forward_us_p99']:.1f}us")
+
+
+class LinkViewers(BenchViewers):
+    """Bench viewers behind an emulated downlink: datagrams are serialized at
+    `link_kbps` through a drop-tail buffer of `buffer_kb`, like a home router.
+    Viewers without a rate get the datagrams as they arrive. Every viewer
+    sends a receiver report every REPORT_INTERVAL_S."""
+
+    REPORT_INTERVAL_S = 0.2
+
+    def __init__(self, count, devices, addr, link_kbps, buffer_kb, fast=1):
+        super().__init__(count + fast, devices)
+        self.addr = addr
+        self.measure_from = float('inf')
+        for i, viewer in enumerate(self.viewers):
+            viewer.update(rate=link_kbps * 1000 / 8 if i >= fast else None, buffer=buffer_kb * 1024,
+                          link=collections.deque(), link_bytes=0, free_at=0.0, delivered=0,
+                          assembler=media_packets.FrameAssembler(timeout_ms=1000), frame_done={},
+                          video_ms=[], audio_ms=[], audio=0, audio_lost=0, link_drops=0)
+
+    def reset(self):
+        with self.lock:
+            self.measure_from = time.time() * 1000.0
+            for viewer in self.viewers:
+                viewer['assembler'].completed_frames = viewer['assembler'].incomplete_frames = 0
+                viewer.update(video_ms=[], audio_ms=[], audio=0, audio_lost=0, link_drops=0)
+
+    def _arrive(self, viewer, data, now_ms):
+        # Serialize through the link, the delivery time is known on arrival
+        while viewer['link'] and viewer['link'][0][0] <= now_ms:
+            viewer['link_bytes'] -= viewer['link'].popleft()[1]
+        measured = now_ms >= self.measure_from
+        if viewer['rate'] is not None:
+            if viewer['link_bytes'] + len(data) > viewer['buffer']:
+                viewer['link_drops'] += measured
+                viewer['audio_lost'] += measured and data[0] == media_packets.AUDIO_PACKAGE
+                viewer['audio'] += measured and data[0] == media_packets.AUDIO_PACKAGE
+                return
+            deliver_ms = max(now_ms, viewer['free_at']) + len(data) * 1000.0 / viewer['rate']
+            viewer['free_at'] = deliver_ms
+            viewer['link'].append((deliver_ms, len(data)))
+            viewer['link_bytes'] += len(data)
+        else:
+            deliver_ms = now_ms
+        viewer['delivered_at'] = viewer.get('delivered_at', [])
+        viewer['delivered_at'].append((deliver_ms, len(data)))
+        if data[0] == media_packets.AUDIO_PACKAGE:
+            header, _ = media_packets.parse_audio_packet(data)
+            if header is not None and measured:
+                viewer['audio'] += 1
+                viewer['audio_ms'].append(deliver_ms - header.timestamp)
+            return
+        header, payload = media_packets.parse_video_packet(data)
+        if header is not None and viewer['assembler'].add(header, payload, deliver_ms) is not None and measured:
+            viewer['video_ms'].append(deliver_ms - header.timestamp)
+
+    def _report(self, viewer, now_ms):
+        pending = viewer.get('delivered_at', [])
+        delivered = [entry for entry in pending if entry[0] <= now_ms]
+        viewer['delivered_at'] = [entry for entry in pending if entry[0] > now_ms]
+        viewer['delivered'] += sum(size for _, size in delivered)
+        msg = {'op': 'report', 'device': viewer['device'], 'bytes': viewer['delivered']}
+        viewer['sock'].sendto(json.dumps(msg).encode(), self.addr)
+
+    def run(self):
+        next_report = time.monotonic()
+        while not self.stop_event.is_set():
+            events = self.selector.select(0.02)
+            with self.lock:
+                for key, _ in events:
+                    viewer = key.data
+                    while True:
+                        try:
+                            data, _ = viewer['sock'].recvfrom(65535)
+                        except BlockingIOError:
+                            break
+                        if data[:1] != b'{':
+                            self._arrive(viewer, data, time.time() * 1000.0)
+                if time.monotonic() >= next_report:
+                    next_report += self.REPORT_INTERVAL_S
+                    now_ms = time.time() * 1000.0
+                    for viewer in self.viewers:
+                        viewer['assembler'].expire(now_ms)
+                        self._report(viewer, now_ms)
+
+
+class CongestionBench(ClusterBench):
+    """Viewers behind a downlink slower than the stream, with and without
+    the relay's viewer queues"""
+
+    def run_mode(self, target_ms):
+        args = self.args
+        self.start_node(1, ['--queue-target-ms', str(target_ms), '--no-join-cache', '--timeshift-s', '0'])
+        viewers = None
+        try:
+            self.wait_converged()
+            addr = self.node_addr(1)
+            viewers = LinkViewers(args.viewers, self.devices, addr, args.link_kbps, args.link_buffer_kb)
+            viewers.start()
+            viewers.subscribe_all([('relay-1', addr)])
+            time.sleep(args.warmup)
+            viewers.reset()
+            time.sleep(args.seconds)
+            stats = self.poll_stats()['relay-1']
+        finally:
+            if viewers is not None:
+                viewers.stop_event.set()
+                viewers.join()
+                for viewer in viewers.viewers:
+                    viewer['sock'].close()
+            self.stop_node('relay-1')
+
+        def summary(group):
+            video = [ms for v in group for ms in v['video_ms']]
+            audio = [ms for v in group for ms in v['audio_ms']]
+            audio_sent = sum(v['audio'] for v in group)
+            return {
+                'video_ms_p50': percentile(video, 50), 'video_ms_p95': percentile(video, 95),
+                'audio_ms_p95': percentile(audio, 95),
+                'audio_loss': sum(v['audio_lost'] for v in group) / audio_sent if audio_sent else 0.0,
+                'fps': len(video) / len(group) / args.seconds,
+                'incomplete_per_s': sum(v['assembler'].incomplete_frames for v in group) / len(group) / args.seconds,
+            }
+
+        slow = [v for v in viewers.viewers if v['rate'] is not None]
+        fast = [v for v in viewers.viewers if v['rate'] is None]
+        legs = [leg for leg in stats['legs'] if leg['rate_kbps'] is not None]
+        result = {'target_ms': target_ms, 'slow': summary(slow), 'fast': summary(fast)}
+        result['relay'] = {
+            'queue_ms_p99': max((leg['delay_ms_p99'] for leg in legs), default=0.0),
+            'rate_kbps_p50': percentile([leg['rate_kbps'] for leg in legs], 50),
+            'dropped_stale': sum(leg['dropped_stale'] for leg in legs),
+            'dropped_incomplete': sum(leg['dropped_incomplete'] for leg in legs),
+            'dropped_sending': sum(leg['dropped_sending'] for leg in legs),
+        }
+        return result
+
+    def run(self):
+        args = self.args
+        sim = subprocess.Popen([sys.executable, os.path.join(self.script_dir, 'device_simulator.py'),
+                                '--devices', '1', '--fps', str(args.fps), '--frame-size', str(args.frame_size)],
+                               stdout=subprocess.DEVNULL, cwd=self.script_dir)
+        report = {'benchmark': 'relay_congestion', 'viewers': args.viewers, 'fps': args.fps,
+                  'frame_size': args.frame_size, 'link_kbps': args.link_kbps, 'link_buffer_kb': args.link_buffer_kb}
+        try:
+            time.sleep(0.5)
+            report['unmanaged'] = self.run_mode(0)
+            report['managed'] = self.run_mode(args.queue_target_ms)
+        finally:
+            for node in list(self.procs):
+                self.stop_node(node)
+            sim.terminate()
+            sim.wait()
+
+        if args.json:
+            print(json.dumps(report))
+            return
+        print(f"{args.viewers} viewers behind {args.link_kbps:g} kbit/s with a {args.link_buffer_kb:g} kB buffer, "
+              f"{args.fps:g} fps of {args.frame_size} byte frames, plus one unshaped viewer")
+        print(f"  {'mode':<11}{'video p50':>10}{'video p95':>10}{'audio p95':>10}{'audio loss':>11}{'fps':>6}"
+              f"{'partial/s':>10}{'queue p99':>10}{'stale':>7}{'incompl':>8}{'cut':>5}{'fast fps':>9}")
+        for mode in ('unmanaged', 'managed'):
+            r = report[mode]
+            slow, relay = r['slow'], r['relay']
+            print(f"  {mode:<11}{slow['video_ms_p50']:>8.0f}ms{slow['video_ms_p95']:>8.0f}ms"
+                  f"{slow['audio_ms_p95']:>8.0f}ms{100 * slow['audio_loss']:>10.1f}%{slow['fps']:>6.1f}"
+                  f"{slow['incomplete_per_s']:>10.1f}{relay['queue_ms_p99']:>8.0f}ms{relay['dropped_stale']:>7}"
+                  f"{relay['dropped_incomplete']:>8}{relay['dropped_sending']:>5}{r['fast']['fps']:>9.1f}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="ESP32 media relay cluster")
+    sub = parser.add_subparsers(dest='command', required=True)
+
+    run = sub.add_parser('run', help="Run one relay node")
+    run.add_argument('--node', required=True, help="Unique node name")
+    run.add_argument('--media-ip', required=True, help="Address the devices stream to")
+    run.add_argument('--control-port', type=int, default=DEFAULT_CONTROL_PORT)
+    run.add_argument('--audio-port', type=int, default=media_packets.AUDIO_UDP_PORT)
+    run.add_argument('--video-port', type=int, default=media_packets.VIDEO_UDP_PORT)
+    run.add_argument('--device-port', type=int, default=media_packets.CONTROL_TCP_PORT)
+    run.add_argument('--devices', default='', help="Device addresses placed on the ring, e.g. 10.0.0.10-10.0.0.90")
+    run.add_argument('--seeds', default='', help="Comma separated host:port of other nodes")
+    run.add_argument('--vnodes', type=int, default=DEFAULT_VNODES)
+    run.add_argument('--join-cache', action=argparse.BooleanOptionalAction, default=True,
+                     help="Serve the last complete frame and recent audio to joining viewers")
+    run.add_argument('--join-audio-ms', type=int, default=DEFAULT_JOIN_AUDIO_MS,
+                     help="Audio kept for joining viewers")
+    run.add_argument('--uplink-port', type=int, default=DEFAULT_UPLINK_PORT,
+                     help="TCP port for devices in uplink mode (CONFIG_RELAY_UPLINK), 0 = disabled")
+    run.add_argument('--nack-cache', type=int, default=DEFAULT_NACK_CACHE,
+                     help="Video datagrams per device kept to answer viewer NACKs, 0 = pass every NACK to the device")
+    run.add_argument('--timeshift-s', type=int, default=DEFAULT_TIMESHIFT_S,
+                     help="Seconds per device kept for viewers that rewind, 0 = disabled")
+    run.add_argument('--timeshift-mb', type=float, default=DEFAULT_TIMESHIFT_MB,
+                     help="Memory limit of the time shift ring per device")
+    run.add_argument('--queue-target-ms', type=int, default=DEFAULT_QUEUE_TARGET_MS,
+                     help="Queueing delay kept for viewers that send reports, 0 = no viewer queues")
+
+    bench = sub.add_parser('cluster-bench', help="Loopback cluster benchmark with simulated devices")
+    bench.add_argument('--nodes', type=int, default=3)
+    bench.add_argument('--devices', type=int, default=24)
+    bench.add_argument('--viewers', type=int, default=48)
+    bench.add_argument('--seconds', type=float, default=3.0)
+    bench.add_argument('--frame-size', type=int, default=8000)
+    bench.add_argument('--json', action='store_true', help="Print a machine-readable report")
+
+    join = sub.add_parser('join-bench', help="Late-join latency with and without the join cache")
+    join.add_argument('--joins', type=int, default=50)
+    join.add_argument('--fps', type=float, default=10.0)
+    join.add_argument('--frame-size', type=int, default=20000)
+    join.add_argument('--loss', type=float, default=0.0, help="Datagram loss between device and relay")
+    join.add_argument('--json', action='store_true', help="Print a machine-readable report")
+
+    uplink = sub.add_parser('uplink-bench', help="Device cost in uplink mode against the number of viewers")
+    uplink.add_argument('--devices', type=int, default=1)
+    uplink.add_argument('--viewers', default='1,4,16,64', help="Comma separated viewer counts per device")
+    uplink.add_argument('--seconds', type=float, default=3.0)
+    uplink.add_argument('--frame-size', type=int, default=20000)
+    uplink.add_argument('--json', action='store_true', help="Print a machine-readable report")
+
+    nack = sub.add_parser('nack-bench', help="Device NACK load with and without the relay's fragment cache")
+    nack.add_argument('--viewers', default='1,4,16', help="Comma separated viewer counts")
+    nack.add_argument('--seconds', type=float, default=3.0)
+    nack.add_argument('--fps', type=float, default=15.0)
+    nack.add_argument('--frame-size', type=int, default=20000)
+    nack.add_argument('--loss', type=float, default=0.02, help="Datagram loss between device and relay")
+    nack.add_argument('--viewer-loss', type=float, default=0.02, help="Video loss between relay and each viewer")
+    nack.add_argument('--nack-cache', type=int, default=DEFAULT_NACK_CACHE)
+    nack.add_argument('--json', action='store_true', help="Print a machine-readable report")
+
+    timeshift = sub.add_parser('timeshift-bench', help="Rewound viewers played out from the time shift ring")
+    timeshift.add_argument('--viewers', type=int, default=100)
+    timeshift.add_argument('--history-s', type=float, default=8.0, help="Recorded before the viewers rewind")
+    timeshift.add_argument('--seconds', type=float, default=8.0)
+    timeshift.add_argument('--fps', type=float, default=10.0)
+    timeshift.add_argument('--frame-size', type=int, default=8000)
+    timeshift.add_argument('--timeshift-s', type=int, default=DEFAULT_TIMESHIFT_S)
+    timeshift.add_argument('--json', action='store_true', help="Print a machine-readable report")
+
+    congestion = sub.add_parser('congestion-bench', help="Viewers behind a slow downlink, with and without viewer queues")
+    congestion.add_argument('--viewers', type=int, default=4, help="Viewers behind the slow link")
+    congestion.add_argument('--link-kbps', type=float, default=1000.0)
+    congestion.add_argument('--link-buffer-kb', type=float, default=256.0, help="Drop-tail buffer of the link")
+    congestion.add_argument('--queue-target-ms', type=int, default=DEFAULT_QUEUE_TARGET_MS)
+    congestion.add_argument('--warmup', type=float, default=3.0)
+    congestion.add_argument('--seconds', type=float, default=5.0)
+    congestion.add_argument('--fps', type=float, default=15.0)
+    congestion.add_argument('--frame-size', type=int, default=12000)
+    congestion.add_argument('--json', action='store_true', help="Print a machine-readable report")
+
+    args = parser.parse_args()
+    if args.command == 'run':
+        node = RelayNode(args)
+        signal.signal(signal.SIGTERM, node.stop)
+        try:
+            node.run()
+        except KeyboardInterrupt:
+            node._leave()
+    elif args.command == 'uplink-bench':
+        UplinkBench(args).run()
+    elif args.command == 'congestion-bench':
+        args.devices = 1
+        CongestionBench(args).run()
+    elif args.command == 'timeshift-bench':
+        args.devices = 1
+        TimeShiftBench(args).run()
+    elif args.command == 'nack-bench':
+        args.devices = 1
+        NackBench(args).run()
+    elif args.command == 'join-bench':
+        args.devices = 1
+        JoinBench(args).run()
+    else:
+        ClusterBench(args).run()
+
+
+if __name__ == "__main__":
+    main()
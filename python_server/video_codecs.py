@@ -0,0 +1,869 @@
+#!/usr/bin/env python3
+"""
+Video codecs of the ESP32 streams on the host
+
+H.264 through PyAV (FFmpeg): the decoder the viewers use for
+CONFIG_VIDEO_CODEC_H264 streams, and a baseline encoder with the settings of
+_video_h264_init (no B frames, IDR every GOP frames and on request) for the
+bench. The bench runs recorded YUV frames (or a synthetic doorstep scene)
+through both video modes of video_manager.c, MJPEG and H.264 packetized with
+FU-A fragments, and compares bitrate, quality and the recovery after losses.
+
+Slice updates (CONFIG_VIDEO_SLICE_UPDATES): the receiver that patches the
+changed restart intervals of a JPEG frame into the last one, an encoder with
+the rules of _video_slice_update, and a bench of the bytes they save.
+"""
+import argparse
+import fractions
+import functools
+import json
+import math
+import os
+import sys
+import time
+
+import cv2
+import numpy as np
+
+import media_packets
+
+DEFAULT_FPS = 15                # VIDEO_FPS in video_manager.c
+DEFAULT_GOP = 150               # CONFIG_VIDEO_H264_GOP
+KEYFRAME_MIN_INTERVAL_MS = 500  # VIDEO_KEYFRAME_MIN_INTERVAL_MS in video_manager.c
+IP_UDP_OVERHEAD = 28            # IPv4 + UDP header bytes per datagram
+
+# Slice updates, matching video_manager.c
+SLICE_REFRESH = 45              # CONFIG_VIDEO_SLICE_REFRESH
+SLICE_MAX = 256                 # VIDEO_SLICE_MAX
+SLICE_FULL_PERCENT = 60         # VIDEO_SLICE_FULL_PERCENT
+SLICE_DC_THRESHOLD = 1          # CONFIG_VIDEO_SLICE_DC_THRESHOLD
+
+# Tried in this order: the esp_h264 software encoder is derived from OpenH264
+ENCODERS = ('libopenh264', 'libx264')
+
+_av = None
+
+
+def load_av():
+    """Import PyAV once; raises RuntimeError when it is not installed"""
+    global _av
+    if _av is None:
+        try:
+            import av
+        except ImportError:
+            raise RuntimeError("PyAV not found (pip install av)") from None
+        _av = av
+    return _av
+
+
+def h264_available():
+    try:
+        load_av()
+        return True
+    except RuntimeError:
+        return False
+
+
+class H264Encoder:
+    """Baseline H.264 encoder with the settings of the firmware"""
+
+    def __init__(self, width, height, fps=DEFAULT_FPS, bitrate=300000, gop=DEFAULT_GOP):
+        av = load_av()
+        self.context = None
+        for name in ENCODERS:
+            try:
+                context = av.CodecContext.create(name, 'w')
+            except (ValueError, av.FFmpegError):
+                continue
+            context.width = width
+            context.height = height
+            context.pix_fmt = 'yuv420p'
+            context.time_base = fractions.Fraction(1, fps)
+            context.framerate = fractions.Fraction(fps, 1)
+            context.bit_rate = bitrate
+            context.gop_size = gop
+            context.max_b_frames = 0
+            if name == 'libx264':
+                context.options = {'profile': 'baseline', 'tune': 'zerolatency', 'preset': 'veryfast',
+                                   'forced-idr': '1'}
+            else:
+                context.options = {'profile': 'constrained_baseline', 'rc_mode': 'bitrate'}
+            context.open()
+            self.context = context
+            self.name = name
+            break
+        if self.context is None:
+            raise RuntimeError("No H.264 encoder in this FFmpeg build (libopenh264 or libx264)")
+        self.pts = 0
+
+    def encode(self, yuv, keyframe=False):
+        """Encode one I420 frame (height * 3/2 rows); returns the Annex B access unit"""
+        av = load_av()
+        frame = av.VideoFrame.from_ndarray(yuv, format='yuv420p')
+        frame.pts = self.pts
+        self.pts += 1
+        if keyframe:
+            frame.pict_type = av.video.frame.PictureType.I
+        return b''.join(bytes(packet) for packet in self.context.encode(frame))
+
+
+class H264Decoder:
+    """H.264 decoder for the access units rebuilt by FrameAssembler"""
+
+    def __init__(self):
+        av = load_av()
+        self.context = av.CodecContext.create('h264', 'r')
+        self.errors = 0
+
+    def decode(self, access_unit, format='bgr24'):
+        """Decode one access unit; returns the picture as an array, or None"""
+        av = load_av()
+        try:
+            frames = self.context.decode(av.Packet(access_unit))
+        except av.FFmpegError:
+            self.errors += 1
+            return None
+        if not frames:
+            return None
+        return frames[-1].to_ndarray(format=format)
+
+
+class _KeyframeRequests:
+    """Call `request_keyframe` at most every KEYFRAME_MIN_INTERVAL_MS, like the
+    device coalesces the requests"""
+
+    def __init__(self, request_keyframe):
+        self.request_keyframe = request_keyframe
+        self.last_request_ms = None
+        self.decoded = 0
+        self.frozen = 0
+        self.requests = 0
+
+    def _request(self, now_ms):
+        if self.last_request_ms is not None and now_ms - self.last_request_ms < KEYFRAME_MIN_INTERVAL_MS:
+            return
+        self.last_request_ms = now_ms
+        self.requests += 1
+        self.request_keyframe()
+
+
+class H264Receiver(_KeyframeRequests):
+    """Decode H.264 frames in frame id order, ask for a keyframe after a loss
+
+    A missing frame breaks the reference chain of the following P frames: they
+    are not decoded (the last picture stays frozen) until an IDR frame arrives.
+    """
+
+    def __init__(self, request_keyframe, decoder=None, format='bgr24'):
+        super().__init__(request_keyframe)
+        self.decoder = decoder if decoder is not None else H264Decoder()
+        self.format = format
+        self.next_id = None
+        self.broken = True      # Nothing to predict from before the first IDR frame
+
+    def lost(self, now_ms):
+        """A frame was lost (incomplete or expired)"""
+        self.broken = True
+        self._request(now_ms)
+
+    def frame(self, frame, now_ms):
+        """Feed a complete VideoFrame; returns the decoded picture or None"""
+        if self.next_id is not None and frame.frame_id != self.next_id:
+            self.broken = True
+        self.next_id = (frame.frame_id + 1) & 0xFFFFFFFF
+        if media_packets.h264_is_keyframe(frame.data):
+            self.broken = False
+        if self.broken:
+            self.frozen += 1
+            self._request(now_ms)
+            return None
+        picture = self.decoder.decode(frame.data, self.format)
+        if picture is None:
+            self.broken = True
+            self.frozen += 1
+            self._request(now_ms)
+            return None
+        self.decoded += 1
+        return picture
+
+
+class JpegLayout:
+    """What _jpeg_parse_layout reads from a JPEG header: sampling, Huffman
+    tables and restart interval of a baseline frame with one interleaved scan"""
+
+    def __init__(self, header):
+        self.components = []    # (h, v, dc table, ac table) in scan order, luma first
+        self.restart_interval = 0
+        self.tables = {}        # (class, id) -> 16 bit lookup of (value, code length)
+        frame = {}
+        width = height = 0
+        i = 2
+        while i + 4 <= len(header):
+            marker = header[i + 1]
+            end = i + 2 + (header[i + 2] << 8 | header[i + 3])
+            p = i + 4
+            if end > len(header):
+                raise ValueError("Truncated JPEG header")
+            if marker in (0xC0, 0xC1):
+                if header[p] != 8 or not 1 <= header[p + 5] <= 3:
+                    raise ValueError("Not an 8 bit frame of up to 3 components")
+                height = header[p + 1] << 8 | header[p + 2]
+                width = header[p + 3] << 8 | header[p + 4]
+                for c in range(header[p + 5]):
+                    cid, sampling = header[p + 6 + c * 3], header[p + 7 + c * 3]
+                    frame[cid] = (sampling >> 4, sampling & 0x0F)
+            elif 0xC2 <= marker <= 0xCF and marker not in (0xC4, 0xC8, 0xCC):
+                raise ValueError("Not a baseline JPEG frame")
+            elif marker == 0xC4:
+                while p + 17 <= end:
+                    table_class, table_id = header[p] >> 4, header[p] & 0x0F
+                    counts = header[p + 1:p + 17]
+                    total = sum(counts)
+                    if table_class > 1 or table_id > 1 or p + 17 + total > end:
+                        raise ValueError("Unsupported Huffman table")
+                    self.tables[table_class, table_id] = self._lookup(counts, header[p + 17:p + 17 + total])
+                    p += 17 + total
+            elif marker == 0xDD:
+                self.restart_interval = header[p] << 8 | header[p + 1]
+            elif marker == 0xDA:
+                count = header[p]
+                if count != len(frame):
+                    raise ValueError("Not an interleaved scan of all components")
+                for s in range(count):
+                    cid, selectors = header[p + 1 + s * 2], header[p + 2 + s * 2]
+                    if cid not in frame:
+                        raise ValueError("Scan of an unknown component")
+                    h, v = frame[cid] if count > 1 else (1, 1)
+                    dc, ac = selectors >> 4, selectors & 0x0F
+                    if (0, dc) not in self.tables or (1, ac) not in self.tables or not h or not v:
+                        raise ValueError("Scan without Huffman tables")
+                    self.components.append((h, v, dc, ac))
+            i = end
+        if not width or not height or not self.components or not self.restart_interval:
+            raise ValueError("No frame, scan or restart interval")
+        h_max = max(c[0] for c in self.components)
+        v_max = max(c[1] for c in self.components)
+        self.mcus = -(-width // (h_max * 8)) * -(-height // (v_max * 8))
+        self.luma_blocks = self.components[0][0] * self.components[0][1]
+
+    @staticmethod
+    def _lookup(counts, values):
+        """Table indexed by the next 16 bits, the code lengths of ITU T.81 C.2"""
+        lookup = [None] * 65536
+        code = index = 0
+        for length, count in enumerate(counts, 1):
+            for _ in range(count):
+                first = code << (16 - length)
+                lookup[first:first + (1 << (16 - length))] = [(values[index], length)] * (1 << (16 - length))
+                code += 1
+                index += 1
+            code <<= 1
+        return lookup
+
+    def slice_mcus(self, n):
+        return min(self.restart_interval, self.mcus - n * self.restart_interval)
+
+    def slice_dc(self, data, mcus):
+        """Luma DC coefficients of a restart interval, like _jpeg_slice_dc; None if it does not decode"""
+        data = bytes(data).replace(b'\xff\x00', b'\xff')
+        bits = (bin(int.from_bytes(b'\x01' + data, 'big'))[3:] if data else '') + '1' * 48
+        pos = 0
+        pred = [0] * len(self.components)
+        dc = []
+        components = [(h * v, self.tables[0, d], self.tables[1, a]) for h, v, d, a in self.components]
+        try:
+            for _ in range(mcus):
+                for s, (blocks, dc_table, ac_table) in enumerate(components):
+                    for _ in range(blocks):
+                        size, length = dc_table[int(bits[pos:pos + 16], 2)]
+                        pos += length
+                        if size > 11:
+                            return None
+                        diff = 0
+                        if size:
+                            diff = int(bits[pos:pos + size], 2)
+                            pos += size
+                            if diff < 1 << (size - 1):
+                                diff -= (1 << size) - 1
+                        pred[s] += diff
+                        if s == 0:
+                            dc.append(pred[0])
+                        k = 1
+                        while k < 64:
+                            rs, length = ac_table[int(bits[pos:pos + 16], 2)]
+                            pos += length
+                            if rs & 0x0F == 0:
+                                if rs != 0xF0:
+                                    break
+                                k += 16
+                                continue
+                            k += rs >> 4
+                            if k > 63:
+                                return None
+                            pos += rs & 0x0F
+                            k += 1
+                        if pos > len(bits) - 32:
+                            # Ran into the padding: more blocks than data, like the 1 bits on the device
+                            bits += '1' * 48
+        except TypeError:
+            return None     # A code that is not in the table
+        return np.array(dc, np.int16)
+
+
+@functools.lru_cache(maxsize=8)
+def _jpeg_layout(header):
+    return JpegLayout(header)
+
+
+@functools.lru_cache(maxsize=1 << 17)
+def _slice_dc(header, n, data):
+    # Cached: the bench sends the same frames more than once
+    layout = _jpeg_layout(header)
+    return layout.slice_dc(data, layout.slice_mcus(n))
+
+
+class SliceEncoder:
+    """The decisions of _video_slice_update, for the bench and simulators
+
+    encode() returns (codec, payload): a whole JPEG frame, or a slice update
+    with the restart intervals that changed visibly since the version the
+    client holds (a luma DC coefficient moved by more than `threshold`
+    quantization steps).
+    """
+
+    def __init__(self, refresh=SLICE_REFRESH, threshold=SLICE_DC_THRESHOLD):
+        self.refresh = refresh
+        self.threshold = threshold
+        self.valid = False
+        self.base_frame_id = 0
+        self.header = None
+        self.layout = None
+        self.slices = []        # The versions the client holds
+        self.dc = []            # Their luma DC coefficients
+        self.frames_since_refresh = 0
+        self.changed_slices = 0     # Intervals in the updates sent
+        self.total_slices = 0       # Intervals of the frames sent as updates
+
+    def invalidate(self):
+        """The last frame was lost on the way out, the next goes out whole"""
+        self.valid = False
+
+    def _whole(self, jpeg):
+        self.valid = False
+        return media_packets.VIDEO_CODEC_MJPEG, jpeg
+
+    def encode(self, frame_id, jpeg, refresh=False):
+        parsed = media_packets.jpeg_slices(jpeg)
+        if parsed is None or len(parsed[1]) > SLICE_MAX:
+            return self._whole(jpeg)
+        header, slices = parsed
+        reset = not self.valid or header != self.header or len(slices) != len(self.slices)
+        if reset:
+            try:
+                self.layout = _jpeg_layout(header)
+            except ValueError:
+                return self._whole(jpeg)
+            if -(-self.layout.mcus // self.layout.restart_interval) != len(slices):
+                return self._whole(jpeg)
+            self.slices = [None] * len(slices)
+            self.dc = [None] * len(slices)
+        full = reset or refresh
+        if not full:
+            self.frames_since_refresh += 1
+            full = self.frames_since_refresh >= self.refresh
+
+        # Bytes compared instead of FNV-1a hashes, the same result without collisions
+        changed, decoded = [], {}
+        for n, data in enumerate(slices):
+            if not reset and data == self.slices[n]:
+                continue
+            dc = _slice_dc(header, n, data)
+            if dc is None:
+                return self._whole(jpeg)
+            decoded[n] = dc
+            if reset or np.abs(dc.astype(np.int32) - self.dc[n]).max() > self.threshold:
+                changed.append(n)
+        update_len = media_packets.SLICE_UPDATE_HEADER_SIZE + sum(
+            media_packets.SLICE_ENTRY_HEADER_SIZE + len(slices[n]) for n in changed)
+        if not full and update_len > len(jpeg) // 100 * SLICE_FULL_PERCENT:
+            full = True
+
+        for n in (decoded if full else changed):
+            self.slices[n] = slices[n]
+            self.dc[n] = decoded[n]
+        self.valid = True
+        self.header = header
+        base_frame_id, self.base_frame_id = self.base_frame_id, frame_id
+        if full:
+            self.frames_since_refresh = 0
+            return media_packets.VIDEO_CODEC_MJPEG, jpeg
+        self.changed_slices += len(changed)
+        self.total_slices += len(slices)
+        return (media_packets.VIDEO_CODEC_MJPEG_SLICES,
+                media_packets.build_slice_update(base_frame_id, len(slices), {n: slices[n] for n in changed}))
+
+
+class SliceReceiver(_KeyframeRequests):
+    """Patch slice updates into the last JPEG frame, ask for a whole one after a loss
+
+    An update only applies to the frame it names as base. After a lost frame
+    the picture stays frozen until the next whole frame: the periodic refresh,
+    or the one `request_keyframe` asks for.
+    """
+
+    def __init__(self, request_keyframe):
+        super().__init__(request_keyframe)
+        self.patcher = media_packets.SlicePatcher()
+        self.updates = 0
+
+    def lost(self, now_ms):
+        """A frame was lost (incomplete or expired)"""
+        self._request(now_ms)
+
+    def frame(self, frame, now_ms):
+        """Feed a complete VideoFrame; returns the JPEG frame to show or None"""
+        jpeg = self.patcher.patch(frame)
+        if jpeg is None:
+            self.frozen += 1
+            self._request(now_ms)
+            return None
+        self.decoded += 1
+        if frame.codec == media_packets.VIDEO_CODEC_MJPEG_SLICES:
+            self.updates += 1
+        return jpeg
+
+
+def doorstep_scene(width, height, seconds, fps, seed=3):
+    """Synthetic doorbell view: a static textured scene with sensor noise and a
+    visitor walking in, standing at the door and leaving (I420 frames)"""
+    rng = np.random.default_rng(seed)
+    y, x = np.mgrid[0:height, 0:width]
+    background = np.zeros((height, width, 3), np.float32)
+    background[...] = (90 + 60 * y / height)[..., None]
+    background[:, :, 1] += 20 * np.sin(x / 7.0) * (y > height * 0.7)   # Path texture
+    door = (slice(height // 6, height * 5 // 6), slice(width * 3 // 5, width * 4 // 5))
+    background[door] = (60, 40, 110)
+    for _ in range(40):
+        cx, cy, r = rng.integers(0, width), rng.integers(0, height * 2 // 3), rng.integers(3, 12)
+        cv2.circle(background, (int(cx), int(cy)), int(r), [float(v) for v in rng.integers(40, 200, 3)], -1)
+
+    frames = []
+    count = int(seconds * fps)
+    for i in range(count):
+        image = background.copy()
+        # Walk in during the first third, stand, walk out during the last fifth
+        t = i / max(1, count - 1)
+        if t < 1 / 3:
+            pos = t * 3
+        elif t < 0.8:
+            pos = 1.0
+        else:
+            pos = 1.0 - (t - 0.8) * 5
+        if pos > 0:
+            px = int(-width * 0.2 + pos * width * 0.75)
+            sway = int(3 * math.sin(i / 2.0))
+            cv2.rectangle(image, (px, height // 4 + sway), (px + width // 8, height * 9 // 10), (30, 60, 160), -1)
+            cv2.circle(image, (px + width // 16, height // 5 + sway), height // 14, (120, 150, 200), -1)
+        image += rng.normal(0, 2.0, image.shape).astype(np.float32)
+        bgr = np.clip(image, 0, 255).astype(np.uint8)
+        frames.append(cv2.cvtColor(bgr, cv2.COLOR_BGR2YUV_I420))
+    return frames
+
+
+def read_yuv(path, width, height, pix_fmt):
+    """Frames of a raw YUV recording as I420; yuyv is the sensor's YUV422 output"""
+    data = np.fromfile(path, np.uint8)
+    frame_bytes = width * height * 2 if pix_fmt == 'yuyv' else width * height * 3 // 2
+    frames = []
+    for i in range(len(data) // frame_bytes):
+        raw = data[i * frame_bytes:(i + 1) * frame_bytes]
+        if pix_fmt == 'yuyv':
+            bgr = cv2.cvtColor(raw.reshape(height, width, 2), cv2.COLOR_YUV2BGR_YUYV)
+            frames.append(cv2.cvtColor(bgr, cv2.COLOR_BGR2YUV_I420))
+        else:
+            frames.append(raw.reshape(height * 3 // 2, width))
+    return frames
+
+
+def psnr_y(reference, decoded):
+    """PSNR of the luma plane in dB"""
+    mse = np.mean((reference.astype(np.float32) - decoded.astype(np.float32)) ** 2)
+    return 99.0 if mse == 0 else 10 * math.log10(255 ** 2 / mse)
+
+
+def _wire_bytes(packets):
+    return sum(len(p) + IP_UDP_OVERHEAD for p in packets)
+
+
+def bench_mjpeg(frames, width, height, fps, quality, loss, seed):
+    sizes, packets_per_frame, psnrs = [], [], []
+    encode_s = decode_s = 0.0
+    wire = 0
+    for i, yuv in enumerate(frames):
+        bgr = cv2.cvtColor(yuv, cv2.COLOR_YUV2BGR_I420)
+        start = time.process_time()
+        jpeg = cv2.imencode('.jpg', bgr, [cv2.IMWRITE_JPEG_QUALITY, quality])[1].tobytes()
+        encode_s += time.process_time() - start
+        packets = media_packets.build_video_packets(i, 0, jpeg)
+        sizes.append(len(jpeg))
+        packets_per_frame.append(len(packets))
+        wire += _wire_bytes(packets)
+        start = time.process_time()
+        decoded = cv2.imdecode(np.frombuffer(jpeg, np.uint8), cv2.IMREAD_GRAYSCALE)
+        decode_s += time.process_time() - start
+        psnrs.append(psnr_y(yuv[:height], decoded))
+
+    # Every frame stands alone: a loss costs exactly the frames it hits
+    rng = np.random.default_rng(seed)
+    lost_frames = sum(1 for n in packets_per_frame if (rng.random(n) < loss).any())
+    seconds = len(frames) / fps
+    return {
+        'quality': quality,
+        'bytes_per_frame': float(np.mean(sizes)),
+        'payload_kbps': sum(sizes) * 8 / seconds / 1000,
+        'wire_kbps': wire * 8 / seconds / 1000,
+        'packets_per_frame': float(np.mean(packets_per_frame)),
+        'encode_ms_per_frame': encode_s * 1000 / len(frames),
+        'decode_ms_per_frame': decode_s * 1000 / len(frames),
+        'psnr_db': float(np.mean(psnrs)),
+        'loss_frames_missing': lost_frames / len(frames),
+    }
+
+
+def _run_h264(frames, width, height, fps, bitrate, gop, loss, rtt_ms, seed, measure_psnr):
+    """Encode, packetize, drop, reassemble and decode like device and viewer"""
+    encoder = H264Encoder(width, height, fps, bitrate, gop)
+    interval_ms = 1000.0 / fps
+    requests = []       # Send times of keyframe requests, applied one RTT later
+    receiver = H264Receiver(lambda: requests.append(now_ms), format='gray')
+    rng = np.random.default_rng(seed)
+    sizes, idr_sizes, packets_per_frame, psnrs = [], [], [], []
+    encode_s = decode_s = 0.0
+    wire = 0
+    last_keyframe_ms = None
+    last_picture = None
+    for i, yuv in enumerate(frames):
+        now_ms = i * interval_ms
+        # The device serves requests that reached it, no more often than VIDEO_KEYFRAME_MIN_INTERVAL_MS
+        due = [r for r in requests if r + rtt_ms / 2 <= now_ms]
+        keyframe = bool(due) and (last_keyframe_ms is None or now_ms - last_keyframe_ms >= KEYFRAME_MIN_INTERVAL_MS)
+        if keyframe:
+            requests = [r for r in requests if r not in due]
+        start = time.process_time()
+        access_unit = encoder.encode(yuv, keyframe=keyframe)
+        encode_s += time.process_time() - start
+        is_idr = media_packets.h264_is_keyframe(access_unit)
+        if is_idr:
+            last_keyframe_ms = now_ms
+            idr_sizes.append(len(access_unit))
+        sizes.append(len(access_unit))
+        packets = media_packets.build_h264_packets(i, int(now_ms), access_unit)
+        packets_per_frame.append(len(packets))
+        wire += _wire_bytes(packets)
+
+        # The viewer's side, one RTT/2 later
+        arrive_ms = now_ms + rtt_ms / 2
+        assembler = media_packets.FrameAssembler()
+        frame = None
+        for packet in packets:
+            if loss and rng.random() < loss:
+                continue
+            header, payload = media_packets.parse_video_packet(packet)
+            frame = assembler.add(header, payload, arrive_ms) or frame
+        if frame is None:
+            receiver.lost(arrive_ms)
+        else:
+            start = time.process_time()
+            picture = receiver.frame(frame, arrive_ms)
+            decode_s += time.process_time() - start
+            if picture is not None:
+                last_picture = picture
+        if measure_psnr and last_picture is not None:
+            psnrs.append(psnr_y(yuv[:height], last_picture[:height]))
+
+    seconds = len(frames) / fps
+    return {
+        'encoder': encoder.name,
+        'bytes_per_frame': float(np.mean(sizes)),
+        'idr_bytes': float(np.mean(idr_sizes)) if idr_sizes else 0.0,
+        'idr_frames': len(idr_sizes),
+        'payload_kbps': sum(sizes) * 8 / seconds / 1000,
+        'wire_kbps': wire * 8 / seconds / 1000,
+        'packets_per_frame': float(np.mean(packets_per_frame)),
+        'encode_ms_per_frame': encode_s * 1000 / len(frames),
+        'decode_ms_per_frame': decode_s * 1000 / max(1, receiver.decoded + receiver.frozen),
+        'psnr_db': float(np.mean(psnrs)) if psnrs else 0.0,
+        'frozen': receiver.frozen / len(frames),
+        'keyframe_requests': receiver.requests,
+    }
+
+
+def bench_h264(frames, width, height, fps, bitrate, gop, loss, rtt_ms, seed):
+    result = _run_h264(frames, width, height, fps, bitrate, gop, 0.0, rtt_ms, seed, True)
+    result['bitrate_setting'] = bitrate
+    # The same stream with random loss: frozen frames until the requested IDR frame arrives
+    lossy = _run_h264(frames, width, height, fps, bitrate, gop, loss, rtt_ms, seed, False)
+    result['loss_frozen'] = lossy['frozen']
+    result['loss_keyframe_requests'] = lossy['keyframe_requests']
+    result['loss_idr_frames'] = lossy['idr_frames']
+    result['loss_wire_kbps'] = lossy['wire_kbps']
+    return result
+
+
+def encode_jpeg(bgr, quality, restart_mcus=0):
+    """libjpeg frame in the sensor's 4:2:2 sampling (16x8 pixel MCUs), with a
+    restart marker every `restart_mcus` MCUs when set"""
+    params = [cv2.IMWRITE_JPEG_QUALITY, quality,
+              cv2.IMWRITE_JPEG_SAMPLING_FACTOR, cv2.IMWRITE_JPEG_SAMPLING_FACTOR_422]
+    if restart_mcus:
+        params += [cv2.IMWRITE_JPEG_RST_INTERVAL, restart_mcus]
+    return cv2.imencode('.jpg', bgr, params)[1].tobytes()
+
+
+def _run_slices(jpegs, lumas, fps, refresh, threshold, loss, rtt_ms, seed):
+    """Send JPEG frames as slice updates, drop packets, patch them like a viewer"""
+    encoder = SliceEncoder(refresh, threshold)
+    interval_ms = 1000.0 / fps
+    requests = []       # Send times of refresh requests, applied one RTT later
+    receiver = SliceReceiver(lambda: requests.append(now_ms))
+    rng = np.random.default_rng(seed)
+    wire = 0
+    full_frames = 0
+    psnrs = []
+    shown = None
+    for i, jpeg in enumerate(jpegs):
+        now_ms = i * interval_ms
+        due = [r for r in requests if r + rtt_ms / 2 <= now_ms]
+        requests = [r for r in requests if r not in due]
+        codec, payload = encoder.encode(i, jpeg, refresh=bool(due))
+        if codec == media_packets.VIDEO_CODEC_MJPEG:
+            full_frames += 1
+        packets = media_packets.build_video_packets(i, int(now_ms), payload, codec)
+        wire += _wire_bytes(packets)
+
+        arrive_ms = now_ms + rtt_ms / 2
+        assembler = media_packets.FrameAssembler()
+        frame = None
+        for packet in packets:
+            if loss and rng.random() < loss:
+                continue
+            header, data = media_packets.parse_video_packet(packet)
+            frame = assembler.add(header, data, arrive_ms) or frame
+        if frame is None:
+            receiver.lost(arrive_ms)
+        else:
+            shown = receiver.frame(frame, arrive_ms) or shown
+        if lumas is not None and shown is not None:
+            # What the viewer shows against the source: the noise of the slices not sent, stale ones after a loss
+            decoded = cv2.imdecode(np.frombuffer(shown, np.uint8), cv2.IMREAD_GRAYSCALE)
+            psnrs.append(psnr_y(lumas[i], decoded))
+
+    seconds = len(jpegs) / fps
+    return {
+        'wire_kbps': wire * 8 / seconds / 1000,
+        'full_frames': full_frames,
+        'changed_slices': encoder.changed_slices / encoder.total_slices if encoder.total_slices else 1.0,
+        'psnr_db': float(np.mean(psnrs)) if psnrs else 0.0,
+        'frozen': receiver.frozen / len(jpegs),
+        'refresh_requests': receiver.requests,
+    }
+
+
+def bench_slices(images, lumas, fps, quality, restart_mcus, refresh, threshold, loss, rtt_ms, seed):
+    jpegs = [encode_jpeg(bgr, quality, restart_mcus) for bgr in images]
+    slices = media_packets.jpeg_slices(jpegs[0])
+    result = _run_slices(jpegs, lumas, fps, refresh, threshold, 0.0, rtt_ms, seed)
+    result['restart_mcus'] = restart_mcus
+    result['slices_per_frame'] = len(slices[1]) if slices is not None else 0
+    result['bytes_per_frame'] = float(np.mean([len(j) for j in jpegs]))
+    # The same stream with random loss: frozen frames until the next whole frame
+    lossy = _run_slices(jpegs, None, fps, refresh, threshold, loss, rtt_ms, seed)
+    result['loss_frozen'] = lossy['frozen']
+    result['loss_wire_kbps'] = lossy['wire_kbps']
+    return result
+
+
+def load_jpeg_dir(path):
+    """Recorded JPEG frames (*.jpg, in name order) as BGR images"""
+    names = sorted(n for n in os.listdir(path) if n.lower().endswith(('.jpg', '.jpeg')))
+    images = [cv2.imread(os.path.join(path, n)) for n in names]
+    return [image for image in images if image is not None]
+
+
+def run_slices_bench(args):
+    width, height = (int(v) for v in args.size.split('x'))
+    if args.jpeg_dir:
+        images = load_jpeg_dir(args.jpeg_dir)
+        source = os.path.basename(os.path.normpath(args.jpeg_dir))
+    elif args.yuv:
+        images = [cv2.cvtColor(yuv, cv2.COLOR_YUV2BGR_I420) for yuv in read_yuv(args.yuv, width, height, args.pix_fmt)]
+        source = os.path.basename(args.yuv)
+    else:
+        images = [cv2.cvtColor(yuv, cv2.COLOR_YUV2BGR_I420)
+                  for yuv in doorstep_scene(width, height, args.seconds, args.fps)]
+        source = 'doorstep_scene'
+    if not images:
+        print(f"No frames in {args.jpeg_dir or args.yuv}")
+        sys.exit(1)
+    height, width = images[0].shape[:2]
+    lumas = [cv2.cvtColor(bgr, cv2.COLOR_BGR2GRAY) for bgr in images]
+
+    # The reference: every frame whole, without restart markers
+    seconds = len(images) / args.fps
+    mjpeg_wire = mjpeg_bytes = 0
+    mjpeg_psnr = []
+    for i, bgr in enumerate(images):
+        jpeg = encode_jpeg(bgr, args.jpeg_quality)
+        mjpeg_bytes += len(jpeg)
+        mjpeg_wire += _wire_bytes(media_packets.build_video_packets(i, 0, jpeg))
+        mjpeg_psnr.append(psnr_y(lumas[i], cv2.imdecode(np.frombuffer(jpeg, np.uint8), cv2.IMREAD_GRAYSCALE)))
+    report = {
+        'benchmark': 'video_slices',
+        'source': source, 'size': f"{width}x{height}", 'fps': args.fps, 'frames': len(images),
+        'jpeg_quality': args.jpeg_quality, 'refresh': args.refresh, 'threshold': args.threshold,
+        'loss': args.loss, 'rtt_ms': args.rtt_ms,
+        'mjpeg': {
+            'wire_kbps': mjpeg_wire * 8 / seconds / 1000,
+            'bytes_per_frame': mjpeg_bytes / len(images),
+            'psnr_db': float(np.mean(mjpeg_psnr)),
+        },
+        'slices': [bench_slices(images, lumas, args.fps, args.jpeg_quality, int(r), args.refresh, args.threshold,
+                                args.loss, args.rtt_ms, args.seed)
+                   for r in args.restart_mcus.split(',')],
+    }
+    best = min(report['slices'], key=lambda r: r['wire_kbps'])
+    report['best_restart_mcus'] = best['restart_mcus']
+    report['reduction'] = report['mjpeg']['wire_kbps'] / best['wire_kbps']
+
+    if args.json:
+        print(json.dumps(report))
+        return
+
+    m = report['mjpeg']
+    print(f"Source {source}, {width}x{height} at {args.fps} fps, {len(images)} frames, quality {args.jpeg_quality}, "
+          f"whole frame every {args.refresh}, threshold {args.threshold}, {args.loss * 100:.1f} % loss and "
+          f"{args.rtt_ms:.0f} ms RTT for the loss column")
+    print(f"  {'mode':<14}{'slices':>7}{'B/frame':>9}{'wire kbps':>11}{'changed':>9}{'whole':>7}{'PSNR dB':>9}"
+          f"{'loss':>8}")
+    print(f"  {'MJPEG':<14}{'':>7}{m['bytes_per_frame']:>9.0f}{m['wire_kbps']:>11.1f}{'':>9}{len(images):>7}"
+          f"{m['psnr_db']:>9.2f}{'':>8}")
+    for r in report['slices']:
+        print(f"  {'RST ' + str(r['restart_mcus']) + ' MCUs':<14}{r['slices_per_frame']:>7}{r['bytes_per_frame']:>9.0f}"
+              f"{r['wire_kbps']:>11.1f}{r['changed_slices'] * 100:>8.1f}%{r['full_frames']:>7}{r['psnr_db']:>9.2f}"
+              f"{r['loss_frozen'] * 100:>7.1f}%")
+    print("  B/frame: JPEG size with restart markers, changed: share of the slices sent in updates, "
+          "whole: frames sent whole, loss: frames frozen until the next whole frame")
+    print(f"  Best: a restart marker every {best['restart_mcus']} MCUs, {best['wire_kbps']:.0f} kbit/s, "
+          f"{report['reduction']:.1f}x less than MJPEG")
+
+
+def run_bench(args):
+    if not h264_available():
+        print("PyAV not found, the H.264 bench needs it (pip install av)")
+        sys.exit(1)
+
+    width, height = (int(v) for v in args.size.split('x'))
+    if width % 16 or height % 16:
+        print("The esp_h264 encoder needs frame sizes in multiples of 16")
+        sys.exit(1)
+    if args.yuv:
+        frames = read_yuv(args.yuv, width, height, args.pix_fmt)
+        if not frames:
+            print(f"No {args.size} {args.pix_fmt} frames in {args.yuv}")
+            sys.exit(1)
+    else:
+        frames = doorstep_scene(width, height, args.seconds, args.fps)
+
+    bitrates = [int(b) for b in args.bitrates.split(',')]
+    report = {
+        'benchmark': 'video_codecs',
+        'source': os.path.basename(args.yuv) if args.yuv else 'doorstep_scene',
+        'size': args.size, 'fps': args.fps, 'frames': len(frames), 'gop': args.gop,
+        'loss': args.loss, 'rtt_ms': args.rtt_ms,
+        'mjpeg': bench_mjpeg(frames, width, height, args.fps, args.jpeg_quality, args.loss, args.seed),
+        'h264': [bench_h264(frames, width, height, args.fps, b, args.gop, args.loss, args.rtt_ms, args.seed)
+                 for b in bitrates],
+    }
+    # Lowest H.264 bitrate that reaches the quality of MJPEG
+    target = report['mjpeg']['psnr_db']
+    equal = [r for r in report['h264'] if r['psnr_db'] >= target]
+    report['equal_quality'] = min(equal, key=lambda r: r['bitrate_setting']) if equal else None
+    if report['equal_quality'] is not None:
+        report['equal_quality_reduction'] = report['mjpeg']['wire_kbps'] / report['equal_quality']['wire_kbps']
+
+    if args.json:
+        print(json.dumps(report))
+        return
+
+    print(f"Source {report['source']}, {args.size} at {args.fps} fps, {len(frames)} frames, "
+          f"{args.loss * 100:.1f} % loss and {args.rtt_ms:.0f} ms RTT for the loss columns")
+    print(f"  {'codec':<14}{'B/frame':>9}{'IDR B':>8}{'wire kbps':>11}{'pkt/frame':>10}{'enc ms':>8}{'dec ms':>8}"
+          f"{'PSNR dB':>9}{'loss':>8}")
+    m = report['mjpeg']
+    print(f"  {'MJPEG q' + str(m['quality']):<14}{m['bytes_per_frame']:>9.0f}{'':>8}{m['wire_kbps']:>11.1f}"
+          f"{m['packets_per_frame']:>10.1f}{m['encode_ms_per_frame']:>8.2f}{m['decode_ms_per_frame']:>8.2f}"
+          f"{m['psnr_db']:>9.2f}{m['loss_frames_missing'] * 100:>7.1f}%")
+    for r in report['h264']:
+        print(f"  {'H.264 ' + str(r['bitrate_setting'] // 1000) + 'k':<14}{r['bytes_per_frame']:>9.0f}"
+              f"{r['idr_bytes']:>8.0f}{r['wire_kbps']:>11.1f}{r['packets_per_frame']:>10.1f}"
+              f"{r['encode_ms_per_frame']:>8.2f}{r['decode_ms_per_frame']:>8.2f}{r['psnr_db']:>9.2f}"
+              f"{r['loss_frozen'] * 100:>7.1f}%")
+    print("  loss: MJPEG frames missing, H.264 frames frozen until the requested IDR frame "
+          f"({report['h264'][0]['encoder']} on the host)")
+    eq = report['equal_quality']
+    if eq is None:
+        print("  No H.264 bitrate reached the PSNR of MJPEG")
+    else:
+        print(f"  Equal quality to MJPEG ({m['wire_kbps']:.0f} kbit/s): H.264 {eq['bitrate_setting'] // 1000}k, "
+              f"{eq['wire_kbps']:.0f} kbit/s on the wire, {report['equal_quality_reduction']:.1f}x less")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    sub = parser.add_subparsers(dest='command', required=True)
+
+    bench = sub.add_parser('bench', help="Bitrate, quality and loss recovery of MJPEG and H.264")
+    bench.add_argument('--yuv', help="Raw YUV recording to use instead of the synthetic scene")
+    bench.add_argument('--pix-fmt', choices=('yuyv', 'i420'), default='yuyv',
+                       help="Layout of the --yuv frames (yuyv is the sensor's YUV422)")
+    bench.add_argument('--size', default='320x240', help="Frame size, WIDTHxHEIGHT")
+    bench.add_argument('--seconds', type=float, default=20.0, help="Length of the synthetic scene")
+    bench.add_argument('--fps', type=int, default=DEFAULT_FPS)
+    bench.add_argument('--gop', type=int, default=DEFAULT_GOP, help="IDR interval in frames")
+    bench.add_argument('--bitrates', default='100000,200000,300000,500000,800000',
+                       help="H.264 bitrates to measure (bit/s)")
+    bench.add_argument('--jpeg-quality', type=int, default=80, help="libjpeg quality of the MJPEG reference")
+    bench.add_argument('--loss', type=float, default=0.01, help="Random packet loss of the loss column")
+    bench.add_argument('--rtt-ms', type=float, default=60.0, help="Round trip of a keyframe request")
+    bench.add_argument('--seed', type=int, default=1)
+    bench.add_argument('--json', action='store_true', help="Print a machine-readable report")
+
+    slices = sub.add_parser('slices', help="Bytes per second of slice updates against whole JPEG frames")
+    source = slices.add_mutually_exclusive_group()
+    source.add_argument('--jpeg-dir', help="Recorded JPEG frames (re-encoded with restart markers)")
+    source.add_argument('--yuv', help="Raw YUV recording to use instead of the synthetic scene")
+    slices.add_argument('--pix-fmt', choices=('yuyv', 'i420'), default='yuyv',
+                        help="Layout of the --yuv frames (yuyv is the sensor's YUV422)")
+    slices.add_argument('--size', default='640x480', help="Frame size of --yuv and the synthetic scene")
+    slices.add_argument('--seconds', type=float, default=20.0, help="Length of the synthetic scene")
+    slices.add_argument('--fps', type=int, default=DEFAULT_FPS)
+    slices.add_argument('--jpeg-quality', type=int, default=80, help="libjpeg quality of the frames")
+    slices.add_argument('--restart-mcus', default='10,20,40,80',
+                        help="Restart intervals to measure, in MCUs (40 is one MCU row at VGA)")
+    slices.add_argument('--refresh', type=int, default=SLICE_REFRESH, help="Whole frame every N frames")
+    slices.add_argument('--threshold', type=int, default=SLICE_DC_THRESHOLD,
+                        help="DC quantization steps a block may move before its slice is sent")
+    slices.add_argument('--loss', type=float, default=0.01, help="Random packet loss of the loss column")
+    slices.add_argument('--rtt-ms', type=float, default=60.0, help="Round trip of a refresh request")
+    slices.add_argument('--seed', type=int, default=1)
+    slices.add_argument('--json', action='store_true', help="Print a machine-readable report")
+
+    args = parser.parse_args()
+    if args.command == 'slices':
+        run_slices_bench(args)
+    else:
+        run_bench(args)
+
+
+if __name__ == "__main__":
+    main()